@@ -0,0 +1,629 @@
+// SPDX-License-Identifier: MIT
+
+#include "ocidconv.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * OpenCellid CSV to openqti shard converter
+ *  Streams the CSV dump (it can be several GB, or come from a pipe)
+ *  sorting fixed size runs of records to temporary files, and then
+ *  merges all the runs writing one sorted, deduplicated shard per
+ *  carrier. Memory use is bounded by the run size no matter how big
+ *  the input is, so it can also run on the modem itself.
+ */
+
+struct conv_stats stats;
+char *tmp_dir = DEFAULT_TMP_DIR;
+int filter_mcc = -1;
+int filter_mnc = -1;
+
+uint64_t get_time_us() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+uint32_t fnv1a_update(uint32_t hash, uint8_t *buf, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    hash = (hash ^ buf[i]) * 16777619U;
+  }
+  return hash;
+}
+
+int get_radio_type(char *radio) {
+  if (strcmp(radio, "GSM") == 0)
+    return OCID_RADIO_GSM;
+  if (strcmp(radio, "CDMA") == 0)
+    return OCID_RADIO_CDMA;
+  if (strcmp(radio, "UMTS") == 0)
+    return OCID_RADIO_UMTS;
+  if (strcmp(radio, "LTE") == 0)
+    return OCID_RADIO_LTE;
+  if (strcmp(radio, "NR") == 0)
+    return OCID_RADIO_NR;
+  return -EINVAL;
+}
+
+/* Splits a CSV line in place, there are no quoted fields in the dump */
+int split_csv_line(char *line, char **fields, int max_fields) {
+  int count = 0;
+  fields[count++] = line;
+  for (char *p = line; *p != '\0'; p++) {
+    if (*p == ',' || *p == '\n' || *p == '\r') {
+      *p = '\0';
+      if (count < max_fields) {
+        fields[count++] = p + 1;
+      }
+    }
+  }
+  return count;
+}
+
+int parse_csv_line(char *line, struct ocid_conv_record *record) {
+  char *fields[CSV_MIN_FIELDS + 1];
+  int radio;
+  if (split_csv_line(line, fields, CSV_MIN_FIELDS + 1) < CSV_MIN_FIELDS) {
+    return -EINVAL;
+  }
+  radio = get_radio_type(fields[0]);
+  if (radio < 0) {
+    return -EINVAL;
+  }
+  memset(record, 0, sizeof(struct ocid_conv_record));
+  record->mcc = strtoul(fields[1], NULL, 10);
+  record->mnc = strtoul(fields[2], NULL, 10);
+  record->cell.radio = radio;
+  record->cell.area = strtoul(fields[3], NULL, 10);
+  record->cell.cell = strtoul(fields[4], NULL, 10);
+  record->cell.lon = strtof(fields[6], NULL);
+  record->cell.lat = strtof(fields[7], NULL);
+  record->cell.range = strtoul(fields[8], NULL, 10);
+  record->cell.updated = strtoul(fields[12], NULL, 10);
+  record->cell.average_signal = strtol(fields[13], NULL, 10);
+  return 0;
+}
+
+/*
+ * Shard order: carrier, then (radio, area, cell) like openqti
+ * expects, and the most recently updated copy of a cell first so
+ * deduplicating is just keeping the first one we see
+ */
+int compare_records(const void *a, const void *b) {
+  const struct ocid_conv_record *ra = a, *rb = b;
+  if (ra->mcc != rb->mcc)
+    return ra->mcc < rb->mcc ? -1 : 1;
+  if (ra->mnc != rb->mnc)
+    return ra->mnc < rb->mnc ? -1 : 1;
+  if (ra->cell.radio != rb->cell.radio)
+    return ra->cell.radio < rb->cell.radio ? -1 : 1;
+  if (ra->cell.area != rb->cell.area)
+    return ra->cell.area < rb->cell.area ? -1 : 1;
+  if (ra->cell.cell != rb->cell.cell)
+    return ra->cell.cell < rb->cell.cell ? -1 : 1;
+  if (ra->cell.updated != rb->cell.updated)
+    return ra->cell.updated > rb->cell.updated ? -1 : 1;
+  return 0;
+}
+
+bool is_same_cell(struct ocid_conv_record *a, struct ocid_conv_record *b) {
+  return a->mcc == b->mcc && a->mnc == b->mnc &&
+         a->cell.radio == b->cell.radio && a->cell.area == b->cell.area &&
+         a->cell.cell == b->cell.cell;
+}
+
+void get_run_path(char *path, size_t len, uint32_t run) {
+  snprintf(path, len, "%s/ocidconv-%i-%u.run", tmp_dir, getpid(), run);
+}
+
+int write_run(struct ocid_conv_record *records, size_t count) {
+  char path[256];
+  FILE *fp;
+  if (stats.runs >= MAX_RUNS) {
+    fprintf(stderr, "Too many runs, give me more memory with -m\n");
+    return -ENOMEM;
+  }
+  qsort(records, count, sizeof(struct ocid_conv_record), compare_records);
+  get_run_path(path, sizeof(path), stats.runs);
+  fp = fopen(path, "wb");
+  if (fp == NULL) {
+    fprintf(stderr, "Can't create %s\n", path);
+    return -EIO;
+  }
+  if (fwrite(records, sizeof(struct ocid_conv_record), count, fp) != count) {
+    fprintf(stderr, "Error writing %s\n", path);
+    fclose(fp);
+    return -EIO;
+  }
+  fclose(fp);
+  stats.runs++;
+  return 0;
+}
+
+/* Pass 1: parse the CSV into sorted runs */
+int build_runs(FILE *input, size_t memory_mb) {
+  struct ocid_conv_record *records;
+  size_t max_records, count = 0;
+  char line[CSV_MAX_LINE];
+
+  max_records = (memory_mb * 1024 * 1024) / sizeof(struct ocid_conv_record);
+  records = malloc(max_records * sizeof(struct ocid_conv_record));
+  if (records == NULL) {
+    fprintf(stderr, "Can't allocate %zu MB to sort\n", memory_mb);
+    return -ENOMEM;
+  }
+
+  while (fgets(line, sizeof(line), input) != NULL) {
+    stats.lines++;
+    stats.bytes += strlen(line);
+    if (parse_csv_line(line, &records[count]) < 0) {
+      stats.skipped++; // Header, or something we don't understand
+      continue;
+    }
+    if ((filter_mcc >= 0 && records[count].mcc != filter_mcc) ||
+        (filter_mnc >= 0 && records[count].mnc != filter_mnc)) {
+      stats.filtered++;
+      continue;
+    }
+    count++;
+    if (count == max_records) {
+      if (write_run(records, count) < 0) {
+        free(records);
+        return -EIO;
+      }
+      count = 0;
+    }
+  }
+
+  if (count > 0 && write_run(records, count) < 0) {
+    free(records);
+    return -EIO;
+  }
+  free(records);
+  return 0;
+}
+
+void get_shard_path(char *path, size_t len, char *outdir, uint16_t mcc,
+                    uint16_t mnc) {
+  snprintf(path, len, "%s/%03u-%02u.bin", outdir, mcc, mnc);
+}
+
+int open_shard(struct shard_writer *shard, char *outdir,
+               struct ocid_conv_record *record) {
+  struct ocid_db_header header = {0};
+  char path[256];
+  get_shard_path(path, sizeof(path), outdir, record->mcc, record->mnc);
+  shard->fp = fopen(path, "wb");
+  if (shard->fp == NULL) {
+    fprintf(stderr, "Can't create %s\n", path);
+    return -EIO;
+  }
+  shard->mcc = record->mcc;
+  shard->mnc = record->mnc;
+  shard->num_records = 0;
+  shard->checksum = 2166136261U;
+  /* Placeholder, we fill it when we know the count and checksum */
+  fwrite(&header, sizeof(struct ocid_db_header), 1, shard->fp);
+  stats.shards++;
+  return 0;
+}
+
+int close_shard(struct shard_writer *shard) {
+  struct ocid_db_header header = {0};
+  int ret = 0;
+  if (shard->fp == NULL) {
+    return 0;
+  }
+  header.magic = OCID_DB_MAGIC;
+  header.version = OCID_DB_VERSION;
+  header.record_size = sizeof(struct ocid_cell_slim);
+  snprintf((char *)header.mcc, sizeof(header.mcc), "%03u", shard->mcc % 1000);
+  snprintf((char *)header.mnc, sizeof(header.mnc), "%02u", shard->mnc % 1000);
+  header.flags = OCID_DB_FLAG_SORTED;
+  header.num_records = shard->num_records;
+  header.checksum = shard->checksum;
+  if (fseek(shard->fp, 0L, SEEK_SET) < 0 ||
+      fwrite(&header, sizeof(struct ocid_db_header), 1, shard->fp) != 1) {
+    fprintf(stderr, "Error writing the header of %03u-%02u\n", shard->mcc,
+            shard->mnc);
+    ret = -EIO;
+  }
+  if (fclose(shard->fp) != 0) {
+    ret = -EIO;
+  }
+  shard->fp = NULL;
+  return ret;
+}
+
+int add_to_shard(struct shard_writer *shard, char *outdir,
+                 struct ocid_conv_record *record) {
+  if (shard->fp != NULL && shard->num_records > 0 &&
+      is_same_cell(&shard->last, record)) {
+    stats.duplicates++;
+    return 0;
+  }
+  if (shard->fp == NULL || shard->mcc != record->mcc ||
+      shard->mnc != record->mnc) {
+    if (close_shard(shard) < 0 || open_shard(shard, outdir, record) < 0) {
+      return -EIO;
+    }
+  }
+  if (fwrite(&record->cell, sizeof(struct ocid_cell_slim), 1, shard->fp) !=
+      1) {
+    fprintf(stderr, "Error writing shard %03u-%02u\n", shard->mcc, shard->mnc);
+    return -EIO;
+  }
+  shard->checksum = fnv1a_update(shard->checksum, (uint8_t *)&record->cell,
+                                 sizeof(struct ocid_cell_slim));
+  shard->num_records++;
+  shard->last = *record;
+  stats.records++;
+  return 0;
+}
+
+void read_run_record(struct run_reader *run) {
+  if (fread(&run->current, sizeof(struct ocid_conv_record), 1, run->fp) != 1) {
+    run->done = true;
+  }
+}
+
+/* Min heap of run indexes, ordered by their current record */
+void sift_down(struct run_reader *runs, uint32_t *heap, uint32_t size,
+               uint32_t pos) {
+  uint32_t child, tmp;
+  while ((child = pos * 2 + 1) < size) {
+    if (child + 1 < size && compare_records(&runs[heap[child + 1]].current,
+                                            &runs[heap[child]].current) < 0) {
+      child++;
+    }
+    if (compare_records(&runs[heap[pos]].current,
+                        &runs[heap[child]].current) <= 0) {
+      break;
+    }
+    tmp = heap[pos];
+    heap[pos] = heap[child];
+    heap[child] = tmp;
+    pos = child;
+  }
+}
+
+/* Pass 2: k-way merge of the runs into the shards */
+int merge_runs(char *outdir) {
+  struct run_reader *runs;
+  struct shard_writer shard = {0};
+  uint32_t heap[MAX_RUNS];
+  uint32_t heap_size = 0;
+  char path[256];
+  int ret = 0;
+
+  runs = calloc(stats.runs, sizeof(struct run_reader));
+  if (runs == NULL) {
+    return -ENOMEM;
+  }
+  for (uint32_t i = 0; i < stats.runs; i++) {
+    get_run_path(path, sizeof(path), i);
+    runs[i].fp = fopen(path, "rb");
+    if (runs[i].fp == NULL) {
+      fprintf(stderr, "Can't open %s\n", path);
+      ret = -EIO;
+      goto out;
+    }
+    setvbuf(runs[i].fp, NULL, _IOFBF, IO_BUFFER_SIZE / 4);
+    read_run_record(&runs[i]);
+    if (!runs[i].done) {
+      heap[heap_size++] = i;
+    }
+  }
+  for (int32_t i = heap_size / 2 - 1; i >= 0; i--) {
+    sift_down(runs, heap, heap_size, i);
+  }
+
+  while (heap_size > 0) {
+    if (add_to_shard(&shard, outdir, &runs[heap[0]].current) < 0) {
+      ret = -EIO;
+      goto out;
+    }
+    read_run_record(&runs[heap[0]]);
+    if (runs[heap[0]].done) {
+      heap[0] = heap[--heap_size];
+    }
+    sift_down(runs, heap, heap_size, 0);
+  }
+  ret = close_shard(&shard);
+
+out:
+  if (shard.fp != NULL) {
+    fclose(shard.fp);
+  }
+  for (uint32_t i = 0; i < stats.runs; i++) {
+    if (runs[i].fp != NULL) {
+      fclose(runs[i].fp);
+    }
+    get_run_path(path, sizeof(path), i);
+    unlink(path);
+  }
+  free(runs);
+  return ret;
+}
+
+int convert(char *input_path, char *outdir, size_t memory_mb) {
+  uint64_t start, parsed, end;
+  FILE *input;
+  int ret;
+
+  if (strcmp(input_path, "-") == 0) {
+    input = stdin;
+  } else {
+    input = fopen(input_path, "r");
+    if (input == NULL) {
+      fprintf(stderr, "Can't open %s\n", input_path);
+      return -ENOENT;
+    }
+  }
+  setvbuf(input, NULL, _IOFBF, IO_BUFFER_SIZE);
+  mkdir(outdir, 0755);
+
+  start = get_time_us();
+  ret = build_runs(input, memory_mb);
+  if (input != stdin) {
+    fclose(input);
+  }
+  parsed = get_time_us();
+  if (ret == 0) {
+    ret = merge_runs(outdir);
+  }
+  end = get_time_us();
+  if (ret < 0) {
+    return ret;
+  }
+
+  fprintf(stdout, "Lines: %llu (%llu skipped, %llu filtered out)\n",
+          (unsigned long long)stats.lines, (unsigned long long)stats.skipped,
+          (unsigned long long)stats.filtered);
+  fprintf(stdout, "Cells: %llu in %u shards (%llu duplicates dropped)\n",
+          (unsigned long long)stats.records, stats.shards,
+          (unsigned long long)stats.duplicates);
+  fprintf(stdout, "Parse and sort: %.2f s, %u runs\n",
+          (parsed - start) / 1000000.0, stats.runs);
+  fprintf(stdout, "Merge: %.2f s\n", (end - parsed) / 1000000.0);
+  if (end > start) {
+    fprintf(stdout, "Throughput: %.0f rows/s, %.2f MB/s\n",
+            stats.lines * 1000000.0 / (end - start),
+            stats.bytes / (double)(end - start));
+  }
+  return 0;
+}
+
+/*
+ * Synthetic sample in the OpenCellid CSV format, so we can measure
+ * without downloading the full dump. Some cells are repeated to
+ * exercise deduplication
+ */
+int generate_sample(char *path, uint64_t rows) {
+  const char *radios[] = {"GSM", "UMTS", "LTE", "NR"};
+  FILE *fp;
+  uint32_t mcc, mnc, area, cell, radio;
+
+  fp = fopen(path, "w");
+  if (fp == NULL) {
+    fprintf(stderr, "Can't create %s\n", path);
+    return -EIO;
+  }
+  setvbuf(fp, NULL, _IOFBF, IO_BUFFER_SIZE);
+  srand(1);
+  fprintf(fp, "radio,mcc,net,area,cell,unit,lon,lat,range,samples,changeable,"
+              "created,updated,averageSignal\n");
+  for (uint64_t i = 0; i < rows; i++) {
+    mcc = 200 + rand() % 50;
+    mnc = 1 + rand() % 8;
+    radio = rand() % 4;
+    area = rand() % 65535;
+    cell = rand();
+    if (i % 20 == 0) { // Small pool, so it repeats
+      radio = 2;
+      area = rand() % 4;
+      cell = rand() % 64;
+    }
+    fprintf(fp, "%s,%u,%u,%u,%u,0,%.6f,%.6f,%u,%u,1,1400000000,%u,0\n",
+            radios[radio], mcc, mnc, area, cell,
+            (rand() % 36000) / 100.0 - 180, (rand() % 18000) / 100.0 - 90,
+            rand() % 10000, rand() % 100, 1400000000 + rand() % 300000000);
+  }
+  fclose(fp);
+  fprintf(stdout, "%llu rows written to %s\n", (unsigned long long)rows, path);
+  return 0;
+}
+
+/* Same search openqti does in get_opencellid_cell_info() */
+int find_cell(struct ocid_cell_slim *cells, uint32_t count, uint8_t radio,
+              uint32_t area, uint32_t cell) {
+  uint32_t low = 0, high = count, mid;
+  while (low < high) {
+    mid = low + (high - low) / 2;
+    if (cells[mid].radio == radio && cells[mid].area == area &&
+        cells[mid].cell == cell) {
+      return mid;
+    }
+    if (cells[mid].radio < radio ||
+        (cells[mid].radio == radio &&
+         (cells[mid].area < area ||
+          (cells[mid].area == area && cells[mid].cell < cell)))) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  return -1;
+}
+
+int benchmark_shard(char *path, uint32_t lookups) {
+  struct ocid_db_header header;
+  struct ocid_cell_slim *cells, *target;
+  uint64_t start, end;
+  uint32_t found = 0, misses = 0;
+  FILE *fp;
+
+  fp = fopen(path, "rb");
+  if (fp == NULL) {
+    fprintf(stderr, "Can't open %s\n", path);
+    return -ENOENT;
+  }
+  if (fread(&header, sizeof(struct ocid_db_header), 1, fp) != 1 ||
+      header.magic != OCID_DB_MAGIC || header.version != OCID_DB_VERSION ||
+      header.record_size != sizeof(struct ocid_cell_slim) ||
+      header.num_records == 0) {
+    fprintf(stderr, "%s is not a valid shard\n", path);
+    fclose(fp);
+    return -EINVAL;
+  }
+  cells = malloc(header.num_records * sizeof(struct ocid_cell_slim));
+  if (cells == NULL ||
+      fread(cells, sizeof(struct ocid_cell_slim), header.num_records, fp) !=
+          header.num_records) {
+    fprintf(stderr, "Error reading %s\n", path);
+    free(cells);
+    fclose(fp);
+    return -EIO;
+  }
+  fclose(fp);
+
+  if (fnv1a_update(2166136261U, (uint8_t *)cells,
+                   header.num_records * sizeof(struct ocid_cell_slim)) !=
+      header.checksum) {
+    fprintf(stderr, "Checksum mismatch in %s\n", path);
+    free(cells);
+    return -EINVAL;
+  }
+
+  srand(1);
+  start = get_time_us();
+  for (uint32_t i = 0; i < lookups; i++) {
+    /* Half of them are hits, the other half most likely misses */
+    target = &cells[rand() % header.num_records];
+    if (i % 2) {
+      if (find_cell(cells, header.num_records, target->radio, target->area,
+                    target->cell) >= 0)
+        found++;
+    } else if (find_cell(cells, header.num_records, target->radio,
+                         target->area, target->cell ^ 0x5a5a5a) < 0) {
+      misses++;
+    }
+  }
+  end = get_time_us();
+
+  fprintf(stdout, "%s: %u cells (%s-%s), checksum OK\n", path,
+          header.num_records, header.mcc, header.mnc);
+  fprintf(stdout, "%u lookups: %u hits, %u misses, %.1f ns per lookup\n",
+          lookups, found, misses, (end - start) * 1000.0 / lookups);
+  free(cells);
+  return 0;
+}
+
+/*
+ * "MCC" or "MCC-MNC". Base 10 only: MNCs are often zero padded, and
+ * "08" must not be read as octal
+ */
+int parse_carrier_filter(char *arg) {
+  int mcc, mnc = -1, end = 0;
+  int ret = sscanf(arg, "%d%n-%d%n", &mcc, &end, &mnc, &end);
+  if (ret < 1 || arg[end] != 0 || mcc < 0 || mcc > 999 ||
+      (ret == 2 && (mnc < 0 || mnc > 999))) {
+    return -EINVAL;
+  }
+  filter_mcc = mcc;
+  filter_mnc = ret == 2 ? mnc : -1;
+  return 0;
+}
+
+void showHelp() {
+  fprintf(stdout, " Converts the OpenCellid CSV dump into openqti databases\n");
+  fprintf(stdout, "Usage:\n");
+  fprintf(stdout, "  ocidconv -i FILE -o DIR [-c MCC[-MNC]] [-m MB] [-t DIR]\n"
+                  "  ocidconv -g ROWS -o FILE\n"
+                  "  ocidconv -b SHARD [-n LOOKUPS]\n");
+  fprintf(stdout, "Arguments: \n"
+                  "\t-i [FILE]: OpenCellid CSV file, - for stdin\n"
+                  "\t-o [DIR]: Where to write <mcc>-<mnc>.bin files\n"
+                  "\t-c [MCC or MCC-MNC]: Only convert these carriers\n"
+                  "\t-m [MB]: Memory to use for sorting (default %i)\n"
+                  "\t-t [DIR]: Directory for temporary files (default %s)\n"
+                  "\t-g [ROWS]: Generate a synthetic CSV sample\n"
+                  "\t-b [SHARD]: Benchmark lookups on a converted file\n"
+                  "\t-n [LOOKUPS]: Lookups to run (default %i)\n",
+          DEFAULT_SORT_MEMORY_MB, DEFAULT_TMP_DIR, DEFAULT_BENCHMARK_LOOKUPS);
+  fprintf(stdout, "Examples:\n"
+                  "\t zcat cell_towers.csv.gz | ./ocidconv -i - -o /tmp\n"
+                  "\t ./ocidconv -i cell_towers.csv -o out -c 214-01\n"
+                  "\t ./ocidconv -b /tmp/214-01.bin\n");
+}
+
+int main(int argc, char **argv) {
+  char *input = NULL, *output = NULL, *shard = NULL;
+  size_t memory_mb = DEFAULT_SORT_MEMORY_MB;
+  uint32_t lookups = DEFAULT_BENCHMARK_LOOKUPS;
+  uint64_t sample_rows = 0;
+  int c;
+
+  fprintf(stdout, "OCIDConv: OpenCellid database converter for openqti\n");
+  fprintf(stdout, "----------------------------------------------------\n");
+  if (argc < 3) {
+    showHelp();
+    return 0;
+  }
+
+  while ((c = getopt(argc, argv, "i:o:c:m:t:g:b:n:h")) != -1)
+    switch (c) {
+    case 'i':
+      input = optarg;
+      break;
+    case 'o':
+      output = optarg;
+      break;
+    case 'c':
+      if (parse_carrier_filter(optarg) < 0) {
+        fprintf(stderr, "Invalid carrier %s\n", optarg);
+        return 1;
+      }
+      break;
+    case 'm':
+      memory_mb = strtoul(optarg, NULL, 10);
+      if (memory_mb == 0) {
+        memory_mb = DEFAULT_SORT_MEMORY_MB;
+      }
+      break;
+    case 't':
+      tmp_dir = optarg;
+      break;
+    case 'g':
+      sample_rows = strtoull(optarg, NULL, 10);
+      break;
+    case 'b':
+      shard = optarg;
+      break;
+    case 'n':
+      lookups = strtoul(optarg, NULL, 10);
+      break;
+    case 'h':
+    default:
+      showHelp();
+      return 0;
+    }
+
+  if (shard != NULL) {
+    return benchmark_shard(shard, lookups ? lookups : 1) < 0 ? 1 : 0;
+  }
+  if (sample_rows > 0 && output != NULL) {
+    return generate_sample(output, sample_rows) < 0 ? 1 : 0;
+  }
+  if (input == NULL || output == NULL) {
+    showHelp();
+    return 1;
+  }
+  return convert(input, output, memory_mb) < 0 ? 1 : 0;
+}
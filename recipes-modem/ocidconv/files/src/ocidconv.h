@@ -0,0 +1,99 @@
+/* SPDX-License-Identifier: MIT */
+
+#ifndef _OCIDCONV_H
+#define _OCIDCONV_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Shard format, must match openqti's inc/nas.h
+ *  Header followed by ocid_cell_slim records sorted by
+ *  (radio, area, cell), one file per carrier: <mcc>-<mnc>.bin
+ */
+#define OCID_DB_MAGIC 0x4449434f // "OCID"
+#define OCID_DB_VERSION 1
+#define OCID_DB_FLAG_SORTED (1 << 0)
+
+enum ocid_radio_type {
+  OCID_RADIO_GSM = 0x01,
+  OCID_RADIO_CDMA,
+  OCID_RADIO_UMTS = 0x05,
+  OCID_RADIO_LTE = 0x0b,
+  OCID_RADIO_NR = 0x0e,
+} __attribute__((__packed__));
+
+struct ocid_cell_slim {
+  uint8_t radio;
+  uint32_t area;
+  uint32_t cell;
+  float lon;
+  float lat;
+  uint32_t range;
+  uint32_t updated;
+  int16_t average_signal;
+} __attribute__((__packed__));
+
+struct ocid_db_header {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t record_size; // sizeof(struct ocid_cell_slim)
+  uint8_t mcc[4];
+  uint8_t mnc[4];
+  uint32_t flags;
+  uint32_t num_records;
+  uint32_t checksum; // FNV-1a of all the records
+} __attribute__((__packed__));
+
+/* What we keep of each CSV row while sorting */
+struct ocid_conv_record {
+  uint16_t mcc;
+  uint16_t mnc;
+  struct ocid_cell_slim cell;
+} __attribute__((__packed__));
+
+/*
+ * CSV columns:
+ * radio,mcc,net,area,cell,unit,lon,lat,range,samples,changeable,created,
+ * updated,averageSignal
+ */
+#define CSV_MAX_LINE 512
+#define CSV_MIN_FIELDS 14
+
+/* Memory used to sort each run of records */
+#define DEFAULT_SORT_MEMORY_MB 32
+#define MAX_RUNS 1024
+#define DEFAULT_TMP_DIR "/tmp"
+#define IO_BUFFER_SIZE (256 * 1024)
+
+/* Benchmark defaults */
+#define DEFAULT_BENCHMARK_LOOKUPS 1000000
+
+struct run_reader {
+  FILE *fp;
+  struct ocid_conv_record current;
+  bool done;
+};
+
+struct shard_writer {
+  FILE *fp;
+  uint16_t mcc;
+  uint16_t mnc;
+  uint32_t num_records;
+  uint32_t checksum;
+  struct ocid_conv_record last;
+};
+
+struct conv_stats {
+  uint64_t lines;
+  uint64_t bytes;
+  uint64_t skipped;
+  uint64_t filtered;
+  uint64_t duplicates;
+  uint64_t records;
+  uint32_t runs;
+  uint32_t shards;
+};
+
+#endif
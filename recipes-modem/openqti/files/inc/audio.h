@@ -56,6 +56,15 @@
 
 #define PCM_DEV_SIZE 18
 
+/*
+ * Text to speech
+ *  Pico hands out 16kHz mono S16_LE samples, we pass them on to
+ *  the sink in chunks of this size (32ms of audio)
+ */
+#define TTS_SAMPLE_RATE 16000
+#define TTS_STREAM_CHUNK_SIZE 1024
+typedef int (*tts_sample_sink)(void *data, uint8_t *samples, size_t bytes);
+
 enum {
   VOICE_SESSION_VSID = 0x10C01000,
   VOICE2_SESSION_VSID = 0x10DC1000,
@@ -237,18 +246,24 @@ void handle_call_pkt(uint8_t *pkt, int sz, uint8_t phone_number[MAX_PHONE_NUMBER
 int set_audio_defaults();
 int set_external_codec_defaults();
 void set_auxpcm_sampling_rate(uint8_t mode);
+uint32_t get_auxpcm_sampling_rate();
 int pcm_write(struct pcm *pcm, void *data, unsigned count);
 unsigned int pcm_get_buffer_size(const struct pcm *pcm);
 unsigned int pcm_frames_to_bytes(struct pcm *pcm, unsigned int frames);
 int pcm_read(struct pcm *pcm, void *data, uint32_t count);
 void setup_codec();
 
-int pico2aud(char *text, size_t len);
+int init_pico_tts();
+const char *get_tts_voice_name();
+void release_pico_tts();
+int pico2aud(char *text, size_t len, tts_sample_sink sink, void *data);
 void set_multimedia_mixer();
 void stop_multimedia_mixer();
 /* Recording */
 void record_next_call(bool en);
 int record_current_call();
 unsigned int pcm_bytes_to_frames(const struct pcm *pcm, unsigned int bytes);
+void recording_storage_level_changed(uint8_t storage_id, uint8_t level,
+                                     int32_t free_mb);
 
 #endif
\ No newline at end of file
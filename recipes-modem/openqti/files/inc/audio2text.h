@@ -1,9 +1,53 @@
+#include <stddef.h>
 #include <stdint.h>
 
 #ifndef __AUDIO2TEXT_H__
 #define __AUDIO2TEXT_H__
 
+/* PocketSphinx default models expect 16kHz mono S16_LE */
+#define STT_SAMPLE_RATE 16000
+#define WAV_HEADER_SIZE 44
+/*
+ * Call audio is read STT_CAPTURE_PERIOD_MS at a time (at whatever
+ * rate AUX PCM runs), and queued for up to STT_RING_SAMPLES
+ * (2 seconds) while the decoder is busy
+ */
+#define STT_CAPTURE_PERIOD_MS 16
+#define STT_RING_SAMPLES (STT_SAMPLE_RATE * 2)
+
+/*
+ * What the decoder listens for
+ *  Commands only knows the phrases in bot_commands[], which is all a
+ *  call can do anyway, and is way cheaper and more accurate than the
+ *  full language model we need to transcribe anything else
+ */
+enum {
+  STT_MODE_COMMANDS = 0,
+  STT_MODE_DICTATION,
+};
+#define STT_SEARCH_COMMANDS "commands"
+#define STT_GRAMMAR_MAX_SIZE 4096
+
 void speech_to_text_stay_running(uint8_t enable);
+int init_speech_to_text();
+void *speech_to_text_preload_thread();
+
+/* Decoder ownership and utterance hooks */
+int build_command_grammar(char *grammar, size_t len);
+int start_speech_stream(uint8_t mode);
+void stop_speech_stream();
+int start_speech_utterance();
+int process_speech_audio(const int16_t *samples, size_t num_samples);
+const char *get_partial_speech_hypothesis();
+const char *end_speech_utterance();
+
+/* Call audio front end */
+void reset_stt_ring();
+void write_stt_ring(const int16_t *samples, size_t num_samples);
+size_t read_stt_ring(int16_t *frame, size_t frame_size);
+size_t resample_stt_audio(const int16_t *in, size_t num_samples,
+                          uint32_t rate, int16_t *last, int16_t *out);
+
 int callaudio_stt_demo(char *filename);
 void *callaudio_stt_continuous();
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,49 @@
+/* SPDX-License-Identifier: MIT */
+
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define CAPTURE_DEFAULT_PATH "/tmp/openqti.pcap"
+/* Capture file is preallocated and mapped, we stop when it's full */
+#define CAPTURE_MAX_SIZE (8 * 1024 * 1024)
+
+/* pcap file format */
+#define PCAP_MAGIC 0xa1b2c3d4
+#define PCAP_VERSION_MAJOR 2
+#define PCAP_VERSION_MINOR 4
+#define PCAP_SNAPLEN 65535
+/* LINKTYPE_USER0: 1 byte direction + raw QMUX frame */
+#define PCAP_LINKTYPE_QMUX 147
+
+enum {
+  CAPTURE_DIR_HOST_TO_MODEM = 0,
+  CAPTURE_DIR_MODEM_TO_HOST = 1,
+};
+
+struct pcap_file_header {
+  uint32_t magic;
+  uint16_t version_major;
+  uint16_t version_minor;
+  int32_t thiszone;
+  uint32_t sigfigs;
+  uint32_t snaplen;
+  uint32_t linktype;
+} __attribute__((packed));
+
+struct pcap_record_header {
+  uint32_t ts_sec;  // CLOCK_MONOTONIC
+  uint32_t ts_usec;
+  uint32_t incl_len; // direction byte + frame
+  uint32_t orig_len;
+} __attribute__((packed));
+
+int capture_start(char *path);
+void capture_stop();
+bool is_capture_enabled();
+void capture_packet(uint8_t direction, uint8_t *buf, size_t len);
+int capture_decode_file(char *path);
+#endif
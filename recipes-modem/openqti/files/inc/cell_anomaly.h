@@ -0,0 +1,83 @@
+/* SPDX-License-Identifier: MIT */
+
+#ifndef _CELL_ANOMALY_H_
+#define _CELL_ANOMALY_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Score contributions, added up for every cell measurement report.
+ * A known, OpenCellid verified cell with the usual neighbours ends
+ * up well below zero; a fake base station with no neighbour list
+ * forcing the phone down to GSM sits way over the critical score
+ */
+#define ANOMALY_SCORE_UNKNOWN_CELL 40
+#define ANOMALY_SCORE_NOT_IN_OPENCELLID 30
+#define ANOMALY_SCORE_IN_OPENCELLID -30
+#define ANOMALY_SCORE_NO_NEIGHBOURS 20
+#define ANOMALY_SCORE_NEIGHBOURS_CHANGED 15
+#define ANOMALY_SCORE_SIGNAL_OUTLIER 20
+#define ANOMALY_SCORE_TIMING_ADVANCE_JUMP 15
+#define ANOMALY_SCORE_RAT_DOWNGRADE 20
+
+/* Notify the user from here on */
+#define ANOMALY_ALERT_SCORE 30
+/* Strict modes power down the baseband from here on */
+#define ANOMALY_CRITICAL_SCORE 60
+
+/* Don't trust a cell's own statistics until we've seen it this many times */
+#define ANOMALY_MIN_SAMPLES 8
+/* Outliers are further than this many standard deviations from the mean */
+#define ANOMALY_MAX_DEVIATIONS 3
+/* Variance floors, so a cell that always reported the same value doesn't
+ * trigger on the first 1dB wobble */
+#define ANOMALY_MIN_SIGNAL_VARIANCE 9 // (3dB)^2
+#define ANOMALY_MIN_TA_VARIANCE 4
+/* LTE/UMTS -> GSM closer than this is treated as a forced downgrade */
+#define ANOMALY_DOWNGRADE_WINDOW_MS 60000
+/* Don't repeat the same alert for the same cell more often than this */
+#define ANOMALY_ALERT_INTERVAL_MS 600000
+
+enum {
+  ANOMALY_REASON_UNKNOWN_CELL = 1 << 0,
+  ANOMALY_REASON_NOT_IN_OPENCELLID = 1 << 1,
+  ANOMALY_REASON_NO_NEIGHBOURS = 1 << 2,
+  ANOMALY_REASON_NEIGHBOURS_CHANGED = 1 << 3,
+  ANOMALY_REASON_SIGNAL_OUTLIER = 1 << 4,
+  ANOMALY_REASON_TIMING_ADVANCE_JUMP = 1 << 5,
+  ANOMALY_REASON_RAT_DOWNGRADE = 1 << 6,
+  ANOMALY_REASON_LAST = 7,
+};
+
+/*
+ * Everything we learnt about the serving cell from a single
+ * NAS_GET_CELL_LOCATION_INFO response
+ */
+struct cell_observation {
+  uint8_t type_of_service; // OCID_RADIO_*
+  int16_t signal;          // RSCP / SRX / RX level, higher is stronger
+  bool has_timing_advance;
+  int32_t timing_advance;
+  uint64_t neighbours; // One bit per neighbour cell
+};
+
+struct anomaly_result {
+  int16_t score;
+  uint16_t reasons; // ANOMALY_REASON_*
+};
+
+void cell_observation_add_neighbour(struct cell_observation *obs,
+                                    uint32_t neighbour_id);
+void cell_observation_set_timing_advance(struct cell_observation *obs,
+                                         int32_t timing_advance);
+void reset_cell_anomaly_stats(uint16_t slot);
+struct anomaly_result evaluate_cell_anomaly(int report_id,
+                                            struct cell_observation *obs,
+                                            int opencellid_res);
+void update_cell_anomaly_stats(int report_id, struct cell_observation *obs);
+bool should_notify_cell_anomaly(uint32_t cell_id, uint16_t lac,
+                                struct anomaly_result *result);
+int format_anomaly_reasons(char *buf, size_t len, uint16_t reasons);
+#endif
@@ -89,10 +89,14 @@ enum {
   CMD_ID_ACTION_INTERNAL_NETWORK_SET_USER,
   CMD_ID_ACTION_INTERNAL_NETWORK_SET_PASS,
   CMD_ID_ACTION_INTERNAL_NETWORK_SET_AUTH_METHOD,
+  CMD_ID_GET_QMI_STATS,
+  CMD_ID_GET_PROXY_LATENCY,
 };
 
 void cmd_get_rmnet_stats();
 void cmd_get_gps_stats();
+void cmd_get_qmi_stats();
+void cmd_get_proxy_latency();
 void cmd_get_help();
 
 int cmd_get_uptime();
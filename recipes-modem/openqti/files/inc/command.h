@@ -208,9 +208,9 @@ static const struct {
     {CMD_ID_ACTION_CALL_OWNER_COUNTDOWN, 1, CMD_CATEGORY_UTILITY, "call me in ",
      "Calling you back in ", "Call me in X seconds"},
     {CMD_ID_ACTION_SET_REMINDER, 1, CMD_CATEGORY_UTILITY, "remind me ",
-     "Will call you ", "Call you [at/in] hh[:xx min] [text]"},
+     "Will call you ", "Call you [at/in/every [day] at] hh[:xx min] [text]"},
     {CMD_ID_ACTION_WAKE_OWNER, 1, CMD_CATEGORY_UTILITY, "wake me up ",
-     "Will wake you up ", "Wake you up [at/in] hh[:xx min]"},
+     "Will wake you up ", "Wake you up [at/in/every [day] at] hh[:xx min]"},
     {CMD_ID_ACTION_DELETE_TASK, 1, CMD_CATEGORY_UTILITY, "delete task ",
      "Removing task ", "delete task X: Removes task X from the scheduler"},
     {CMD_ID_ACTION_ENABLE_DND, 1, CMD_CATEGORY_CALLS, "enable dnd for ",
@@ -242,6 +242,11 @@ static const struct {
      "set internal network auth method ", "Set internal apn auth method ",
      "Configure your carrier APN authentication method (options: none, pap, "
      "chap, auto)"},
+    {CMD_ID_GET_QMI_STATS, 0, CMD_CATEGORY_INFO, "qmi stats",
+     "QMI stats:", "Get response times of the internal QMI client"},
+    {CMD_ID_GET_PROXY_LATENCY, 0, CMD_CATEGORY_INFO, "proxy latency",
+     "Proxy latency:",
+     "Get how long it takes to handle and forward QMI messages"},
 };
 
 char *get_rt_modem_name();
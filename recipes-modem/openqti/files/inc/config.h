@@ -9,6 +9,9 @@
 #define PERSIST_CUSTOM_ALERT_TONE "cust_alert_tone"
 #define CONFIG_FILE_PATH "/persist/openqti.conf"
 #define SCHEDULER_DATA_FILE_PATH "/persist/sched.raw"
+/* Task log. Must survive cleanup_storage(), which removes any "log" */
+#define SCHEDULER_LOG_FILE_PATH "/persist/sched_tasks.raw"
+#define SCHEDULER_LOG_TMP_FILE_PATH "/persist/sched_tasks.raw.tmp"
 #define PERSISTENT_PATH "/persist/"
 #define VOLATILE_PATH "/tmp/"
 #define MAX_NAME_SZ 128
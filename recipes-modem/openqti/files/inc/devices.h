@@ -38,6 +38,8 @@
 #define USB_EN_PATH "/sys/class/android_usb/android0/enable"
 #define SUSPEND_INHIBIT_PATH                                                   \
   "/sys/devices/78d9000.usb/msm_hsusb/isr_inhibit_suspend"
+#define USB_SUSPEND_STATE_PATH                                                 \
+  "/sys/devices/78d9000.usb/msm_hsusb/isr_suspend_state"
 
 #define ADSP_BOOT_HANDLER "/sys/kernel/boot_adsp/boot"
 #endif
\ No newline at end of file
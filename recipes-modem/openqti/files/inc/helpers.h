@@ -20,6 +20,7 @@
 #define CPUFREQ_PS "powersave"
 
 int write_to(const char *path, const char *val, int flags);
+int run_command(const char *cmd);
 uint32_t get_curr_timestamp();
 void store_adb_setting(bool en);
 void switch_adb(bool en);
@@ -13,6 +13,17 @@
 #define VOLATILE_THERMAL_LOGFILE "/var/log/thermal.log"
 #define PERSISTENT_THERMAL_LOGFILE "/persist/thermal.log"
 
+/* Log ring: must be a power of 2 */
+#define LOG_RING_SLOTS 1024
+#define LOG_RING_MASK (LOG_RING_SLOTS - 1)
+#define LOG_SLOT_DATA_SIZE 249
+/* A full hex dump of a MAX_PACKET_SIZE packet still fits */
+#define LOG_MAX_SLOTS_PER_LINE 160
+/* Stack buffer for a single line, longer ones go to the heap */
+#define LOG_LINE_SIZE 512
+/* Writer thread output buffer */
+#define LOG_BATCH_SIZE 16384
+
 void reset_logtime();
 double get_elapsed_time();
 void logger(uint8_t level, char *format, ...);
@@ -20,9 +31,16 @@ void dump_to_file(char *filename, char *header, char *format, ...);
 void log_thermal_status(uint8_t level, char *format, ...);
 void dump_packet(char *direction, uint8_t *buf, int pktsize);
 void dump_pkt_raw(uint8_t *buf, int pktsize);
+const char *get_command_desc(uint8_t service, uint16_t msgid);
+void pretty_print_tlvs(FILE *fd, size_t initial_offset, uint8_t service,
+                       uint16_t msgid, uint8_t *buf, int pktsize);
+void pretty_print_qmi_pkt_to_file(FILE *fd, char *direction, uint8_t *buf,
+                                  int pktsize);
 void pretty_print_qmi_pkt(char *direction, uint8_t *buf, int pktsize);
 uint8_t get_log_level();
 void set_log_level(uint8_t level);
+void log_storage_level_changed(uint8_t storage_id, uint8_t level,
+                               int32_t free_mb);
 void set_log_method(bool ttyout);
 int mask_phone_number(uint8_t *orig, char *dest, uint8_t len);
 #endif
@@ -0,0 +1,63 @@
+/* SPDX-License-Identifier: MIT */
+
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Connect to it to get a text dump of the proxy histograms */
+#define METRICS_SOCKET_PATH "/tmp/openqti-metrics.sock"
+#define METRICS_SOCKET_BACKLOG 4
+/* Don't let a stuck reader hold the socket thread forever */
+#define METRICS_SOCKET_SEND_TIMEOUT_S 2
+
+/*
+ * Histograms are log2: bucket 0 counts zeroes and bucket N counts
+ * values below 2^N. Values past the last bucket go to the last one
+ */
+#define METRICS_BUCKETS 20
+
+/* Services below this get their own slot, the rest share the last one */
+#define METRICS_MAX_SERVICES 32
+#define METRICS_OTHER_SERVICES METRICS_MAX_SERVICES
+
+enum {
+  METRIC_PACKET_SIZE = 0, // bytes
+  METRIC_HANDLER_TIME,    // us in process_packet()
+  METRIC_FORWARD_LATENCY, // us from read() to write() of the frame
+  METRIC_LAST,
+};
+
+struct metrics_histogram {
+  _Atomic uint32_t count;
+  _Atomic uint32_t max;
+  _Atomic uint64_t total;
+  _Atomic uint32_t buckets[METRICS_BUCKETS];
+};
+
+/* Plain copy of a histogram, for readers */
+struct metrics_snapshot {
+  uint32_t count;
+  uint32_t max;
+  uint64_t total;
+  uint32_t buckets[METRICS_BUCKETS];
+};
+
+void metrics_record_frame(uint8_t source, uint8_t service, size_t size,
+                          uint32_t handler_us);
+void metrics_record_forward(uint8_t source, uint8_t service,
+                            uint32_t latency_us);
+uint8_t get_metrics_slot(uint8_t service);
+const char *get_metrics_slot_name(uint8_t slot);
+struct metrics_snapshot get_proxy_metrics(uint8_t source, uint8_t slot,
+                                          uint8_t metric);
+struct metrics_snapshot get_proxy_metrics_total(uint8_t source,
+                                                uint8_t metric);
+uint32_t get_metrics_percentile(struct metrics_snapshot *snapshot,
+                                uint8_t percent);
+uint8_t get_slowest_proxy_service(uint32_t *p95_us);
+void *metrics_socket_thread();
+#endif
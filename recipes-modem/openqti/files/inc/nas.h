@@ -10,7 +10,22 @@
 
 
 #define INTERNAL_CELLID_INFO_PATH "/persist/cellid_data.raw"
+#define INTERNAL_CELLID_INFO_TMP_PATH "/persist/cellid_data.raw.tmp"
+#define INTERNAL_CELLID_JOURNAL_PATH "/persist/cellid_data.journal"
 #define MAX_REPORT_NUM 4096
+/* Open addressed index of the reports, power of 2, max 50% load */
+#define REPORT_HASH_SIZE (MAX_REPORT_NUM * 2)
+#define REPORT_HASH_EMPTY 0 // Buckets hold report slot + 1
+
+/*
+ * Report journal
+ *  Changed reports are appended to the journal in batches, and the
+ *  journal is folded back into the full dump once it grows too much
+ */
+#define REPORT_JOURNAL_MAGIC 0x4a52434e
+#define REPORT_JOURNAL_MAX_DIRTY 32            // Flush after this many changes
+#define REPORT_JOURNAL_FLUSH_INTERVAL_MS 120000 // or this long after the first
+#define REPORT_JOURNAL_MAX_ENTRIES 2048        // Compact past this
 #define MAX_FILE_SIZE 13107200
 
 /*
@@ -585,6 +600,29 @@ struct ocid_cell_slim {
   int16_t average_signal;
 } __attribute__ ((__packed__));
 
+/*
+ * OpenCellid database files (/tmp/<mcc>-<mnc>.bin)
+ *  A header followed by ocid_cell_slim records sorted by
+ *  (radio, area, cell), so we can mmap them and binary search.
+ *  They're built from the OpenCellid CSV dump with ocidconv.
+ *  Files without a header (the original format) are still
+ *  accepted: they're indexed in memory when loaded.
+ */
+#define OCID_DB_MAGIC 0x4449434f // "OCID"
+#define OCID_DB_VERSION 1
+#define OCID_DB_FLAG_SORTED (1 << 0)
+
+struct ocid_db_header {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t record_size; // sizeof(struct ocid_cell_slim)
+  uint8_t mcc[4];
+  uint8_t mnc[4];
+  uint32_t flags;
+  uint32_t num_records;
+  uint32_t checksum; // FNV-1a of all the records
+} __attribute__ ((__packed__));
+
 struct nas_report {
   uint16_t mcc;
   uint16_t mnc;
@@ -632,11 +670,25 @@ struct network_status_reports {
   struct nas_report report;
 };
 
+struct report_journal_entry {
+  uint32_t magic;
+  uint32_t checksum; // FNV-1a of the report
+  struct network_status_reports data;
+};
+
 /* Functions */
 void notify_database_unavailable();
+void index_report(uint16_t slot);
+int find_report(uint16_t mcc, uint16_t mnc, uint8_t type_of_service,
+                uint32_t cell_id, uint16_t lac);
+uint16_t allocate_report_slot();
+int flush_report_data(bool force);
+void cell_history_storage_level_changed(uint8_t storage_id, uint8_t level,
+                                        int32_t free_mb);
 uint8_t is_cellid_data_missing();
 void set_cellid_data_missing_as_requested();
 void get_opencellid_data();
+void request_opencellid_reload();
 uint8_t *get_current_mcc();
 uint8_t *get_current_mnc();
 uint8_t get_network_type();
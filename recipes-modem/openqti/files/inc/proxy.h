@@ -3,9 +3,70 @@
 #ifndef _PROXY_H
 #define _PROXY_H
 
+#include "openqti.h"
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
+/* Max number of events to handle on each epoll_wait() pass */
+#define PROXY_MAX_EVENTS 8
+/* How often we step internal work (SMS queue, simulated calls...) */
+#define PROXY_INJECT_INTERVAL_MS 500
+/* How often we retry to open GPS nodes if they're closed */
+#define PROXY_GPS_REOPEN_INTERVAL_MS 1000
+
+/*
+ * Packet routing
+ *  Subsystems register handlers for (service, message id, direction)
+ *  and the proxy only calls the ones matching each frame. Services
+ *  without routes are forwarded without looking any further
+ */
+#define PROXY_MAX_ROUTES 32
+#define PROXY_MAX_ROUTE_CHAINS 32
+#define PROXY_MAX_ROUTES_PER_CHAIN 8
+/* Message IDs below this get their own slot, the rest share one */
+#define PROXY_ROUTE_MSGID_SLOTS 256
+/* Matches every message of the service */
+#define PROXY_ROUTE_ANY_MSGID 0xffff
+/* Handler didn't make a decision, try the next one */
+#define PROXY_ROUTE_CONTINUE 0xff
+#define PROXY_ROUTE_NO_CHAIN 0xff
+
+#define PROXY_ROUTE_FROM_DSP (1 << FROM_DSP)
+#define PROXY_ROUTE_FROM_HOST (1 << FROM_HOST)
+#define PROXY_ROUTE_ANY_DIRECTION (PROXY_ROUTE_FROM_DSP | PROXY_ROUTE_FROM_HOST)
+
+/* Returns a PACKET_* action or PROXY_ROUTE_CONTINUE */
+typedef uint8_t (*proxy_route_handler)(uint8_t source, uint8_t *pkt,
+                                       size_t pkt_size, int adspfd, int usbfd);
+
+struct proxy_route {
+  uint8_t service;
+  uint16_t msgid;
+  uint8_t directions;
+  proxy_route_handler handler;
+};
+
+/* Routes matching a (service, msgid slot, direction), in registration order */
+struct proxy_route_chain {
+  uint8_t num_routes;
+  uint8_t routes[PROXY_MAX_ROUTES_PER_CHAIN];
+};
+
+/*
+ * USB suspend monitor
+ *  Time we give the host to finish waking up before sending it
+ *  anything, and how long we sleep waiting for the kernel to notify
+ *  a change before re-reading the state anyway. Nothing guarantees
+ *  the msm_hsusb driver calls sysfs_notify() on isr_suspend_state, so
+ *  the fallback has to be short enough to catch a resume in time
+ */
+#define USB_RESUME_SETTLE_MS 100
+#define USB_SUSPEND_FALLBACK_POLL_MS 1000
+
+/* Forwarding buffer alignment (cache line) */
+#define PROXY_BUF_ALIGNMENT 64
+
 struct pkt_stats {
   uint32_t bypassed;
   uint32_t empty;
@@ -13,14 +74,25 @@ struct pkt_stats {
   uint32_t allowed;
   uint32_t failed;
   uint32_t other;
+  /* Forwarded traffic, by source (FROM_DSP / FROM_HOST) */
+  uint32_t frames[2];
+  uint64_t bytes[2];
 };
 void proxy_rt_reset();
 void enable_service_debugging(uint8_t service_id);
 void disable_service_debugging();
+void wake_up_proxy();
+int proxy_register_route(uint8_t service, uint16_t msgid, uint8_t directions,
+                         proxy_route_handler handler);
+void proxy_set_default_action(uint8_t service, uint8_t action);
+void register_default_proxy_routes();
+int build_proxy_route_table();
+uint64_t get_monotonic_time_ms();
+uint64_t get_monotonic_time_us();
 
 struct pkt_stats get_rmnet_stats();
 struct pkt_stats get_gps_stats();
 int get_transceiver_suspend_state();
-void *gps_proxy();
+void *usb_suspend_monitor();
 void *rmnet_proxy(void *node_data);
 #endif
\ No newline at end of file
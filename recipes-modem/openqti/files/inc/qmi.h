@@ -2,6 +2,7 @@
 
 #ifndef _QMI_H
 #define _QMI_H
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <sys/types.h>
@@ -298,14 +299,89 @@ typedef enum {
 } QMI_Service;
 
 
+/* Internal QMI client: outgoing messages per service */
+#define QMI_QUEUE_SIZE 32 // Must be a power of 2
+#define QMI_QUEUE_MASK (QMI_QUEUE_SIZE - 1)
+/* How many requests we let the baseband have per service at once */
+#define QMI_MAX_INFLIGHT 8
+/* Default deadline for a request if the caller doesn't set one */
+#define QMI_REQUEST_TIMEOUT_MS 10000
+/* Ask again for a client if the baseband didn't answer */
+#define QMI_ALLOCATION_RETRY_MS 5000
+/* Poll interval while something is waiting on the baseband */
+#define QMI_CLIENT_TICK_MS 500
+/* Max number of services with a queue */
+#define QMI_MAX_QUEUES 16
+
+/* Latency histogram: bucket N counts responses that took < 2^N ms */
+#define QMI_LATENCY_BUCKETS 16
+
+/*
+ * Called from the client thread when the response to a request
+ * arrives (status 0), or when its deadline expires (-ETIMEDOUT,
+ * with a NULL buffer)
+ */
+typedef void (*qmi_response_cb)(uint8_t *buf, size_t buf_len, int status,
+                                void *data);
+
+/* A message waiting in a service queue */
+struct qmi_pending_request {
+  uint8_t *message;
+  size_t len;
+  qmi_response_cb callback;
+  void *data;
+  uint64_t deadline;
+};
+
+/*
+ * Bounded MPSC queue
+ *  Any thread can push, only the internal client thread
+ *  pops. Each slot has a sequence number telling if it's
+ *  free (seq == pos) or ready to be read (seq == pos + 1)
+ */
+struct qmi_queue_slot {
+  _Atomic uint32_t seq;
+  struct qmi_pending_request request;
+};
+
+struct qmi_message_queue {
+  struct qmi_queue_slot slots[QMI_QUEUE_SIZE];
+  _Atomic uint32_t head; // Producers
+  uint32_t tail;         // Consumer (client thread)
+};
+
+/*
+ * A request we sent and for which we still expect a response
+ * Responses are matched by client instance and transaction ID
+ */
+struct qmi_inflight_request {
+  uint8_t instance;
+  uint16_t transaction_id;
+  uint16_t msgid;
+  uint64_t sent_at;
+  uint64_t deadline;
+  qmi_response_cb callback;
+  void *data;
+};
+
+struct qmi_latency_stats {
+  uint32_t responses;
+  uint32_t timeouts;
+  uint32_t max_ms;
+  uint64_t total_ms;
+  uint32_t buckets[QMI_LATENCY_BUCKETS];
+};
+
 struct qmi_service_bindings {
   uint8_t service;
   uint8_t instance;
   uint8_t is_initialized;
-  uint8_t has_pending_message;
-  uint8_t *message;
-  size_t message_len;
-  uint16_t transaction_id;
+  uint64_t allocation_requested_at;
+  struct qmi_message_queue *_Atomic queue;
+  uint16_t transaction_id; // Last one we used
+  uint8_t inflight_count;
+  struct qmi_inflight_request inflight[QMI_MAX_INFLIGHT];
+  struct qmi_latency_stats latency;
 };
 
 struct qmux_packet {      // 6 byte
@@ -411,6 +487,23 @@ struct tlv_position {
   uint16_t size;
 };
 
+/*
+ * TLV index
+ *  Built walking a packet's TLVs once, so handlers looking for
+ *  several of them don't have to walk the packet every time
+ */
+#define QMI_MAX_INDEXED_TLVS 48
+struct qmi_tlv_index {
+  uint8_t *buf;
+  size_t len;
+  struct qmi_packet header; // Tells a recycled buffer from the indexed frame
+  bool is_valid;     // Every TLV is within the packet
+  bool is_truncated; // Packet has more TLVs than we can index
+  uint8_t num_tlvs;
+  uint32_t present[8]; // Bitmap of TLV IDs in the packet
+  struct tlv_position tlvs[QMI_MAX_INDEXED_TLVS];
+};
+
 struct qmux_alloc_pkt {   // 7 byte
   uint8_t version;        // 0x01 ?? it's always 0x01, no idea what it is
   uint16_t packet_length; // sz
@@ -459,6 +552,12 @@ uint16_t get_qmi_message_type(void *bytes, size_t len);
 uint16_t get_qmi_transaction_id(void *bytes, size_t len);
 uint16_t get_transaction_id(void *bytes, size_t len);
 uint16_t get_tlv_offset_by_id(uint8_t *bytes, size_t len, uint8_t tlvid);
+int build_qmi_tlv_index(struct qmi_tlv_index *index, uint8_t *buf, size_t len);
+uint16_t get_tlv_offset_from_index(struct qmi_tlv_index *index, uint8_t tlvid);
+void set_current_tlv_index(struct qmi_tlv_index *index);
+void invalidate_tlv_index(void *buf);
+struct qmi_tlv_index *get_tlv_index(uint8_t *buf, size_t len,
+                                    struct qmi_tlv_index *fallback);
 const char *get_qmi_error_string(uint16_t result_code);
 uint16_t did_qmi_op_fail(uint8_t *bytes, size_t len);
 int build_qmux_header(void *output, size_t output_len, uint8_t control, uint8_t service, uint8_t instance);
@@ -466,9 +565,16 @@ int build_qmi_header(void *output, size_t output_len, uint8_t ctlid, uint16_t tr
 int build_u8_tlv(void *output, size_t output_len, size_t offset, uint8_t id, uint8_t data);
 int build_u32_tlv(void *output, size_t output_len, size_t offset, uint8_t id,
                  uint32_t data);
+void wake_up_qmi_client();
 void clear_current_transaction_id(uint8_t service);
 uint16_t get_transaction_id_for_service(uint8_t service);
 int add_pending_message(uint8_t service, uint8_t *buf, size_t buf_len);
+int add_pending_message_with_callback(uint8_t service, uint8_t *buf,
+                                      size_t buf_len, qmi_response_cb callback,
+                                      void *data, uint32_t timeout_ms);
+struct qmi_latency_stats get_qmi_latency_stats(uint8_t service);
+uint32_t get_qmi_latency_percentile(struct qmi_latency_stats *stats,
+                                    uint8_t percent);
 void *init_internal_qmi_client();
 uint8_t is_internal_qmi_client_ready();
 uint16_t count_tlvs_in_message(uint8_t *bytes, size_t len);
@@ -9,6 +9,23 @@
 #define MAX_NUM_TASKS 255
 #define ARG_SIZE 160
 
+/* How often the scheduler checks if the network is up before starting */
+#define SCHEDULER_NETWORK_WAIT_S 5
+/* Recurring jobs */
+#define SCHEDULER_NETWORK_REFRESH_S 10
+
+/*
+ * Task log
+ *  Tasks are stored as an append-only log of task_log_entry records,
+ *  each one followed by arg_len bytes of arguments. Adding or removing
+ *  a task appends a single record; recurring tasks are never rewritten
+ *  when they fire since their next run is calculated on the fly. Once
+ *  the log has this many records over twice the live tasks, it is
+ *  rewritten with just the live ones
+ */
+#define TASK_LOG_MAGIC 0x4b534154 // "TASK"
+#define TASK_LOG_COMPACT_SLACK 64
+
 enum {
   STATUS_FREE = 0,
   STATUS_PENDING,
@@ -26,7 +43,29 @@ enum {
 };
 
 /* Time mode */
-enum { SCHED_MODE_TIME_AT = 0, SCHED_MODE_TIME_COUNTDOWN };
+enum {
+  SCHED_MODE_TIME_AT = 0,    // Once, next hh:mm
+  SCHED_MODE_TIME_COUNTDOWN, // Once, hh:mm from now
+  SCHED_MODE_TIME_DAILY,     // Every day at hh:mm
+  SCHED_MODE_TIME_WEEKLY,    // At hh:mm on the days set in weekdays
+  SCHED_MODE_TIME_INTERVAL,  // Every hh:mm
+};
+
+enum {
+  TASK_LOG_ADD = 1,
+  TASK_LOG_REMOVE,
+};
+
+/* Weekday bits, like tm_wday */
+#define SCHED_SUNDAY (1 << 0)
+#define SCHED_MONDAY (1 << 1)
+#define SCHED_TUESDAY (1 << 2)
+#define SCHED_WEDNESDAY (1 << 3)
+#define SCHED_THURSDAY (1 << 4)
+#define SCHED_FRIDAY (1 << 5)
+#define SCHED_SATURDAY (1 << 6)
+#define SCHED_WEEKDAYS 0x3e
+#define SCHED_WEEKEND (SCHED_SATURDAY | SCHED_SUNDAY)
 /*
  *  Status:
  *      0 -> free
@@ -36,10 +75,22 @@ enum { SCHED_MODE_TIME_AT = 0, SCHED_MODE_TIME_COUNTDOWN };
  */
 
 struct execution_time {
-  time_t exec_time;
-  uint8_t mode; // 0 -> Specific time ; 1 -> In specific time from creation
+  time_t exec_time; // Next run
+  uint8_t mode;     // SCHED_MODE_TIME_*
   uint8_t hh;
   uint8_t mm;
+  uint8_t weekdays; // SCHED_MODE_TIME_WEEKLY only
+};
+
+/*
+ * Housekeeping that has to run forever every few seconds. These aren't
+ * user tasks, so they are neither persisted nor listed
+ */
+struct scheduler_job {
+  const char *name;
+  uint32_t interval_s;
+  time_t next_run;
+  void (*run)();
 };
 
 struct task_p {
@@ -50,7 +101,44 @@ struct task_p {
   char arguments[ARG_SIZE];
 };
 
+/* One record of the task log */
+struct task_log_entry {
+  uint32_t magic;
+  uint32_t checksum; // FNV-1a of the record (with this set to 0) + arguments
+  int64_t exec_time;
+  uint8_t op; // TASK_LOG_*
+  uint8_t task_id;
+  uint8_t type;
+  uint8_t param;
+  uint8_t mode;
+  uint8_t hh;
+  uint8_t mm;
+  uint8_t weekdays;
+  uint8_t arg_len;
+  uint8_t reserved[7];
+};
+
+/* SCHEDULER_DATA_FILE_PATH layout, only read to migrate it to the log */
+struct legacy_execution_time {
+  time_t exec_time;
+  uint8_t mode;
+  uint8_t hh;
+  uint8_t mm;
+};
+
+struct legacy_task_p {
+  uint8_t type;
+  uint8_t param;
+  uint8_t status;
+  struct legacy_execution_time time;
+  char arguments[ARG_SIZE];
+};
+
 void *start_scheduler_thread();
+bool is_recurring_task(struct execution_time *time);
+time_t get_next_execution_time(struct execution_time *time, time_t now);
+int get_task_schedule_description(struct execution_time *time, char *buf,
+                                  size_t len);
 int add_task(struct task_p task);
 void dump_pending_tasks();
 int remove_task(int taskID);
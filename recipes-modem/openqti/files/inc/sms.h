@@ -10,7 +10,37 @@
 #define MAX_MESSAGE_SIZE 160
 #define MAX_MESSAGE_SIZE_HEADROOM_GSM7 140
 #define MSG_MAX_MULTIPART_SIZE 16384
-#define QUEUE_SIZE 256
+#define QUEUE_SIZE 256 // Slot index is the message ID, must fit in uint8_t
+/* How long we wait for the host before retrying a message, and how many times */
+#define SMS_QUEUE_RETRY_MS 5000
+#define SMS_QUEUE_MAX_RETRIES 3
+
+/*
+ * Concatenated messages
+ *  Texts that don't fit in a single PDU are split in segments with a
+ *  concatenation user data header (IEI 0x00, 8 bit reference): 153
+ *  septets per segment in GSM-7, 134 octets (67 UCS-2 chars) otherwise.
+ *  Even longer texts are sent as several concatenated messages of
+ *  SMS_MAX_SEGMENTS segments each
+ */
+#define SMS_UDH_CONCAT_SIZE 6 // UDHL, IEI, IEDL, reference, total, sequence
+#define SMS_UDH_CONCAT_SEPTETS 7 // The header plus one fill bit
+#define SMS_GSM7_MAX_SEPTETS 160
+#define SMS_GSM7_SEGMENT_SEPTETS 153
+#define SMS_MAX_USER_DATA_OCTETS 140
+#define SMS_SEGMENT_OCTETS 134
+#define SMS_MAX_SEGMENTS 32
+
+/*
+ * Inbound concatenated messages (long commands sent to us)
+ *  At most SMS_REASSEMBLY_SLOTS of them in flight, with up to
+ *  SMS_REASSEMBLY_MAX_PARTS parts each. Anything left incomplete for
+ *  SMS_REASSEMBLY_TIMEOUT_MS is dropped
+ */
+#define SMS_REASSEMBLY_SLOTS 4
+#define SMS_REASSEMBLY_MAX_PARTS 4
+#define SMS_REASSEMBLY_TIMEOUT_MS 120000
+#define SMS_MAX_COMMAND_SIZE (SMS_REASSEMBLY_MAX_PARTS * MAX_MESSAGE_SIZE + 1)
 #define MAX_PHONE_NUMBER_SIZE 20
 
 /* OpenQTI's way of knowing if it
@@ -657,6 +687,14 @@ typedef enum {
 #define  SMS_TP_MTI_SMS_DELIVER       0x00
 #define  SMS_TP_MTI_SMS_SUBMIT        0x01
 #define  SMS_TP_MTI_SMS_STATUS_REPORT 0x02
+#define SMS_TP_MMS                    0x04 // No more messages to send
+#define SMS_TP_VPF_MASK               0x18
+#define  SMS_TP_VPF_NONE              0x00
+#define  SMS_TP_VPF_RELATIVE          0x10
+#define SMS_TP_UDHI                   0x40
+
+#define SMS_IEI_CONCAT_8BIT_REF       0x00
+#define SMS_IEI_CONCAT_16BIT_REF      0x08
 
 #define SMS_NUMBER_TYPE_MASK          0x70
 #define SMS_NUMBER_TYPE_UNKNOWN       0x00
@@ -724,6 +762,8 @@ uint8_t do_inject_notification(int fd);
 uint8_t intercept_and_parse(void *bytes, size_t len, int hostfd, int adspfd);
 
 int process_message_queue(int fd);
+bool is_message_queue_empty();
+void release_message_slot(uint32_t message_id);
 void add_sms_to_queue(uint8_t *message, size_t len);
 void notify_wms_event(uint8_t *bytes, size_t len, int fd);
 int check_wms_message(uint8_t source, void *bytes, size_t len, int adspfd,
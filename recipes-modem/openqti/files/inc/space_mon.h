@@ -9,8 +9,67 @@
 #define RAM_STORAGE_PATH_BASE "/tmp"
 #define PERSISTENT_STORAGE_PATH_BASE "/persist"
 
+/* Storage IDs, as used by cleanup_storage() */
+enum {
+  STORAGE_TMPFS = 0,
+  STORAGE_PERSIST,
+  STORAGE_LAST,
+};
+
+/* Whoever writes enough to fill a filesystem */
+enum {
+  STORAGE_CONSUMER_RECORDINGS = 0,
+  STORAGE_CONSUMER_LOGS,
+  STORAGE_CONSUMER_CELL_HISTORY,
+  STORAGE_CONSUMER_TTS_CACHE,
+  STORAGE_CONSUMER_LAST,
+};
+
+/*
+ * Free space levels. Each one is entered when free space drops below
+ * its threshold, and left only once it's STORAGE_HYSTERESIS_MB over it
+ * again, so we don't flap around a boundary while a recording goes on
+ */
+enum {
+  STORAGE_LEVEL_OK = 0,
+  STORAGE_LEVEL_LOW,      // Only log errors
+  STORAGE_LEVEL_CLEANUP,  // Remove old logs
+  STORAGE_LEVEL_CRITICAL, // Remove everything we can
+  STORAGE_LEVEL_FULL,     // Stop writing
+};
+
+#define STORAGE_LOW_MB 10
+#define STORAGE_CLEANUP_MB 5
+#define STORAGE_CRITICAL_MB 3
+#define STORAGE_FULL_MB 2
+#define STORAGE_HYSTERESIS_MB 1
+
+/*
+ * Sampling interval: as slow as STORAGE_POLL_MAX_MS while nothing is
+ * filling up, down to STORAGE_POLL_MIN_MS when getting close to full.
+ * We want STORAGE_POLL_SAMPLES_TO_FULL samples before the projected
+ * time to full
+ */
+#define STORAGE_POLL_MIN_MS 1000
+#define STORAGE_POLL_MAX_MS 60000
+#define STORAGE_POLL_SAMPLES_TO_FULL 20
+/* Write rate smoothing, 1/N of every new sample */
+#define STORAGE_RATE_SMOOTHING 4
+
+/* Runs on the monitor thread whenever the consumer's storage changes level */
+typedef void (*storage_level_cb)(uint8_t storage_id, uint8_t level,
+                                 int32_t free_mb);
 
 int get_available_space_tmpfs_mb();
 int get_available_space_persist_mb();
 int cleanup_storage(int storage_id, bool aggressive, char *exclude_file);
+
+void register_storage_consumer(uint8_t consumer, storage_level_cb callback);
+void storage_account_write(uint8_t consumer, uint32_t bytes);
+void set_storage_protected_file(const char *filename);
+uint8_t get_consumer_storage(uint8_t consumer);
+uint8_t get_storage_level(uint8_t storage_id);
+int32_t get_cached_free_space_mb(uint8_t storage_id);
+int64_t get_storage_time_to_full_s(uint8_t consumer);
+void *storage_monitor_thread();
 #endif
@@ -0,0 +1,44 @@
+/* SPDX-License-Identifier: MIT */
+
+#ifndef _TTS_CACHE_H_
+#define _TTS_CACHE_H_
+
+#include "audio.h"
+#include "space_mon.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Synthesized phrase cache
+ *  Idle prompts and looped reminders are spoken over and over, so we
+ *  keep their PCM (16kHz mono S16_LE, 32KB per second) around, keyed
+ *  by voice and normalized text.
+ *  Least recently used phrases are moved to tmpfs once the memory
+ *  budget is used up, and dropped once the spill budget is too.
+ */
+#define TTS_CACHE_MAX_ENTRIES 16
+#define TTS_CACHE_MAX_TEXT 160
+/* Phrases longer than this (~12s) are always synthesized */
+#define TTS_CACHE_MAX_ENTRY_SIZE (384 * 1024)
+#define TTS_CACHE_MEMORY_BUDGET (1024 * 1024)
+#define TTS_CACHE_SPILL_BUDGET (4 * 1024 * 1024)
+#define TTS_CACHE_SPILL_FILE RAM_STORAGE_PATH_BASE "/openqti-tts-%.16llx.pcm"
+
+struct tts_cache_entry {
+  bool in_use;
+  bool spilled; // PCM is in the spill file instead of memory
+  uint64_t key;
+  char text[TTS_CACHE_MAX_TEXT]; // Normalized, to tell collisions apart
+  uint8_t *pcm;
+  uint32_t size;
+  uint32_t hits;
+  uint64_t last_used;
+};
+
+int speak_cached_phrase(char *phrase, size_t len, tts_sample_sink sink,
+                        void *data);
+void flush_tts_cache();
+void tts_cache_storage_level_changed(uint8_t storage_id, uint8_t level,
+                                     int32_t free_mb);
+#endif
@@ -14,6 +14,8 @@
  */
 
 #define DEFAULT_APN_NAME "internet"
+/* Bringing up a data session can take a while */
+#define WDS_START_NETWORK_TIMEOUT_MS 60000
 enum rmnet_ioctl_cmds_e {
 	RMNET_IOCTL_SET_LLP_ETHERNET = 0x000089F1, /* Set Ethernet protocol  */
 	RMNET_IOCTL_SET_LLP_IP       = 0x000089F2, /* Set RAWIP protocol     */
@@ -270,6 +272,7 @@ struct wds_start_network_autoconnect {
 void reset_wds_runtime();
 uint8_t is_wds_initialized();
 int wds_attempt_to_connect();
+void wds_handle_start_network_response(uint8_t *buf, size_t buf_len);
 void *init_internal_networking();
 const char *get_wds_command(uint16_t msgid);
 void wds_chat_ifup_down(bool start);
@@ -536,16 +536,19 @@ int handle_atfwd_response(struct qmi_device *qmidev, uint8_t *buf,
   case 144: // Send example #1 CB message
       sckret = send_pkt(qmidev, response, pkt_size);
       atfwd_runtime_state.debug_cb = true;
+      wake_up_proxy();
       break;
 
   case 145: // Send a random example CB message from our list
       sckret = send_pkt(qmidev, response, pkt_size);
       atfwd_runtime_state.random_debug_cb = true;
+      wake_up_proxy();
       break;
 
   case 146: // Send a random example CB message from our list
       sckret = send_pkt(qmidev, response, pkt_size);
       atfwd_runtime_state.stream_cb = true;
+      wake_up_proxy();
       break;
 
   default:
@@ -758,7 +761,7 @@ void *start_atfwd_thread() {
         is_cellid_data_missing() == 0) {
       logger(MSG_INFO, "%s: Fire the pending cell id notification!\n", __func__);
       at_send_missing_cellid_data(at_qmi_dev);
-      get_opencellid_data();
+      request_opencellid_reload();
 
     }
   }
@@ -1,6 +1,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <string.h>
 #include <sys/ioctl.h>
 #include <unistd.h>
@@ -33,6 +34,7 @@ struct {
   uint8_t current_active_call_id;
   uint8_t is_recording;
   uint8_t record_next_call;
+  _Atomic uint8_t storage_full; // Set by the storage monitor
 } audio_runtime_state;
 
 void set_audio_runtime_default() {
@@ -261,42 +263,12 @@ int populate_filename(bool mode, char *filename, int sz) {
           .phone_number);
   return 0;
 }
-uint8_t watch_storage(char *filename) {
-  uint8_t kill_recording = 0;
-  uint32_t avail_space_persist = get_available_space_persist_mb();
-  uint32_t avail_space_tmpfs = get_available_space_tmpfs_mb();
-  logger(MSG_ERROR, "%s: Available space: Persist %i Mb, Volatile: %i Mb\n",
-         __func__, avail_space_persist, avail_space_tmpfs);
-  /* AVAILABLE SPACE MONITORING! */
-  if (use_persistent_logging()) {
-    if (avail_space_persist != -EINVAL && avail_space_persist < 2) {
-      kill_recording = 1;
-    } else if (avail_space_persist != -EINVAL && avail_space_persist < 3) {
-      // AGGRESSIVE
-      cleanup_storage(1, true, filename);
-    } else if (avail_space_persist != -EINVAL && avail_space_persist < 5) {
-      // NORMAL
-      cleanup_storage(1, false, filename);
-    } else if (avail_space_persist != -EINVAL && avail_space_persist < 10) {
-      // Only log errors from now on to avoid wasting more space
-      set_log_level(MSG_ERROR);
-    }
-  } else {
-    if (avail_space_tmpfs != -EINVAL && avail_space_tmpfs < 2) {
-      kill_recording = 1;
-    } else if (avail_space_tmpfs != -EINVAL && avail_space_tmpfs < 3) {
-      // AGGRESSIVE
-      cleanup_storage(0, true, filename);
-    } else if (avail_space_tmpfs != -EINVAL && avail_space_tmpfs < 5) {
-      // NORMAL
-      cleanup_storage(0, false, filename);
-    } else if (avail_space_tmpfs != -EINVAL && avail_space_tmpfs < 10) {
-      // Only log errors from now on to avoid wasting more space
-      set_log_level(MSG_ERROR);
-    }
-  }
-  return kill_recording;
+/* Called from the storage monitor thread */
+void recording_storage_level_changed(uint8_t storage_id, uint8_t level,
+                                     int32_t free_mb) {
+  atomic_store(&audio_runtime_state.storage_full, level >= STORAGE_LEVEL_FULL);
 }
+
 void *incall_recording_tread() {
   char *buffer;
   size_t bufsize;
@@ -356,6 +328,11 @@ void *incall_recording_tread() {
     populate_filename(0, filename, 256);
   }
   
+  /* Don't let a cleanup remove the file we're writing to */
+  set_storage_protected_file(filename);
+  atomic_store(&audio_runtime_state.storage_full,
+               get_storage_level(get_consumer_storage(
+                   STORAGE_CONSUMER_RECORDINGS)) >= STORAGE_LEVEL_FULL);
   file_rx = fopen(filename, "w");
   struct wav_header *file_header;
   file_header = malloc(sizeof(struct wav_header));
@@ -388,6 +365,7 @@ void *incall_recording_tread() {
     if (file_rx == NULL) {
       pcm_close(incall_pcm_rx);
       logger(MSG_ERROR, "%s: Error opening files for writing\n", __func__);
+      set_storage_protected_file(NULL);
       audio_runtime_state.is_recording = 0; // Clear recording flag
       audio_runtime_state.record_next_call = 0;
       return NULL;
@@ -403,6 +381,7 @@ void *incall_recording_tread() {
       audio_runtime_state.is_recording = 0; // Clear recording flag
       audio_runtime_state.record_next_call = 0;
       fclose(file_rx);
+      set_storage_protected_file(NULL);
       pcm_close(incall_pcm_rx);
       return NULL;
     }
@@ -417,11 +396,12 @@ void *incall_recording_tread() {
           logger(MSG_WARN, "%s: Error writing to file, fwrite returned %u\n", __func__, fret);
         }
         file_header->data_bytes += bufsize;
+        storage_account_write(STORAGE_CONSUMER_RECORDINGS, bufsize);
       } else {
         logger(MSG_ERROR, "%s: Error reading RX\n", __func__);
       }
 
-      kill_recording = watch_storage(filename);
+      kill_recording = atomic_load(&audio_runtime_state.storage_full);
 
       if (kill_recording) {
         logger(MSG_ERROR, "%s: Killing the call due to lack of space\n",
@@ -443,6 +423,7 @@ void *incall_recording_tread() {
     fwrite(file_header, sizeof(struct wav_header), 1, file_rx);
     free(file_header);
     fclose(file_rx);
+    set_storage_protected_file(NULL);
     // Close MultiMedia 1
     pcm_close(incall_pcm_rx);
     /* We disable the mixers last */
@@ -518,6 +499,17 @@ void set_output_device(int device) {
 
 uint8_t get_output_device() { return audio_runtime_state.output_device; }
 
+uint32_t get_auxpcm_sampling_rate() {
+  switch (audio_runtime_state.sampling_rate) {
+  case 1:
+    return 16000;
+  case 2:
+    return 48000;
+  default:
+    return 8000;
+  }
+}
+
 void set_auxpcm_sampling_rate(uint8_t mode) {
   int previous_call_state = audio_runtime_state.current_call_state;
   audio_runtime_state.sampling_rate = mode;
@@ -1,240 +1,621 @@
-#include <stdlib.h>
+// SPDX-License-Identifier: MIT
+
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdint.h>
-#include "logger.h"
-#include "devices.h"
-#include "command.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
 #include "audio.h"
+#include "audio2text.h"
+#include "command.h"
+#include "devices.h"
 #include "helpers.h"
+#include "logger.h"
+#include "proxy.h"
 
 #ifdef USE_POCKETSPHINX
 #include <pocketsphinx.h>
 #endif
 
-
+/*
+ * Speech to text
+ *  Loading the acoustic model, the dictionary and the language model
+ *  takes seconds, so the decoder is created once, at startup or the
+ *  first time we need it, and every call reuses it. Models are mmap'd
+ *  where possible, so they live in the page cache instead of the heap.
+ *  Only one audio stream can go through the decoder at a time: its
+ *  owner calls start_speech_stream() and stop_speech_stream() around
+ *  it, and the utterance hooks in between.
+ */
 struct {
-    uint8_t is_enabled;
-    uint8_t stay_running;
-} speech_to_text;
-
+  uint8_t stay_running;
+  pthread_mutex_t init_lock;
+  pthread_mutex_t stream_lock;
+  bool in_utterance;
+  bool has_command_grammar;
+  uint8_t mode;
+#ifdef USE_POCKETSPHINX
+  ps_decoder_t *decoder;
+  ps_endpointer_t *ep;
+  char lm_search[32];
+#endif
+  struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int16_t samples[STT_RING_SAMPLES];
+    size_t head; // Samples written since the capture started
+    size_t tail; // Samples read
+    size_t dropped;
+    bool capture_done;
+  } ring;
+} speech_to_text = {
+    .init_lock = PTHREAD_MUTEX_INITIALIZER,
+    .stream_lock = PTHREAD_MUTEX_INITIALIZER,
+    .ring =
+        {
+            .mutex = PTHREAD_MUTEX_INITIALIZER,
+            .cond = PTHREAD_COND_INITIALIZER,
+        },
+};
 
 void speech_to_text_stay_running(uint8_t enable) {
-    logger(MSG_INFO, "%s: SET %u\n", __func__, enable);
-    speech_to_text.stay_running = enable;
+  logger(MSG_INFO, "%s: SET %u\n", __func__, enable);
+  speech_to_text.stay_running = enable;
 }
-#ifdef USE_POCKETSPHINX
 
-int
-callaudio_stt_demo(char *filename) {
-    ps_decoder_t *decoder;
-    ps_config_t *config;
-    FILE *fh;
-    short *buf;
-    size_t len, nsamples;
-
-    if (speech_to_text.is_enabled) {
-        logger(MSG_ERROR, "%s: Already running\n", __func__);
-        return 0;
+/*
+ * Call audio front end
+ *  The capture thread reads the call audio a short period at a time,
+ *  converts it to STT_SAMPLE_RATE and pushes it to the ring; the
+ *  recognizer takes it out in endpointer sized frames. The ALSA
+ *  reads never wait for the decoder, so a slow utterance doesn't
+ *  overrun the capture. If the decoder falls too far behind, the
+ *  oldest audio is dropped so we don't drift away from the call.
+ */
+void reset_stt_ring() {
+  pthread_mutex_lock(&speech_to_text.ring.mutex);
+  speech_to_text.ring.head = 0;
+  speech_to_text.ring.tail = 0;
+  speech_to_text.ring.dropped = 0;
+  speech_to_text.ring.capture_done = false;
+  pthread_mutex_unlock(&speech_to_text.ring.mutex);
+}
+
+void write_stt_ring(const int16_t *samples, size_t num_samples) {
+  size_t pos, chunk;
+  pthread_mutex_lock(&speech_to_text.ring.mutex);
+  if (speech_to_text.ring.head - speech_to_text.ring.tail + num_samples >
+      STT_RING_SAMPLES) {
+    chunk = speech_to_text.ring.head - speech_to_text.ring.tail +
+            num_samples - STT_RING_SAMPLES;
+    speech_to_text.ring.tail += chunk;
+    speech_to_text.ring.dropped += chunk;
+  }
+  while (num_samples > 0) {
+    pos = speech_to_text.ring.head % STT_RING_SAMPLES;
+    chunk = STT_RING_SAMPLES - pos;
+    if (chunk > num_samples) {
+      chunk = num_samples;
     }
+    memcpy(&speech_to_text.ring.samples[pos], samples,
+           chunk * sizeof(int16_t));
+    speech_to_text.ring.head += chunk;
+    samples += chunk;
+    num_samples -= chunk;
+  }
+  pthread_cond_signal(&speech_to_text.ring.cond);
+  pthread_mutex_unlock(&speech_to_text.ring.mutex);
+}
+
+/*
+ * Waits for a full frame. Returns how many samples we got, which is
+ * only less than frame_size once the capture is over
+ */
+size_t read_stt_ring(int16_t *frame, size_t frame_size) {
+  size_t pos, chunk, read = 0;
+  pthread_mutex_lock(&speech_to_text.ring.mutex);
+  while (speech_to_text.ring.head - speech_to_text.ring.tail < frame_size &&
+         !speech_to_text.ring.capture_done) {
+    pthread_cond_wait(&speech_to_text.ring.cond, &speech_to_text.ring.mutex);
+  }
+  while (read < frame_size &&
+         speech_to_text.ring.tail < speech_to_text.ring.head) {
+    pos = speech_to_text.ring.tail % STT_RING_SAMPLES;
+    chunk = STT_RING_SAMPLES - pos;
+    if (chunk > frame_size - read) {
+      chunk = frame_size - read;
+    }
+    if (chunk > speech_to_text.ring.head - speech_to_text.ring.tail) {
+      chunk = speech_to_text.ring.head - speech_to_text.ring.tail;
+    }
+    memcpy(frame + read, &speech_to_text.ring.samples[pos],
+           chunk * sizeof(int16_t));
+    speech_to_text.ring.tail += chunk;
+    read += chunk;
+  }
+  pthread_mutex_unlock(&speech_to_text.ring.mutex);
+  return read;
+}
+
+/*
+ * Call audio to STT_SAMPLE_RATE
+ *  8kHz is upsampled by interpolating every other sample, 48kHz
+ *  averaged down 3 to 1. Returns the number of samples in out
+ */
+size_t resample_stt_audio(const int16_t *in, size_t num_samples,
+                          uint32_t rate, int16_t *last, int16_t *out) {
+  size_t strsz = 0;
+  switch (rate) {
+  case STT_SAMPLE_RATE:
+    memcpy(out, in, num_samples * sizeof(int16_t));
+    return num_samples;
+  case STT_SAMPLE_RATE / 2:
+    for (size_t i = 0; i < num_samples; i++) {
+      out[strsz++] = (*last + in[i]) / 2;
+      out[strsz++] = in[i];
+      *last = in[i];
+    }
+    return strsz;
+  case STT_SAMPLE_RATE * 3:
+    for (size_t i = 0; i + 2 < num_samples; i += 3) {
+      out[strsz++] = (in[i] + in[i + 1] + in[i + 2]) / 3;
+    }
+    return strsz;
+  }
+  return 0;
+}
 
-    logger(MSG_INFO,"%s: Start\n", __func__);
-    speech_to_text.is_enabled = 1;
+void *stt_capture_thread(void *arg) {
+  struct pcm *pcm = (struct pcm *)arg;
+  uint32_t period = pcm->rate * STT_CAPTURE_PERIOD_MS / 1000;
+  int16_t *in = calloc(period, sizeof(int16_t));
+  int16_t *out = calloc(period * 2, sizeof(int16_t));
+  int16_t last = 0;
+  size_t num_samples;
+  int ret;
 
-    /* Look for a single audio file as input parameter. */
-    if ((fh = fopen(filename, "rb")) == NULL) {
-        logger(MSG_ERROR,"Failed to open %s", filename);
-        speech_to_text.is_enabled = 0;
-        return -1;
+  while (in != NULL && out != NULL && speech_to_text.stay_running) {
+    if ((ret = pcm_read(pcm, in, period)) < 0) {
+      logger(MSG_ERROR, "%s: Capture failed: %i\n", __func__, ret);
+      break;
+    }
+    num_samples = resample_stt_audio(in, period, pcm->rate, &last, out);
+    write_stt_ring(out, num_samples);
+  }
+
+  pthread_mutex_lock(&speech_to_text.ring.mutex);
+  speech_to_text.ring.capture_done = true;
+  pthread_cond_signal(&speech_to_text.ring.cond);
+  pthread_mutex_unlock(&speech_to_text.ring.mutex);
+  free(in);
+  free(out);
+  return NULL;
+}
+
+#ifdef USE_POCKETSPHINX
+/* Every word of the phrase needs to be in the dictionary */
+bool is_phrase_in_dictionary(const char *phrase) {
+  char word[64];
+  size_t len;
+  while (*phrase != 0) {
+    len = strcspn(phrase, " ");
+    if (len > 0) {
+      if (len >= sizeof(word)) {
+        return false;
+      }
+      memcpy(word, phrase, len);
+      word[len] = 0;
+      for (size_t i = 0; i < len; i++) {
+        if (!isalpha((unsigned char)word[i]) && word[i] != '\'') {
+          return false;
+        }
+      }
+      if (ps_lookup_word(speech_to_text.decoder, word) == NULL) {
+        return false;
+      }
+    }
+    phrase += len;
+    while (*phrase == ' ') {
+      phrase++;
     }
+  }
+  return true;
+}
+
+/*
+ * JSGF grammar with every command we can say
+ *  Commands taking arguments are left out, we wouldn't understand
+ *  a spoken "five" anyway. So are those with words missing from the
+ *  dictionary (usbsuspend, dbgucs...), or the grammar won't load.
+ *  Returns how many commands made it
+ */
+int build_command_grammar(char *grammar, size_t len) {
+  size_t strsz;
+  int num_commands = 0;
 
-    /* Get the size of the input. */
-    if (fseek(fh, 0, SEEK_END) < 0)
-        logger(MSG_ERROR,"Unable to find end of input file %s", filename);
-    len = ftell(fh);
-    rewind(fh);
-
-    /* Initialize configuration from input file. */
-    config = ps_config_init(NULL);
-    ps_default_search_args(config);
-    if (ps_config_soundfile(config, fh, filename) < 0) {
-        logger(MSG_ERROR,"Unsupported input file %s\n", filename);
-        if (config)
-            free(config);
-        speech_to_text.is_enabled = 0;
-
-        return -1;
+  strsz = snprintf(grammar, len,
+                   "#JSGF V1.0;\ngrammar " STT_SEARCH_COMMANDS
+                   ";\npublic <command> = ");
+  for (uint8_t i = 0; i < (sizeof(bot_commands) / sizeof(bot_commands[0]));
+       i++) {
+    if (bot_commands[i].is_partial ||
+        !is_phrase_in_dictionary(bot_commands[i].cmd)) {
+      logger(MSG_DEBUG, "%s: Skipping \"%s\"\n", __func__,
+             bot_commands[i].cmd);
+      continue;
     }
-    if ((decoder = ps_init(config)) == NULL) {
-        logger(MSG_ERROR,"PocketSphinx decoder init failed\n");
-        if (config)
-            free(config);
-        speech_to_text.is_enabled = 0;
+    if (strsz + strlen(bot_commands[i].cmd) + 4 >= len) {
+      logger(MSG_WARN, "%s: Grammar is full\n", __func__);
+      break;
+    }
+    strsz += snprintf(grammar + strsz, len - strsz, "%s%s",
+                      num_commands > 0 ? " | " : "", bot_commands[i].cmd);
+    num_commands++;
+  }
+  snprintf(grammar + strsz, len - strsz, ";\n");
+  return num_commands;
+}
 
-        return -1;
+/* Must be called with init_lock held */
+void add_command_grammar() {
+  char *grammar = calloc(STT_GRAMMAR_MAX_SIZE, sizeof(char));
+  int num_commands;
+  if (grammar == NULL) {
+    return;
+  }
+  num_commands = build_command_grammar(grammar, STT_GRAMMAR_MAX_SIZE);
+  if (num_commands > 0 &&
+      ps_add_jsgf_string(speech_to_text.decoder, STT_SEARCH_COMMANDS,
+                         grammar) == 0) {
+    speech_to_text.has_command_grammar = true;
+    logger(MSG_INFO, "%s: %i commands in the grammar\n", __func__,
+           num_commands);
+  } else {
+    logger(MSG_ERROR, "%s: Can't load the command grammar, using the "
+                      "language model for everything\n",
+           __func__);
+  }
+  free(grammar);
+}
+
+int init_speech_to_text() {
+  ps_config_t *config;
+  uint64_t start = get_monotonic_time_ms();
+  int ret = 0;
+
+  pthread_mutex_lock(&speech_to_text.init_lock);
+  if (speech_to_text.decoder != NULL) {
+    goto out;
+  }
+
+  logger(MSG_INFO, "%s: Loading models\n", __func__);
+  config = ps_config_init(NULL);
+  if (config == NULL) {
+    ret = -ENOMEM;
+    goto out;
+  }
+  ps_default_search_args(config);
+  ps_config_set_bool(config, "mmap", TRUE);
+  /* The decoder keeps its own reference to the config */
+  speech_to_text.decoder = ps_init(config);
+  ps_config_free(config);
+  if (speech_to_text.decoder == NULL) {
+    logger(MSG_ERROR, "%s: PocketSphinx decoder init failed\n", __func__);
+    ret = -EIO;
+    goto out;
+  }
+
+  speech_to_text.ep = ps_endpointer_init(0, 0.0, 0, 0, 0);
+  if (speech_to_text.ep == NULL) {
+    logger(MSG_ERROR, "%s: PocketSphinx endpointer init failed\n", __func__);
+    ps_free(speech_to_text.decoder);
+    speech_to_text.decoder = NULL;
+    ret = -EIO;
+    goto out;
+  }
+
+  /* The language model is loaded as the default search */
+  strncpy(speech_to_text.lm_search, ps_current_search(speech_to_text.decoder),
+          sizeof(speech_to_text.lm_search) - 1);
+  speech_to_text.mode = STT_MODE_DICTATION;
+  add_command_grammar();
+  logger(MSG_INFO, "%s: Speech to text ready (%llu ms)\n", __func__,
+         (unsigned long long)(get_monotonic_time_ms() - start));
+
+out:
+  pthread_mutex_unlock(&speech_to_text.init_lock);
+  return ret;
+}
+
+/*
+ * Takes the decoder for an audio stream, loading it if needed
+ *  Switching modes is just picking another search, both are
+ *  loaded already
+ */
+int start_speech_stream(uint8_t mode) {
+  const char *search;
+  int ret;
+  if ((ret = init_speech_to_text()) < 0) {
+    return ret;
+  }
+  if (pthread_mutex_trylock(&speech_to_text.stream_lock) != 0) {
+    logger(MSG_ERROR, "%s: Already running\n", __func__);
+    return -EBUSY;
+  }
+  speech_to_text.in_utterance = false;
+
+  if (mode == STT_MODE_COMMANDS && !speech_to_text.has_command_grammar) {
+    mode = STT_MODE_DICTATION;
+  }
+  if (mode != speech_to_text.mode) {
+    search = mode == STT_MODE_COMMANDS ? STT_SEARCH_COMMANDS
+                                       : speech_to_text.lm_search;
+    if (ps_activate_search(speech_to_text.decoder, search) < 0) {
+      logger(MSG_ERROR, "%s: Can't switch to %s\n", __func__, search);
+      pthread_mutex_unlock(&speech_to_text.stream_lock);
+      return -EIO;
     }
+    speech_to_text.mode = mode;
+  }
+  return 0;
+}
 
-    /* Allocate data (skipping header) */
-    len -= ftell(fh);
-    if ((buf = malloc(len)) == NULL)
-        logger(MSG_ERROR,"Unable to allocate %d bytes", len);
-    /* Read input */
-    nsamples = fread(buf, sizeof(buf[0]), len / sizeof(buf[0]), fh);
-    if (nsamples != len / sizeof(buf[0]))
-        logger(MSG_ERROR,"Unable to read %d samples", len / sizeof(buf[0]));
-
-    /* Recognize it! */
-    if (ps_start_utt(decoder) < 0)
-        logger(MSG_ERROR,"Failed to start processing\n");
-    if (ps_process_raw(decoder, buf, nsamples, FALSE, TRUE) < 0)
-        logger(MSG_ERROR,"ps_process_raw() failed\n");
-    if (ps_end_utt(decoder) < 0)
-        logger(MSG_ERROR,"Failed to end processing\n");
-
-    /* Print the result */
-    if (ps_get_hyp(decoder, NULL) != NULL)
-        logger(MSG_INFO, "%s: %s\n",__func__, ps_get_hyp(decoder, NULL));
-
-    /* Clean up */
-    if (fclose(fh) < 0)
-        logger(MSG_ERROR,"Failed to close %s", filename);
-    free(buf);
-    ps_free(decoder);
-    ps_config_free(config);
-    speech_to_text.is_enabled = 0;
+/* Gives the decoder back, dropping whatever was left half said */
+void stop_speech_stream() {
+  if (speech_to_text.in_utterance) {
+    ps_end_utt(speech_to_text.decoder);
+    speech_to_text.in_utterance = false;
+  }
+  /* There's no way to reset an endpointer, but they're cheap to make */
+  if (ps_endpointer_in_speech(speech_to_text.ep)) {
+    ps_endpointer_free(speech_to_text.ep);
+    speech_to_text.ep = ps_endpointer_init(0, 0.0, 0, 0, 0);
+  }
+  pthread_mutex_unlock(&speech_to_text.stream_lock);
+}
 
+int start_speech_utterance() {
+  if (speech_to_text.in_utterance) {
     return 0;
+  }
+  if (ps_start_utt(speech_to_text.decoder) < 0) {
+    logger(MSG_ERROR, "%s: Failed to start processing\n", __func__);
+    return -EIO;
+  }
+  speech_to_text.in_utterance = true;
+  return 0;
 }
 
-/* launched from call thread */
-void *callaudio_stt_continuous()
-{
-    ps_decoder_t *decoder;
-    ps_config_t *config;
-    ps_endpointer_t *ep;
-    short *frame;
-    size_t frame_size;
-    struct pcm *incall_pcm_rx;
-    size_t bufsize;
-    logger(MSG_INFO, "%s: START\n", __func__);
-    if (speech_to_text.is_enabled) {
-        logger(MSG_ERROR, "%s: Already running\n", __func__);
-        return NULL;
-    }
+int process_speech_audio(const int16_t *samples, size_t num_samples) {
+  if (!speech_to_text.in_utterance) {
+    return -EINVAL;
+  }
+  if (ps_process_raw(speech_to_text.decoder, samples, num_samples, FALSE,
+                     FALSE) < 0) {
+    logger(MSG_ERROR, "%s: ps_process_raw() failed\n", __func__);
+    return -EIO;
+  }
+  return 0;
+}
+
+/* Best guess so far, NULL if none */
+const char *get_partial_speech_hypothesis() {
+  if (!speech_to_text.in_utterance) {
+    return NULL;
+  }
+  return ps_get_hyp(speech_to_text.decoder, NULL);
+}
 
-    if(!speech_to_text.stay_running) {
-        logger(MSG_ERROR, "%s: Wasn't ordered to stay running\n", __func__);
-        return NULL;
+/* Final hypothesis, valid until the next utterance starts */
+const char *end_speech_utterance() {
+  if (!speech_to_text.in_utterance) {
+    return NULL;
+  }
+  speech_to_text.in_utterance = false;
+  if (ps_end_utt(speech_to_text.decoder) < 0) {
+    logger(MSG_ERROR, "%s: Failed to end processing\n", __func__);
+    return NULL;
+  }
+  return ps_get_hyp(speech_to_text.decoder, NULL);
+}
+
+/* Transcribes a 16kHz mono 16 bit WAV file */
+int callaudio_stt_demo(char *filename) {
+  FILE *fh;
+  int16_t *buf;
+  uint8_t header[WAV_HEADER_SIZE];
+  uint32_t sample_rate;
+  size_t len, nsamples;
+  const char *hyp;
+  int ret;
+
+  if ((ret = start_speech_stream(STT_MODE_DICTATION)) < 0) {
+    return ret;
+  }
+  logger(MSG_INFO, "%s: Start\n", __func__);
+
+  if ((fh = fopen(filename, "rb")) == NULL) {
+    logger(MSG_ERROR, "%s: Failed to open %s\n", __func__, filename);
+    stop_speech_stream();
+    return -ENOENT;
+  }
+
+  if (fread(header, 1, WAV_HEADER_SIZE, fh) != WAV_HEADER_SIZE ||
+      memcmp(header, "RIFF", 4) != 0 || memcmp(header + 8, "WAVE", 4) != 0) {
+    logger(MSG_ERROR, "%s: Unsupported input file %s\n", __func__, filename);
+    fclose(fh);
+    stop_speech_stream();
+    return -EINVAL;
+  }
+  sample_rate = header[24] | header[25] << 8 | header[26] << 16 |
+                (uint32_t)header[27] << 24;
+  if (sample_rate != STT_SAMPLE_RATE) {
+    logger(MSG_WARN, "%s: %s is %u Hz, expect garbage\n", __func__, filename,
+           sample_rate);
+  }
+
+  fseek(fh, 0, SEEK_END);
+  len = ftell(fh) - WAV_HEADER_SIZE;
+  fseek(fh, WAV_HEADER_SIZE, SEEK_SET);
+  if ((buf = malloc(len)) == NULL) {
+    logger(MSG_ERROR, "%s: Unable to allocate %zu bytes\n", __func__, len);
+    fclose(fh);
+    stop_speech_stream();
+    return -ENOMEM;
+  }
+  nsamples = fread(buf, sizeof(buf[0]), len / sizeof(buf[0]), fh);
+  fclose(fh);
+
+  if (start_speech_utterance() == 0 &&
+      process_speech_audio(buf, nsamples) == 0 &&
+      (hyp = end_speech_utterance()) != NULL) {
+    logger(MSG_INFO, "%s: %s\n", __func__, hyp);
+  }
+
+  free(buf);
+  stop_speech_stream();
+  return 0;
+}
+
+/* Feeds a frame of speech coming out of the endpointer to the decoder */
+void process_stt_speech(const int16_t *speech, size_t num_samples,
+                        bool was_in_speech) {
+  ps_endpointer_t *ep = speech_to_text.ep;
+  const char *hyp;
+  if (!was_in_speech) {
+    logger(MSG_DEBUG, "%s: Speech start at %.2f\n", __func__,
+           ps_endpointer_speech_start(ep));
+    start_speech_utterance();
+  }
+  process_speech_audio(speech, num_samples);
+  /* A grammar's partial result is just its best path so far */
+  if (speech_to_text.mode == STT_MODE_DICTATION &&
+      (hyp = get_partial_speech_hypothesis()) != NULL) {
+    logger(MSG_DEBUG, "%s: Partial result: %s\n", __func__, hyp);
+    parse_command((uint8_t *)hyp);
+  }
+  if (!ps_endpointer_in_speech(ep)) {
+    logger(MSG_DEBUG, "%s: Speech end at %.2f\n", __func__,
+           ps_endpointer_speech_end(ep));
+    if ((hyp = end_speech_utterance()) != NULL) {
+      logger(MSG_INFO, "%s: %s\n", __func__, hyp);
+      parse_command((uint8_t *)hyp);
     }
+  }
+}
+
+/* launched from call thread */
+void *callaudio_stt_continuous() {
+  ps_endpointer_t *ep;
+  pthread_t capture_thread;
+  int16_t *frame;
+  const int16_t *speech;
+  size_t frame_size, num_samples, end_samples;
+  struct pcm *incall_pcm_rx;
+  bool was_in_speech;
+  logger(MSG_INFO, "%s: START\n", __func__);
+
+  if (!speech_to_text.stay_running) {
+    logger(MSG_ERROR, "%s: Wasn't ordered to stay running\n", __func__);
+    return NULL;
+  }
+
+  if (start_speech_stream(STT_MODE_COMMANDS) < 0) {
+    speech_to_text.stay_running = 0;
+    return NULL;
+  }
+  ep = speech_to_text.ep;
+  if (ps_endpointer_sample_rate(ep) != STT_SAMPLE_RATE) {
+    logger(MSG_ERROR, "%s: Endpointer runs at %i Hz\n", __func__,
+           ps_endpointer_sample_rate(ep));
+    speech_to_text.stay_running = 0;
+    stop_speech_stream();
+    return NULL;
+  }
 
   incall_pcm_rx = pcm_open((PCM_IN | PCM_MONO | PCM_MMAP), PCM_DEV_HIFI);
   if (incall_pcm_rx == NULL) {
     logger(MSG_INFO, "%s: Error opening %s (rx), bailing out\n", __func__,
            PCM_DEV_HIFI);
     speech_to_text.stay_running = 0;
+    stop_speech_stream();
+    return NULL;
+  }
+  incall_pcm_rx->channels = 1;
+  incall_pcm_rx->flags = PCM_IN | PCM_MONO;
+  incall_pcm_rx->format = PCM_FORMAT_S16_LE;
+  incall_pcm_rx->rate = get_auxpcm_sampling_rate();
+  incall_pcm_rx->period_size =
+      incall_pcm_rx->rate * STT_CAPTURE_PERIOD_MS / 1000;
+  incall_pcm_rx->period_cnt = 1;
+  incall_pcm_rx->buffer_size = 32768;
+  if (set_params(incall_pcm_rx, PCM_IN)) {
+    logger(MSG_ERROR, "Error setting RX Params\n");
+    speech_to_text.stay_running = 0;
+    pcm_close(incall_pcm_rx);
+    stop_speech_stream();
     return NULL;
   }
-    logger(MSG_INFO, "%s: ARMED\n", __func__);
-    speech_to_text.is_enabled = 1;
-    incall_pcm_rx->channels = 1;
-    incall_pcm_rx->flags = PCM_IN | PCM_MONO;
-    incall_pcm_rx->format = PCM_FORMAT_S16_LE;
-    incall_pcm_rx->rate = 16000;
-    incall_pcm_rx->period_size = 1024;
-    incall_pcm_rx->period_cnt = 1;
-    incall_pcm_rx->buffer_size = 32768;
-    if (set_params(incall_pcm_rx, PCM_IN)) {
-        logger(MSG_ERROR, "Error setting RX Params\n");
-        speech_to_text.is_enabled = 0;
-        speech_to_text.stay_running = 0;
-        pcm_close(incall_pcm_rx);
-        return NULL;
-    }
-
-    config = ps_config_init(NULL);
-    ps_default_search_args(config);
-    if ((decoder = ps_init(config)) == NULL) {
-        logger(MSG_ERROR,"PocketSphinx decoder init failed\n");
-        speech_to_text.is_enabled = 0;
-        speech_to_text.stay_running = 0;
-        pcm_close(incall_pcm_rx);
-        return NULL;
-    }
 
-    if ((ep = ps_endpointer_init(0, 0.0, 0, 0, 0)) == NULL) {
-        logger(MSG_ERROR,"PocketSphinx endpointer init failed\n");
-        speech_to_text.is_enabled = 0;
-        speech_to_text.stay_running = 0;
-        pcm_close(incall_pcm_rx);
-        return NULL;
-    }
-//    sox = popen_sox(ps_endpointer_sample_rate(ep));
-    frame_size =  pcm_get_buffer_size(incall_pcm_rx); // ps_endpointer_frame_size(ep);
-    if ((frame = malloc(frame_size * sizeof(frame[0]))) == NULL)
-        logger(MSG_ERROR,"Failed to allocate frame");
-
-    while (speech_to_text.stay_running) {
-        logger(MSG_INFO, "%s: LOOPING\n", __func__);
-
-        const int16 *speech;
-        int prev_in_speech = ps_endpointer_in_speech(ep);
-        size_t len, end_samples;
-        if (pcm_read(incall_pcm_rx, frame,
-            pcm_bytes_to_frames(incall_pcm_rx,
-                                pcm_get_buffer_size(incall_pcm_rx))) == 0) {
-                speech = ps_endpointer_end_stream(ep, frame,
-                                                  frame_size,
-                                                  &end_samples);
-            logger(MSG_INFO, "%s: Read %u bytes\n", __func__, frame_size);
-        } else {
-            speech = ps_endpointer_process(ep, frame);
-        }
-        if (speech != NULL) {
-            logger(MSG_INFO, "%s: Speech is not null\n", __func__);
-            const char *hyp;
-            if (!prev_in_speech) {
-                logger(MSG_ERROR, "%s: Speech start at %.2f\n", __func__,
-                        ps_endpointer_speech_start(ep));
-                ps_start_utt(decoder);
-            }
-            if (ps_process_raw(decoder, speech, frame_size, FALSE, FALSE) < 0)
-                logger(MSG_ERROR,"%s: ps_process_raw() failed\n", __func__);
-            if ((hyp = ps_get_hyp(decoder, NULL)) != NULL) {
-                logger(MSG_ERROR, "%s: PARTIAL RESULT: %s\n", __func__, hyp);
-                parse_command(hyp);
-            }
-            if (!ps_endpointer_in_speech(ep)) {
-                logger(MSG_ERROR, "%s: Speech end at %.2f\n", __func__,
-                        ps_endpointer_speech_end(ep));
-                ps_end_utt(decoder);
-                if ((hyp = ps_get_hyp(decoder, NULL)) != NULL) {
-                    logger(MSG_INFO, "%s: %s\n", __func__, hyp);
-                    parse_command(hyp);
-
-
-                }
-            }
-        } else {
-            logger(MSG_WARN, "%s: Speech is null!\n", __func__);
-        }
-    }
-    logger(MSG_INFO, "%s: GETTING OUT\n", __func__);
+  frame_size = ps_endpointer_frame_size(ep);
+  if ((frame = malloc(frame_size * sizeof(frame[0]))) == NULL) {
+    logger(MSG_ERROR, "Failed to allocate frame");
+    speech_to_text.stay_running = 0;
+    pcm_close(incall_pcm_rx);
+    stop_speech_stream();
+    return NULL;
+  }
 
+  reset_stt_ring();
+  if (pthread_create(&capture_thread, NULL, &stt_capture_thread,
+                     incall_pcm_rx)) {
+    logger(MSG_ERROR, "%s: Error creating capture thread\n", __func__);
     free(frame);
-
-    ps_endpointer_free(ep);
-    ps_free(decoder);
-    ps_config_free(config);
-    speech_to_text.is_enabled = 0;
     speech_to_text.stay_running = 0;
     pcm_close(incall_pcm_rx);
-
+    stop_speech_stream();
     return NULL;
+  }
+  logger(MSG_INFO, "%s: ARMED (%u Hz, %zu samples per frame)\n", __func__,
+         incall_pcm_rx->rate, frame_size);
+
+  while ((num_samples = read_stt_ring(frame, frame_size)) == frame_size) {
+    was_in_speech = ps_endpointer_in_speech(ep);
+    speech = ps_endpointer_process(ep, frame);
+    if (speech != NULL) {
+      process_stt_speech(speech, frame_size, was_in_speech);
+    }
+  }
+
+  /* Whatever the endpointer was still holding */
+  was_in_speech = ps_endpointer_in_speech(ep);
+  speech = ps_endpointer_end_stream(ep, frame, num_samples, &end_samples);
+  if (speech != NULL && end_samples > 0) {
+    process_stt_speech(speech, end_samples, was_in_speech);
+  }
+  pthread_join(capture_thread, NULL);
+  logger(MSG_INFO, "%s: GETTING OUT (%zu samples dropped)\n", __func__,
+         speech_to_text.ring.dropped);
+
+  free(frame);
+  speech_to_text.stay_running = 0;
+  pcm_close(incall_pcm_rx);
+  stop_speech_stream();
+
+  return NULL;
 }
 #else
-int
-callaudio_stt_demo(char *filename) {
-    return 0;
-}
-void *callaudio_stt_continuous() {
-    return NULL;
+int init_speech_to_text() { return 0; }
+int callaudio_stt_demo(char *filename) { return 0; }
+void *callaudio_stt_continuous() { return NULL; }
+#endif
+
+/* Gets the models in memory before the first call needs them */
+void *speech_to_text_preload_thread() {
+  init_speech_to_text();
+  return NULL;
 }
-#endif
\ No newline at end of file
@@ -14,6 +14,7 @@
 #include "proxy.h"
 #include "sms.h"
 #include "tracking.h"
+#include "tts_cache.h"
 #include <errno.h>
 #include <fcntl.h>
 #include <pthread.h>
@@ -108,6 +109,7 @@ void reset_call_state() {
 void set_pending_call_flag(bool en) {
   if (en && !call_rt.call_simulation_mode) {
     call_rt.is_call_pending = true;
+    wake_up_proxy();
   } else {
     call_rt.is_call_pending = false;
   }
@@ -382,19 +384,28 @@ void add_voice_message_to_queue(uint8_t *message, size_t len) {
   }
 }
 
+/* Plays the TTS samples as they come out of the engine */
+int simulated_call_pcm_sink(void *data, uint8_t *samples, size_t bytes) {
+  struct pcm *pcm0 = (struct pcm *)data;
+  if (!get_call_simulation_mode()) {
+    return -ECANCELED;
+  }
+  if (pcm_write(pcm0, samples, bytes)) {
+    logger(MSG_ERROR, "Error playing sample\n");
+    return -EIO;
+  }
+  return 0;
+}
+
 void *simulated_call_tts_handler() {
-  char *buffer;
-  int size;
-  int num_read;
-  FILE *file;
   struct pcm *pcm0 = NULL;
   int i;
   bool handled;
   char *phrase; //[MAX_TTS_TEXT_SIZE];
+  int ret;
 #ifdef USE_POCKETSPHINX
   pthread_t incoming_audio_thread;
-  int ret;
-#endif 
+#endif
 
   /*
    * Open PCM if we're in call simulation mode,
@@ -425,7 +436,7 @@ void *simulated_call_tts_handler() {
     pcm0->channels = 1;
     pcm0->flags = PCM_OUT | PCM_MONO;
     pcm0->format = PCM_FORMAT_S16_LE;
-    pcm0->rate = 16000;
+    pcm0->rate = TTS_SAMPLE_RATE;
     pcm0->period_size = 1024;
     pcm0->period_cnt = 1;
     pcm0->buffer_size = 32768;
@@ -442,6 +453,8 @@ void *simulated_call_tts_handler() {
   }
   /* Set cpu governor to performance to speed it up a bit */
   enable_cpufreq_performance_mode(true);
+  /* Only slow the first time, the engine stays loaded afterwards */
+  init_pico_tts();
 
   while (get_call_simulation_mode()) {
     handled = false;
@@ -465,46 +478,14 @@ void *simulated_call_tts_handler() {
                get_rt_user_name());
       call_rt.empty_message_loop++;
     }
-    pico2aud(phrase, strlen(phrase));
+    ret = speak_cached_phrase(phrase, strlen(phrase), simulated_call_pcm_sink,
+                              pcm0);
     free(phrase);
     phrase = NULL;
-    file = fopen("/tmp/wave.wav", "r");
-    if (file == NULL) {
-      logger(MSG_ERROR, "%s: Unable to open file\n", __func__);
-      pcm_close(pcm0);
-      speech_to_text_stay_running(0);
-      return NULL;
+    if (ret < 0 && ret != -ECANCELED) {
+      logger(MSG_ERROR, "%s: Can't speak: %i\n", __func__, ret);
+      break;
     }
-
-    fseek(file, 44, SEEK_SET);
-    size = pcm_frames_to_bytes(pcm0, pcm_get_buffer_size(pcm0));
-    buffer = malloc(size * 1024);
-
-    if (!buffer) {
-      logger(MSG_ERROR, "Unable to allocate %d bytes\n", size);
-      free(buffer);
-      buffer = NULL;
-      speech_to_text_stay_running(0);
-      return NULL;
-    }
-
-    do {
-      num_read = fread(buffer, 1, size, file);
-
-      if (num_read > 0) {
-        if (pcm_write(pcm0, buffer, num_read)) {
-          logger(MSG_ERROR, "Error playing sample\n");
-          break;
-        }
-      }
-    } while (num_read > 0 && get_call_simulation_mode());
-    fclose(file);
-    free(buffer);
-
-#ifdef USE_POCKETSPHINX
-/* Demo: Transcript whatever the modem said last run */
-/* callaudio_stt_demo("/tmp/wave.wav"); */
-#endif
   }
   /* Set cpu governor to performance to speed it up a bit */
   enable_cpufreq_performance_mode(false);
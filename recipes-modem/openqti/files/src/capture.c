@@ -0,0 +1,218 @@
+// SPDX-License-Identifier: MIT
+
+#include "capture.h"
+#include "logger.h"
+#include "openqti.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * QMI packet capture
+ *  Instead of rendering each frame as hex text in the log, we copy
+ *  the raw QMUX frame with a timestamp and its direction to a pcap
+ *  file that is preallocated and mmap'd, so capturing is just a
+ *  memcpy in the proxy thread.
+ *  The file can be decoded later with `openqti -r <file>`, or opened
+ *  in Wireshark as DLT_USER0.
+ */
+struct {
+  _Atomic bool enabled;
+  _Atomic uint32_t writers; // capture_packet() calls still using the map
+  int fd;
+  uint8_t *map;
+  size_t map_size;
+  _Atomic size_t offset;
+  _Atomic bool full;
+} capture_rt = {
+    .enabled = false,
+    .fd = -1,
+    .map = NULL,
+};
+
+bool is_capture_enabled() { return atomic_load(&capture_rt.enabled); }
+
+int capture_start(char *path) {
+  struct pcap_file_header *header;
+  if (atomic_load(&capture_rt.enabled)) {
+    logger(MSG_WARN, "%s: Capture is already running\n", __func__);
+    return -EBUSY;
+  }
+
+  capture_rt.fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (capture_rt.fd < 0) {
+    logger(MSG_ERROR, "%s: Can't open %s\n", __func__, path);
+    return -ENOENT;
+  }
+
+  if (ftruncate(capture_rt.fd, CAPTURE_MAX_SIZE) < 0) {
+    logger(MSG_ERROR, "%s: Can't allocate the capture file\n", __func__);
+    close(capture_rt.fd);
+    capture_rt.fd = -1;
+    return -ENOSPC;
+  }
+
+  capture_rt.map = mmap(NULL, CAPTURE_MAX_SIZE, PROT_READ | PROT_WRITE,
+                        MAP_SHARED, capture_rt.fd, 0);
+  if (capture_rt.map == MAP_FAILED) {
+    logger(MSG_ERROR, "%s: Can't map the capture file\n", __func__);
+    capture_rt.map = NULL;
+    close(capture_rt.fd);
+    capture_rt.fd = -1;
+    return -ENOMEM;
+  }
+  capture_rt.map_size = CAPTURE_MAX_SIZE;
+
+  header = (struct pcap_file_header *)capture_rt.map;
+  header->magic = PCAP_MAGIC;
+  header->version_major = PCAP_VERSION_MAJOR;
+  header->version_minor = PCAP_VERSION_MINOR;
+  header->thiszone = 0;
+  header->sigfigs = 0;
+  header->snaplen = PCAP_SNAPLEN;
+  header->linktype = PCAP_LINKTYPE_QMUX;
+
+  atomic_store(&capture_rt.offset, sizeof(struct pcap_file_header));
+  atomic_store(&capture_rt.full, false);
+  atomic_store(&capture_rt.enabled, true);
+  logger(MSG_INFO, "%s: Capturing QMI traffic to %s (max %i bytes)\n",
+         __func__, path, CAPTURE_MAX_SIZE);
+  return 0;
+}
+
+/*
+ * Unmaps the file and trims it to what we actually used. New writers
+ * bail out once the flag is cleared, and we wait for the ones already
+ * copying a frame before touching the map
+ */
+void capture_stop() {
+  size_t used;
+  if (!atomic_exchange(&capture_rt.enabled, false)) {
+    return;
+  }
+  while (atomic_load(&capture_rt.writers) > 0) {
+    sched_yield();
+  }
+
+  used = atomic_exchange(&capture_rt.offset, capture_rt.map_size);
+  if (used > capture_rt.map_size) {
+    used = capture_rt.map_size;
+  }
+  msync(capture_rt.map, used, MS_SYNC);
+  if (ftruncate(capture_rt.fd, used) < 0) {
+    logger(MSG_WARN, "%s: Can't trim the capture file\n", __func__);
+  }
+  munmap(capture_rt.map, capture_rt.map_size);
+  capture_rt.map = NULL;
+  close(capture_rt.fd);
+  capture_rt.fd = -1;
+  logger(MSG_INFO, "%s: Capture stopped, %zu bytes\n", __func__, used);
+}
+
+/*
+ * Reserves space in the mapped file and copies the frame. Space is
+ * claimed atomically, so more than one thread can capture at once
+ */
+void capture_packet(uint8_t direction, uint8_t *buf, size_t len) {
+  struct pcap_record_header *record;
+  struct timespec now;
+  size_t record_sz, offset;
+
+  if (len == 0) {
+    return;
+  }
+  /*
+   * Register before checking the flag, so capture_stop() either sees
+   * us or we see it's stopped
+   */
+  atomic_fetch_add(&capture_rt.writers, 1);
+  if (!atomic_load(&capture_rt.enabled)) {
+    atomic_fetch_sub(&capture_rt.writers, 1);
+    return;
+  }
+
+  if (len > PCAP_SNAPLEN - 1) {
+    len = PCAP_SNAPLEN - 1;
+  }
+  record_sz = sizeof(struct pcap_record_header) + 1 + len;
+  offset = atomic_fetch_add(&capture_rt.offset, record_sz);
+  if (offset + record_sz > capture_rt.map_size) {
+    if (!atomic_exchange(&capture_rt.full, true)) {
+      logger(MSG_WARN, "%s: Capture file is full, not capturing anymore\n",
+             __func__);
+    }
+    atomic_fetch_sub(&capture_rt.writers, 1);
+    return;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  record = (struct pcap_record_header *)(capture_rt.map + offset);
+  record->ts_sec = now.tv_sec;
+  record->ts_usec = now.tv_nsec / 1000;
+  record->orig_len = len + 1;
+  capture_rt.map[offset + sizeof(struct pcap_record_header)] = direction;
+  memcpy(capture_rt.map + offset + sizeof(struct pcap_record_header) + 1, buf,
+         len);
+  /* Set it last: a zero size marks the end if we die mid-write */
+  record->incl_len = len + 1;
+  atomic_fetch_sub(&capture_rt.writers, 1);
+}
+
+/*
+ * Offline decoder
+ *  Reads a capture and renders every frame to stdout with the
+ *  same output as service debugging.
+ */
+int capture_decode_file(char *path) {
+  struct pcap_file_header header;
+  struct pcap_record_header record;
+  uint8_t *frame;
+  uint32_t count = 0;
+  FILE *fp;
+
+  fp = fopen(path, "r");
+  if (fp == NULL) {
+    fprintf(stderr, "Can't open %s\n", path);
+    return -ENOENT;
+  }
+
+  if (fread(&header, sizeof(struct pcap_file_header), 1, fp) != 1 ||
+      header.magic != PCAP_MAGIC ||
+      header.linktype != PCAP_LINKTYPE_QMUX) {
+    fprintf(stderr, "%s is not an OpenQTI capture file\n", path);
+    fclose(fp);
+    return -EINVAL;
+  }
+
+  frame = malloc(PCAP_SNAPLEN);
+  while (fread(&record, sizeof(struct pcap_record_header), 1, fp) == 1) {
+    /* Unused (preallocated) space or a record that wasn't finished */
+    if (record.incl_len < 2 || record.incl_len > PCAP_SNAPLEN) {
+      break;
+    }
+    if (fread(frame, record.incl_len, 1, fp) != 1) {
+      break;
+    }
+    count++;
+    fprintf(stdout, "[%u.%.6u] #%u\n", record.ts_sec, record.ts_usec, count);
+    pretty_print_qmi_pkt_to_file(stdout,
+                                 frame[0] == CAPTURE_DIR_HOST_TO_MODEM
+                                     ? "Host --> Baseband"
+                                     : "Baseband --> Host",
+                                 frame + 1, record.incl_len - 1);
+  }
+
+  fprintf(stdout, "%u packets decoded\n", count);
+  free(frame);
+  fclose(fp);
+  return 0;
+}
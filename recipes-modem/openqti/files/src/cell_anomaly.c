@@ -0,0 +1,237 @@
+// SPDX-License-Identifier: MIT
+
+#include <stdio.h>
+#include <string.h>
+
+#include "cell_anomaly.h"
+#include "logger.h"
+#include "nas.h"
+#include "proxy.h"
+
+/*
+ * Per cell statistics
+ *  Indexed by the same slot as nas_runtime.data, so a cell's history
+ *  lives and dies with its report. Kept as a struct of arrays since
+ *  every update only touches a handful of fields of a single cell.
+ *  Means and variances are updated incrementally (Welford), so every
+ *  measurement report costs the same no matter how often we saw the
+ *  cell before.
+ */
+struct {
+  uint32_t samples[MAX_REPORT_NUM];
+  float signal_mean[MAX_REPORT_NUM];
+  float signal_m2[MAX_REPORT_NUM];
+  uint32_t ta_samples[MAX_REPORT_NUM];
+  float ta_mean[MAX_REPORT_NUM];
+  float ta_m2[MAX_REPORT_NUM];
+  float neighbours_mean[MAX_REPORT_NUM];
+  uint64_t neighbour_set[MAX_REPORT_NUM];
+
+  /* Whatever cell we were camped on, for unknown cells */
+  uint32_t observations;
+  float neighbours_mean_all;
+  uint8_t last_type_of_service;
+  uint64_t last_observation_ms;
+
+  /* Last alert we sent */
+  uint32_t alert_cell_id;
+  uint16_t alert_lac;
+  uint16_t alert_reasons;
+  uint64_t alert_sent_ms;
+} anomaly_rt;
+
+const char *anomaly_reason_names[ANOMALY_REASON_LAST] = {
+    "unknown cell", "not in OpenCellid", "no neighbours", "new neighbours",
+    "signal too strong", "timing advance jump", "forced to 2G",
+};
+
+/* Neighbours are only compared as a set, so hash them to a 64 bit mask */
+void cell_observation_add_neighbour(struct cell_observation *obs,
+                                    uint32_t neighbour_id) {
+  obs->neighbours |= 1ULL << ((neighbour_id * 2654435761U) >> 26);
+}
+
+void cell_observation_set_timing_advance(struct cell_observation *obs,
+                                         int32_t timing_advance) {
+  /* Baseband reports all ones when it doesn't know it */
+  if (timing_advance < 0 || timing_advance == 0xffff) {
+    return;
+  }
+  obs->has_timing_advance = true;
+  obs->timing_advance = timing_advance;
+}
+
+void reset_cell_anomaly_stats(uint16_t slot) {
+  if (slot >= MAX_REPORT_NUM) {
+    return;
+  }
+  anomaly_rt.samples[slot] = 0;
+  anomaly_rt.signal_mean[slot] = 0;
+  anomaly_rt.signal_m2[slot] = 0;
+  anomaly_rt.ta_samples[slot] = 0;
+  anomaly_rt.ta_mean[slot] = 0;
+  anomaly_rt.ta_m2[slot] = 0;
+  anomaly_rt.neighbours_mean[slot] = 0;
+  anomaly_rt.neighbour_set[slot] = 0;
+}
+
+/* (value - mean)^2 > (N * stddev)^2, no need for sqrt() */
+bool is_outlier(float value, float mean, float m2, uint32_t samples,
+                float min_variance) {
+  float variance, delta;
+  if (samples < 2) {
+    return false;
+  }
+  variance = m2 / (samples - 1);
+  if (variance < min_variance) {
+    variance = min_variance;
+  }
+  delta = value - mean;
+  return delta * delta >
+         variance * ANOMALY_MAX_DEVIATIONS * ANOMALY_MAX_DEVIATIONS;
+}
+
+void welford_update(float value, uint32_t samples, float *mean, float *m2) {
+  float delta = value - *mean;
+  *mean += delta / samples;
+  *m2 += delta * (value - *mean);
+}
+
+/*
+ * Score the serving cell against what we know about it
+ *  report_id is the slot of the cell or -1 if we never saw it.
+ *  Must be called before update_cell_anomaly_stats(), so the cell is
+ *  compared with its history and not with itself
+ */
+struct anomaly_result evaluate_cell_anomaly(int report_id,
+                                            struct cell_observation *obs,
+                                            int opencellid_res) {
+  struct anomaly_result result = {0};
+  uint8_t num_neighbours = __builtin_popcountll(obs->neighbours);
+  uint8_t new_neighbours;
+
+  if (report_id < 0 || report_id >= MAX_REPORT_NUM) {
+    result.score += ANOMALY_SCORE_UNKNOWN_CELL;
+    result.reasons |= ANOMALY_REASON_UNKNOWN_CELL;
+    if (num_neighbours == 0 &&
+        anomaly_rt.observations >= ANOMALY_MIN_SAMPLES &&
+        anomaly_rt.neighbours_mean_all >= 1) {
+      result.score += ANOMALY_SCORE_NO_NEIGHBOURS;
+      result.reasons |= ANOMALY_REASON_NO_NEIGHBOURS;
+    }
+  } else if (anomaly_rt.samples[report_id] >= ANOMALY_MIN_SAMPLES) {
+    if (num_neighbours == 0 && anomaly_rt.neighbours_mean[report_id] >= 1) {
+      result.score += ANOMALY_SCORE_NO_NEIGHBOURS;
+      result.reasons |= ANOMALY_REASON_NO_NEIGHBOURS;
+    } else if (num_neighbours >= 2) {
+      new_neighbours = __builtin_popcountll(
+          obs->neighbours & ~anomaly_rt.neighbour_set[report_id]);
+      if (new_neighbours * 2 > num_neighbours) {
+        result.score += ANOMALY_SCORE_NEIGHBOURS_CHANGED;
+        result.reasons |= ANOMALY_REASON_NEIGHBOURS_CHANGED;
+      }
+    }
+    /* A fake base station needs to outshout the real one */
+    if (obs->signal > anomaly_rt.signal_mean[report_id] &&
+        is_outlier(obs->signal, anomaly_rt.signal_mean[report_id],
+                   anomaly_rt.signal_m2[report_id],
+                   anomaly_rt.samples[report_id],
+                   ANOMALY_MIN_SIGNAL_VARIANCE)) {
+      result.score += ANOMALY_SCORE_SIGNAL_OUTLIER;
+      result.reasons |= ANOMALY_REASON_SIGNAL_OUTLIER;
+    }
+    if (obs->has_timing_advance &&
+        anomaly_rt.ta_samples[report_id] >= ANOMALY_MIN_SAMPLES &&
+        is_outlier(obs->timing_advance, anomaly_rt.ta_mean[report_id],
+                   anomaly_rt.ta_m2[report_id], anomaly_rt.ta_samples[report_id],
+                   ANOMALY_MIN_TA_VARIANCE)) {
+      result.score += ANOMALY_SCORE_TIMING_ADVANCE_JUMP;
+      result.reasons |= ANOMALY_REASON_TIMING_ADVANCE_JUMP;
+    }
+  }
+
+  if (opencellid_res == 1) {
+    result.score += ANOMALY_SCORE_IN_OPENCELLID;
+  } else if (opencellid_res == 0) {
+    result.score += ANOMALY_SCORE_NOT_IN_OPENCELLID;
+    result.reasons |= ANOMALY_REASON_NOT_IN_OPENCELLID;
+  }
+
+  if (obs->type_of_service == OCID_RADIO_GSM &&
+      (anomaly_rt.last_type_of_service == OCID_RADIO_UMTS ||
+       anomaly_rt.last_type_of_service == OCID_RADIO_LTE) &&
+      get_monotonic_time_ms() - anomaly_rt.last_observation_ms <
+          ANOMALY_DOWNGRADE_WINDOW_MS) {
+    result.score += ANOMALY_SCORE_RAT_DOWNGRADE;
+    result.reasons |= ANOMALY_REASON_RAT_DOWNGRADE;
+  }
+
+  logger(MSG_DEBUG, "%s: Report %i: score %i, reasons %.4x\n", __func__,
+         report_id, result.score, result.reasons);
+  return result;
+}
+
+/* Fold the observation into the cell's history (if any) and the global one */
+void update_cell_anomaly_stats(int report_id, struct cell_observation *obs) {
+  uint8_t num_neighbours = __builtin_popcountll(obs->neighbours);
+  uint32_t n;
+
+  anomaly_rt.observations++;
+  anomaly_rt.neighbours_mean_all +=
+      (num_neighbours - anomaly_rt.neighbours_mean_all) /
+      anomaly_rt.observations;
+  anomaly_rt.last_type_of_service = obs->type_of_service;
+  anomaly_rt.last_observation_ms = get_monotonic_time_ms();
+
+  if (report_id < 0 || report_id >= MAX_REPORT_NUM) {
+    return;
+  }
+
+  n = ++anomaly_rt.samples[report_id];
+  welford_update(obs->signal, n, &anomaly_rt.signal_mean[report_id],
+                 &anomaly_rt.signal_m2[report_id]);
+  anomaly_rt.neighbours_mean[report_id] +=
+      (num_neighbours - anomaly_rt.neighbours_mean[report_id]) / n;
+  /* Once the set is mostly full it stops telling us anything, start over */
+  if (__builtin_popcountll(anomaly_rt.neighbour_set[report_id]) > 48) {
+    anomaly_rt.neighbour_set[report_id] = 0;
+  }
+  anomaly_rt.neighbour_set[report_id] |= obs->neighbours;
+
+  if (obs->has_timing_advance) {
+    n = ++anomaly_rt.ta_samples[report_id];
+    welford_update(obs->timing_advance, n, &anomaly_rt.ta_mean[report_id],
+                   &anomaly_rt.ta_m2[report_id]);
+  }
+}
+
+/* Don't flood the user with the same alert on every measurement report */
+bool should_notify_cell_anomaly(uint32_t cell_id, uint16_t lac,
+                                struct anomaly_result *result) {
+  uint64_t now = get_monotonic_time_ms();
+  if (result->score < ANOMALY_ALERT_SCORE) {
+    return false;
+  }
+  if (cell_id == anomaly_rt.alert_cell_id && lac == anomaly_rt.alert_lac &&
+      (result->reasons & ~anomaly_rt.alert_reasons) == 0 &&
+      now - anomaly_rt.alert_sent_ms < ANOMALY_ALERT_INTERVAL_MS) {
+    return false;
+  }
+  anomaly_rt.alert_cell_id = cell_id;
+  anomaly_rt.alert_lac = lac;
+  anomaly_rt.alert_reasons = result->reasons;
+  anomaly_rt.alert_sent_ms = now;
+  return true;
+}
+
+int format_anomaly_reasons(char *buf, size_t len, uint16_t reasons) {
+  int strsz = 0;
+  buf[0] = 0;
+  for (uint8_t i = 0; i < ANOMALY_REASON_LAST && strsz < (int)len; i++) {
+    if (reasons & (1 << i)) {
+      strsz += snprintf(buf + strsz, len - strsz, "%s%s", strsz ? ", " : "",
+                        anomaly_reason_names[i]);
+    }
+  }
+  return strsz < (int)len ? strsz : (int)len - 1;
+}
@@ -10,6 +10,7 @@
 #include "dms.h"
 #include "ipc.h"
 #include "logger.h"
+#include "metrics.h"
 #include "nas.h"
 #include "proxy.h"
 #include "scheduler.h"
@@ -40,10 +41,14 @@ void cmd_get_rmnet_stats() {
   packet_stats = get_rmnet_stats();
   strsz += snprintf((char *)reply + strsz, MAX_MESSAGE_SIZE - strsz,
                     "RMNET IF stats:\nBypassed: "
-                    "%i\nEmpty:%i\nDiscarded:%i\nFailed:%i\nAllowed:%i",
+                    "%i\nEmpty:%i\nDiscarded:%i\nFailed:%i\nAllowed:%i\n"
+                    "To host: %u (%u KB)\nTo modem: %u (%u KB)",
                     packet_stats.bypassed, packet_stats.empty,
                     packet_stats.discarded, packet_stats.failed,
-                    packet_stats.allowed);
+                    packet_stats.allowed, packet_stats.frames[FROM_DSP],
+                    (uint32_t)(packet_stats.bytes[FROM_DSP] / 1024),
+                    packet_stats.frames[FROM_HOST],
+                    (uint32_t)(packet_stats.bytes[FROM_HOST] / 1024));
   add_message_to_queue(reply, strsz);
 }
 void cmd_get_gps_stats() {
@@ -55,19 +60,88 @@ void cmd_get_gps_stats() {
   strsz += snprintf((char *)reply + strsz, MAX_MESSAGE_SIZE - strsz,
                     "GPS IF stats:\nBypassed: "
                     "%i\nEmpty:%i\nDiscarded:%i\nFailed:%i\nAllowed:%"
-                    "i\nQMI Location svc.: %i",
+                    "i\nQMI Location svc.: %i\nTo host: %u (%u KB)\n"
+                    "To modem: %u (%u KB)",
                     packet_stats.bypassed, packet_stats.empty,
                     packet_stats.discarded, packet_stats.failed,
-                    packet_stats.allowed, packet_stats.other);
+                    packet_stats.allowed, packet_stats.other,
+                    packet_stats.frames[FROM_DSP],
+                    (uint32_t)(packet_stats.bytes[FROM_DSP] / 1024),
+                    packet_stats.frames[FROM_HOST],
+                    (uint32_t)(packet_stats.bytes[FROM_HOST] / 1024));
   add_message_to_queue(reply, strsz);
 }
 
-void cmd_get_help() {
-  /* Help */
+void cmd_get_qmi_stats() {
   size_t strsz = 0;
-  size_t full_msg_size = 0;
+  uint8_t reply[MAX_MESSAGE_SIZE];
+  struct qmi_latency_stats stats;
+  uint8_t services[] = {QMI_SERVICE_DMS, QMI_SERVICE_NAS, QMI_SERVICE_WDS,
+                        QMI_SERVICE_VOICE};
+  bool found = false;
+
+  for (uint8_t i = 0; i < sizeof(services); i++) {
+    stats = get_qmi_latency_stats(services[i]);
+    if (stats.responses == 0 && stats.timeouts == 0) {
+      continue;
+    }
+    found = true;
+    strsz = snprintf(
+        (char *)reply, MAX_MESSAGE_SIZE,
+        "QMI %s:\nResponses: %u\nTimeouts: %u\nAvg: %u ms\np50: <%u ms\n"
+        "p95: <%u ms\nMax: %u ms",
+        get_service_name(services[i]), stats.responses, stats.timeouts,
+        stats.responses ? (uint32_t)(stats.total_ms / stats.responses) : 0,
+        get_qmi_latency_percentile(&stats, 50),
+        get_qmi_latency_percentile(&stats, 95), stats.max_ms);
+    add_message_to_queue(reply, strsz);
+  }
 
+  if (!found) {
+    strsz = snprintf((char *)reply, MAX_MESSAGE_SIZE,
+                     "The internal QMI client didn't send anything yet");
+    add_message_to_queue(reply, strsz);
+  }
+}
+
+void cmd_get_proxy_latency() {
+  size_t strsz = 0;
   uint8_t reply[MAX_MESSAGE_SIZE];
+  struct metrics_snapshot handler, forward;
+  uint32_t slowest_p95;
+  uint8_t slowest;
+
+  strsz = snprintf((char *)reply, MAX_MESSAGE_SIZE, "Proxy (us, p95/max)\n");
+  for (uint8_t source = FROM_DSP; source <= FROM_HOST; source++) {
+    handler = get_proxy_metrics_total(source, METRIC_HANDLER_TIME);
+    forward = get_proxy_metrics_total(source, METRIC_FORWARD_LATENCY);
+    strsz += snprintf((char *)reply + strsz, MAX_MESSAGE_SIZE - strsz,
+                      "%s %u msgs\nHandler: <%u/%u\nForward: <%u/%u\n",
+                      source == FROM_HOST ? "To modem:" : "To host:",
+                      handler.count, get_metrics_percentile(&handler, 95),
+                      handler.max, get_metrics_percentile(&forward, 95),
+                      forward.max);
+    if (strsz >= MAX_MESSAGE_SIZE) {
+      strsz = MAX_MESSAGE_SIZE - 1;
+      break;
+    }
+  }
+
+  slowest = get_slowest_proxy_service(&slowest_p95);
+  if (slowest_p95 > 0 && strsz < MAX_MESSAGE_SIZE - 1) {
+    strsz += snprintf((char *)reply + strsz, MAX_MESSAGE_SIZE - strsz,
+                      "Slowest: %s <%u", get_metrics_slot_name(slowest),
+                      slowest_p95);
+    if (strsz >= MAX_MESSAGE_SIZE) {
+      strsz = MAX_MESSAGE_SIZE - 1;
+    }
+  }
+  add_message_to_queue(reply, strsz);
+}
+
+void cmd_get_help() {
+  /* Help */
+  size_t full_msg_size = 0;
   char *full_help_msg = calloc(MSG_MAX_MULTIPART_SIZE, sizeof(char));
 
   full_msg_size =
@@ -98,20 +172,8 @@ void cmd_get_help() {
     }
   }
 
-  set_queue_lock(true);
-  while (strsz < full_msg_size) {
-    memset(reply, 0, MAX_MESSAGE_SIZE);
-    if ((full_msg_size - strsz) > MAX_MESSAGE_SIZE_HEADROOM_GSM7) {
-      memcpy(reply, (full_help_msg + strsz), MAX_MESSAGE_SIZE_HEADROOM_GSM7);
-      add_message_to_queue(reply, MAX_MESSAGE_SIZE_HEADROOM_GSM7);
-      strsz += MAX_MESSAGE_SIZE_HEADROOM_GSM7;
-    } else if ((full_msg_size - strsz) > 0) {
-      memcpy(reply, (full_help_msg + strsz), (full_msg_size - strsz));
-      add_message_to_queue(reply, (full_msg_size - strsz));
-      strsz += (full_msg_size - strsz);
-    }
-  }
-  set_queue_lock(false);
+  /* Goes out as a concatenated message */
+  add_message_to_queue((uint8_t *)full_help_msg, full_msg_size);
   free(full_help_msg);
 }
 
@@ -620,19 +682,89 @@ void cmd_render_gsm_signal_data() {
  *  remind me in 99 do some stuff
  *
  */
+/*
+ * Recurring schedules
+ *  "<prefix>every day|weekday|weekend|<days> at hh[:mm]..." and
+ *  "<prefix>every hh[:mm]..." are rewritten in place to the plain
+ *  at / in form the parsers below understand. <days> is a comma
+ *  separated list of day names. Returns the mode the task has to use
+ *  once parsed, 0 if it isn't a recurring task or -EINVAL if we can't
+ *  make sense of it
+ */
+int strip_task_recurrence(char *command, const char *prefix,
+                          uint8_t *weekdays) {
+  const char *day_names[] = {"sunday",   "monday", "tuesday", "wednesday",
+                             "thursday", "friday", "saturday"};
+  char *start, *word, *next, *part;
+  size_t word_len, part_len, name_len;
+  int mode = -EINVAL;
+
+  start = strstr(command, prefix);
+  if (start == NULL) {
+    return 0;
+  }
+  start += strlen(prefix);
+  if (strncasecmp(start, "every ", 6) != 0) {
+    return 0;
+  }
+  word = start + 6;
+  next = strchr(word, ' ');
+  word_len = next != NULL ? (size_t)(next - word) : strlen(word);
+  *weekdays = 0;
+
+  if (isdigit(word[0])) {
+    memmove(start + 3, word, strlen(word) + 1);
+    memcpy(start, "in ", 3);
+    return SCHED_MODE_TIME_INTERVAL;
+  }
+  if (word_len == 3 && strncasecmp(word, "day", 3) == 0) {
+    mode = SCHED_MODE_TIME_DAILY;
+  } else if (word_len == 7 && strncasecmp(word, "weekday", 7) == 0) {
+    mode = SCHED_MODE_TIME_WEEKLY;
+    *weekdays = SCHED_WEEKDAYS;
+  } else if (word_len == 7 && strncasecmp(word, "weekend", 7) == 0) {
+    mode = SCHED_MODE_TIME_WEEKLY;
+    *weekdays = SCHED_WEEKEND;
+  } else {
+    for (part = word; part < word + word_len; part += part_len + 1) {
+      part_len = strcspn(part, ", ");
+      if (part_len > word_len - (part - word)) {
+        part_len = word_len - (part - word);
+      }
+      for (uint8_t i = 0; i < 7; i++) {
+        name_len = strlen(day_names[i]);
+        /* "monday", "mondays" and "mon" */
+        if ((part_len == name_len || part_len == 3 ||
+             (part_len == name_len + 1 && part[name_len] == 's')) &&
+            strncasecmp(part, day_names[i],
+                        part_len < name_len ? part_len : name_len) == 0) {
+          *weekdays |= 1 << i;
+          mode = SCHED_MODE_TIME_WEEKLY;
+        }
+      }
+    }
+  }
+  if (mode < 0 || next == NULL || strncasecmp(next + 1, "at ", 3) != 0) {
+    return -EINVAL;
+  }
+  memmove(start, next + 1, strlen(next + 1) + 1);
+  return mode;
+}
+
 void cmd_schedule_reminder(uint8_t *command) {
   uint8_t *offset_command;
   uint8_t *reply = calloc(MAX_MESSAGE_SIZE, sizeof(uint8_t));
   int strsz = 0;
-  char temp_str[160];
-  char reminder_text[160] = {0};
-  char current_word[160] = {0};
+  char temp_str[SMS_MAX_COMMAND_SIZE];
+  char reminder_text[SMS_MAX_COMMAND_SIZE] = {0};
+  char current_word[SMS_MAX_COMMAND_SIZE] = {0};
   int markers[128] = {0};
   int phrase_size = 1;
   int start = 0;
   int end = 0;
   char sep[] = " ";
-  struct task_p scheduler_task;
+  int recurrence;
+  struct task_p scheduler_task = {0};
   scheduler_task.time.mode = SCHED_MODE_TIME_AT; // 0 at, 1 in
   /* Initial command check */
   offset_command = (uint8_t *)strstr(
@@ -645,8 +777,22 @@ void cmd_schedule_reminder(uint8_t *command) {
     reply = NULL;
     return;
   }
+  recurrence = strip_task_recurrence(
+      (char *)command, bot_commands[CMD_ID_ACTION_SET_REMINDER].cmd,
+      &scheduler_task.time.weekdays);
+  if (recurrence < 0) {
+    strsz = snprintf((char *)reply, MAX_MESSAGE_SIZE,
+                     "How often? Try every day|weekday|weekend|monday... at "
+                     "hh[:mm] or every hh[:mm]\n");
+    add_message_to_queue(reply, strsz);
+    free(reply);
+    reply = NULL;
+    return;
+  }
 
-  strcpy(temp_str, (char *)command);
+
+  /* Concatenated messages can be longer than a single SMS */
+  snprintf(temp_str, sizeof(temp_str), "%s", (char *)command);
   int init_size = strlen(temp_str);
   char *ptr = strtok(temp_str, sep);
   while (ptr != NULL) {
@@ -654,7 +800,9 @@ void cmd_schedule_reminder(uint8_t *command) {
     ptr = strtok(NULL, sep);
   }
 
-  for (int i = 0; i < init_size; i++) {
+  for (int i = 0; i < init_size &&
+                  phrase_size < (int)(sizeof(markers) / sizeof(markers[0]));
+       i++) {
     if (temp_str[i] == 0) {
       markers[phrase_size] = i;
       phrase_size++;
@@ -674,7 +822,7 @@ void cmd_schedule_reminder(uint8_t *command) {
       start++;
     }
     // Copy this token
-    memset(current_word, 0, 160);
+    memset(current_word, 0, sizeof(current_word));
     memcpy(current_word, temp_str + start, (end - start));
     // current_word[strlen(current_word)] = '\0';
 
@@ -784,7 +932,8 @@ void cmd_schedule_reminder(uint8_t *command) {
       }
       break;
     case 4:
-      memcpy(reminder_text, command + start, (strlen((char *)command) - start));
+      snprintf(reminder_text, sizeof(reminder_text), "%s",
+               (char *)command + start);
       logger(MSG_INFO, "%s: Reminder has the following text: %s\n", __func__,
              reminder_text);
       if (scheduler_task.time.mode == SCHED_MODE_TIME_AT) {
@@ -803,8 +952,28 @@ void cmd_schedule_reminder(uint8_t *command) {
   scheduler_task.type = TASK_TYPE_CALL;
   scheduler_task.status = STATUS_PENDING;
   scheduler_task.param = 0;
-  scheduler_task.time.mode = scheduler_task.time.mode;
-  strncpy(scheduler_task.arguments, reminder_text, MAX_MESSAGE_SIZE);
+  if (recurrence > 0) {
+    scheduler_task.time.mode = recurrence;
+    strsz = snprintf((char *)reply, MAX_MESSAGE_SIZE, " Remind you ");
+    strsz += get_task_schedule_description(
+        &scheduler_task.time, (char *)reply + strsz, MAX_MESSAGE_SIZE - strsz);
+    strsz += snprintf((char *)reply + strsz, MAX_MESSAGE_SIZE - strsz,
+                      ".\n%s\n", reminder_text);
+    if (strsz >= MAX_MESSAGE_SIZE) {
+      strsz = MAX_MESSAGE_SIZE - 1;
+    }
+  }
+  /* The task only has room for ARG_SIZE bytes, don't store half of it */
+  if (strlen(reminder_text) >= ARG_SIZE) {
+    strsz = snprintf((char *)reply, MAX_MESSAGE_SIZE,
+                     "Reminder is too long, keep it under %i characters\n",
+                     ARG_SIZE);
+    add_message_to_queue(reply, strsz);
+    free(reply);
+    reply = NULL;
+    return;
+  }
+  snprintf(scheduler_task.arguments, ARG_SIZE, "%s", reminder_text);
   if (add_task(scheduler_task) < 0) {
     strsz = snprintf((char *)reply, MAX_MESSAGE_SIZE,
                      " Can't add reminder, my task queue is full!\n");
@@ -829,14 +998,15 @@ void cmd_schedule_wakeup(uint8_t *command) {
   uint8_t *offset_command;
   uint8_t *reply = calloc(MAX_MESSAGE_SIZE, sizeof(uint8_t));
   int strsz = 0;
-  char temp_str[160];
-  char current_word[160] = {0};
+  char temp_str[SMS_MAX_COMMAND_SIZE];
+  char current_word[SMS_MAX_COMMAND_SIZE] = {0};
   int markers[128] = {0};
   int phrase_size = 1;
   int start = 0;
   int end = 0;
   char sep[] = " ";
-  struct task_p scheduler_task;
+  int recurrence;
+  struct task_p scheduler_task = {0};
   scheduler_task.time.mode = SCHED_MODE_TIME_AT; // 0 at, 1 in
   /* Initial command check */
   offset_command = (uint8_t *)strstr(
@@ -849,8 +1019,22 @@ void cmd_schedule_wakeup(uint8_t *command) {
     reply = NULL;
     return;
   }
+  recurrence = strip_task_recurrence(
+      (char *)command, bot_commands[CMD_ID_ACTION_WAKE_OWNER].cmd,
+      &scheduler_task.time.weekdays);
+  if (recurrence < 0) {
+    strsz = snprintf((char *)reply, MAX_MESSAGE_SIZE,
+                     "How often? Try every day|weekday|weekend|monday... at "
+                     "hh[:mm] or every hh[:mm]\n");
+    add_message_to_queue(reply, strsz);
+    free(reply);
+    reply = NULL;
+    return;
+  }
 
-  strcpy(temp_str, (char *)command);
+
+  /* Concatenated messages can be longer than a single SMS */
+  snprintf(temp_str, sizeof(temp_str), "%s", (char *)command);
   int init_size = strlen(temp_str);
   char *ptr = strtok(temp_str, sep);
   while (ptr != NULL) {
@@ -858,7 +1042,9 @@ void cmd_schedule_wakeup(uint8_t *command) {
     ptr = strtok(NULL, sep);
   }
 
-  for (int i = 0; i < init_size; i++) {
+  for (int i = 0; i < init_size &&
+                  phrase_size < (int)(sizeof(markers) / sizeof(markers[0]));
+       i++) {
     if (temp_str[i] == 0) {
       markers[phrase_size] = i;
       phrase_size++;
@@ -878,7 +1064,7 @@ void cmd_schedule_wakeup(uint8_t *command) {
       start++;
     }
     // Copy this token
-    memset(current_word, 0, 160);
+    memset(current_word, 0, sizeof(current_word));
     memcpy(current_word, temp_str + start, (end - start));
     // current_word[strlen(current_word)] = '\0';
 
@@ -1047,9 +1233,14 @@ void cmd_schedule_wakeup(uint8_t *command) {
   scheduler_task.type = TASK_TYPE_CALL;
   scheduler_task.status = STATUS_PENDING;
   scheduler_task.param = 0;
-  scheduler_task.time.mode = scheduler_task.time.mode;
-  snprintf(scheduler_task.arguments, MAX_MESSAGE_SIZE,
-           "It's time to wakeup, %s", get_rt_user_name());
+  if (recurrence > 0) {
+    scheduler_task.time.mode = recurrence;
+    strsz = snprintf((char *)reply, MAX_MESSAGE_SIZE, "Waking you up ");
+    strsz += get_task_schedule_description(
+        &scheduler_task.time, (char *)reply + strsz, MAX_MESSAGE_SIZE - strsz);
+  }
+  snprintf(scheduler_task.arguments, ARG_SIZE, "It's time to wakeup, %s",
+           get_rt_user_name());
   if (add_task(scheduler_task) < 0) {
     strsz = snprintf((char *)reply, MAX_MESSAGE_SIZE,
                      " Can't schedule wakeup, my task queue is full!\n");
@@ -1063,8 +1254,8 @@ void cmd_suspend_call_notifications(uint8_t *command) {
   uint8_t *offset_command;
   uint8_t *reply = calloc(MAX_MESSAGE_SIZE, sizeof(uint8_t));
   int strsz = 0;
-  char temp_str[160];
-  char current_word[160] = {0};
+  char temp_str[SMS_MAX_COMMAND_SIZE];
+  char current_word[SMS_MAX_COMMAND_SIZE] = {0};
   int markers[128] = {0};
   int phrase_size = 1;
   int start = 0;
@@ -1084,7 +1275,8 @@ void cmd_suspend_call_notifications(uint8_t *command) {
     return;
   }
 
-  strcpy(temp_str, (char *)command);
+  /* Concatenated messages can be longer than a single SMS */
+  snprintf(temp_str, sizeof(temp_str), "%s", (char *)command);
   int init_size = strlen(temp_str);
   char *ptr = strtok(temp_str, sep);
   while (ptr != NULL) {
@@ -1092,7 +1284,9 @@ void cmd_suspend_call_notifications(uint8_t *command) {
     ptr = strtok(NULL, sep);
   }
 
-  for (int i = 0; i < init_size; i++) {
+  for (int i = 0; i < init_size &&
+                  phrase_size < (int)(sizeof(markers) / sizeof(markers[0]));
+       i++) {
     if (temp_str[i] == 0) {
       markers[phrase_size] = i;
       phrase_size++;
@@ -1112,7 +1306,7 @@ void cmd_suspend_call_notifications(uint8_t *command) {
       start++;
     }
     // Copy this token
-    memset(current_word, 0, 160);
+    memset(current_word, 0, sizeof(current_word));
     memcpy(current_word, temp_str + start, (end - start));
     // current_word[strlen(current_word)] = '\0';
 
@@ -1259,18 +1453,7 @@ int cmd_find_dictionary_entry(char *word) {
         if (found) {
           logger(MSG_DEBUG, "--> Definition: %s: %s\n", next, wtypes[type]);
           def_size = strlen(next);
-          while (strsz < def_size) {
-            memset(reply, 0, MAX_MESSAGE_SIZE);
-            if (def_size - strsz > MAX_MESSAGE_SIZE) {
-              strncpy((char *)reply, (next + strsz), MAX_MESSAGE_SIZE - 1);
-              add_message_to_queue(reply, MAX_MESSAGE_SIZE);
-              strsz += MAX_MESSAGE_SIZE - 1;
-            } else {
-              strncpy((char *)reply, (next + strsz), (def_size - strsz));
-              add_message_to_queue(reply, (def_size - strsz));
-              strsz += (def_size - strsz);
-            }
-          }
+          add_message_to_queue((uint8_t *)next, def_size);
           free(line);
           fclose(dictfile);
           return 0;
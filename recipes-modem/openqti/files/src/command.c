@@ -102,14 +102,15 @@ uint8_t parse_command(uint8_t *command) {
   int cmd_id = -1;
   int strsz = 0;
   pthread_t disposable_thread;
-  char lowercase_cmd[160];
+  char lowercase_cmd[SMS_MAX_COMMAND_SIZE];
   uint8_t reply[MAX_MESSAGE_SIZE] = {0};
+  size_t cmdlen = strnlen((char *)command, SMS_MAX_COMMAND_SIZE - 1);
   srand(time(NULL));
 
-  for (uint8_t i = 0; i < command[i]; i++) {
+  for (size_t i = 0; i < cmdlen; i++) {
     lowercase_cmd[i] = tolower(command[i]);
   }
-  lowercase_cmd[strlen((char *)command)] = '\0';
+  lowercase_cmd[cmdlen] = '\0';
   /* Static commands */
   for (uint8_t i = 0; i < (sizeof(bot_commands) / sizeof(bot_commands[0]));
        i++) {
@@ -157,6 +158,12 @@ uint8_t parse_command(uint8_t *command) {
   case CMD_ID_GET_GPS_STATS:
     cmd_get_gps_stats();
     break;
+  case CMD_ID_GET_QMI_STATS:
+    cmd_get_qmi_stats();
+    break;
+  case CMD_ID_GET_PROXY_LATENCY:
+    cmd_get_proxy_latency();
+    break;
   case CMD_ID_GET_HELP:
     cmd_get_help();
     break;
@@ -1,6 +1,7 @@
 // SPDX-License-Identifier: MIT
 
 #include "config.h"
+#include "helpers.h"
 #include "logger.h"
 
 #include <errno.h>
@@ -22,7 +23,7 @@
 struct config_prototype *settings;
 
 int set_persistent_partition_rw() {
-  if (system("mount -o remount,rw /persist") < 0) {
+  if (run_command("mount -o remount,rw /persist") < 0) {
     logger(MSG_ERROR, "%s: Error setting partition in RW mode\n", __func__);
     return -1;
   }
@@ -30,7 +31,7 @@ int set_persistent_partition_rw() {
 }
 
 int set_persistent_partition_ro() {
-  if (system("mount -o remount,ro /persist") < 0) {
+  if (run_command("mount -o remount,ro /persist") < 0) {
     logger(MSG_ERROR, "%s: Error setting partition in RO mode\n", __func__);
     return -1;
   }
@@ -39,7 +40,7 @@ int set_persistent_partition_ro() {
 }
 
 void do_sync_fs() {
-  if (system("sync") < 0)
+  if (run_command("sync") < 0)
     logger(MSG_ERROR, "%s: Failed to sync fs\n", __func__);
 }
 
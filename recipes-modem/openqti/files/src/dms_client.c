@@ -4,6 +4,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -42,6 +43,7 @@ struct {
   char modem_sw_ver[DMS_MODEM_INFO_MAX_STR_LEN];
   struct fw_parts firmware_sections;
   uint8_t sim_lock_status;
+  _Atomic uint8_t modem_info_pending;
 } dms_runtime;
 
 void print_modem_information() {
@@ -102,7 +104,33 @@ const char *get_sim_unlock_state_text(uint8_t state) {
   return "Unknown state";
 }
 
+/* Done with one of the modem info requests, print it all after the last */
+void dms_modem_info_request_done() {
+  if (atomic_fetch_sub(&dms_runtime.modem_info_pending, 1) == 1) {
+    print_modem_information();
+  }
+}
+
+/*
+ * Callback for the modem info requests: we print everything
+ * once, when the last one is answered, rejected or times out
+ */
+void dms_modem_info_response(uint8_t *buf, size_t buf_len, int status,
+                             void *data) {
+  if (status < 0) {
+    logger(MSG_WARN, "%s: Modem info request failed: %i\n", __func__, status);
+  } else if (did_qmi_op_fail(buf, buf_len) != QMI_RESULT_SUCCESS) {
+    logger(MSG_WARN, "%s: Modem rejected request %.4x\n", __func__,
+           get_qmi_message_id(buf, buf_len));
+  } else {
+    handle_incoming_dms_message(buf, buf_len);
+  }
+
+  dms_modem_info_request_done();
+}
+
 int dms_request_model() {
+  int ret;
   size_t pkt_len = sizeof(struct qmux_packet) + sizeof(struct qmi_packet);
   uint8_t *pkt = malloc(pkt_len);
   memset(pkt, 0, pkt_len);
@@ -122,12 +150,15 @@ int dms_request_model() {
     return -EINVAL;
   }
 
-  add_pending_message(QMI_SERVICE_DMS, (uint8_t *)pkt, pkt_len);
+  ret = add_pending_message_with_callback(QMI_SERVICE_DMS, (uint8_t *)pkt,
+                                          pkt_len, dms_modem_info_response,
+                                          NULL, QMI_REQUEST_TIMEOUT_MS);
   free(pkt);
-  return 0;
+  return ret;
 }
 
 int dms_request_serial_number() {
+  int ret;
   size_t pkt_len = sizeof(struct qmux_packet) + sizeof(struct qmi_packet);
   uint8_t *pkt = malloc(pkt_len);
   memset(pkt, 0, pkt_len);
@@ -147,12 +178,15 @@ int dms_request_serial_number() {
     return -EINVAL;
   }
 
-  add_pending_message(QMI_SERVICE_DMS, (uint8_t *)pkt, pkt_len);
+  ret = add_pending_message_with_callback(QMI_SERVICE_DMS, (uint8_t *)pkt,
+                                          pkt_len, dms_modem_info_response,
+                                          NULL, QMI_REQUEST_TIMEOUT_MS);
   free(pkt);
-  return 0;
+  return ret;
 }
 
 int dms_request_revision() {
+  int ret;
   size_t pkt_len = sizeof(struct qmux_packet) + sizeof(struct qmi_packet);
   uint8_t *pkt = malloc(pkt_len);
   memset(pkt, 0, pkt_len);
@@ -172,12 +206,15 @@ int dms_request_revision() {
     return -EINVAL;
   }
 
-  add_pending_message(QMI_SERVICE_DMS, (uint8_t *)pkt, pkt_len);
+  ret = add_pending_message_with_callback(QMI_SERVICE_DMS, (uint8_t *)pkt,
+                                          pkt_len, dms_modem_info_response,
+                                          NULL, QMI_REQUEST_TIMEOUT_MS);
   free(pkt);
-  return 0;
+  return ret;
 }
 
 int dms_request_hw_rev() {
+  int ret;
   size_t pkt_len = sizeof(struct qmux_packet) + sizeof(struct qmi_packet);
   uint8_t *pkt = malloc(pkt_len);
   memset(pkt, 0, pkt_len);
@@ -194,9 +231,11 @@ int dms_request_hw_rev() {
     return -EINVAL;
   }
 
-  add_pending_message(QMI_SERVICE_DMS, (uint8_t *)pkt, pkt_len);
+  ret = add_pending_message_with_callback(QMI_SERVICE_DMS, (uint8_t *)pkt,
+                                          pkt_len, dms_modem_info_response,
+                                          NULL, QMI_REQUEST_TIMEOUT_MS);
   free(pkt);
-  return 0;
+  return ret;
 }
 
 int dms_register_to_events() {
@@ -282,6 +321,7 @@ int dms_register_to_indications() {
 }
 
 int dms_request_sw_ver() {
+  int ret;
   size_t pkt_len = sizeof(struct qmux_packet) + sizeof(struct qmi_packet);
   uint8_t *pkt = malloc(pkt_len);
   memset(pkt, 0, pkt_len);
@@ -302,9 +342,11 @@ int dms_request_sw_ver() {
     return -EINVAL;
   }
 
-  add_pending_message(QMI_SERVICE_DMS, (uint8_t *)pkt, pkt_len);
+  ret = add_pending_message_with_callback(QMI_SERVICE_DMS, (uint8_t *)pkt,
+                                          pkt_len, dms_modem_info_response,
+                                          NULL, QMI_REQUEST_TIMEOUT_MS);
   free(pkt);
-  return 0;
+  return ret;
 }
 
 void parse_dms_event_report(uint8_t *buf, size_t buf_len) {
@@ -422,11 +464,9 @@ int handle_incoming_dms_message(uint8_t *buf, size_t buf_len) {
     break;
   case DMS_GET_IDS:
     check_and_set_fw_string(buf, buf_len, 0x12, dms_runtime.modem_serial_num);
-    print_modem_information();
     break;
   case DMS_GET_HARDWARE_REVISION:
     check_and_set_fw_string(buf, buf_len, 0x01, dms_runtime.modem_hw_rev);
-    print_modem_information();
     break;
 
   case DMS_GET_SOFTWARE_VERSION:
@@ -504,7 +544,6 @@ int handle_incoming_dms_message(uint8_t *buf, size_t buf_len) {
         }
       }
     }
-    print_modem_information();
     break;
   default:
     logger(MSG_INFO, "%s: Unhandled message for DMS: %.4x\n", __func__,
@@ -515,11 +554,25 @@ int handle_incoming_dms_message(uint8_t *buf, size_t buf_len) {
   return 0;
 }
 
+/*
+ * All of these go out at once, dms_modem_info_response()
+ * prints the result when the last one comes back
+ *  Only requests that made it to the queue are waited for. We hold
+ *  an extra count while queueing them, so answers arriving meanwhile
+ *  can't print everything before the last one is sent
+ */
 void dms_retrieve_modem_info() {
-  dms_request_model();
-  dms_request_hw_rev();
-  dms_request_revision();
-  dms_request_serial_number();
-  dms_request_sw_ver();
- return;
+  int (*requests[])() = {dms_request_model, dms_request_hw_rev,
+                         dms_request_revision, dms_request_serial_number,
+                         dms_request_sw_ver};
+  atomic_store(&dms_runtime.modem_info_pending, 1);
+  for (uint8_t i = 0; i < (sizeof(requests) / sizeof(requests[0])); i++) {
+    atomic_fetch_add(&dms_runtime.modem_info_pending, 1);
+    if (requests[i]() < 0) {
+      logger(MSG_WARN, "%s: Can't queue modem info request %u\n", __func__,
+             i);
+      atomic_fetch_sub(&dms_runtime.modem_info_pending, 1);
+    }
+  }
+  dms_modem_info_request_done();
 }
\ No newline at end of file
@@ -17,10 +17,13 @@
 #include <linux/input.h>
 #include <linux/reboot.h>
 #include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/poll.h>
 #include <sys/time.h>
+#include <sys/wait.h>
 #include <syscall.h>
 #include <unistd.h>
 
@@ -35,6 +38,51 @@ int write_to(const char *path, const char *val, int flags) {
   return ret;
 }
 
+/*
+ * Replacement for system(): main() blocks SIGTERM and SIGINT in every
+ * thread, and system() would pass that mask on to adbd, udhcpc and
+ * friends, so they couldn't be stopped. Children get a clean mask and
+ * default handlers instead.
+ * Returns the wait status of the shell, or a negative errno
+ */
+int run_command(const char *cmd) {
+  extern char **environ;
+  char *argv[] = {"sh", "-c", (char *)cmd, NULL};
+  posix_spawnattr_t attr;
+  sigset_t mask;
+  pid_t pid;
+  int status;
+  int ret;
+
+  ret = posix_spawnattr_init(&attr);
+  if (ret != 0) {
+    return -ret;
+  }
+  sigemptyset(&mask);
+  posix_spawnattr_setsigmask(&attr, &mask);
+  sigaddset(&mask, SIGTERM);
+  sigaddset(&mask, SIGINT);
+  posix_spawnattr_setsigdefault(&attr, &mask);
+  posix_spawnattr_setflags(&attr,
+                           POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+  ret = posix_spawn(&pid, "/bin/sh", NULL, &attr, argv, environ);
+  posix_spawnattr_destroy(&attr);
+  if (ret != 0) {
+    logger(MSG_ERROR, "%s: Can't run \"%s\": %s\n", __func__, cmd,
+           strerror(ret));
+    return -ret;
+  }
+
+  while (waitpid(pid, &status, 0) < 0) {
+    if (errno != EINTR) {
+      return -errno;
+    }
+  }
+
+  return status;
+}
+
 uint32_t get_curr_timestamp() {
   struct timeval te;
   gettimeofday(&te, NULL); // get current time
@@ -176,7 +224,7 @@ void restart_usb_stack() {
 
   // ADB should start when usb is available
   if (is_adb_enabled()) {
-    if (system("/etc/init.d/adbd start") < 0) {
+    if (run_command("/etc/init.d/adbd start") < 0) {
       logger(MSG_WARN, "%s: Failed to start ADB \n", __func__);
     }
   }
@@ -409,6 +457,12 @@ void add_message_to_queue(uint8_t *message, size_t len) {
   }
 
   if (get_call_simulation_mode()) {
+    /* Voice messages are still one SMS worth of text each */
+    while (len > MAX_MESSAGE_SIZE) {
+      add_voice_message_to_queue(message, MAX_MESSAGE_SIZE);
+      message += MAX_MESSAGE_SIZE;
+      len -= MAX_MESSAGE_SIZE;
+    }
     add_voice_message_to_queue(message, len);
   } else {
     add_sms_to_queue(message, len);
@@ -1,9 +1,16 @@
 // SPDX-License-Identifier: MIT
 
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -15,14 +22,316 @@
 #include "logger.h"
 #include "nas.h"
 #include "openqti.h"
+#include "space_mon.h"
 #include "tracking.h"
 #include "voice.h"
 #include "wds.h"
 
 bool log_to_file = true;
 uint8_t log_level = 0;
+uint8_t log_level_before_low_storage = 0;
+bool low_storage_log_level = false;
 struct timespec startup_time;
 
+/*
+ * Log ring
+ *  Every thread formats its own lines and pushes them to a lock free
+ *  ring of fixed size slots. A line longer than a slot takes several
+ *  consecutive slots, claimed at once so lines from different threads
+ *  never get mixed. A single writer thread drains the ring in order
+ *  and writes it out in batches with the logfile kept open.
+ *  If the ring is full the line is dropped: logging can't block the
+ *  proxy or any other thread.
+ */
+struct log_slot {
+  _Atomic uint32_t seq;
+  uint16_t len;
+  uint8_t is_last; // Last slot of a line
+  char data[LOG_SLOT_DATA_SIZE];
+};
+
+struct {
+  struct log_slot slots[LOG_RING_SLOTS];
+  _Atomic uint32_t head;      // Next position to claim (producers)
+  uint32_t tail;              // Next position to drain (writer)
+  bool in_line;               // Writer stopped in the middle of a line
+  _Atomic uint32_t dropped;   // Lines lost because the ring was full
+  _Atomic int writer_idle;    // Writer is waiting for wakeup_fd
+  int wakeup_fd;
+  int out_fd;
+  char out_path[64];
+  pthread_mutex_t drain_lock; // Writer thread vs. atexit drain
+  char batch[LOG_BATCH_SIZE];
+  size_t batch_len;
+} log_ring;
+
+pthread_once_t log_ring_once = PTHREAD_ONCE_INIT;
+
+void *log_writer_thread();
+void log_ring_flush_at_exit();
+
+void log_ring_init() {
+  pthread_t writer;
+  sigset_t all_signals, old_mask;
+  for (uint32_t i = 0; i < LOG_RING_SLOTS; i++) {
+    atomic_init(&log_ring.slots[i].seq, i);
+  }
+  atomic_init(&log_ring.head, 0);
+  atomic_init(&log_ring.dropped, 0);
+  atomic_init(&log_ring.writer_idle, 0);
+  log_ring.tail = 0;
+  log_ring.in_line = false;
+  log_ring.out_fd = -1;
+  log_ring.batch_len = 0;
+  pthread_mutex_init(&log_ring.drain_lock, NULL);
+  log_ring.wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (log_ring.wakeup_fd < 0) {
+    fprintf(stderr, "[%s] Error creating logger wakeup event\n", __func__);
+  }
+  atexit(log_ring_flush_at_exit);
+  /* Signals are for main(), the writer inherits a mask blocking them all */
+  sigfillset(&all_signals);
+  pthread_sigmask(SIG_BLOCK, &all_signals, &old_mask);
+  if (pthread_create(&writer, NULL, &log_writer_thread, NULL)) {
+    fprintf(stderr, "[%s] Error creating logger thread\n", __func__);
+  } else {
+    pthread_detach(writer);
+  }
+  pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+}
+
+/*
+ * Claims enough consecutive slots for len bytes. Returns the
+ * first position or -1 if it doesn't fit right now
+ */
+int64_t log_ring_claim(size_t len, uint32_t *nslots) {
+  uint32_t pos, last, seq;
+  int32_t diff;
+
+  pthread_once(&log_ring_once, log_ring_init);
+  *nslots = (len + LOG_SLOT_DATA_SIZE - 1) / LOG_SLOT_DATA_SIZE;
+  if (*nslots == 0 || *nslots > LOG_MAX_SLOTS_PER_LINE) {
+    atomic_fetch_add(&log_ring.dropped, 1);
+    return -1;
+  }
+
+  pos = atomic_load_explicit(&log_ring.head, memory_order_relaxed);
+  for (;;) {
+    last = pos + *nslots - 1;
+    seq = atomic_load_explicit(&log_ring.slots[last & LOG_RING_MASK].seq,
+                               memory_order_acquire);
+    diff = (int32_t)(seq - last);
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(
+              &log_ring.head, &pos, pos + *nslots, memory_order_relaxed,
+              memory_order_relaxed)) {
+        return pos;
+      }
+    } else if (diff < 0) {
+      atomic_fetch_add(&log_ring.dropped, 1);
+      return -1;
+    } else {
+      pos = atomic_load_explicit(&log_ring.head, memory_order_relaxed);
+    }
+  }
+}
+
+/* Publishes a claimed slot and wakes up the writer if it's sleeping */
+void log_ring_commit_slot(uint32_t pos, uint16_t len, uint8_t is_last) {
+  uint64_t val = 1;
+  log_ring.slots[pos & LOG_RING_MASK].len = len;
+  log_ring.slots[pos & LOG_RING_MASK].is_last = is_last;
+  atomic_store(&log_ring.slots[pos & LOG_RING_MASK].seq, pos + 1);
+  if (atomic_exchange(&log_ring.writer_idle, 0) && log_ring.wakeup_fd >= 0) {
+    if (write(log_ring.wakeup_fd, &val, sizeof(uint64_t)) < 0) {
+      // Counter is already set, writer will wake up anyway
+    }
+  }
+}
+
+/*
+ * Cursor to fill claimed slots sequentially, so callers can format
+ * straight into the ring without an intermediate buffer
+ */
+struct log_cursor {
+  uint32_t pos;
+  uint32_t last;
+  uint16_t used;
+};
+
+void log_cursor_put(struct log_cursor *cur, const char *data, size_t len) {
+  size_t chunk;
+  while (len > 0) {
+    chunk = LOG_SLOT_DATA_SIZE - cur->used;
+    if (chunk > len) {
+      chunk = len;
+    }
+    memcpy(log_ring.slots[cur->pos & LOG_RING_MASK].data + cur->used, data,
+           chunk);
+    cur->used += chunk;
+    data += chunk;
+    len -= chunk;
+    if (cur->used == LOG_SLOT_DATA_SIZE) {
+      log_ring_commit_slot(cur->pos, cur->used, cur->pos == cur->last);
+      cur->pos++;
+      cur->used = 0;
+    }
+  }
+}
+
+void log_cursor_finish(struct log_cursor *cur) {
+  if (cur->used > 0) {
+    log_ring_commit_slot(cur->pos, cur->used, 1);
+  }
+}
+
+/* Push an already formatted line */
+void log_push(const char *data, size_t len) {
+  struct log_cursor cur;
+  uint32_t nslots;
+  int64_t pos = log_ring_claim(len, &nslots);
+  if (pos < 0) {
+    return;
+  }
+  cur.pos = pos;
+  cur.last = pos + nslots - 1;
+  cur.used = 0;
+  log_cursor_put(&cur, data, len);
+  log_cursor_finish(&cur);
+}
+
+void log_write_out(const char *data, size_t len) {
+  ssize_t ret;
+  while (len > 0) {
+    ret = write(log_ring.out_fd, data, len);
+    if (ret <= 0) {
+      return;
+    }
+    data += ret;
+    len -= ret;
+  }
+}
+
+/*
+ * Writes whatever we have in the batch buffer. We keep the logfile
+ * open between batches, but if persistent logging is enabled we close
+ * it again so /persist can still be remounted as read only.
+ */
+void log_flush_batch() {
+  char *path;
+  if (log_ring.batch_len == 0) {
+    return;
+  }
+
+  if (!log_to_file) {
+    if (log_ring.out_fd >= 0 && log_ring.out_fd != STDOUT_FILENO) {
+      close(log_ring.out_fd);
+    }
+    log_ring.out_fd = STDOUT_FILENO;
+  } else {
+    path = get_openqti_logfile();
+    if (log_ring.out_fd == STDOUT_FILENO ||
+        strcmp(path, log_ring.out_path) != 0) {
+      if (log_ring.out_fd > STDOUT_FILENO) {
+        close(log_ring.out_fd);
+      }
+      log_ring.out_fd = -1;
+    }
+    if (log_ring.out_fd < 0) {
+      snprintf(log_ring.out_path, sizeof(log_ring.out_path), "%s", path);
+      log_ring.out_fd =
+          open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+      if (log_ring.out_fd < 0) {
+        fprintf(stderr, "[%s] Error opening logfile \n", __func__);
+        log_ring.out_fd = STDOUT_FILENO;
+      }
+    }
+  }
+
+  log_write_out(log_ring.batch, log_ring.batch_len);
+  if (log_to_file) {
+    storage_account_write(STORAGE_CONSUMER_LOGS, log_ring.batch_len);
+  }
+  log_ring.batch_len = 0;
+
+  if (log_to_file && use_persistent_logging() &&
+      log_ring.out_fd > STDOUT_FILENO) {
+    close(log_ring.out_fd);
+    log_ring.out_fd = -1;
+  }
+}
+
+/* Moves everything that's ready from the ring to the logfile */
+int log_ring_drain() {
+  struct log_slot *slot;
+  uint32_t dropped;
+  int drained = 0;
+
+  dropped = log_ring.in_line ? 0 : atomic_exchange(&log_ring.dropped, 0);
+  if (dropped > 0) {
+    log_ring.batch_len += snprintf(log_ring.batch + log_ring.batch_len,
+                                   LOG_BATCH_SIZE - log_ring.batch_len,
+                                   "[logger] %u lines dropped\n", dropped);
+  }
+
+  for (;;) {
+    slot = &log_ring.slots[log_ring.tail & LOG_RING_MASK];
+    if (atomic_load(&slot->seq) != log_ring.tail + 1) {
+      break;
+    }
+    if (log_ring.batch_len + slot->len > LOG_BATCH_SIZE) {
+      log_flush_batch();
+    }
+    memcpy(log_ring.batch + log_ring.batch_len, slot->data, slot->len);
+    log_ring.batch_len += slot->len;
+    log_ring.in_line = !slot->is_last;
+    atomic_store_explicit(&slot->seq, log_ring.tail + LOG_RING_SLOTS,
+                          memory_order_release);
+    log_ring.tail++;
+    drained++;
+  }
+  log_flush_batch();
+  return drained;
+}
+
+void *log_writer_thread() {
+  struct pollfd pfd;
+  uint64_t val;
+  pfd.fd = log_ring.wakeup_fd;
+  pfd.events = POLLIN;
+  while (1) {
+    pthread_mutex_lock(&log_ring.drain_lock);
+    log_ring_drain();
+    pthread_mutex_unlock(&log_ring.drain_lock);
+
+    atomic_store(&log_ring.writer_idle, 1);
+    /* Check again, something may have arrived before we set the flag */
+    if (atomic_load(&log_ring.slots[log_ring.tail & LOG_RING_MASK].seq) ==
+            log_ring.tail + 1 ||
+        (!log_ring.in_line && atomic_load(&log_ring.dropped) > 0)) {
+      atomic_store(&log_ring.writer_idle, 0);
+      continue;
+    }
+    if (log_ring.wakeup_fd < 0) {
+      usleep(100000);
+      continue;
+    }
+    if (poll(&pfd, 1, -1) > 0) {
+      if (read(log_ring.wakeup_fd, &val, sizeof(uint64_t)) < 0) {
+        // Already consumed
+      }
+    }
+  }
+  return NULL;
+}
+
+/* Make sure we don't lose the last lines if we bail out */
+void log_ring_flush_at_exit() {
+  pthread_mutex_lock(&log_ring.drain_lock);
+  log_ring_drain();
+  pthread_mutex_unlock(&log_ring.drain_lock);
+}
+
 void reset_logtime() { clock_gettime(CLOCK_MONOTONIC, &startup_time); }
 
 void set_log_method(bool ttyout) {
@@ -41,6 +350,23 @@ void set_log_level(uint8_t level) {
 
 uint8_t get_log_level() { return log_level; }
 
+/*
+ * Called from the storage monitor thread
+ *  Only log errors while the logfile's storage is running low, and go
+ *  back to whatever we had once there's room again
+ */
+void log_storage_level_changed(uint8_t storage_id, uint8_t level,
+                               int32_t free_mb) {
+  if (level >= STORAGE_LEVEL_LOW && !low_storage_log_level) {
+    log_level_before_low_storage = log_level;
+    low_storage_log_level = true;
+    log_level = MSG_ERROR;
+  } else if (level == STORAGE_LEVEL_OK && low_storage_log_level) {
+    low_storage_log_level = false;
+    log_level = log_level_before_low_storage;
+  }
+}
+
 double get_elapsed_time() {
   struct timespec current_time;
   clock_gettime(CLOCK_MONOTONIC, &current_time);
@@ -50,48 +376,57 @@ double get_elapsed_time() {
 }
 
 void logger(uint8_t level, char *format, ...) {
-  FILE *fd;
   va_list args;
-  double elapsed_time;
-  struct timespec current_time;
-  clock_gettime(CLOCK_MONOTONIC, &current_time);
-  elapsed_time = (((current_time.tv_sec - startup_time.tv_sec) * 1e9) +
-                  (current_time.tv_nsec - startup_time.tv_nsec)) /
-                 1e9; // in seconds
+  char line[LOG_LINE_SIZE];
+  char *longline;
+  int hdr_len, len;
+  char level_str;
 
-  if (level >= log_level) {
-    if (!log_to_file) {
-      fd = stdout;
-    } else {
-      fd = fopen(get_openqti_logfile(), "a");
-      if (fd < 0) {
-        fprintf(stderr, "[%s] Error opening logfile \n", __func__);
-        fd = stdout;
-      }
-    }
+  if (level < log_level) {
+    return;
+  }
 
-    switch (level) {
-    case 0:
-      fprintf(fd, "[%.4f] D ", elapsed_time);
-      break;
-    case 1:
-      fprintf(fd, "[%.4f] I ", elapsed_time);
-      break;
-    case 2:
-      fprintf(fd, "[%.4f] W ", elapsed_time);
-      break;
-    default:
-      fprintf(fd, "[%.4f] E ", elapsed_time);
-      break;
-    }
-    va_start(args, format);
-    vfprintf(fd, format, args);
-    va_end(args);
-    fflush(fd);
-    if (fd != stdout) {
-      fclose(fd);
-    }
+  switch (level) {
+  case 0:
+    level_str = 'D';
+    break;
+  case 1:
+    level_str = 'I';
+    break;
+  case 2:
+    level_str = 'W';
+    break;
+  default:
+    level_str = 'E';
+    break;
+  }
+  hdr_len = snprintf(line, LOG_LINE_SIZE, "[%.4f] %c ", get_elapsed_time(),
+                     level_str);
+
+  va_start(args, format);
+  len = vsnprintf(line + hdr_len, LOG_LINE_SIZE - hdr_len, format, args);
+  va_end(args);
+  if (len < 0) {
+    return;
+  }
+
+  if (hdr_len + len < LOG_LINE_SIZE) {
+    log_push(line, hdr_len + len);
+    return;
   }
+
+  /* Doesn't fit in the stack buffer, do it again in the heap */
+  longline = malloc(hdr_len + len + 1);
+  if (longline == NULL) {
+    log_push(line, LOG_LINE_SIZE - 1);
+    return;
+  }
+  memcpy(longline, line, hdr_len);
+  va_start(args, format);
+  vsnprintf(longline + hdr_len, len + 1, format, args);
+  va_end(args);
+  log_push(longline, hdr_len + len);
+  free(longline);
 }
 
 void dump_to_file(char *filename, char *header, char *format, ...) {
@@ -168,52 +503,58 @@ void log_thermal_status(uint8_t level, char *format, ...) {
     }
   }
 }
-void dump_packet(char *direction, uint8_t *buf, int pktsize) {
+/*
+ * Formats a buffer as hex straight into the log ring:
+ *  <prefix>0xXX<separator>0xXX<separator>...<suffix>
+ */
+void log_hex_buffer(const char *prefix, const char *separator,
+                    const char *suffix, uint8_t *buf, int pktsize) {
+  static const char hexchars[] = "0123456789abcdef";
+  struct log_cursor cur;
+  uint32_t nslots;
+  int64_t pos;
+  char byte[8];
+  size_t prefix_len = strlen(prefix);
+  size_t sep_len = strlen(separator);
+  size_t suffix_len = strlen(suffix);
+  size_t byte_len = 4 + sep_len;
   int i;
-  FILE *fd;
+
+  if (pktsize < 0) {
+    pktsize = 0;
+  }
+  pos = log_ring_claim(prefix_len + (byte_len * pktsize) + suffix_len,
+                       &nslots);
+  if (pos < 0) {
+    return;
+  }
+  cur.pos = pos;
+  cur.last = pos + nslots - 1;
+  cur.used = 0;
+  log_cursor_put(&cur, prefix, prefix_len);
+  byte[0] = '0';
+  byte[1] = 'x';
+  memcpy(byte + 4, separator, sep_len);
+  for (i = 0; i < pktsize; i++) {
+    byte[2] = hexchars[buf[i] >> 4];
+    byte[3] = hexchars[buf[i] & 0x0f];
+    log_cursor_put(&cur, byte, byte_len);
+  }
+  log_cursor_put(&cur, suffix, suffix_len);
+  log_cursor_finish(&cur);
+}
+
+void dump_packet(char *direction, uint8_t *buf, int pktsize) {
+  char prefix[64];
   if (log_level == 0) {
-    if (!log_to_file) {
-      fd = stdout;
-    } else {
-      fd = fopen(get_openqti_logfile(), "a");
-      if (fd < 0) {
-        fprintf(stderr, "[%s] Error opening logfile \n", __func__);
-        fd = stdout;
-      }
-    }
-    fprintf(fd, "%s :", direction);
-    for (i = 0; i < pktsize; i++) {
-      fprintf(fd, "0x%02x ", buf[i]);
-    }
-    fprintf(fd, "\n");
-    if (fd != stdout) {
-      fclose(fd);
-    }
+    snprintf(prefix, sizeof(prefix), "%s :", direction);
+    log_hex_buffer(prefix, " ", "\n", buf, pktsize);
   }
 }
 
 void dump_pkt_raw(uint8_t *buf, int pktsize) {
-  int i;
-  FILE *fd;
   if (log_level == 0) {
-
-    if (!log_to_file) {
-      fd = stdout;
-    } else {
-      fd = fopen(get_openqti_logfile(), "a");
-      if (fd < 0) {
-        fprintf(stderr, "[%s] Error opening logfile \n", __func__);
-        fd = stdout;
-      }
-    }
-    fprintf(fd, "raw_pkt[] = {");
-    for (i = 0; i < pktsize; i++) {
-      fprintf(fd, "0x%02x, ", buf[i]);
-    }
-    fprintf(fd, " }; \n");
-    if (fd != stdout) {
-      fclose(fd);
-    }
+    log_hex_buffer("raw_pkt[] = {", ", ", " }; \n", buf, pktsize);
   }
 }
 
@@ -276,19 +617,10 @@ void pretty_print_tlvs(FILE *fd, size_t initial_offset, uint8_t service,
   } while (curr_offset < pktsize);
 }
 
-void pretty_print_qmi_pkt(char *direction, uint8_t *buf, int pktsize) {
+void pretty_print_qmi_pkt_to_file(FILE *fd, char *direction, uint8_t *buf,
+                                  int pktsize) {
   int i;
-  FILE *fd;
   struct qmux_packet *qmux = (struct qmux_packet *)buf;
-  if (!log_to_file) {
-    fd = stdout;
-  } else {
-    fd = fopen(get_openqti_logfile(), "a");
-    if (fd < 0) {
-      fprintf(stderr, "[%s] Error opening logfile \n", __func__);
-      fd = stdout;
-    }
-  }
 
   fprintf(fd,
           "RAW:\n"
@@ -353,9 +685,22 @@ void pretty_print_qmi_pkt(char *direction, uint8_t *buf, int pktsize) {
     fprintf(fd, "QMUX message is too short!\n");
   }
   fprintf(fd, "------\n");
-  if (fd != stdout) {
-    fclose(fd);
+}
+
+void pretty_print_qmi_pkt(char *direction, uint8_t *buf, int pktsize) {
+  FILE *fd;
+  char *output = NULL;
+  size_t output_len = 0;
+  /* Render it in memory and push it to the log as a single block */
+  fd = open_memstream(&output, &output_len);
+  if (fd == NULL) {
+    logger(MSG_ERROR, "%s: Can't allocate output buffer\n", __func__);
+    return;
   }
+  pretty_print_qmi_pkt_to_file(fd, direction, buf, pktsize);
+  fclose(fd);
+  log_push(output, output_len);
+  free(output);
 }
 
 int mask_phone_number(uint8_t *orig, char *dest, uint8_t len) {
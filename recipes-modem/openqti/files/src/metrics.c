@@ -0,0 +1,298 @@
+// SPDX-License-Identifier: MIT
+
+#include "metrics.h"
+#include "ipc.h"
+#include "logger.h"
+#include "openqti.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/*
+ * Proxy instrumentation
+ *  Size, handler time and forwarding latency histograms for every
+ *  frame going through the proxy, split by direction and service.
+ *  The proxy thread is the only writer, so it just bumps atomic
+ *  counters and never waits; the chat command and the metrics
+ *  socket read them whenever they want.
+ */
+struct {
+  struct metrics_histogram histograms[2][METRICS_MAX_SERVICES + 1]
+                                     [METRIC_LAST];
+  int listen_fd;
+} metrics_rt = {
+    .listen_fd = -1,
+};
+
+const char *metric_names[METRIC_LAST] = {
+    "size_bytes",
+    "handler_us",
+    "forward_us",
+};
+
+uint8_t get_metrics_slot(uint8_t service) {
+  return service < METRICS_MAX_SERVICES ? service : METRICS_OTHER_SERVICES;
+}
+
+const char *get_metrics_slot_name(uint8_t slot) {
+  if (slot >= METRICS_OTHER_SERVICES) {
+    return "Other services";
+  }
+  return get_service_name(slot);
+}
+
+uint8_t get_metrics_bucket(uint32_t value) {
+  uint8_t bucket;
+  if (value == 0) {
+    return 0;
+  }
+  bucket = 32 - __builtin_clz(value);
+  return bucket < METRICS_BUCKETS ? bucket : METRICS_BUCKETS - 1;
+}
+
+void histogram_add(struct metrics_histogram *histogram, uint32_t value) {
+  atomic_fetch_add_explicit(&histogram->buckets[get_metrics_bucket(value)], 1,
+                            memory_order_relaxed);
+  atomic_fetch_add_explicit(&histogram->total, value, memory_order_relaxed);
+  /* Single writer, no need for a CAS loop */
+  if (value > atomic_load_explicit(&histogram->max, memory_order_relaxed)) {
+    atomic_store_explicit(&histogram->max, value, memory_order_relaxed);
+  }
+  /* Last, so readers never see more samples than bucket counts */
+  atomic_fetch_add_explicit(&histogram->count, 1, memory_order_release);
+}
+
+void metrics_record_frame(uint8_t source, uint8_t service, size_t size,
+                          uint32_t handler_us) {
+  struct metrics_histogram *histograms;
+  if (source > FROM_HOST) {
+    return;
+  }
+  histograms = metrics_rt.histograms[source][get_metrics_slot(service)];
+  histogram_add(&histograms[METRIC_PACKET_SIZE], size);
+  histogram_add(&histograms[METRIC_HANDLER_TIME], handler_us);
+}
+
+void metrics_record_forward(uint8_t source, uint8_t service,
+                            uint32_t latency_us) {
+  if (source > FROM_HOST) {
+    return;
+  }
+  histogram_add(&metrics_rt.histograms[source][get_metrics_slot(service)]
+                                      [METRIC_FORWARD_LATENCY],
+                latency_us);
+}
+
+void histogram_snapshot(struct metrics_histogram *histogram,
+                        struct metrics_snapshot *snapshot) {
+  snapshot->count =
+      atomic_load_explicit(&histogram->count, memory_order_acquire);
+  snapshot->max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+  snapshot->total =
+      atomic_load_explicit(&histogram->total, memory_order_relaxed);
+  for (uint8_t i = 0; i < METRICS_BUCKETS; i++) {
+    snapshot->buckets[i] =
+        atomic_load_explicit(&histogram->buckets[i], memory_order_relaxed);
+  }
+}
+
+struct metrics_snapshot get_proxy_metrics(uint8_t source, uint8_t slot,
+                                          uint8_t metric) {
+  struct metrics_snapshot snapshot = {0};
+  if (source > FROM_HOST || slot > METRICS_OTHER_SERVICES ||
+      metric >= METRIC_LAST) {
+    return snapshot;
+  }
+  histogram_snapshot(&metrics_rt.histograms[source][slot][metric], &snapshot);
+  return snapshot;
+}
+
+/* All services of a direction merged together */
+struct metrics_snapshot get_proxy_metrics_total(uint8_t source,
+                                                uint8_t metric) {
+  struct metrics_snapshot total = {0};
+  struct metrics_snapshot snapshot;
+  for (uint8_t slot = 0; slot <= METRICS_OTHER_SERVICES; slot++) {
+    snapshot = get_proxy_metrics(source, slot, metric);
+    total.count += snapshot.count;
+    total.total += snapshot.total;
+    if (snapshot.max > total.max) {
+      total.max = snapshot.max;
+    }
+    for (uint8_t i = 0; i < METRICS_BUCKETS; i++) {
+      total.buckets[i] += snapshot.buckets[i];
+    }
+  }
+  return total;
+}
+
+/* Upper bound of the bucket holding the percentile */
+uint32_t get_metrics_percentile(struct metrics_snapshot *snapshot,
+                                uint8_t percent) {
+  uint64_t target, seen = 0;
+  if (snapshot->count == 0) {
+    return 0;
+  }
+  target = ((uint64_t)snapshot->count * percent + 99) / 100;
+  for (uint8_t i = 0; i < METRICS_BUCKETS - 1; i++) {
+    seen += snapshot->buckets[i];
+    if (seen >= target) {
+      return 1U << i;
+    }
+  }
+  return snapshot->max;
+}
+
+/* Service slot with the worst p95 handler time, in any direction */
+uint8_t get_slowest_proxy_service(uint32_t *p95_us) {
+  struct metrics_snapshot snapshot;
+  uint32_t p95;
+  uint8_t slowest = METRICS_OTHER_SERVICES;
+  *p95_us = 0;
+  for (uint8_t source = FROM_DSP; source <= FROM_HOST; source++) {
+    for (uint8_t slot = 0; slot <= METRICS_OTHER_SERVICES; slot++) {
+      snapshot = get_proxy_metrics(source, slot, METRIC_HANDLER_TIME);
+      p95 = get_metrics_percentile(&snapshot, 95);
+      if (snapshot.count > 0 && p95 > *p95_us) {
+        *p95_us = p95;
+        slowest = slot;
+      }
+    }
+  }
+  return slowest;
+}
+
+/*
+ * Text dump for the metrics socket
+ *  One line per direction, service and metric with samples:
+ *  <direction> <service id> <metric> count= avg= max= p50= p95= p99=
+ *  buckets=<b0>,<b1>... (bucket N counts values below 2^N)
+ */
+void write_metrics_report(FILE *fp) {
+  struct metrics_snapshot snapshot;
+  fprintf(fp, "# openqti proxy metrics\n");
+  fprintf(fp, "# buckets: log2, bucket 0 counts zeroes, bucket N counts "
+              "values below 2^N\n");
+  for (uint8_t source = FROM_DSP; source <= FROM_HOST; source++) {
+    for (uint8_t slot = 0; slot <= METRICS_OTHER_SERVICES; slot++) {
+      for (uint8_t metric = 0; metric < METRIC_LAST; metric++) {
+        snapshot = get_proxy_metrics(source, slot, metric);
+        if (snapshot.count == 0) {
+          continue;
+        }
+        fprintf(fp, "%s ", source == FROM_HOST ? "host_to_modem"
+                                               : "modem_to_host");
+        if (slot == METRICS_OTHER_SERVICES) {
+          fprintf(fp, "other ");
+        } else {
+          fprintf(fp, "0x%.2x ", slot);
+        }
+        fprintf(fp, "%s count=%u avg=%u max=%u p50=%u p95=%u p99=%u buckets=",
+                metric_names[metric], snapshot.count,
+                (uint32_t)(snapshot.total / snapshot.count), snapshot.max,
+                get_metrics_percentile(&snapshot, 50),
+                get_metrics_percentile(&snapshot, 95),
+                get_metrics_percentile(&snapshot, 99));
+        for (uint8_t i = 0; i < METRICS_BUCKETS; i++) {
+          fprintf(fp, i == 0 ? "%u" : ",%u", snapshot.buckets[i]);
+        }
+        fprintf(fp, " # %s\n", get_metrics_slot_name(slot));
+      }
+    }
+  }
+}
+
+/*
+ * Metrics socket
+ *  Every client connecting to METRICS_SOCKET_PATH gets a full report
+ *  and is disconnected: `socat - UNIX-CONNECT:/tmp/openqti-metrics.sock`
+ */
+/*
+ * Sends the whole report to a client. MSG_NOSIGNAL keeps a client that
+ * hangs up early from killing us with SIGPIPE, we just drop it
+ */
+int send_metrics_report(int fd) {
+  char *report = NULL;
+  size_t report_len = 0, sent = 0;
+  ssize_t ret;
+  FILE *fp;
+
+  fp = open_memstream(&report, &report_len);
+  if (fp == NULL) {
+    return -ENOMEM;
+  }
+  write_metrics_report(fp);
+  fclose(fp);
+
+  while (sent < report_len) {
+    ret = send(fd, report + sent, report_len - sent, MSG_NOSIGNAL);
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      ret = -errno;
+      free(report);
+      return ret;
+    }
+    sent += ret;
+  }
+
+  free(report);
+  return 0;
+}
+
+void *metrics_socket_thread() {
+  struct sockaddr_un addr;
+  struct timeval timeout;
+  int fd, ret;
+
+  metrics_rt.listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (metrics_rt.listen_fd < 0) {
+    logger(MSG_ERROR, "%s: Can't create the metrics socket: %s\n", __func__,
+           strerror(errno));
+    return NULL;
+  }
+
+  memset(&addr, 0, sizeof(struct sockaddr_un));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, METRICS_SOCKET_PATH, sizeof(addr.sun_path) - 1);
+  unlink(METRICS_SOCKET_PATH);
+  if (bind(metrics_rt.listen_fd, (struct sockaddr *)&addr,
+           sizeof(struct sockaddr_un)) < 0 ||
+      listen(metrics_rt.listen_fd, METRICS_SOCKET_BACKLOG) < 0) {
+    logger(MSG_ERROR, "%s: Can't listen on %s: %s\n", __func__,
+           METRICS_SOCKET_PATH, strerror(errno));
+    close(metrics_rt.listen_fd);
+    metrics_rt.listen_fd = -1;
+    return NULL;
+  }
+  logger(MSG_INFO, "%s: Proxy metrics available at %s\n", __func__,
+         METRICS_SOCKET_PATH);
+
+  timeout.tv_sec = METRICS_SOCKET_SEND_TIMEOUT_S;
+  timeout.tv_usec = 0;
+  while (1) {
+    fd = accept(metrics_rt.listen_fd, NULL, NULL);
+    if (fd < 0) {
+      if (errno != EINTR) {
+        logger(MSG_WARN, "%s: accept failed: %s\n", __func__, strerror(errno));
+      }
+      continue;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    ret = send_metrics_report(fd);
+    if (ret < 0) {
+      logger(MSG_DEBUG, "%s: Dropping metrics client: %s\n", __func__,
+             strerror(-ret));
+    }
+    close(fd);
+  }
+
+  return NULL;
+}
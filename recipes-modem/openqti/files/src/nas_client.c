@@ -4,6 +4,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -12,6 +13,8 @@
 #include <string.h>
 #include <sys/file.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "config.h"
@@ -19,10 +22,13 @@
 #include "helpers.h"
 #include "ipc.h"
 #include "logger.h"
+#include "proxy.h"
 #include "nas.h"
 #include "qmi.h"
 #include "sms.h"
 #include "audio.h"
+#include "cell_anomaly.h"
+#include "space_mon.h"
 
 // #define DEBUG_NAS 0
 
@@ -34,8 +40,18 @@ struct {
   uint8_t prev_plmn[3];
 
   /* Network status report history */
-  uint16_t current_report;
+  uint16_t current_report; // Last added or updated
+  uint16_t oldest_report;  // Reports are a ring, we drop the oldest one
+  uint16_t num_reports;
   struct network_status_reports data[MAX_REPORT_NUM];
+  /* (mcc, mnc, rat, lac, cell id) -> report slot */
+  uint16_t report_index[REPORT_HASH_SIZE];
+  /* Reports changed since the last journal flush */
+  uint8_t dirty_reports[MAX_REPORT_NUM / 8];
+  uint16_t num_dirty_reports;
+  uint64_t first_dirty_at;
+  uint32_t journal_entries;
+  _Atomic uint8_t storage_full; // Set by the storage monitor
 
   /* Latest retrieved Cell ID and LAC/TAC */
   uint32_t current_cell_id;
@@ -43,8 +59,17 @@ struct {
 
   /* Open Cellid data */
   uint8_t cellid_data_missing; // 0 missing, 1 ready, 2 missing and requested
-  FILE *curr_ocid_db_fp;
-  uint64_t open_cellid_num_items;
+  /*
+   * The database is only mapped, looked up and unmapped from the NAS
+   * thread. Others ask for a reload and we pick it up with the next
+   * cell location update
+   */
+  _Atomic bool ocid_reload_pending;
+  uint8_t *ocid_db_map;
+  size_t ocid_db_map_size;
+  struct ocid_cell_slim *ocid_records;
+  uint32_t *ocid_sorted_index; // Only for unsorted files
+  uint32_t open_cellid_num_items;
   uint8_t open_cellid_mcc[4];
   uint8_t open_cellid_mnc[3];
 
@@ -54,98 +79,220 @@ struct {
  * OpenCellid base functions
  */
 
-struct ocid_cell_slim get_opencellid_cell_info(uint32_t cell_id, uint16_t lac) {
-  struct ocid_cell_slim *ocid = malloc(sizeof(struct ocid_cell_slim));
+/* Sort order of the database: radio, area, cell */
+int compare_ocid_cell(struct ocid_cell_slim *cell, uint8_t radio,
+                      uint32_t area, uint32_t cell_id) {
+  if (cell->radio != radio) {
+    return cell->radio < radio ? -1 : 1;
+  }
+  if (cell->area != area) {
+    return cell->area < area ? -1 : 1;
+  }
+  if (cell->cell != cell_id) {
+    return cell->cell < cell_id ? -1 : 1;
+  }
+  return 0;
+}
+
+struct ocid_cell_slim *get_ocid_record(uint32_t pos) {
+  if (nas_runtime.ocid_sorted_index != NULL) {
+    pos = nas_runtime.ocid_sorted_index[pos];
+  }
+  return &nas_runtime.ocid_records[pos];
+}
+
+int compare_ocid_index_entries(const void *a, const void *b) {
+  struct ocid_cell_slim *cell_b =
+      &nas_runtime.ocid_records[*(const uint32_t *)b];
+  return compare_ocid_cell(&nas_runtime.ocid_records[*(const uint32_t *)a],
+                           cell_b->radio, cell_b->area, cell_b->cell);
+}
+
+/*
+ * OpenCellid records are keyed on their OCID_RADIO_* type, which is
+ * what the cell info parser gives us, not nas_runtime's network_type
+ */
+struct ocid_cell_slim get_opencellid_cell_info(uint8_t radio, uint32_t cell_id,
+                                               uint16_t lac) {
   struct ocid_cell_slim cell = {0};
+  struct ocid_cell_slim *ocid;
+  uint32_t low, high, mid;
+  int cmp;
 
   if (nas_runtime.cellid_data_missing != 1) {
     logger(MSG_ERROR, "%s: Open Cellid data isn't available\n", __func__);
-    free(ocid);
     return cell;
   }
 
-  if (nas_runtime.curr_ocid_db_fp == NULL) {
+  if (nas_runtime.ocid_db_map == NULL) {
     nas_runtime.cellid_data_missing = 0;
     logger(MSG_ERROR, "%s: File is missing!\n", __func__);
-    free(ocid);
     return cell;
   }
 
-  fseek(nas_runtime.curr_ocid_db_fp, 0L, SEEK_SET);
-
   logger(MSG_DEBUG, "%s Looking for the cell id\n", __func__);
-  for (uint64_t i = 0; i < nas_runtime.open_cellid_num_items; i++) {
-    memset(ocid, 0, sizeof(struct ocid_cell_slim));
-    if (fread(ocid, sizeof(struct ocid_cell_slim), 1,
-              nas_runtime.curr_ocid_db_fp) != 1) {
-      logger(MSG_ERROR, "%s: Error reading OpenCellid database!\n", __func__);
-      fclose(nas_runtime.curr_ocid_db_fp);
-      nas_runtime.curr_ocid_db_fp = NULL;
-      free(ocid);
-      return cell;
-    }
-    if (nas_runtime.curr_state.network_type == ocid->radio &&
-        cell_id == ocid->cell && ocid->area == lac) {
-      logger(MSG_DEBUG, "%s: Found %.8x %.4x (OpenCellID: %.8x %.4x)\n", __func__,
-             cell_id, lac, ocid->cell, ocid->area);
-      cell = *ocid;
-      free(ocid);
-      return cell;
+  low = 0;
+  high = nas_runtime.open_cellid_num_items;
+  while (low < high) {
+    mid = low + (high - low) / 2;
+    ocid = get_ocid_record(mid);
+    cmp = compare_ocid_cell(ocid, radio, lac, cell_id);
+    if (cmp == 0) {
+      logger(MSG_DEBUG, "%s: Found %.8x %.4x (OpenCellID: %.8x %.4x)\n",
+             __func__, cell_id, lac, ocid->cell, ocid->area);
+      return *ocid;
+    } else if (cmp < 0) {
+      low = mid + 1;
+    } else {
+      high = mid;
     }
   }
 
   logger(MSG_DEBUG, "%s: Couldn't find cid %u with lac %u \n", __func__, cell_id,
          lac);
-  free(ocid);
   return cell;
 }
 
-int is_cell_id_in_db(uint32_t cell_id, uint16_t lac) {
-  struct ocid_cell_slim *ocid = malloc(sizeof(struct ocid_cell_slim));
-  int ret = 0;
+int is_cell_id_in_db(uint8_t radio, uint32_t cell_id, uint16_t lac) {
+  struct ocid_cell_slim ocid;
   if (nas_runtime.cellid_data_missing != 1) {
     logger(MSG_ERROR, "%s: Open Cellid data isn't available\n", __func__);
-    free(ocid);
     return -EINVAL;
   }
 
-  *ocid = get_opencellid_cell_info(cell_id, lac);
-  if (nas_runtime.curr_state.network_type == ocid->radio &&
-      cell_id == ocid->cell && ocid->area == lac) {
-    ret = 1;
+  ocid = get_opencellid_cell_info(radio, cell_id, lac);
+  if (radio == ocid.radio && cell_id == ocid.cell && ocid.area == lac) {
+    return 1;
   }
 
-  free(ocid);
-  return ret;
+  return 0;
 }
 
 uint8_t is_cellid_data_missing() {
-  if (nas_is_network_in_service())
-    return nas_runtime.cellid_data_missing;
-  return 2;
+  if (!nas_is_network_in_service() ||
+      atomic_load(&nas_runtime.ocid_reload_pending))
+    return 2;
+  return nas_runtime.cellid_data_missing;
+}
+
+void request_opencellid_reload() {
+  atomic_store(&nas_runtime.ocid_reload_pending, true);
 }
 
 void set_cellid_data_missing_as_requested() {
   nas_runtime.cellid_data_missing = 2;
 }
 
+void unload_opencellid_data() {
+  if (nas_runtime.ocid_db_map != NULL) {
+    munmap(nas_runtime.ocid_db_map, nas_runtime.ocid_db_map_size);
+    nas_runtime.ocid_db_map = NULL;
+    nas_runtime.ocid_db_map_size = 0;
+  }
+  if (nas_runtime.ocid_sorted_index != NULL) {
+    free(nas_runtime.ocid_sorted_index);
+    nas_runtime.ocid_sorted_index = NULL;
+  }
+  nas_runtime.ocid_records = NULL;
+  nas_runtime.open_cellid_num_items = 0;
+}
+
+uint32_t get_ocid_checksum(uint8_t *buf, size_t len) {
+  uint32_t hash = 2166136261U;
+  for (size_t i = 0; i < len; i++) {
+    hash = (hash ^ buf[i]) * 16777619U;
+  }
+  return hash;
+}
+
+/*
+ * Finds the records in the mapped file. Files in the original
+ * format (no header, any order) get a sorted index so lookups
+ * work the same way for both
+ */
+int index_opencellid_data() {
+  struct ocid_db_header *header;
+  char mcc[5] = {0}, mnc[5] = {0};
+  size_t num_items;
+
+  header = (struct ocid_db_header *)nas_runtime.ocid_db_map;
+  if (nas_runtime.ocid_db_map_size >= sizeof(struct ocid_db_header) &&
+      header->magic == OCID_DB_MAGIC) {
+    if (header->version != OCID_DB_VERSION ||
+        header->record_size != sizeof(struct ocid_cell_slim)) {
+      logger(MSG_ERROR, "%s: Unsupported database version %u\n", __func__,
+             header->version);
+      return -EINVAL;
+    }
+    /* A renamed or copied file would check every cell against another
+     * carrier's network */
+    memcpy(mcc, header->mcc, sizeof(header->mcc));
+    memcpy(mnc, header->mnc, sizeof(header->mnc));
+    if (atoi(mcc) != atoi((char *)nas_runtime.curr_state.mcc) ||
+        atoi(mnc) != atoi((char *)nas_runtime.curr_state.mnc)) {
+      logger(MSG_ERROR, "%s: Database is for %s-%s, not for %s-%s\n",
+             __func__, mcc, mnc, (char *)nas_runtime.curr_state.mcc,
+             (char *)nas_runtime.curr_state.mnc);
+      return -EINVAL;
+    }
+    num_items = (nas_runtime.ocid_db_map_size - sizeof(struct ocid_db_header)) /
+                sizeof(struct ocid_cell_slim);
+    if (header->num_records > num_items) {
+      logger(MSG_ERROR, "%s: Database is truncated\n", __func__);
+      return -EINVAL;
+    }
+    nas_runtime.ocid_records =
+        (struct ocid_cell_slim *)(nas_runtime.ocid_db_map +
+                                  sizeof(struct ocid_db_header));
+    nas_runtime.open_cellid_num_items = header->num_records;
+    if (get_ocid_checksum((uint8_t *)nas_runtime.ocid_records,
+                          header->num_records *
+                              sizeof(struct ocid_cell_slim)) !=
+        header->checksum) {
+      logger(MSG_ERROR, "%s: Database is corrupted\n", __func__);
+      return -EINVAL;
+    }
+    if (header->flags & OCID_DB_FLAG_SORTED) {
+      return 0;
+    }
+  } else {
+    logger(MSG_WARN, "%s: Database has no header, please regenerate it\n",
+           __func__);
+    nas_runtime.ocid_records = (struct ocid_cell_slim *)nas_runtime.ocid_db_map;
+    nas_runtime.open_cellid_num_items =
+        nas_runtime.ocid_db_map_size / sizeof(struct ocid_cell_slim);
+  }
+
+  nas_runtime.ocid_sorted_index =
+      malloc(nas_runtime.open_cellid_num_items * sizeof(uint32_t));
+  if (nas_runtime.ocid_sorted_index == NULL) {
+    logger(MSG_ERROR, "%s: Can't allocate the database index\n", __func__);
+    return -ENOMEM;
+  }
+  for (uint32_t i = 0; i < nas_runtime.open_cellid_num_items; i++) {
+    nas_runtime.ocid_sorted_index[i] = i;
+  }
+  qsort(nas_runtime.ocid_sorted_index, nas_runtime.open_cellid_num_items,
+        sizeof(uint32_t), compare_ocid_index_entries);
+  return 0;
+}
+
 void get_opencellid_data() {
   uint8_t reply[MAX_MESSAGE_SIZE] = {0};
   size_t strsz = 0;
   char filename[256];
-  size_t filesize = 0;
+  struct stat st;
+  int fd;
   snprintf(filename, 255, "/tmp/%s-%s.bin", (char *)nas_runtime.curr_state.mcc,
            (char *)nas_runtime.curr_state.mnc);
 
-  if (nas_runtime.curr_ocid_db_fp != NULL) {
+  if (nas_runtime.ocid_db_map != NULL) {
     logger(MSG_WARN, "%s: It seems we changed carriers!\n", __func__);
-    fclose(nas_runtime.curr_ocid_db_fp);
-    nas_runtime.curr_ocid_db_fp = NULL;
-    nas_runtime.open_cellid_num_items = 0;
+    unload_opencellid_data();
   }
 
-  nas_runtime.curr_ocid_db_fp = fopen(filename, "r");
-  if (nas_runtime.curr_ocid_db_fp == NULL) {
+  fd = open(filename, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
     logger(
         MSG_WARN,
         "%s: Can't find OpenCellid database for the current carrier: %s-%s\n",
@@ -157,11 +304,27 @@ void get_opencellid_data() {
     return;
   }
 
-  /* I probably should add a header to each file in ocid_conv */
-  fseek(nas_runtime.curr_ocid_db_fp, 0L, SEEK_END);
-  filesize = ftell(nas_runtime.curr_ocid_db_fp);
-  fseek(nas_runtime.curr_ocid_db_fp, 0L, SEEK_SET);
-  nas_runtime.open_cellid_num_items = filesize / sizeof(struct ocid_cell_slim);
+  if (fstat(fd, &st) < 0 || st.st_size < sizeof(struct ocid_cell_slim)) {
+    logger(MSG_ERROR, "%s: OpenCellid database is empty\n", __func__);
+    close(fd);
+    return;
+  }
+
+  nas_runtime.ocid_db_map =
+      mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (nas_runtime.ocid_db_map == MAP_FAILED) {
+    logger(MSG_ERROR, "%s: Can't map the OpenCellid database\n", __func__);
+    nas_runtime.ocid_db_map = NULL;
+    return;
+  }
+  nas_runtime.ocid_db_map_size = st.st_size;
+
+  if (index_opencellid_data() < 0) {
+    unload_opencellid_data();
+    return;
+  }
+
   memcpy(nas_runtime.open_cellid_mcc, nas_runtime.curr_state.mcc, 4);
   memcpy(nas_runtime.open_cellid_mnc, nas_runtime.curr_state.mnc, 3);
   nas_runtime.cellid_data_missing = 1;
@@ -170,7 +333,8 @@ void get_opencellid_data() {
       (char *)reply, MAX_MESSAGE_SIZE, "OpenCellid database for %s-%s loaded",
       (char *)nas_runtime.curr_state.mcc, (char *)nas_runtime.curr_state.mnc);
   add_message_to_queue(reply, strsz);
-  logger(MSG_INFO, "%s: End\n", __func__);
+  logger(MSG_INFO, "%s: %u cells loaded\n", __func__,
+         nas_runtime.open_cellid_num_items);
 }
 
 /*
@@ -195,15 +359,15 @@ void fallback_notify() {
 }
 
 void emergency_baseband_pwoerdown(uint32_t cell_id, uint16_t lac,
-                                  int opencellid_res) {
+                                  int opencellid_res, int16_t score) {
   uint8_t reply[MAX_MESSAGE_SIZE] = {0};
 
   size_t strsz = snprintf(
       (char *)reply, MAX_MESSAGE_SIZE,
-      "Emergency: I connected to an unknown Cell ID and will lock myself up\n"
+      "Emergency: Suspicious cell (score %i), I will lock myself up\n"
       "Reboot me to use me again\n"
       "Cell ID: %.8x\nLAC: %.4x\n",
-      cell_id, lac);
+      score, cell_id, lac);
   if (opencellid_res == 1) {
     strsz += snprintf((char *)reply + strsz, MAX_MESSAGE_SIZE - strsz,
                       "OpenCellid DB check: Found in db");
@@ -215,6 +379,7 @@ void emergency_baseband_pwoerdown(uint32_t cell_id, uint16_t lac,
                       "OpenCellid DB check: Database not loaded!");
   }
   add_message_to_queue(reply, strsz);
+  flush_report_data(true);
   // Disable until we get to production with this
     sleep(10);
     if (write_to(ADSP_BOOT_HANDLER, "0", O_WRONLY) < 0) {
@@ -222,7 +387,20 @@ void emergency_baseband_pwoerdown(uint32_t cell_id, uint16_t lac,
     }
 }
 
-void notify_cellid_change(uint32_t cell_id, uint16_t lac) {
+void notify_cell_anomaly(uint32_t cell_id, uint16_t lac,
+                         struct anomaly_result *result) {
+  uint8_t reply[MAX_MESSAGE_SIZE] = {0};
+  size_t strsz = snprintf((char *)reply, MAX_MESSAGE_SIZE,
+                          "Signal Tracking warning!\n"
+                          "Cell ID: %.8x\nLAC: %.4x\n"
+                          "Anomaly score: %i\n",
+                          cell_id, lac, result->score);
+  strsz += format_anomaly_reasons((char *)reply + strsz,
+                                  MAX_MESSAGE_SIZE - strsz, result->reasons);
+  add_message_to_queue(reply, strsz);
+}
+
+void notify_cellid_change(uint8_t radio, uint32_t cell_id, uint16_t lac) {
   uint8_t reply[MAX_MESSAGE_SIZE] = {0};
   size_t strsz = snprintf((char *)reply, MAX_MESSAGE_SIZE,
                           "Network status changed:\n"
@@ -230,7 +408,8 @@ void notify_cellid_change(uint32_t cell_id, uint16_t lac) {
                           "Cell ID: %.8x\nLAC: %.4x\n",
                           cell_id, lac);
   if (get_signal_tracking_mode() > 1) {
-    struct ocid_cell_slim cell = get_opencellid_cell_info(cell_id, lac);
+    struct ocid_cell_slim cell =
+        get_opencellid_cell_info(radio, cell_id, lac);
     if (cell.cell != 0 && cell.area != 0) {
       strsz += snprintf((char *)reply + strsz, MAX_MESSAGE_SIZE - strsz,
                         "OpenCellid Verified:"
@@ -247,27 +426,161 @@ void notify_cellid_change(uint32_t cell_id, uint16_t lac) {
 
 /*
   Save & retrieve previous reports
+   Every change marks its report as dirty. Dirty reports are
+   appended to the journal in batches (see flush_report_data()),
+   and the journal is folded into the full dump when it gets too
+   big. At boot we load the dump and replay the journal on top.
 */
-int store_report_data() {
+void mark_report_dirty(uint16_t slot) {
+  if (nas_runtime.dirty_reports[slot / 8] & (1 << (slot % 8))) {
+    return;
+  }
+  if (nas_runtime.num_dirty_reports == 0) {
+    nas_runtime.first_dirty_at = get_monotonic_time_ms();
+  }
+  nas_runtime.dirty_reports[slot / 8] |= (1 << (slot % 8));
+  nas_runtime.num_dirty_reports++;
+}
+
+uint32_t get_report_checksum(struct network_status_reports *data) {
+  uint8_t *bytes = (uint8_t *)data;
+  uint32_t hash = 2166136261U;
+  for (size_t i = 0; i < sizeof(struct network_status_reports); i++) {
+    hash = (hash ^ bytes[i]) * 16777619U;
+  }
+  return hash;
+}
+
+/* Full dump, oldest first so the ring order survives a reload */
+int write_report_snapshot() {
   FILE *fp;
   int ret;
-  logger(MSG_DEBUG, "%s: Start\n", __func__);
+  fp = fopen(INTERNAL_CELLID_INFO_TMP_PATH, "w");
+  if (fp == NULL) {
+    logger(MSG_ERROR, "%s: Can't open report file for writing\n", __func__);
+    return -EIO;
+  }
+  ret = fwrite(&nas_runtime.data[nas_runtime.oldest_report],
+               sizeof(struct network_status_reports),
+               MAX_REPORT_NUM - nas_runtime.oldest_report, fp);
+  ret += fwrite(nas_runtime.data, sizeof(struct network_status_reports),
+                nas_runtime.oldest_report, fp);
+  if (ret != MAX_REPORT_NUM || fflush(fp) != 0 || fsync(fileno(fp)) < 0) {
+    logger(MSG_ERROR, "%s: Error writing the reports\n", __func__);
+    fclose(fp);
+    unlink(INTERNAL_CELLID_INFO_TMP_PATH);
+    return -EIO;
+  }
+  fclose(fp);
+  /* Replace it in one go, we don't want half a dump if we die here */
+  if (rename(INTERNAL_CELLID_INFO_TMP_PATH, INTERNAL_CELLID_INFO_PATH) < 0) {
+    logger(MSG_ERROR, "%s: Can't replace the report file\n", __func__);
+    return -EIO;
+  }
+  /* Everything is in the dump now */
+  if (truncate(INTERNAL_CELLID_JOURNAL_PATH, 0) < 0 && errno != ENOENT) {
+    logger(MSG_WARN, "%s: Can't truncate the journal\n", __func__);
+  }
+  nas_runtime.journal_entries = 0;
+  storage_account_write(STORAGE_CONSUMER_CELL_HISTORY,
+                        ret * sizeof(struct network_status_reports));
+  logger(MSG_DEBUG, "%s: Stored %i reports\n", __func__, ret);
+  return 0;
+}
+
+/* Appends every dirty report to the journal, in ring order */
+int write_report_journal() {
+  struct report_journal_entry *entries;
+  uint16_t slot, count = 0;
+  ssize_t len;
+  int fd;
+
+  entries = calloc(nas_runtime.num_dirty_reports,
+                   sizeof(struct report_journal_entry));
+  if (entries == NULL) {
+    return -ENOMEM;
+  }
+  for (uint16_t i = 0; i < nas_runtime.num_reports &&
+                       count < nas_runtime.num_dirty_reports;
+       i++) {
+    slot = (nas_runtime.oldest_report + i) % MAX_REPORT_NUM;
+    if (nas_runtime.dirty_reports[slot / 8] & (1 << (slot % 8))) {
+      entries[count].magic = REPORT_JOURNAL_MAGIC;
+      entries[count].data = nas_runtime.data[slot];
+      entries[count].checksum = get_report_checksum(&entries[count].data);
+      count++;
+    }
+  }
+
+  fd = open(INTERNAL_CELLID_JOURNAL_PATH,
+            O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    logger(MSG_ERROR, "%s: Can't open the journal\n", __func__);
+    free(entries);
+    return -EIO;
+  }
+  len = count * sizeof(struct report_journal_entry);
+  if (write(fd, entries, len) != len || fsync(fd) < 0) {
+    logger(MSG_ERROR, "%s: Error writing to the journal\n", __func__);
+    close(fd);
+    free(entries);
+    return -EIO;
+  }
+  close(fd);
+  free(entries);
+  nas_runtime.journal_entries += count;
+  storage_account_write(STORAGE_CONSUMER_CELL_HISTORY, len);
+  logger(MSG_DEBUG, "%s: %u reports appended\n", __func__, count);
+  return 0;
+}
+
+/* Called from the storage monitor thread */
+void cell_history_storage_level_changed(uint8_t storage_id, uint8_t level,
+                                        int32_t free_mb) {
+  atomic_store(&nas_runtime.storage_full, level >= STORAGE_LEVEL_FULL);
+}
+
+/*
+ * Writes pending changes if there are enough of them, if the
+ * oldest one has waited long enough, or if we're asked to.
+ * With /persist full we keep them in memory until there's room
+ * again, unless forced
+ */
+int flush_report_data(bool force) {
+  int ret;
+  if (nas_runtime.num_dirty_reports == 0) {
+    return 0;
+  }
+  if (!force && atomic_load(&nas_runtime.storage_full)) {
+    return 0;
+  }
+  if (!force &&
+      nas_runtime.num_dirty_reports < REPORT_JOURNAL_MAX_DIRTY &&
+      get_monotonic_time_ms() - nas_runtime.first_dirty_at <
+          REPORT_JOURNAL_FLUSH_INTERVAL_MS) {
+    return 0;
+  }
+
   if (set_persistent_partition_rw() < 0) {
     logger(MSG_ERROR, "%s: Can't set persist partition in RW mode\n", __func__);
     return -1;
   }
-  logger(MSG_DEBUG, "%s: Open file\n", __func__);
-  fp = fopen(INTERNAL_CELLID_INFO_PATH, "w");
-  if (fp == NULL) {
-    logger(MSG_ERROR, "%s: Can't open config file for writing\n", __func__);
-    return -1;
+  /*
+   * If the journal went away under us, whatever it held is only in
+   * memory now: appending to a new one would lose it on reload
+   */
+  if (nas_runtime.journal_entries + nas_runtime.num_dirty_reports >
+          REPORT_JOURNAL_MAX_ENTRIES ||
+      (nas_runtime.journal_entries > 0 &&
+       access(INTERNAL_CELLID_JOURNAL_PATH, F_OK) < 0)) {
+    ret = write_report_snapshot();
+  } else {
+    ret = write_report_journal();
+  }
+  if (ret == 0) {
+    memset(nas_runtime.dirty_reports, 0, sizeof(nas_runtime.dirty_reports));
+    nas_runtime.num_dirty_reports = 0;
   }
-  logger(MSG_DEBUG, "%s: Store\n", __func__);
-  ret = fwrite(nas_runtime.data, sizeof(struct network_status_reports),
-               MAX_REPORT_NUM, fp);
-  logger(MSG_DEBUG, "%s: Close (%i bytes written)\n", __func__, ret);
-  fclose(fp);
-  do_sync_fs();
   if (!use_persistent_logging()) {
     if (set_persistent_partition_ro() < 0) {
       logger(MSG_ERROR, "%s: Can't set persist partition in RO mode\n",
@@ -275,17 +588,98 @@ int store_report_data() {
       return -1;
     }
   }
-  return 0;
+  return ret;
+}
+
+/* Updates the report if we have it already, or adds it */
+/*
+ * GSM cells used to be stored without a radio type, they're the only
+ * ones that could end up with 0
+ */
+void fix_legacy_report_radio(struct network_status_reports *data) {
+  if (data->report.type_of_service == 0) {
+    data->report.type_of_service = OCID_RADIO_GSM;
+  }
+}
+
+void restore_report(struct network_status_reports *data) {
+  int slot;
+  fix_legacy_report_radio(data);
+  slot = find_report(data->report.mcc, data->report.mnc,
+                     data->report.type_of_service, data->report.cell_id,
+                     data->report.lac);
+  if (slot < 0) {
+    slot = allocate_report_slot();
+    nas_runtime.data[slot] = *data;
+    index_report(slot);
+  } else {
+    nas_runtime.data[slot] = *data;
+  }
+  nas_runtime.current_report = slot;
+}
+
+int replay_report_journal() {
+  struct report_journal_entry entry;
+  uint32_t count = 0;
+  FILE *fp;
+  fp = fopen(INTERNAL_CELLID_JOURNAL_PATH, "r");
+  if (fp == NULL) {
+    /* Nothing changed since the last dump, or it was cleaned up */
+    logger(MSG_DEBUG, "%s: No journal to replay\n", __func__);
+    nas_runtime.journal_entries = 0;
+    return 0;
+  }
+  while (fread(&entry, sizeof(struct report_journal_entry), 1, fp) == 1) {
+    /* A torn write at the end, the rest never made it */
+    if (entry.magic != REPORT_JOURNAL_MAGIC ||
+        entry.checksum != get_report_checksum(&entry.data)) {
+      logger(MSG_WARN, "%s: Journal is damaged after %u entries\n", __func__,
+             count);
+      break;
+    }
+    if (entry.data.in_use) {
+      restore_report(&entry.data);
+    }
+    count++;
+  }
+  fclose(fp);
+  nas_runtime.journal_entries = count;
+  return count;
 }
 
 int load_report_data() {
   FILE *fp;
-  int ret;
+  int ret = 0;
   struct network_status_reports reports[MAX_REPORT_NUM];
   logger(MSG_DEBUG, "%s: Start, open file\n", __func__);
+  memset(nas_runtime.data, 0, sizeof(nas_runtime.data));
+  memset(nas_runtime.report_index, 0, sizeof(nas_runtime.report_index));
+  nas_runtime.oldest_report = 0;
+  nas_runtime.num_reports = 0;
   fp = fopen(INTERNAL_CELLID_INFO_PATH, "r");
-  if (fp == NULL) {
-    logger(MSG_DEBUG, "%s: Can't open config file for reading\n", __func__);
+  if (fp != NULL) {
+    ret = fread(reports, sizeof(struct network_status_reports), MAX_REPORT_NUM,
+                fp);
+    fclose(fp);
+  }
+  if (ret > 0) {
+    logger(MSG_DEBUG, "%s: Loading previous reports...\n ", __func__);
+    for (int i = 0; i < ret; i++) {
+      if (reports[i].in_use) {
+        fix_legacy_report_radio(&reports[i]);
+        nas_runtime.data[nas_runtime.num_reports] = reports[i];
+        index_report(nas_runtime.num_reports);
+        nas_runtime.current_report = nas_runtime.num_reports;
+        nas_runtime.num_reports++;
+      }
+    }
+  }
+  ret = replay_report_journal();
+  logger(MSG_INFO, "%s finished, %i reports in memory (%i from the journal)\n",
+         __func__, nas_runtime.num_reports, ret);
+
+  if (nas_runtime.num_reports == 0) {
+    logger(MSG_DEBUG, "%s: There are no stored reports\n", __func__);
     if (get_signal_tracking_mode() == 1 || get_signal_tracking_mode() == 3) {
       logger(MSG_ERROR,
              "%s: Error: There's no cell id data to use, mode falling back to "
@@ -300,20 +694,6 @@ int load_report_data() {
     }
     return -1;
   }
-  ret =
-      fread(reports, sizeof(struct network_status_reports), MAX_REPORT_NUM, fp);
-  if (ret >= sizeof(struct network_status_reports)) {
-    logger(MSG_DEBUG, "%s: Loading previous reports...\n ", __func__);
-    for (int i = 0; i < MAX_REPORT_NUM; i++) {
-      if (reports[i].in_use) {
-        nas_runtime.data[i] = reports[i];
-        nas_runtime.current_report++;
-      }
-    }
-  }
-  logger(MSG_INFO, "%s finished, %i reports in memory\n", __func__,
-         nas_runtime.current_report);
-  fclose(fp);
   return 0;
 }
 
@@ -702,21 +1082,103 @@ void parse_serving_system_message(uint8_t *buf, size_t buf_len) {
  *    WIP Location? In reports from OCID. Investigate PDSv2 later on
  */
 
+/*
+ * Report index
+ *  Open addressing with linear probing. Removing an entry shifts
+ *  back the ones after it that would become unreachable, so we
+ *  never need tombstones and lookups stay short
+ */
+uint32_t hash_report_key(uint16_t mcc, uint16_t mnc, uint8_t type_of_service,
+                         uint32_t cell_id, uint16_t lac) {
+  uint64_t key = ((uint64_t)cell_id << 32) | ((uint32_t)lac << 16) |
+                 ((uint32_t)type_of_service << 8);
+  key ^= ((uint64_t)mcc << 48) ^ ((uint64_t)mnc << 36);
+  key *= 0x9e3779b97f4a7c15ULL;
+  return (uint32_t)(key >> 32) & (REPORT_HASH_SIZE - 1);
+}
+
+uint32_t hash_report(uint16_t slot) {
+  struct nas_report *report = &nas_runtime.data[slot].report;
+  return hash_report_key(report->mcc, report->mnc, report->type_of_service,
+                         report->cell_id, report->lac);
+}
+
+void index_report(uint16_t slot) {
+  uint32_t pos = hash_report(slot);
+  while (nas_runtime.report_index[pos] != REPORT_HASH_EMPTY) {
+    pos = (pos + 1) & (REPORT_HASH_SIZE - 1);
+  }
+  nas_runtime.report_index[pos] = slot + 1;
+}
+
+void unindex_report(uint16_t slot) {
+  uint32_t pos = hash_report(slot);
+  uint32_t next, home;
+  while (nas_runtime.report_index[pos] != slot + 1) {
+    if (nas_runtime.report_index[pos] == REPORT_HASH_EMPTY) {
+      return;
+    }
+    pos = (pos + 1) & (REPORT_HASH_SIZE - 1);
+  }
+
+  next = pos;
+  while (1) {
+    next = (next + 1) & (REPORT_HASH_SIZE - 1);
+    if (nas_runtime.report_index[next] == REPORT_HASH_EMPTY) {
+      break;
+    }
+    home = hash_report(nas_runtime.report_index[next] - 1);
+    /* Leave it if its home bucket is between the hole and itself */
+    if ((pos <= next) ? (pos < home && home <= next)
+                      : (pos < home || home <= next)) {
+      continue;
+    }
+    nas_runtime.report_index[pos] = nas_runtime.report_index[next];
+    pos = next;
+  }
+  nas_runtime.report_index[pos] = REPORT_HASH_EMPTY;
+}
+
+int find_report(uint16_t mcc, uint16_t mnc, uint8_t type_of_service,
+                uint32_t cell_id, uint16_t lac) {
+  struct nas_report *report;
+  uint32_t pos = hash_report_key(mcc, mnc, type_of_service, cell_id, lac);
+  while (nas_runtime.report_index[pos] != REPORT_HASH_EMPTY) {
+    report = &nas_runtime.data[nas_runtime.report_index[pos] - 1].report;
+    if (report->mcc == mcc && report->mnc == mnc &&
+        report->type_of_service == type_of_service &&
+        report->cell_id == cell_id && report->lac == lac) {
+      return nas_runtime.report_index[pos] - 1;
+    }
+    pos = (pos + 1) & (REPORT_HASH_SIZE - 1);
+  }
+  return -1;
+}
+
+/* Next free slot in the ring, dropping the oldest report if it's full */
+uint16_t allocate_report_slot() {
+  uint16_t slot;
+  if (nas_runtime.num_reports >= MAX_REPORT_NUM) {
+    logger(MSG_INFO, "%s: Rotating log...\n", __func__);
+    slot = nas_runtime.oldest_report;
+    unindex_report(slot);
+    nas_runtime.oldest_report = (nas_runtime.oldest_report + 1) % MAX_REPORT_NUM;
+  } else {
+    slot = (nas_runtime.oldest_report + nas_runtime.num_reports) % MAX_REPORT_NUM;
+    nas_runtime.num_reports++;
+  }
+  memset(&nas_runtime.data[slot], 0, sizeof(struct network_status_reports));
+  reset_cell_anomaly_stats(slot);
+  return slot;
+}
+
 int add_report(uint16_t mcc, uint16_t mnc, uint8_t type_of_service,
                uint16_t lac, uint16_t phy_cell_id, uint32_t cell_id,
                uint8_t bsic, uint16_t bcch, uint16_t psc, uint16_t arfcn,
                int16_t srx_lev, uint16_t rx_lev) {
-  int report_id = 0;
-  if (nas_runtime.current_report >= (MAX_REPORT_NUM - 1)) {
-    logger(MSG_INFO, "%s: Rotating log...\n", __func__);
-    for (int k = 1; k < MAX_REPORT_NUM; k++) {
-      nas_runtime.data[k - 1] = nas_runtime.data[k];
-    }
-  } else {
-    nas_runtime.current_report++;
-  }
-  logger(MSG_INFO, "%s: Report ID %i\n", __func__, nas_runtime.current_report);
-  report_id = nas_runtime.current_report;
+  int report_id = allocate_report_slot();
+  logger(MSG_INFO, "%s: Report ID %i\n", __func__, report_id);
+  nas_runtime.current_report = report_id;
   nas_runtime.data[report_id].in_use = 1;
   nas_runtime.data[report_id].report.found_in_network = 1;
   nas_runtime.data[report_id].report.mcc = mcc;
@@ -734,26 +1196,21 @@ int add_report(uint16_t mcc, uint16_t mnc, uint8_t type_of_service,
   nas_runtime.data[report_id].report.rx_level_min = rx_lev;
   nas_runtime.data[report_id].report.rx_level_max = rx_lev;
   nas_runtime.data[report_id].report.opencellid_verified = 0;
+  index_report(report_id);
+  mark_report_dirty(report_id);
 
   return report_id;
 }
 int is_in_report(uint16_t mcc, uint16_t mnc, uint8_t type_of_service,
                  uint32_t cell_id, uint16_t lac) {
-  int report_id = -1;
+  int report_id;
   uint8_t opencellid_verified =  0;
-  for (int i = 0; i < nas_runtime.current_report; i++) {
-    if (nas_runtime.data[i].report.mcc == mcc &&
-        nas_runtime.data[i].report.mnc == mnc &&
-        nas_runtime.data[i].report.type_of_service == type_of_service &&
-        nas_runtime.data[i].report.cell_id == cell_id &&
-        nas_runtime.data[i].report.lac == lac) {
-      nas_runtime.data[i].in_use = 1;
-      nas_runtime.data[i].report.found_in_network = 1;
-      opencellid_verified = nas_runtime.data[i].report.opencellid_verified;
-
-      report_id = i;
-      store_report_data();
-    }
+  report_id = find_report(mcc, mnc, type_of_service, cell_id, lac);
+  if (report_id >= 0) {
+    nas_runtime.data[report_id].in_use = 1;
+    nas_runtime.data[report_id].report.found_in_network = 1;
+    opencellid_verified = nas_runtime.data[report_id].report.opencellid_verified;
+    nas_runtime.current_report = report_id;
   }
 
   dump_to_file("cell_history",
@@ -765,15 +1222,28 @@ int is_in_report(uint16_t mcc, uint16_t mnc, uint8_t type_of_service,
   return report_id;
 }
 
+/*
+ * Decide what to do with the serving cell
+ *  Every measurement report gets an anomaly score (see cell_anomaly.h)
+ *  instead of a yes/no on whether we knew the cell. Learning modes
+ *  store every new cell and only warn about suspicious ones; strict
+ *  modes never learn unverified cells, and power down the baseband
+ *  once the score reaches ANOMALY_CRITICAL_SCORE. Cells a strict mode
+ *  can't trust (unknown, and in mode 3 not verified by OpenCellid or
+ *  with no database to check) always score at least that much
+ */
 void process_current_network_data(uint16_t mcc, uint16_t mnc,
                                   uint8_t type_of_service, uint16_t lac,
                                   uint16_t phy_cell_id, uint32_t cell_id,
                                   uint8_t bsic, uint16_t bcch, uint16_t psc,
                                   uint16_t arfcn, int16_t srx_lev,
-                                  uint16_t rx_lev) {
+                                  uint16_t rx_lev,
+                                  struct cell_observation *obs) {
   uint8_t cell_is_known = 0;
+  uint8_t tracking_mode = get_signal_tracking_mode();
   int report_id = -1;
   int opencellid_res = -1;
+  struct anomaly_result anomaly;
 
   if (lac == 0 || cell_id == 0) {
     logger(MSG_WARN, "%s: Not enough data to process\n", __func__);
@@ -794,10 +1264,20 @@ void process_current_network_data(uint16_t mcc, uint16_t mnc,
     nas_runtime.data[report_id].report.bcch = bcch;
     nas_runtime.data[report_id].report.psc = psc;
     nas_runtime.data[report_id].report.arfcn = arfcn;
-    store_report_data();
+    mark_report_dirty(report_id);
+  }
+
+  if (tracking_mode > 1) {
+    opencellid_res = is_cell_id_in_db(type_of_service, cell_id, lac);
+  }
+  anomaly = evaluate_cell_anomaly(report_id, obs, opencellid_res);
+  if (!cell_is_known &&
+      (tracking_mode == 1 || (tracking_mode == 3 && opencellid_res != 1)) &&
+      anomaly.score < ANOMALY_CRITICAL_SCORE) {
+    anomaly.score = ANOMALY_CRITICAL_SCORE;
   }
 
-  switch (get_signal_tracking_mode()) {
+  switch (tracking_mode) {
   case 0:
     logger(MSG_DEBUG, "%s: Learning mode: standalone\n", __func__);
     if (!cell_is_known) {
@@ -807,14 +1287,13 @@ void process_current_network_data(uint16_t mcc, uint16_t mnc,
     break;
   case 1:
     logger(MSG_DEBUG, "%s: Strict mode: standalone\n", __func__);
-    if (!cell_is_known) {
-      emergency_baseband_pwoerdown(cell_id, lac, opencellid_res);
+    if (anomaly.score >= ANOMALY_CRITICAL_SCORE) {
+      emergency_baseband_pwoerdown(cell_id, lac, opencellid_res,
+                                   anomaly.score);
     }
     break;
   case 2:
     logger(MSG_DEBUG, "%s: Learning mode: OpenCellid + standalone\n", __func__);
-    opencellid_res = is_cell_id_in_db(cell_id, lac);
-
     if (!cell_is_known) {
       report_id = add_report(mcc, mnc, type_of_service, lac, phy_cell_id,
                              cell_id, bsic, bcch, psc, arfcn, srx_lev, rx_lev);
@@ -825,18 +1304,13 @@ void process_current_network_data(uint16_t mcc, uint16_t mnc,
     break;
   case 3:
     logger(MSG_DEBUG, "%s: Strict mode: OpenCellid + standalone\n", __func__);
-    opencellid_res = is_cell_id_in_db(cell_id, lac);
-    if (opencellid_res == 1 && !cell_is_known) {
+    if (anomaly.score >= ANOMALY_CRITICAL_SCORE) {
+      emergency_baseband_pwoerdown(cell_id, lac, opencellid_res,
+                                   anomaly.score);
+    } else if (opencellid_res == 1 && !cell_is_known) {
       report_id = add_report(mcc, mnc, type_of_service, lac, phy_cell_id,
                              cell_id, bsic, bcch, psc, arfcn, srx_lev, rx_lev);
       nas_runtime.data[report_id].report.opencellid_verified = 1;
-    } else if (!cell_is_known) {
-      emergency_baseband_pwoerdown(cell_id, lac, opencellid_res);
-    } else {
-      logger(
-          MSG_WARN,
-          "%s: Don't know what to do! Cell is known: %u | opencellid_res: %i\n",
-          __func__, cell_is_known, opencellid_res);
     }
     break;
 
@@ -847,14 +1321,21 @@ void process_current_network_data(uint16_t mcc, uint16_t mnc,
     break;
   }
 
+  update_cell_anomaly_stats(report_id, obs);
+  if (should_notify_cell_anomaly(cell_id, lac, &anomaly)) {
+    notify_cell_anomaly(cell_id, lac, &anomaly);
+  }
+
   if (cell_id != nas_runtime.current_cell_id ||
       lac != nas_runtime.current_lac) {
     if (get_signal_tracking_cell_change_notification_mode() == 2 ||
         (get_signal_tracking_cell_change_notification_mode() == 1 && !cell_is_known))
-          notify_cellid_change(cell_id, lac);
+          notify_cellid_change(type_of_service, cell_id, lac);
     nas_runtime.current_cell_id = cell_id;
     nas_runtime.current_lac = lac;
   }
+
+  flush_report_data(false);
 }
 
 void update_cell_location_information(uint8_t *buf, size_t buf_len) {
@@ -863,6 +1344,8 @@ void update_cell_location_information(uint8_t *buf, size_t buf_len) {
   uint8_t type_of_service = 0, bsic = 0;
   uint32_t cell_id = 0;
   uint8_t reported_plmn[3] = { 0 };
+  struct cell_observation observation = {0};
+  struct qmi_tlv_index local_index, *index;
   mcc = atoi((char *)nas_runtime.curr_state.mcc);
   mnc = atoi((char *)nas_runtime.curr_state.mnc);
   if (!is_signal_tracking_enabled()) {
@@ -877,7 +1360,10 @@ void update_cell_location_information(uint8_t *buf, size_t buf_len) {
   }
 
   if (is_signal_tracking_enabled() && get_signal_tracking_mode() > 1 && mcc != 0 && mnc != 0) {
-    if (memcmp(nas_runtime.curr_state.mcc, nas_runtime.open_cellid_mcc, 4) !=
+    bool reload_requested =
+        atomic_exchange(&nas_runtime.ocid_reload_pending, false);
+    if (reload_requested ||
+        memcmp(nas_runtime.curr_state.mcc, nas_runtime.open_cellid_mcc, 4) !=
             0 ||
         memcmp(nas_runtime.curr_state.mnc, nas_runtime.open_cellid_mnc, 3) !=
             0) {
@@ -918,10 +1404,12 @@ void update_cell_location_information(uint8_t *buf, size_t buf_len) {
       NAS_CELL_LAC_INFO_LTE_INFO_RRC_STATE,
   };
 
+  /* Big message, walk it once and look everything up from there */
+  index = get_tlv_index(buf, buf_len, &local_index);
   logger(MSG_DEBUG, "%s: Found %u information segments in this message\n",
-         __func__, count_tlvs_in_message(buf, buf_len));
+         __func__, index->num_tlvs);
   for (uint8_t i = 0; i < 27; i++) {
-    int offset = get_tlv_offset_by_id(buf, buf_len, available_tlvs[i]);
+    int offset = get_tlv_offset_from_index(index, available_tlvs[i]);
     if (offset > 0) {
       logger(MSG_DEBUG, "%s: TLV %.2x found at offset %.2x\n", __func__,
              available_tlvs[i], offset);
@@ -961,6 +1449,9 @@ void update_cell_location_information(uint8_t *buf, size_t buf_len) {
                  cell_info->monitored_cells[j].psc,
                  cell_info->monitored_cells[j].rscp,
                  cell_info->monitored_cells[j].ecio);
+          cell_observation_add_neighbour(
+              &observation, cell_info->monitored_cells[j].uarfcn << 16 |
+                                cell_info->monitored_cells[j].psc);
         }
       } break;
       case NAS_CELL_LAC_INFO_LTE_INTRA_INFO: {
@@ -1008,7 +1499,9 @@ void update_cell_location_information(uint8_t *buf, size_t buf_len) {
                  cell_info->lte_cell_info[j].rsrp,
                  cell_info->lte_cell_info[j].srx_level,
                  cell_info->lte_cell_info[j].rssi_level);
-          // add neighbours too?
+          cell_observation_add_neighbour(
+              &observation,
+              cell_info->earfcn << 16 | cell_info->lte_cell_info[j].phy_cell_id);
         }
       } break;
       case NAS_CELL_LAC_INFO_LTE_INTER_INFO:
@@ -1057,6 +1550,11 @@ void update_cell_location_information(uint8_t *buf, size_t buf_len) {
                    cell_info->lte_inter_freq_instance[j]
                        .lte_cell_info[k]
                        .rssi_level);
+            cell_observation_add_neighbour(
+                &observation, cell_info->lte_inter_freq_instance[j].earfcn << 16 |
+                                  cell_info->lte_inter_freq_instance[j]
+                                      .lte_cell_info[k]
+                                      .phy_cell_id);
           }
         }
       } break;
@@ -1110,6 +1608,13 @@ void update_cell_location_information(uint8_t *buf, size_t buf_len) {
                     .srxlev
 
             );
+            cell_observation_add_neighbour(
+                &observation,
+                cell_info->lte_gsm_neighbours[j].lte_gsm_cell_neighbour[k].arfcn
+                        << 8 |
+                    cell_info->lte_gsm_neighbours[j]
+                        .lte_gsm_cell_neighbour[k]
+                        .bsic);
           }
         }
 
@@ -1200,7 +1705,10 @@ void update_cell_location_information(uint8_t *buf, size_t buf_len) {
                "\t Timing Advance: %.4x\n"
                "\t Channel Freq.: %.4x\n",
                __func__, cell_info->timing_advance, cell_info->bcch);
+        type_of_service = OCID_RADIO_GSM;
         bcch = cell_info->bcch;
+        cell_observation_set_timing_advance(&observation,
+                                            cell_info->timing_advance);
       } break;
       case NAS_CELL_LAC_INFO_WCDMA_CELL_INFO_EXTENDED: {
         struct nas_lac_extended_wcdma_cell_info *cell_info =
@@ -1221,6 +1729,8 @@ void update_cell_location_information(uint8_t *buf, size_t buf_len) {
                "%s: NAS_CELL_LAC_INFO_LTE_INFO_TIMING_ADV\n"
                "\t Timing advance: %i\n",
                __func__, cell_info->timing_advance);
+        cell_observation_set_timing_advance(&observation,
+                                            cell_info->timing_advance);
       } break;
       case NAS_CELL_LAC_INFO_EXTENDED_GERAN_INFO: {
         struct nas_lac_extended_geran_info *cell_info =
@@ -1237,9 +1747,12 @@ void update_cell_location_information(uint8_t *buf, size_t buf_len) {
                __func__, cell_info->cell_id, cell_info->lac, cell_info->arfcn,
                cell_info->bsic, cell_info->timing_advance, cell_info->rx_level,
                cell_info->num_instances);
+        type_of_service = OCID_RADIO_GSM;
         rx_lev = cell_info->rx_level;
         bsic = cell_info->bsic;
         cell_id = cell_info->cell_id;
+        cell_observation_set_timing_advance(&observation,
+                                            cell_info->timing_advance);
         lac = cell_info->lac;
         arfcn = cell_info->arfcn;
         memcpy(reported_plmn, cell_info->plmn, 3);
@@ -1257,6 +1770,8 @@ void update_cell_location_information(uint8_t *buf, size_t buf_len) {
                  cell_info->nmr_cell_data[j].arfcn,
                  cell_info->nmr_cell_data[j].bsic,
                  cell_info->nmr_cell_data[j].rx_level);
+          cell_observation_add_neighbour(&observation,
+                                         cell_info->nmr_cell_data[j].cell_id);
         }
       } break;
       case NAS_CELL_LAC_INFO_UMTS_EXTENDED_INFO: {
@@ -1305,6 +1820,10 @@ void update_cell_location_information(uint8_t *buf, size_t buf_len) {
                  cell_info->umts_monitored_cell_extended_info[j].srx_level,
                  cell_info->umts_monitored_cell_extended_info[j].rank,
                  cell_info->umts_monitored_cell_extended_info[j].cell_set);
+          cell_observation_add_neighbour(
+              &observation,
+              cell_info->umts_monitored_cell_extended_info[j].uarfcn << 16 |
+                  cell_info->umts_monitored_cell_extended_info[j].psc);
         }
       } break;
       case NAS_CELL_LAC_INFO_SCELL_GERAN_CONF: {
@@ -1389,15 +1908,18 @@ void update_cell_location_information(uint8_t *buf, size_t buf_len) {
     nas_runtime.curr_state.mnc[0] = (nas_runtime.curr_plmn[2] & 0x0f) + 0x30;
     nas_runtime.curr_state.mnc[1] = ((nas_runtime.curr_plmn[2] & 0xf0) >> 4) + 0x30;
   }
+  observation.type_of_service = type_of_service;
+  observation.signal = srx_lev != 0 ? (int16_t)srx_lev : rx_lev;
   if (mcc != 0 && mnc != 0)
     process_current_network_data(mcc, mnc, type_of_service, lac, phy_cell_id,
                                 cell_id, bsic, bcch, psc, arfcn, srx_lev,
-                                rx_lev);
+                                rx_lev, &observation);
 
 }
 
 void log_cell_location_information(uint8_t *buf, size_t buf_len) {
   uint32_t curr_time = time(NULL);
+  struct qmi_tlv_index local_index, *index;
   if (!is_signal_tracking_enabled()) {
     logger(MSG_DEBUG, "%s: Tracking is disabled\n", __func__);
     return;
@@ -1440,10 +1962,12 @@ void log_cell_location_information(uint8_t *buf, size_t buf_len) {
       NAS_CELL_LAC_INFO_LTE_INFO_RRC_STATE,
   };
 
+  /* Big message, walk it once and look everything up from there */
+  index = get_tlv_index(buf, buf_len, &local_index);
   logger(MSG_DEBUG, "%s: Found %u information segments in this message\n",
-         __func__, count_tlvs_in_message(buf, buf_len));
+         __func__, index->num_tlvs);
   for (uint8_t i = 0; i < 27; i++) {
-    int offset = get_tlv_offset_by_id(buf, buf_len, available_tlvs[i]);
+    int offset = get_tlv_offset_from_index(index, available_tlvs[i]);
     if (offset > 0) {
       logger(MSG_DEBUG, "%s: TLV %.2x found at offset %.2x\n", __func__,
              available_tlvs[i], offset);
@@ -3,6 +3,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -13,19 +14,25 @@
 
 #include "atfwd.h"
 #include "audio.h"
+#include "audio2text.h"
+#include "capture.h"
 #include "command.h"
 #include "config.h"
 #include "devices.h"
 #include "helpers.h"
 #include "ipc.h"
 #include "logger.h"
+#include "metrics.h"
+#include "nas.h"
 #include "openqti.h"
 #include "proxy.h"
 #include "scheduler.h"
 #include "sms.h"
+#include "space_mon.h"
 #include "thermal.h"
 #include "timesync.h"
 #include "tracking.h"
+#include "tts_cache.h"
 #include "wds.h"
 #include "dms.h"
 
@@ -63,16 +70,24 @@ int connected_clients = 0;
 int main(int argc, char **argv) {
   int ret, lockfile;
   int linestate;
-  pthread_t gps_proxy_thread;
+  bool capture = false;
   pthread_t rmnet_proxy_thread;
   pthread_t atfwd_thread;
   pthread_t time_sync_thread;
   pthread_t pwrkey_thread;
   pthread_t scheduler_thread;
+  pthread_t storage_thread;
   pthread_t thermal_thread;
+  pthread_t metrics_thread;
+  pthread_t usb_suspend_thread;
   pthread_t qmi_client_thread;
   pthread_t qmi_services_thead;
+#ifdef USE_POCKETSPHINX
+  pthread_t stt_preload_thread;
+#endif
   struct node_pair rmnet_nodes;
+  sigset_t exit_signals;
+  int signum;
   rmnet_nodes.allow_exit = false;
 
   /* Set initial settings before moving to actual initialization */
@@ -92,7 +107,7 @@ int main(int argc, char **argv) {
   reset_dirty_reconnects();
   set_log_level(MSG_INFO); // By default, set log level to info
   print_banner();
-  while ((ret = getopt(argc, argv, "dulv?")) != -1)
+  while ((ret = getopt(argc, argv, "dulcr:v?")) != -1)
     switch (ret) {
     case 'd':
       fprintf(stdout, "Print logs to stdout\n");
@@ -104,6 +119,14 @@ int main(int argc, char **argv) {
       find_services();
       return 0;
 
+    case 'c':
+      fprintf(stdout, "Capture QMI traffic to %s\n", CAPTURE_DEFAULT_PATH);
+      capture = true;
+      break;
+
+    case 'r':
+      return capture_decode_file(optarg) < 0 ? 1 : 0;
+
     case 'l':
       fprintf(stdout, "Log everything (even passing packets)\n");
       fprintf(stdout, "WARNING: Your logfile might contain sensitive data, "
@@ -116,6 +139,8 @@ int main(int argc, char **argv) {
       fprintf(stdout, " -u: Print available ADSP firmware services\n");
       fprintf(stdout, " -d: Send logs to stdout\n");
       fprintf(stdout, " -l: Set log level to debug\n");
+      fprintf(stdout, " -c: Capture QMI traffic to " CAPTURE_DEFAULT_PATH "\n");
+      fprintf(stdout, " -r <file>: Decode a QMI capture file\n");
       fprintf(stdout, " -?: Show available options\n");
       fprintf(stdout, " -v: Show OpenQTI version\n");
       return 0;
@@ -129,6 +154,15 @@ int main(int argc, char **argv) {
       break;
     }
 
+  /*
+   * Every thread we start inherits this mask, so SIGTERM and SIGINT
+   * can only be picked up by main() once everything is running
+   */
+  sigemptyset(&exit_signals);
+  sigaddset(&exit_signals, SIGTERM);
+  sigaddset(&exit_signals, SIGINT);
+  pthread_sigmask(SIG_BLOCK, &exit_signals, NULL);
+
   if ((lockfile = open(LOCKFILE, O_RDWR | O_CREAT | O_TRUNC, 0660)) == -1) {
     fprintf(stderr, "%s: Can't open lockfile!\n", __func__);
     return -ENOENT;
@@ -138,6 +172,11 @@ int main(int argc, char **argv) {
     return -EBUSY;
   }
 
+  /* Don't clobber a capture from an instance that is already running */
+  if (capture) {
+    capture_start(CAPTURE_DEFAULT_PATH);
+  }
+
   /* Set cpu governor to performance to speed it up a bit */
   enable_cpufreq_performance_mode(true);
 
@@ -233,17 +272,26 @@ int main(int argc, char **argv) {
   /* Enable or disable ADB depending on the misc partition setting */
   set_adb_runtime(is_adb_enabled());
 
-  logger(MSG_INFO, "%s: Init: Create GPS runtime thread \n", __func__);
-  if ((ret = pthread_create(&gps_proxy_thread, NULL, &gps_proxy, NULL))) {
-    logger(MSG_ERROR, "%s: Error creating GPS proxy thread\n", __func__);
+  logger(MSG_INFO, "%s: Init: Create USB suspend monitor thread \n", __func__);
+  if ((ret = pthread_create(&usb_suspend_thread, NULL, &usb_suspend_monitor,
+                            NULL))) {
+    logger(MSG_ERROR, "%s: Error creating USB suspend monitor thread\n",
+           __func__);
   }
 
-  logger(MSG_INFO, "%s: Init: Create RMNET runtime thread \n", __func__);
+  logger(MSG_INFO, "%s: Init: Create RMNET and GPS runtime thread \n",
+         __func__);
   if ((ret = pthread_create(&rmnet_proxy_thread, NULL, &rmnet_proxy,
                             (void *)&rmnet_nodes))) {
     logger(MSG_ERROR, "%s: Error creating RMNET proxy thread\n", __func__);
   }
 
+  logger(MSG_INFO, "%s: Init: Create Proxy metrics thread \n", __func__);
+  if ((ret = pthread_create(&metrics_thread, NULL, &metrics_socket_thread,
+                            NULL))) {
+    logger(MSG_ERROR, "%s: Error creating proxy metrics thread\n", __func__);
+  }
+
   logger(MSG_INFO, "%s: Init: Create Time sync thread \n", __func__);
   if ((ret = pthread_create(&time_sync_thread, NULL, &time_sync, NULL))) {
     logger(MSG_ERROR, "%s: Error creating time sync thread\n", __func__);
@@ -260,11 +308,32 @@ int main(int argc, char **argv) {
                             NULL))) {
     logger(MSG_ERROR, "%s: Error creating scheduler thread\n", __func__);
   }
+  logger(MSG_INFO, "%s: Init: Create Storage monitor thread \n", __func__);
+  register_storage_consumer(STORAGE_CONSUMER_RECORDINGS,
+                            &recording_storage_level_changed);
+  register_storage_consumer(STORAGE_CONSUMER_LOGS, &log_storage_level_changed);
+  register_storage_consumer(STORAGE_CONSUMER_CELL_HISTORY,
+                            &cell_history_storage_level_changed);
+  register_storage_consumer(STORAGE_CONSUMER_TTS_CACHE,
+                            &tts_cache_storage_level_changed);
+  if ((ret = pthread_create(&storage_thread, NULL, &storage_monitor_thread,
+                            NULL))) {
+    logger(MSG_ERROR, "%s: Error creating storage monitor thread\n", __func__);
+  }
   logger(MSG_INFO, "%s: Init: Create Thermal monitor thread \n", __func__);
   if ((ret = pthread_create(&thermal_thread, NULL, &thermal_monitoring_thread,
                             NULL))) {
     logger(MSG_ERROR, "%s: Error creating thermal monitor thread\n", __func__);
   }
+#ifdef USE_POCKETSPHINX
+  logger(MSG_INFO, "%s: Init: Preload speech to text models\n", __func__);
+  if ((ret = pthread_create(&stt_preload_thread, NULL,
+                            &speech_to_text_preload_thread, NULL))) {
+    logger(MSG_ERROR, "%s: Error creating speech to text thread\n", __func__);
+  } else {
+    pthread_detach(stt_preload_thread);
+  }
+#endif
 
   logger(MSG_INFO, "%s: Init: Create Internal QMI client thread \n", __func__);
   if ((ret = pthread_create(&qmi_client_thread, NULL, &init_internal_qmi_client,
@@ -286,14 +355,15 @@ int main(int argc, char **argv) {
   /* just in case we previously died... */
   enable_usb_port();
  
-  /* This pipes messages between rmnet_ctl and smdcntl8,
-     and reads the IPC socket in case there's a pending
-     AT command to answer to */
-  pthread_join(gps_proxy_thread, NULL);
-  pthread_join(rmnet_proxy_thread, NULL);
-  pthread_join(atfwd_thread, NULL);
-  pthread_join(qmi_client_thread, NULL);
-  
+  /*
+   * Worker threads never return, so we just wait here until we're
+   * told to stop, and finalize the capture file on the way out
+   */
+  while (sigwait(&exit_signals, &signum) != 0)
+    ;
+  logger(MSG_INFO, "%s: Got signal %i, exiting\n", __func__, signum);
+  capture_stop();
+
   flock(lockfile, LOCK_UN);
   close(lockfile);
   unlink(LOCKFILE);
@@ -18,6 +18,8 @@
  *
  */
 
+#include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -25,6 +27,7 @@
 #include "audio.h"
 #include "logger.h"
 #include "openqti.h"
+#include "proxy.h"
 #include <picoapi.h>
 #include <picoapid.h>
 #include <picoos.h>
@@ -32,7 +35,6 @@
 /* adaptation layer defines */
 #define PICO_MEM_SIZE 2500000
 #define RESOURCE_NAME_SZ 200
-#define DummyLen 100000000
 
 /* string constants */
 #define MAX_OUTBUF_SIZE 128
@@ -54,277 +56,285 @@ const char *picoInternalSgLingware[] = {"en-US_lh0_sg.bin"};
 const char *picoInternalUtppLingware[] = {"en-US_utpp.bin"};
 const int picoNumSupportedVocs = 6;
 
-/* adapation layer global variables */
-void *picoMemArea = NULL;
-pico_System picoSystem = NULL;
-pico_Resource picoTaResource = NULL;
-pico_Resource picoSgResource = NULL;
-pico_Resource picoUtppResource = NULL;
-pico_Engine picoEngine = NULL;
-pico_Char *picoTaFileName = NULL;
-pico_Char *picoSgFileName = NULL;
-pico_Char *picoUtppFileName = NULL;
-pico_Char *picoTaResourceName = NULL;
-pico_Char *picoSgResourceName = NULL;
-pico_Char *picoUtppResourceName = NULL;
-int picoSynthAbort = 0;
-
-// So we need, wave sample pointer, and pointer to the actual text
+/*
+ * Pico TTS engine
+ *  Loading the lingware and creating the engine takes way longer
+ *  than synthesizing a short phrase, so we do it once, the first
+ *  time we need to speak, and keep the engine around afterwards.
+ *  Only one phrase can go through the engine at a time.
+ */
+struct {
+  pthread_mutex_t mutex;
+  bool ready;
+  bool has_voice;
+  void *mem_area;
+  pico_System system;
+  pico_Resource ta_resource;
+  pico_Resource sg_resource;
+  pico_Engine engine;
+  char ta_resource_name[RESOURCE_NAME_SZ];
+  char sg_resource_name[RESOURCE_NAME_SZ];
+} pico_rt = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* Must be called with the mutex held */
+void unload_pico_tts() {
+  if (pico_rt.engine) {
+    pico_disposeEngine(pico_rt.system, &pico_rt.engine);
+    pico_rt.engine = NULL;
+  }
+  if (pico_rt.has_voice) {
+    pico_releaseVoiceDefinition(pico_rt.system, (pico_Char *)PICO_VOICE_NAME);
+    pico_rt.has_voice = false;
+  }
+  if (pico_rt.sg_resource) {
+    pico_unloadResource(pico_rt.system, &pico_rt.sg_resource);
+    pico_rt.sg_resource = NULL;
+  }
+  if (pico_rt.ta_resource) {
+    pico_unloadResource(pico_rt.system, &pico_rt.ta_resource);
+    pico_rt.ta_resource = NULL;
+  }
+  if (pico_rt.system) {
+    pico_terminate(&pico_rt.system);
+    pico_rt.system = NULL;
+  }
+  free(pico_rt.mem_area);
+  pico_rt.mem_area = NULL;
+  pico_rt.ready = false;
+}
 
-int pico2aud(char *phrase, size_t len) {
-  char *wavefile = "/tmp/wave.wav";
+/* Must be called with the mutex held */
+int load_pico_tts() {
+  char filename[PICO_MAX_DATAPATH_NAME_SIZE + PICO_MAX_FILE_NAME_SIZE];
+  uint64_t start = get_monotonic_time_ms();
+  pico_Retstring outMessage;
   int langIndex = 0;
-  int8_t *buffer;
-  size_t bufferSize = 256;
+  int ret;
 
-  char *text = phrase;
-  if (len < 1) {
-    logger(MSG_WARN, "%s: Nothing to say\n", __func__);
+  if (pico_rt.ready) {
     return 0;
   }
 
-  buffer = malloc(bufferSize);
-
-  int ret, getstatus;
-  pico_Char *inp = NULL;
-  pico_Char *local_text = NULL;
-  short outbuf[MAX_OUTBUF_SIZE / 2];
-  pico_Int16 bytes_sent, bytes_recv, text_remaining, out_data_type;
-  pico_Retstring outMessage;
-
-  picoSynthAbort = 0;
   logger(MSG_DEBUG, "%s: Starting PicoTTS Engine\n", __func__);
-  picoMemArea = malloc(PICO_MEM_SIZE);
-  if ((ret = pico_initialize(picoMemArea, PICO_MEM_SIZE, &picoSystem))) {
-    pico_getSystemStatusMessage(picoSystem, ret, outMessage);
+  pico_rt.mem_area = malloc(PICO_MEM_SIZE);
+  if (pico_rt.mem_area == NULL) {
+    logger(MSG_ERROR, "%s: Can't allocate the engine memory\n", __func__);
+    return -ENOMEM;
+  }
+  if ((ret = pico_initialize(pico_rt.mem_area, PICO_MEM_SIZE,
+                             &pico_rt.system))) {
+    pico_getSystemStatusMessage(pico_rt.system, ret, outMessage);
     logger(MSG_ERROR, "Cannot initialize pico (%i): %s\n", ret, outMessage);
-    goto terminate;
+    goto err;
   }
 
-  logger(MSG_DEBUG, "%s: Text analysis Lingware resouce file\n", __func__);
-
   /* Load the text analysis Lingware resource file.   */
-  picoTaFileName = (pico_Char *)malloc(PICO_MAX_DATAPATH_NAME_SIZE +
-                                       PICO_MAX_FILE_NAME_SIZE);
-  strcpy((char *)picoTaFileName, PICO_LINGWARE_PATH);
-  strcat((char *)picoTaFileName,
-         (const char *)picoInternalTaLingware[langIndex]);
-  if ((ret = pico_loadResource(picoSystem, picoTaFileName, &picoTaResource))) {
-    pico_getSystemStatusMessage(picoSystem, ret, outMessage);
+  snprintf(filename, sizeof(filename), "%s%s", PICO_LINGWARE_PATH,
+           picoInternalTaLingware[langIndex]);
+  if ((ret = pico_loadResource(pico_rt.system, (pico_Char *)filename,
+                               &pico_rt.ta_resource))) {
+    pico_getSystemStatusMessage(pico_rt.system, ret, outMessage);
     logger(MSG_ERROR, "Cannot load text analysis resource file (%i): %s\n", ret,
            outMessage);
-    goto unloadTaResource;
+    goto err;
   }
 
-  logger(MSG_DEBUG, "%s: Signal generation lingware resource file\n", __func__);
   /* Load the signal generation Lingware resource file.   */
-  picoSgFileName = (pico_Char *)malloc(PICO_MAX_DATAPATH_NAME_SIZE +
-                                       PICO_MAX_FILE_NAME_SIZE);
-  strcpy((char *)picoSgFileName, PICO_LINGWARE_PATH);
-  strcat((char *)picoSgFileName,
-         (const char *)picoInternalSgLingware[langIndex]);
-  if ((ret = pico_loadResource(picoSystem, picoSgFileName, &picoSgResource))) {
-    pico_getSystemStatusMessage(picoSystem, ret, outMessage);
+  snprintf(filename, sizeof(filename), "%s%s", PICO_LINGWARE_PATH,
+           picoInternalSgLingware[langIndex]);
+  if ((ret = pico_loadResource(pico_rt.system, (pico_Char *)filename,
+                               &pico_rt.sg_resource))) {
+    pico_getSystemStatusMessage(pico_rt.system, ret, outMessage);
     logger(MSG_ERROR,
            "Cannot load signal generation Lingware resource file (%i): %s\n",
            ret, outMessage);
-    goto unloadSgResource;
+    goto err;
   }
 
-  logger(MSG_DEBUG, "%s: Text analysis resource file\n", __func__);
   /* Get the text analysis resource name.     */
-  picoTaResourceName = (pico_Char *)malloc(RESOURCE_NAME_SZ);
-  if ((ret = pico_getResourceName(picoSystem, picoTaResource,
-                                  (char *)picoTaResourceName))) {
-    pico_getSystemStatusMessage(picoSystem, ret, outMessage);
+  if ((ret = pico_getResourceName(pico_rt.system, pico_rt.ta_resource,
+                                  pico_rt.ta_resource_name))) {
+    pico_getSystemStatusMessage(pico_rt.system, ret, outMessage);
     logger(MSG_ERROR, "Cannot get the text analysis resource name (%i): %s\n",
            ret, outMessage);
-    goto unloadUtppResource;
+    goto err;
   }
 
-  logger(MSG_DEBUG, "%s: Signal generation resource file\n", __func__);
   /* Get the signal generation resource name. */
-  picoSgResourceName = (pico_Char *)malloc(RESOURCE_NAME_SZ);
-  if ((ret = pico_getResourceName(picoSystem, picoSgResource,
-                                  (char *)picoSgResourceName))) {
-    pico_getSystemStatusMessage(picoSystem, ret, outMessage);
+  if ((ret = pico_getResourceName(pico_rt.system, pico_rt.sg_resource,
+                                  pico_rt.sg_resource_name))) {
+    pico_getSystemStatusMessage(pico_rt.system, ret, outMessage);
     logger(MSG_ERROR,
            "Cannot get the signal generation resource name (%i): %s\n", ret,
            outMessage);
-    goto unloadUtppResource;
+    goto err;
   }
 
-  logger(MSG_DEBUG, "%s: Voice definition\n", __func__);
   /* Create a voice definition.   */
-  if ((ret = pico_createVoiceDefinition(picoSystem,
+  if ((ret = pico_createVoiceDefinition(pico_rt.system,
                                         (const pico_Char *)PICO_VOICE_NAME))) {
-    pico_getSystemStatusMessage(picoSystem, ret, outMessage);
+    pico_getSystemStatusMessage(pico_rt.system, ret, outMessage);
     logger(MSG_ERROR, "Cannot create voice definition (%i): %s\n", ret,
            outMessage);
-    goto unloadUtppResource;
+    goto err;
   }
+  pico_rt.has_voice = true;
 
-  logger(MSG_DEBUG, "%s: Add Text analysis resource \n", __func__);
   /* Add the text analysis resource to the voice. */
   if ((ret = pico_addResourceToVoiceDefinition(
-           picoSystem, (const pico_Char *)PICO_VOICE_NAME,
-           picoTaResourceName))) {
-    pico_getSystemStatusMessage(picoSystem, ret, outMessage);
+           pico_rt.system, (const pico_Char *)PICO_VOICE_NAME,
+           (pico_Char *)pico_rt.ta_resource_name))) {
+    pico_getSystemStatusMessage(pico_rt.system, ret, outMessage);
     logger(MSG_ERROR,
            "Cannot add the text analysis resource to the voice (%i): %s\n", ret,
            outMessage);
-    goto unloadUtppResource;
+    goto err;
   }
 
-  logger(MSG_DEBUG, "%s: Add Signal generation resource \n", __func__);
   /* Add the signal generation resource to the voice. */
   if ((ret = pico_addResourceToVoiceDefinition(
-           picoSystem, (const pico_Char *)PICO_VOICE_NAME,
-           picoSgResourceName))) {
-    pico_getSystemStatusMessage(picoSystem, ret, outMessage);
+           pico_rt.system, (const pico_Char *)PICO_VOICE_NAME,
+           (pico_Char *)pico_rt.sg_resource_name))) {
+    pico_getSystemStatusMessage(pico_rt.system, ret, outMessage);
     logger(MSG_ERROR,
            "Cannot add the signal generation resource to the voice (%i): %s\n",
            ret, outMessage);
-    goto unloadUtppResource;
+    goto err;
   }
 
-  logger(MSG_DEBUG, "%s: Create engine \n", __func__);
   /* Create a new Pico engine. */
-  if ((ret = pico_newEngine(picoSystem, (const pico_Char *)PICO_VOICE_NAME,
-                            &picoEngine))) {
-    pico_getSystemStatusMessage(picoSystem, ret, outMessage);
+  if ((ret = pico_newEngine(pico_rt.system, (const pico_Char *)PICO_VOICE_NAME,
+                            &pico_rt.engine))) {
+    pico_getSystemStatusMessage(pico_rt.system, ret, outMessage);
     logger(MSG_ERROR, "Cannot create a new pico engine (%i): %s\n", ret,
            outMessage);
-    goto disposeEngine;
+    goto err;
   }
 
-  local_text = (pico_Char *)text;
-  text_remaining = strlen((const char *)local_text) + 1;
+  pico_rt.ready = true;
+  logger(MSG_INFO, "%s: PicoTTS ready (%llu ms)\n", __func__,
+         (unsigned long long)(get_monotonic_time_ms() - start));
+  return 0;
 
-  inp = (pico_Char *)local_text;
+err:
+  unload_pico_tts();
+  return -EIO;
+}
+
+/* Cached phrases are only good for the voice that spoke them */
+const char *get_tts_voice_name() { return picoInternalLang[0]; }
+
+/* Load the engine ahead of time, so the first phrase doesn't pay for it */
+int init_pico_tts() {
+  int ret;
+  pthread_mutex_lock(&pico_rt.mutex);
+  ret = load_pico_tts();
+  pthread_mutex_unlock(&pico_rt.mutex);
+  return ret;
+}
 
-  size_t bufused = 0;
+void release_pico_tts() {
+  pthread_mutex_lock(&pico_rt.mutex);
+  unload_pico_tts();
+  pthread_mutex_unlock(&pico_rt.mutex);
+}
 
-  picoos_Common common = (picoos_Common)pico_sysGetCommon(picoSystem);
+/*
+ * Speak a phrase
+ *  Samples (16kHz, mono, S16_LE) are handed to the sink as the
+ *  engine produces them, in chunks of up to TTS_STREAM_CHUNK_SIZE
+ *  bytes, so playback starts as soon as the first one is ready.
+ *  A sink returning < 0 stops the synthesis, and its error is
+ *  returned to the caller.
+ */
+int pico2aud(char *phrase, size_t len, tts_sample_sink sink, void *data) {
+  uint8_t chunk[TTS_STREAM_CHUNK_SIZE];
+  short outbuf[MAX_OUTBUF_SIZE / 2];
+  pico_Char *inp = (pico_Char *)phrase;
+  pico_Char terminator = 0;
+  pico_Int16 bytes_sent, bytes_recv, text_size, out_data_type;
+  pico_Retstring outMessage;
+  size_t chunk_used = 0;
+  size_t text_remaining = len;
+  bool text_done = false;
+  uint64_t start;
+  uint64_t first_audio = 0;
+  int ret = 0, getstatus;
 
-  picoos_SDFile sdOutFile = NULL;
+  if (len < 1) {
+    logger(MSG_WARN, "%s: Nothing to say\n", __func__);
+    return 0;
+  }
 
-  picoos_bool done = TRUE;
-  if (TRUE !=
-      (done = picoos_sdfOpenOut(common, &sdOutFile, (picoos_char *)wavefile,
-                                SAMPLE_FREQ_16KHZ, PICOOS_ENC_LIN))) {
-    logger(MSG_ERROR, "Cannot open output wave file\n");
-    ret = 1;
-    goto disposeEngine;
+  pthread_mutex_lock(&pico_rt.mutex);
+  if ((ret = load_pico_tts()) < 0) {
+    pthread_mutex_unlock(&pico_rt.mutex);
+    return ret;
   }
 
-  /* synthesis loop   */
-  while (text_remaining) {
-    /* Feed the text into the engine.   */
-    if ((ret =
-             pico_putTextUtf8(picoEngine, inp, text_remaining, &bytes_sent))) {
-      pico_getSystemStatusMessage(picoSystem, ret, outMessage);
+  start = get_monotonic_time_ms();
+  /* The text goes in as is, the final NUL flushes the last sentence */
+  while (!text_done) {
+    if (text_remaining > 0) {
+      text_size = text_remaining > INT16_MAX ? INT16_MAX : text_remaining;
+      ret = pico_putTextUtf8(pico_rt.engine, inp, text_size, &bytes_sent);
+      inp += bytes_sent;
+      text_remaining -= bytes_sent;
+    } else {
+      ret = pico_putTextUtf8(pico_rt.engine, &terminator, 1, &bytes_sent);
+      text_done = bytes_sent == 1;
+    }
+    if (ret) {
+      pico_getSystemStatusMessage(pico_rt.system, ret, outMessage);
       logger(MSG_ERROR, "Cannot put Text (%i): %s\n", ret, outMessage);
-      goto disposeEngine;
+      ret = -EIO;
+      goto reset;
     }
 
-    text_remaining -= bytes_sent;
-    inp += bytes_sent;
-
     do {
-      if (picoSynthAbort) {
-        goto disposeEngine;
-      }
-      /* Retrieve the samples and add them to the buffer. */
-      getstatus = pico_getData(picoEngine, (void *)outbuf, MAX_OUTBUF_SIZE,
-                               &bytes_recv, &out_data_type);
+      getstatus = pico_getData(pico_rt.engine, (void *)outbuf,
+                               MAX_OUTBUF_SIZE, &bytes_recv, &out_data_type);
       if ((getstatus != PICO_STEP_BUSY) && (getstatus != PICO_STEP_IDLE)) {
-        pico_getSystemStatusMessage(picoSystem, getstatus, outMessage);
+        pico_getSystemStatusMessage(pico_rt.system, getstatus, outMessage);
         logger(MSG_ERROR, "Cannot get Data (%i): %s\n", getstatus, outMessage);
-        goto disposeEngine;
+        ret = -EIO;
+        goto reset;
       }
-      if (bytes_recv) {
-        if ((bufused + bytes_recv) <= bufferSize) {
-          memcpy(buffer + bufused, (int8_t *)outbuf, bytes_recv);
-          bufused += bytes_recv;
-        } else {
-          done = picoos_sdfPutSamples(sdOutFile, bufused / 2,
-                                      (picoos_int16 *)(buffer));
-          bufused = 0;
-          memcpy(buffer, (int8_t *)outbuf, bytes_recv);
-          bufused += bytes_recv;
+      if (bytes_recv <= 0) {
+        continue;
+      }
+      memcpy(chunk + chunk_used, outbuf, bytes_recv);
+      chunk_used += bytes_recv;
+      if (chunk_used + MAX_OUTBUF_SIZE > TTS_STREAM_CHUNK_SIZE) {
+        if (first_audio == 0) {
+          first_audio = get_monotonic_time_ms();
+        }
+        if ((ret = sink(data, chunk, chunk_used)) < 0) {
+          goto reset;
         }
+        chunk_used = 0;
       }
     } while (PICO_STEP_BUSY == getstatus);
-    /* This chunk of synthesis is finished; pass the remaining samples. */
-    if (!picoSynthAbort) {
-      done = picoos_sdfPutSamples(sdOutFile, bufused / 2,
-                                  (picoos_int16 *)(buffer));
-    }
-    picoSynthAbort = 0;
   }
 
-  if (TRUE != (done = picoos_sdfCloseOut(common, &sdOutFile))) {
-    logger(MSG_ERROR, "Cannot close output wave file\n");
-    ret = 1;
-    goto disposeEngine;
-  }
-
-disposeEngine:
-  if (picoEngine) {
-    pico_disposeEngine(picoSystem, &picoEngine);
-    pico_releaseVoiceDefinition(picoSystem, (pico_Char *)PICO_VOICE_NAME);
-    picoEngine = NULL;
-  }
-unloadUtppResource:
-  if (picoUtppResource) {
-    pico_unloadResource(picoSystem, &picoUtppResource);
-    picoUtppResource = NULL;
+  if (chunk_used > 0 && (ret = sink(data, chunk, chunk_used)) < 0) {
+    goto reset;
   }
-unloadSgResource:
-  if (picoSgResource) {
-    pico_unloadResource(picoSystem, &picoSgResource);
-    picoSgResource = NULL;
+  logger(MSG_DEBUG, "%s: First audio after %llu ms, done in %llu ms\n",
+         __func__,
+         (unsigned long long)(first_audio ? first_audio - start : 0),
+         (unsigned long long)(get_monotonic_time_ms() - start));
+  pthread_mutex_unlock(&pico_rt.mutex);
+  return 0;
+
+reset:
+  /* Drop whatever is left in the pipeline, so it isn't spoken next time */
+  if (pico_resetEngine(pico_rt.engine, PICO_RESET_SOFT)) {
+    logger(MSG_WARN, "%s: Can't reset the engine, reloading it\n", __func__);
+    unload_pico_tts();
   }
-unloadTaResource:
-  if (picoTaResource) {
-    pico_unloadResource(picoSystem, &picoTaResource);
-    picoTaResource = NULL;
-  }
-terminate:
-  if (picoSystem) {
-    pico_terminate(&picoSystem);
-    picoSystem = NULL;
-  }
-
-  logger(MSG_DEBUG, "%s: Getting out of pico2aud - %i\n", __func__, ret);
-
-  free(buffer);
-  free(picoMemArea);
-  free(picoTaFileName);
-  free(picoSgFileName);
-  free(picoTaResourceName);
-  free(picoSgResourceName);
-  free(picoSystem);
-  free(picoTaResource);
-  free(picoSgResource);
-  free(picoUtppResource);
-  free(picoEngine);
-  free(picoUtppFileName);
-  free(picoUtppResourceName);
-
-  buffer = NULL;
-  picoMemArea = NULL;
-  picoTaFileName = NULL;
-  picoSgFileName = NULL;
-  picoTaResourceName = NULL;
-  picoSgResourceName = NULL;
-  picoSystem = NULL;
-  picoTaResource = NULL;
-  picoSgResource = NULL;
-  picoUtppResource = NULL;
-  picoEngine = NULL;
-  picoUtppFileName = NULL;
-  picoUtppResourceName = NULL;
+  pthread_mutex_unlock(&pico_rt.mutex);
   return ret;
 }
@@ -4,11 +4,13 @@
 #include "atfwd.h"
 #include "audio.h"
 #include "call.h"
+#include "capture.h"
 #include "config.h"
 #include "devices.h"
 #include "helpers.h"
 #include "ipc.h"
 #include "logger.h"
+#include "metrics.h"
 #include "openqti.h"
 #include "qmi.h"
 #include "sms.h"
@@ -18,24 +20,73 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <sys/poll.h>
 #include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 
 struct {
-  int is_usb_suspended;
+  _Atomic int is_usb_suspended;
+  int usb_state_fd;
   uint8_t is_service_debugging_enabled;
   uint8_t debug_service_id;
+  int epollfd;
+  int wakeup_fd;
   struct pkt_stats rmnet_packet_stats;
   struct pkt_stats gps_packet_stats;
-} proxy_rt;
+  /* Packet routing */
+  uint8_t num_routes;
+  struct proxy_route routes[PROXY_MAX_ROUTES];
+  uint8_t num_chains;
+  struct proxy_route_chain chains[PROXY_MAX_ROUTE_CHAINS];
+  /* [direction][service] -> chain ID for each message ID slot */
+  uint8_t *route_table[2][QMI_SERVICES_LAST + 1];
+  uint8_t default_action[QMI_SERVICES_LAST + 1];
+  /* Every frame is read here and written from here, never cleared */
+  uint8_t io_buf[MAX_PACKET_SIZE] __attribute__((aligned(PROXY_BUF_ALIGNMENT)));
+} proxy_rt = {
+    .epollfd = -1,
+    .wakeup_fd = -1,
+    .usb_state_fd = -1,
+};
 
 void proxy_rt_reset() {
-  proxy_rt.is_usb_suspended = 0;
+  atomic_store(&proxy_rt.is_usb_suspended, 0);
   proxy_rt.is_service_debugging_enabled = 0;
   proxy_rt.debug_service_id = 0;
+  proxy_rt.num_routes = 0;
+  memset(proxy_rt.default_action, PACKET_PASS_TRHU,
+         sizeof(proxy_rt.default_action));
+  register_default_proxy_routes();
+  if (proxy_rt.wakeup_fd < 0) {
+    proxy_rt.wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (proxy_rt.wakeup_fd < 0) {
+      logger(MSG_ERROR, "%s: Error creating the proxy wakeup event\n",
+             __func__);
+    }
+  }
+}
+
+/*
+ * wake_up_proxy
+ *  Called from any thread after queueing something the proxy
+ *  has to inject (internal SMS, simulated calls, CB messages...)
+ *  so it is handled right away instead of on the next tick
+ */
+void wake_up_proxy() {
+  uint64_t val = 1;
+  if (proxy_rt.wakeup_fd < 0) {
+    return;
+  }
+  if (write(proxy_rt.wakeup_fd, &val, sizeof(uint64_t)) < 0 &&
+      errno != EAGAIN) {
+    logger(MSG_WARN, "%s: Failed to signal the proxy thread\n", __func__);
+  }
 }
 
 void enable_service_debugging(uint8_t service_id) {
@@ -55,33 +106,74 @@ struct pkt_stats get_gps_stats() {
   return proxy_rt.gps_packet_stats;
 }
 
+/* Updated by usb_suspend_monitor(), so it's just a load */
 int get_transceiver_suspend_state() {
-  int fd, val = 0;
-  char readval[6];
-  proxy_rt.is_usb_suspended = 0;
-  fd = open("/sys/devices/78d9000.usb/msm_hsusb/isr_suspend_state", O_RDONLY);
-  if (fd < 0) {
-    logger(MSG_ERROR, "%s: Cannot open USB state \n", __func__);
-    return proxy_rt.is_usb_suspended;
-  }
-  lseek(fd, 0, SEEK_SET);
-  if (read(fd, &readval, 1) <= 0) {
-    logger(MSG_ERROR, "%s: Error reading USB Sysfs entry \n", __func__);
-    close(fd);
-    return proxy_rt.is_usb_suspended; // return last state
-  }
-  val = strtol(readval, NULL, 10);
-
-  if (val > 0 && proxy_rt.is_usb_suspended == 0) {
-    proxy_rt.is_usb_suspended =
-        1; // USB is suspended, stop trying to transfer data
-           // system("echo mem > /sys/power/state");
-  } else if (val == 0 && proxy_rt.is_usb_suspended == 1) {
-    usleep(100000);                // Allow time to finish wakeup
-    proxy_rt.is_usb_suspended = 0; // Then allow transfers again
-  }
-  close(fd);
-  return proxy_rt.is_usb_suspended;
+  return atomic_load_explicit(&proxy_rt.is_usb_suspended,
+                              memory_order_acquire);
+}
+
+/* Sysfs attributes must be read from the start every time */
+int read_usb_suspend_state(int fd) {
+  char readval[6] = {0};
+  if (lseek(fd, 0, SEEK_SET) < 0 || read(fd, readval, 1) <= 0) {
+    return -EIO;
+  }
+  return strtol(readval, NULL, 10) > 0 ? 1 : 0;
+}
+
+/*
+ * USB suspend monitor
+ *  Keeps the suspend state sysfs node open and sleeps on it until
+ *  the kernel notifies a change (sysfs_notify() wakes us up with
+ *  POLLPRI | POLLERR). If the driver doesn't notify, we still pick
+ *  the change up within USB_SUSPEND_FALLBACK_POLL_MS, which is a
+ *  single read instead of the old busy loop. Suspending is published
+ *  right away; on resume we give the host USB_RESUME_SETTLE_MS to
+ *  finish waking up before allowing transfers again, and then kick
+ *  the proxy so it can reopen the GPS port and flush pending work.
+ *  The proxy thread never waits for any of this
+ */
+void *usb_suspend_monitor() {
+  struct pollfd pfd;
+  int val, ret;
+
+  proxy_rt.usb_state_fd = open(USB_SUSPEND_STATE_PATH, O_RDONLY | O_CLOEXEC);
+  if (proxy_rt.usb_state_fd < 0) {
+    logger(MSG_ERROR, "%s: Cannot open USB state, assuming it's awake\n",
+           __func__);
+    return NULL;
+  }
+
+  pfd.fd = proxy_rt.usb_state_fd;
+  pfd.events = POLLPRI | POLLERR;
+  while (1) {
+    val = read_usb_suspend_state(proxy_rt.usb_state_fd);
+    if (val < 0) {
+      logger(MSG_ERROR, "%s: Error reading USB Sysfs entry \n", __func__);
+    } else if (val == 1 && !get_transceiver_suspend_state()) {
+      logger(MSG_DEBUG, "%s: USB is suspended\n", __func__);
+      atomic_store_explicit(&proxy_rt.is_usb_suspended, 1,
+                            memory_order_release);
+    } else if (val == 0 && get_transceiver_suspend_state()) {
+      usleep(USB_RESUME_SETTLE_MS * 1000); // Allow time to finish wakeup
+      /* It might have gone back to sleep meanwhile */
+      if (read_usb_suspend_state(proxy_rt.usb_state_fd) == 0) {
+        logger(MSG_DEBUG, "%s: USB is awake\n", __func__);
+        atomic_store_explicit(&proxy_rt.is_usb_suspended, 0,
+                              memory_order_release);
+        wake_up_proxy();
+      }
+      continue;
+    }
+
+    ret = poll(&pfd, 1, USB_SUSPEND_FALLBACK_POLL_MS);
+    if (ret < 0 && errno != EINTR) {
+      logger(MSG_ERROR, "%s: poll failed: %s\n", __func__, strerror(errno));
+      usleep(USB_SUSPEND_FALLBACK_POLL_MS * 1000);
+    }
+  }
+
+  return NULL;
 }
 
 /*
@@ -112,95 +204,6 @@ void find_and_set_current_sms_memory_index(uint8_t *buf, int len) {
   pos = NULL;
 }
 
-void *gps_proxy() {
-  struct node_pair *nodes;
-  nodes = calloc(1, sizeof(struct node_pair));
-  int ret;
-  fd_set readfds;
-  uint8_t buf[MAX_PACKET_SIZE];
-  struct timeval tv;
-  logger(MSG_INFO, "%s: Initialize GPS proxy thread.\n", __func__);
-
-  nodes->node1.fd = -1;
-  nodes->node2.fd = -1;
-
-  while (1) {
-    FD_ZERO(&readfds);
-    memset(buf, 0, sizeof(buf));
-
-    if (nodes->node1.fd < 0) {
-      nodes->node1.fd = open(SMD_GPS, O_RDWR);
-      if (nodes->node1.fd < 0) {
-        logger(MSG_ERROR, "%s: Error opening %s \n", __func__, SMD_GPS);
-      }
-    }
-
-    if (!get_transceiver_suspend_state() && nodes->node2.fd < 0) {
-      nodes->node2.fd = open(USB_GPS, O_RDWR);
-      if (nodes->node2.fd < 0) {
-        logger(MSG_ERROR, "%s: Error opening %s \n", __func__, USB_GPS);
-      }
-    } else if (nodes->node2.fd < 0) {
-      logger(MSG_WARN, "%s: Not trying to open USB GPS \n", __func__);
-    }
-
-    FD_SET(nodes->node1.fd, &readfds);
-    if (nodes->node2.fd > 0) {
-      FD_SET(nodes->node2.fd, &readfds);
-    }
-
-    tv.tv_sec = 0;
-    tv.tv_usec = 500000;
-    select(MAX_FD, &readfds, NULL, NULL, &tv);
-    if (FD_ISSET(nodes->node1.fd, &readfds)) {
-      ret = read(nodes->node1.fd, &buf, MAX_PACKET_SIZE);
-      if (ret > 0) {
-        dump_packet("GPS_SMD-->USB", buf, ret);
-        // CMTI Initial check:
-        /*       if (strstr((char*)buf, "+CMTI: \"ME\",") != NULL) {
-                 logger(MSG_WARN, "CMTI Report: %s", buf);
-                 find_and_set_current_sms_memory_index(buf, ret);
-               }*/
-        if (!get_transceiver_suspend_state() && nodes->node2.fd >= 0) {
-          proxy_rt.gps_packet_stats.allowed++;
-          ret = write(nodes->node2.fd, buf, ret);
-          if (ret == 0) {
-            proxy_rt.gps_packet_stats.failed++;
-            logger(MSG_ERROR, "%s: [GPS_TRACK Failed to write to USB\n",
-                   __func__);
-          }
-        } else {
-          proxy_rt.gps_packet_stats.discarded++;
-        }
-      } else {
-        proxy_rt.gps_packet_stats.empty++;
-        logger(MSG_WARN, "%s: Closing at the ADSP side \n", __func__);
-        close(nodes->node1.fd);
-        nodes->node1.fd = -1;
-      }
-    } else if (!get_transceiver_suspend_state() && nodes->node2.fd >= 0 &&
-               FD_ISSET(nodes->node2.fd, &readfds)) {
-
-      ret = read(nodes->node2.fd, &buf, MAX_PACKET_SIZE);
-      if (ret > 0) {
-        proxy_rt.gps_packet_stats.allowed++;
-        dump_packet("GPS_SMD<--USB", buf, ret);
-        ret = write(nodes->node1.fd, buf, ret);
-        if (ret == 0) {
-          proxy_rt.gps_packet_stats.failed++;
-          logger(MSG_ERROR, "%s: Failed to write to the ADSP\n", __func__);
-        }
-      } else {
-        proxy_rt.gps_packet_stats.empty++;
-        logger(MSG_ERROR, "%s: Closing at the USB side \n", __func__);
-        nodes->allow_exit = true;
-        close(nodes->node2.fd);
-        nodes->node2.fd = -1;
-      }
-    }
-  }
-}
-
 uint8_t process_simulated_packet(uint8_t source, int adspfd, int usbfd) {
   /* Messaging */
   if (is_message_pending() && get_notification_source() == MSG_INTERNAL) {
@@ -257,37 +260,276 @@ uint8_t process_wms_packet(void *bytes, size_t len, int adspfd, int usbfd) {
   return needs_rerouting;
 }
 
+/*
+ * proxy_register_route
+ *  Adds a handler for a (service, message ID, direction) tuple.
+ *  Handlers for the same message are called in the order they
+ *  were registered, until one of them returns an action.
+ *  Routes must be registered before the proxy thread starts,
+ *  as that's when we build the lookup table.
+ */
+int proxy_register_route(uint8_t service, uint16_t msgid, uint8_t directions,
+                         proxy_route_handler handler) {
+  if (proxy_rt.num_routes >= PROXY_MAX_ROUTES) {
+    logger(MSG_ERROR, "%s: No space left for new routes\n", __func__);
+    return -ENOSPC;
+  }
+  proxy_rt.routes[proxy_rt.num_routes].service = service;
+  proxy_rt.routes[proxy_rt.num_routes].msgid = msgid;
+  proxy_rt.routes[proxy_rt.num_routes].directions = directions;
+  proxy_rt.routes[proxy_rt.num_routes].handler = handler;
+  proxy_rt.num_routes++;
+  return 0;
+}
+
+/* What to do with a service's packets when no handler decides */
+void proxy_set_default_action(uint8_t service, uint8_t action) {
+  proxy_rt.default_action[service] = action;
+}
+
+bool route_matches(struct proxy_route *route, uint8_t service, uint16_t msgid,
+                   uint8_t direction) {
+  return route->service == service && (route->directions & (1 << direction)) &&
+         (route->msgid == PROXY_ROUTE_ANY_MSGID || route->msgid == msgid);
+}
+
+/*
+ * Finds the chain with the routes for a message ID slot, adding
+ * it if we don't have it yet. Most slots share the same chain
+ */
+int find_or_add_route_chain(struct proxy_route_chain *chain) {
+  for (uint8_t i = 0; i < proxy_rt.num_chains; i++) {
+    if (proxy_rt.chains[i].num_routes == chain->num_routes &&
+        memcmp(proxy_rt.chains[i].routes, chain->routes,
+               chain->num_routes) == 0) {
+      return i;
+    }
+  }
+  if (proxy_rt.num_chains >= PROXY_MAX_ROUTE_CHAINS) {
+    return -ENOSPC;
+  }
+  proxy_rt.chains[proxy_rt.num_chains] = *chain;
+  return proxy_rt.num_chains++;
+}
+
+/*
+ * build_proxy_route_table
+ *  Turns the registered routes into a table indexed by direction,
+ *  service and message ID, so the proxy needs a single lookup per
+ *  packet. Message IDs above PROXY_ROUTE_MSGID_SLOTS share the
+ *  last slot, and handlers there are checked against the real ID.
+ */
+int build_proxy_route_table() {
+  struct proxy_route_chain chain;
+  uint16_t msgid;
+  int chain_id;
+
+  for (uint8_t dir = 0; dir < 2; dir++) {
+    for (int svc = 0; svc <= QMI_SERVICES_LAST; svc++) {
+      free(proxy_rt.route_table[dir][svc]);
+      proxy_rt.route_table[dir][svc] = NULL;
+    }
+  }
+  proxy_rt.num_chains = 0;
+
+  for (uint8_t i = 0; i < proxy_rt.num_routes; i++) {
+    for (uint8_t dir = 0; dir < 2; dir++) {
+      uint8_t svc = proxy_rt.routes[i].service;
+      if (!(proxy_rt.routes[i].directions & (1 << dir)) ||
+          proxy_rt.route_table[dir][svc] != NULL) {
+        continue;
+      }
+      proxy_rt.route_table[dir][svc] = malloc(PROXY_ROUTE_MSGID_SLOTS + 1);
+      for (uint16_t slot = 0; slot <= PROXY_ROUTE_MSGID_SLOTS; slot++) {
+        chain.num_routes = 0;
+        for (uint8_t j = 0; j < proxy_rt.num_routes; j++) {
+          msgid = proxy_rt.routes[j].msgid;
+          if (slot == PROXY_ROUTE_MSGID_SLOTS &&
+              msgid >= PROXY_ROUTE_MSGID_SLOTS) {
+            msgid = PROXY_ROUTE_ANY_MSGID; // Checked when dispatching
+          }
+          if (proxy_rt.routes[j].service == svc &&
+              (proxy_rt.routes[j].directions & (1 << dir)) &&
+              (msgid == PROXY_ROUTE_ANY_MSGID || msgid == slot) &&
+              chain.num_routes < PROXY_MAX_ROUTES_PER_CHAIN) {
+            chain.routes[chain.num_routes++] = j;
+          }
+        }
+        if (chain.num_routes == 0) {
+          proxy_rt.route_table[dir][svc][slot] = PROXY_ROUTE_NO_CHAIN;
+          continue;
+        }
+        chain_id = find_or_add_route_chain(&chain);
+        if (chain_id < 0) {
+          logger(MSG_ERROR, "%s: Too many route combinations\n", __func__);
+          return chain_id;
+        }
+        proxy_rt.route_table[dir][svc][slot] = chain_id;
+      }
+    }
+  }
+
+  logger(MSG_INFO, "%s: %u routes in %u chains\n", __func__,
+         proxy_rt.num_routes, proxy_rt.num_chains);
+  return 0;
+}
+
+/*
+ * Route handlers
+ *  Glue between the router and each subsystem's checks
+ */
+uint8_t route_track_client(uint8_t source, uint8_t *pkt, size_t pkt_size,
+                           int adspfd, int usbfd) {
+  track_client_count(pkt, source, pkt_size, adspfd, usbfd);
+  return PROXY_ROUTE_CONTINUE;
+}
+
+uint8_t route_nas_signal_info(uint8_t source, uint8_t *pkt, size_t pkt_size,
+                              int adspfd, int usbfd) {
+  if (get_call_simulation_mode()) {
+    logger(MSG_INFO, "%s: Skip signal level reporting while in call\n",
+           __func__);
+    return PACKET_BYPASS;
+  }
+  return PROXY_ROUTE_CONTINUE;
+}
+
+uint8_t route_wms_message(uint8_t source, uint8_t *pkt, size_t pkt_size,
+                          int adspfd, int usbfd) {
+  if (check_wms_message(source, pkt, pkt_size, adspfd, usbfd)) {
+    return PACKET_BYPASS; // We bypass response
+  }
+  return PROXY_ROUTE_CONTINUE;
+}
+
+uint8_t route_wms_indication(uint8_t source, uint8_t *pkt, size_t pkt_size,
+                             int adspfd, int usbfd) {
+  if (check_wms_indication_message(pkt, pkt_size, adspfd, usbfd)) {
+    return PACKET_FORCED_PT;
+  }
+  return PROXY_ROUTE_CONTINUE;
+}
+
+uint8_t route_cb_message(uint8_t source, uint8_t *pkt, size_t pkt_size,
+                         int adspfd, int usbfd) {
+  check_cb_message(pkt, pkt_size, adspfd, usbfd);
+  return PROXY_ROUTE_CONTINUE; // We let it go anyway
+}
+
+uint8_t route_wms_list_all(uint8_t source, uint8_t *pkt, size_t pkt_size,
+                           int adspfd, int usbfd) {
+  if (is_sms_list_all_bypass_enabled() &&
+      check_wms_list_all_messages(source, pkt, pkt_size, adspfd, usbfd)) {
+    return PACKET_BYPASS;
+  }
+  return PROXY_ROUTE_CONTINUE;
+}
+
+uint8_t route_wms_host_request(uint8_t source, uint8_t *pkt, size_t pkt_size,
+                               int adspfd, int usbfd) {
+  if (process_wms_packet(pkt, pkt_size, adspfd, usbfd)) {
+    return PACKET_BYPASS; // We bypass response
+  }
+  return PROXY_ROUTE_CONTINUE;
+}
+
+uint8_t route_voice(uint8_t source, uint8_t *pkt, size_t pkt_size, int adspfd,
+                    int usbfd) {
+  return call_service_handler(source, pkt, pkt_size, adspfd, usbfd);
+}
+
+uint8_t route_location(uint8_t source, uint8_t *pkt, size_t pkt_size,
+                       int adspfd, int usbfd) {
+  logger(MSG_DEBUG, "%s Location service packet, MSG ID = %.4x \n", __func__,
+         get_qmi_message_id(pkt, pkt_size));
+  proxy_rt.gps_packet_stats.other++;
+  return PROXY_ROUTE_CONTINUE;
+}
+
+/*
+ * Everything the proxy itself needs to look at
+ */
+void register_default_proxy_routes() {
+  uint16_t voice_messages[] = {
+      VO_SVC_CALL_REQUEST,       VO_SVC_CALL_ANSWER_REQ,
+      VO_SVC_CALL_INFO,          VO_SVC_CALL_STATUS,
+      VO_SVC_GET_ALL_CALL_INFO,  VO_SVC_CALL_STATUS_CHANGE,
+      VO_SVC_CALL_END_REQ,
+  };
+
+  /* Control: keep track of clients the host allocates */
+  proxy_register_route(QMI_SERVICE_CONTROL, CONTROL_CLIENT_REGISTER_REQ,
+                       PROXY_ROUTE_ANY_DIRECTION, route_track_client);
+  proxy_register_route(QMI_SERVICE_CONTROL, CONTROL_CLIENT_RELEASE_REQ,
+                       PROXY_ROUTE_ANY_DIRECTION, route_track_client);
+
+  /* NAS: Signal reports while simulating a call */
+  proxy_register_route(QMI_SERVICE_NAS, NAS_GET_SIGNAL_INFO,
+                       PROXY_ROUTE_ANY_DIRECTION, route_nas_signal_info);
+
+  /* WMS: Here we'll trap messages to the Modem */
+  proxy_set_default_action(QMI_SERVICE_WMS, PACKET_FORCED_PT);
+  proxy_register_route(QMI_SERVICE_WMS, WMS_RAW_SEND, PROXY_ROUTE_ANY_DIRECTION,
+                       route_wms_message);
+  proxy_register_route(QMI_SERVICE_WMS, WMS_READ_MESSAGE,
+                       PROXY_ROUTE_ANY_DIRECTION, route_wms_message);
+  proxy_register_route(QMI_SERVICE_WMS, WMS_EVENT_REPORT, PROXY_ROUTE_FROM_DSP,
+                       route_wms_indication);
+  proxy_register_route(QMI_SERVICE_WMS, WMS_EVENT_REPORT, PROXY_ROUTE_FROM_DSP,
+                       route_cb_message);
+  proxy_register_route(QMI_SERVICE_WMS, WMS_LIST_ALL_MESSAGES,
+                       PROXY_ROUTE_FROM_DSP, route_wms_list_all);
+  proxy_register_route(QMI_SERVICE_WMS, PROXY_ROUTE_ANY_MSGID,
+                       PROXY_ROUTE_FROM_HOST, route_wms_host_request);
+
+  /* Voice: in call audio and simulated voicecalls */
+  proxy_set_default_action(QMI_SERVICE_VOICE, PACKET_FORCED_PT);
+  for (uint8_t i = 0; i < sizeof(voice_messages) / sizeof(voice_messages[0]);
+       i++) {
+    proxy_register_route(QMI_SERVICE_VOICE, voice_messages[i],
+                         PROXY_ROUTE_ANY_DIRECTION, route_voice);
+  }
+
+  /* Location: just count them */
+  proxy_register_route(QMI_SERVICE_LOCATION, PROXY_ROUTE_ANY_MSGID,
+                       PROXY_ROUTE_ANY_DIRECTION, route_location);
+}
+
 /* Node1 -> RMNET , Node2 -> SMD */
 /*
  *  process_packet()
- *    Looks at the QMI message to get the service type
- *    and if needed, moves the message somewhere else
- *    for further processing
+ *    Looks up the handlers for the QMI message (service, message ID
+ *    and direction) and calls them until one decides what to do
+ *    with it. Services nobody registered for are passed through
+ *    without further inspection
  */
 uint8_t process_packet(uint8_t source, uint8_t *pkt, size_t pkt_size,
                        int adspfd, int usbfd) {
   struct qmux_packet *qmux_header;
-
-  // By default everything should just go to its place
-  int action = PACKET_PASS_TRHU;
-  if (source == FROM_HOST) {
-    logger(MSG_DEBUG, "%s: New packet from HOST of %i bytes\n", __func__,
-           pkt_size);
+  struct proxy_route_chain *chain;
+  struct proxy_route *route;
+  struct qmi_tlv_index tlv_index;
+  uint8_t *table;
+  uint8_t chain_id, action;
+  uint16_t msgid;
+
+  if (get_log_level() == MSG_DEBUG) {
+    logger(MSG_DEBUG, "%s: New packet from %s of %i bytes\n", __func__,
+           source == FROM_HOST ? "HOST" : "ADSP", pkt_size);
+  }
+  if (is_capture_enabled()) {
+    capture_packet(source == FROM_HOST ? CAPTURE_DIR_HOST_TO_MODEM
+                                       : CAPTURE_DIR_MODEM_TO_HOST,
+                   pkt, pkt_size);
   } else {
-    logger(MSG_DEBUG, "%s: New packet from ADSP of %i bytes\n", __func__,
-           pkt_size);
+    dump_packet(source == FROM_HOST ? "HOST->SMD" : "HOST<-SMD", pkt,
+                pkt_size);
   }
-  dump_packet(source == FROM_HOST ? "HOST->SMD" : "HOST<-SMD", pkt, pkt_size);
 
   if (pkt_size == 0) {   // Port was closed
     return PACKET_EMPTY; // Abort processing
   }
 
-  /*
-   * There are two different types of QMI packets, and we don't know
-   * which one we're handling right now, so cast both and then check
-   */
-
   /*
    * Message needs to have a QMUX header and at least a 6 byte QMI header
    * (control) Or QMUX header + 7 Byte QMI header (service). If it's less than
@@ -300,79 +542,59 @@ uint8_t process_packet(uint8_t source, uint8_t *pkt, size_t pkt_size,
   }
 
   qmux_header = (struct qmux_packet *)pkt;
-  /* If we have enough for a "service" QMI message we will inspect things
-   * further down
-   */
-
-  logger(MSG_DEBUG, "[New QMI message] Service: %s (%i bytes)\n",
-         get_service_name(qmux_header->service), pkt_size);
+  if (get_log_level() == MSG_DEBUG) {
+    logger(MSG_DEBUG, "[New QMI message] Service: %s (%i bytes)\n",
+           get_service_name(qmux_header->service), pkt_size);
+  }
 
   if (proxy_rt.is_service_debugging_enabled &&
-      get_qmux_service_id(pkt, pkt_size) == proxy_rt.debug_service_id) {
+      qmux_header->service == proxy_rt.debug_service_id) {
     pretty_print_qmi_pkt(source == FROM_HOST ? "Host --> Baseband"
                                              : "Baseband --> Host",
                          pkt, pkt_size);
   }
-  /* In the future we can use this as a router inside the application.
-   * For now we only do some simple tasks depending on service, so no
-   * need to do too much
-   */
-  switch (get_qmux_service_id(pkt, pkt_size)) {
-  case 0: // Control packet with no service
-    logger(
-        MSG_DEBUG, "%s Control message, Command: %s\n", __func__,
-        get_ctl_command(get_control_message_id(
-            pkt, pkt_size))); // reroute to the tracker for further inspection
-    if (get_control_message_id(pkt, pkt_size) == CONTROL_CLIENT_REGISTER_REQ ||
-        get_control_message_id(pkt, pkt_size) == CONTROL_CLIENT_RELEASE_REQ) {
-      track_client_count(pkt, source, pkt_size, adspfd, usbfd);
-    }
-    break;
-  case 3:
-    logger(MSG_DEBUG, "%s: Network Access Service\n", __func__);
-    if (get_call_simulation_mode() && get_qmi_message_id(pkt, pkt_size) == NAS_GET_SIGNAL_INFO) { // 0x004f == GET_SIGNAL_REPORT
-        logger(MSG_INFO, "%s: Skip signal level reporting while in call\n",
-               __func__);
-        action = PACKET_BYPASS;
-    }
-    break;
-  /* Here we'll trap messages to the Modem */
-  case 5: // Message for the WMS service
-    action = PACKET_FORCED_PT;
-    logger(MSG_DEBUG, "%s WMS Packet\n", __func__);
-    if (check_wms_message(source, pkt, pkt_size, adspfd, usbfd)) {
-      action = PACKET_BYPASS; // We bypass response
-    } else if (check_wms_indication_message(pkt, pkt_size, adspfd, usbfd)) {
-      action = PACKET_FORCED_PT;
-    } else if (check_cb_message(pkt, pkt_size, adspfd, usbfd)) {
-      action = PACKET_FORCED_PT;
-    } else if (is_sms_list_all_bypass_enabled() && check_wms_list_all_messages(source, pkt, pkt_size, adspfd,
-                                           usbfd)) {
-      action = PACKET_BYPASS;
-    } else if (source == FROM_HOST &&
-               process_wms_packet(pkt, pkt_size, adspfd, usbfd)) {
-      action = PACKET_BYPASS; // We bypass response
-    }
 
-    break;
+  table = proxy_rt.route_table[source][qmux_header->service];
+  if (table == NULL) {
+    return proxy_rt.default_action[qmux_header->service];
+  }
 
-  /* Here we'll handle in call audio and simulated voicecalls */
-  /* REMEMBER: 0x002e -> Call indication
-              0x0024 -> All Call information */
-  case 9: // Voice service
-    action = call_service_handler(source, pkt, pkt_size, adspfd, usbfd);
-    break;
+  /* Control packets have a shorter QMI header */
+  if (qmux_header->service == QMI_SERVICE_CONTROL) {
+    msgid = get_control_message_id(pkt, pkt_size);
+  } else if (pkt_size >=
+             sizeof(struct qmux_packet) + sizeof(struct qmi_packet)) {
+    msgid = get_qmi_message_id(pkt, pkt_size);
+  } else {
+    return proxy_rt.default_action[qmux_header->service];
+  }
 
-  case 16: // Location service
-    logger(MSG_DEBUG, "%s Location service packet, MSG ID = %.4x \n", __func__,
-           get_qmi_message_id(pkt, pkt_size));
-    proxy_rt.gps_packet_stats.other++;
-    break;
+  chain_id = table[msgid < PROXY_ROUTE_MSGID_SLOTS ? msgid
+                                                   : PROXY_ROUTE_MSGID_SLOTS];
+  if (chain_id == PROXY_ROUTE_NO_CHAIN) {
+    return proxy_rt.default_action[qmux_header->service];
+  }
 
-  default:
-    break;
+  /* Handlers share a single TLV walk of the frame */
+  if (qmux_header->service != QMI_SERVICE_CONTROL) {
+    build_qmi_tlv_index(&tlv_index, pkt, pkt_size);
+    set_current_tlv_index(&tlv_index);
+  }
+  action = PROXY_ROUTE_CONTINUE;
+  chain = &proxy_rt.chains[chain_id];
+  for (uint8_t i = 0; i < chain->num_routes && action == PROXY_ROUTE_CONTINUE;
+       i++) {
+    route = &proxy_rt.routes[chain->routes[i]];
+    if (route_matches(route, qmux_header->service, msgid, source)) {
+      action = route->handler(source, pkt, pkt_size, adspfd, usbfd);
+    }
+  }
+  set_current_tlv_index(NULL);
+
+  if (action == PROXY_ROUTE_CONTINUE) {
+    return proxy_rt.default_action[qmux_header->service];
   }
-  return action; // 1 == Pass through
+  return action;
 }
 
 /*
@@ -408,99 +630,300 @@ uint8_t is_inject_needed() {
   return 0;
 }
 
+
+uint64_t get_monotonic_time_ms() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+uint64_t get_monotonic_time_us() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+int proxy_watch_fd(int fd) {
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(struct epoll_event));
+  ev.events = EPOLLIN;
+  ev.data.fd = fd;
+  if (epoll_ctl(proxy_rt.epollfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    logger(MSG_ERROR, "%s: Can't watch fd %i: %s\n", __func__, fd,
+           strerror(errno));
+    return -EINVAL;
+  }
+  return 0;
+}
+
+void proxy_unwatch_fd(int fd) {
+  if (epoll_ctl(proxy_rt.epollfd, EPOLL_CTL_DEL, fd, NULL) < 0) {
+    logger(MSG_WARN, "%s: Can't stop watching fd %i\n", __func__, fd);
+  }
+}
+
+void open_gps_nodes(struct node_pair *gps) {
+  if (gps->node1.fd < 0) {
+    gps->node1.fd = open(SMD_GPS, O_RDWR);
+    if (gps->node1.fd < 0) {
+      logger(MSG_ERROR, "%s: Error opening %s \n", __func__, SMD_GPS);
+    } else {
+      proxy_watch_fd(gps->node1.fd);
+    }
+  }
+
+  if (!get_transceiver_suspend_state() && gps->node2.fd < 0) {
+    gps->node2.fd = open(USB_GPS, O_RDWR);
+    if (gps->node2.fd < 0) {
+      logger(MSG_ERROR, "%s: Error opening %s \n", __func__, USB_GPS);
+    } else {
+      proxy_watch_fd(gps->node2.fd);
+    }
+  } else if (gps->node2.fd < 0) {
+    logger(MSG_WARN, "%s: Not trying to open USB GPS \n", __func__);
+  }
+}
+
+void close_gps_node(struct node_def *node) {
+  proxy_unwatch_fd(node->fd);
+  close(node->fd);
+  node->fd = -1;
+}
+
+/* GPS: Node1 -> SMD, Node2 -> USB */
+/*
+ * forward_frame
+ *  Writes a frame we didn't touch to the other side and
+ *  accounts for it in the path's stats
+ */
+int forward_frame(struct pkt_stats *stats, uint8_t source, int targetfd,
+                  uint8_t *buf, ssize_t len) {
+  ssize_t ret;
+  stats->allowed++;
+  ret = write(targetfd, buf, len);
+  if (ret < 1) {
+    logger(MSG_WARN, "%s Error writing to %s\n", __func__,
+           (source == FROM_HOST ? "ADSP" : "HOST"));
+    stats->failed++;
+    return -EIO;
+  }
+  stats->frames[source]++;
+  stats->bytes[source] += ret;
+  return 0;
+}
+
+/* Time from the frame being read to it being written to the other side */
+void record_forward_latency(uint8_t source, uint8_t *buf, ssize_t len,
+                            uint64_t read_at) {
+  if (len >= sizeof(struct qmux_packet)) {
+    metrics_record_forward(source, ((struct qmux_packet *)buf)->service,
+                           get_monotonic_time_us() - read_at);
+  }
+}
+
+void handle_gps_event(struct node_pair *gps, int fd, uint8_t *buf) {
+  ssize_t ret;
+  if (fd == gps->node1.fd) {
+    ret = read(gps->node1.fd, buf, MAX_PACKET_SIZE);
+    if (ret > 0) {
+      dump_packet("GPS_SMD-->USB", buf, ret);
+      if (!get_transceiver_suspend_state() && gps->node2.fd >= 0) {
+        forward_frame(&proxy_rt.gps_packet_stats, FROM_DSP, gps->node2.fd, buf,
+                      ret);
+      } else {
+        proxy_rt.gps_packet_stats.discarded++;
+      }
+    } else {
+      proxy_rt.gps_packet_stats.empty++;
+      logger(MSG_WARN, "%s: Closing at the ADSP side \n", __func__);
+      close_gps_node(&gps->node1);
+    }
+  } else if (fd == gps->node2.fd && !get_transceiver_suspend_state()) {
+    ret = read(gps->node2.fd, buf, MAX_PACKET_SIZE);
+    if (ret > 0) {
+      dump_packet("GPS_SMD<--USB", buf, ret);
+      forward_frame(&proxy_rt.gps_packet_stats, FROM_HOST, gps->node1.fd, buf,
+                    ret);
+    } else {
+      proxy_rt.gps_packet_stats.empty++;
+      logger(MSG_ERROR, "%s: Closing at the USB side \n", __func__);
+      gps->allow_exit = true;
+      close_gps_node(&gps->node2);
+    }
+  }
+}
+
+/* RMNET: Node1 -> RMNET , Node2 -> SMD */
+void handle_rmnet_event(struct node_pair *nodes, uint8_t source, uint8_t *buf) {
+  int sourcefd, targetfd;
+  ssize_t bytes_read;
+  uint64_t read_at;
+  uint8_t action;
+
+  if (source == FROM_DSP) {
+    sourcefd = nodes->node2.fd;
+    targetfd = nodes->node1.fd;
+  } else {
+    sourcefd = nodes->node1.fd;
+    targetfd = nodes->node2.fd;
+  }
+
+  bytes_read = read(sourcefd, buf, MAX_PACKET_SIZE);
+  if (bytes_read < 0) {
+    bytes_read = 0;
+  }
+  read_at = get_monotonic_time_us();
+  action = process_packet(source, buf, bytes_read, nodes->node2.fd,
+                          nodes->node1.fd);
+  if (bytes_read >= sizeof(struct qmux_packet)) {
+    metrics_record_frame(source, ((struct qmux_packet *)buf)->service,
+                         bytes_read, get_monotonic_time_us() - read_at);
+  }
+
+  switch (action) {
+  case PACKET_EMPTY:
+    logger(MSG_WARN, "%s Empty packet on %s, (device closed?)\n", __func__,
+           (source == FROM_HOST ? "HOST" : "ADSP"));
+    proxy_rt.rmnet_packet_stats.empty++;
+    break;
+  case PACKET_PASS_TRHU:
+    logger(MSG_DEBUG, "%s Pass through\n", __func__); // MSG_DEBUG
+    if (source == FROM_HOST || !get_transceiver_suspend_state()) {
+      if (forward_frame(&proxy_rt.rmnet_packet_stats, source, targetfd, buf,
+                        bytes_read) == 0) {
+        record_forward_latency(source, buf, bytes_read, read_at);
+      }
+    } else {
+      proxy_rt.rmnet_packet_stats.discarded++;
+      logger(MSG_DEBUG, "%s Data discarded from %s to %s\n", __func__,
+             (source == FROM_HOST ? "HOST" : "ADSP"),
+             (source == FROM_HOST ? "ADSP" : "HOST"));
+    }
+    break;
+  case PACKET_FORCED_PT:
+    logger(MSG_DEBUG, "%s Force pass through\n", __func__); // MSG_DEBUG
+    if (forward_frame(&proxy_rt.rmnet_packet_stats, source, targetfd, buf,
+                      bytes_read) == 0) {
+      record_forward_latency(source, buf, bytes_read, read_at);
+    }
+    break;
+  case PACKET_BYPASS:
+    proxy_rt.rmnet_packet_stats.bypassed++;
+    logger(MSG_DEBUG, "%s Packet bypassed\n", __func__);
+    break;
+
+  default:
+    logger(MSG_WARN, "%s Default case\n", __func__);
+    break;
+  }
+}
+
+/*
+ * Time to wait in epoll_wait(). We only need to wake up periodically
+ * while there's some internal work in progress (retries, simulated
+ * call timeouts...) or while one of the GPS nodes is still closed.
+ * Otherwise we sleep until there's traffic or someone signals us.
+ */
+int get_proxy_wait_timeout(struct node_pair *gps, uint64_t last_inject) {
+  uint64_t elapsed;
+  if (is_inject_needed()) {
+    elapsed = get_monotonic_time_ms() - last_inject;
+    if (elapsed >= PROXY_INJECT_INTERVAL_MS) {
+      return 0;
+    }
+    return PROXY_INJECT_INTERVAL_MS - elapsed;
+  }
+
+  if (gps->node1.fd < 0 || gps->node2.fd < 0) {
+    return PROXY_GPS_REOPEN_INTERVAL_MS;
+  }
+
+  return -1;
+}
+
 /*
  *  rmnet_proxy
- *    Moves QMI messages between the host and the baseband firmware
+ *    Moves QMI messages between the host and the baseband firmware,
+ *    and NMEA data between the ADSP and the USB GPS port.
  *    It also handles routing to internal (simulated) call and message
  *    functions.
+ *    Everything is driven from a single epoll instance: RMNET_CTL,
+ *    SMD_CNTL, SMD_GPS, USB_GPS and the wakeup eventfd that other
+ *    threads signal when they queue something to inject.
  */
 void *rmnet_proxy(void *node_data) {
   struct node_pair *nodes = (struct node_pair *)node_data;
-  uint8_t sourcefd, targetfd;
-  size_t bytes_read, bytes_written;
-  int8_t source;
-  fd_set readfds;
-  uint8_t buf[MAX_PACKET_SIZE];
-  struct timeval tv;
+  struct node_pair gps_nodes;
+  struct epoll_event events[PROXY_MAX_EVENTS];
+  uint8_t *buf = proxy_rt.io_buf;
+  uint64_t last_inject = 0;
+  uint64_t val;
+  bool woken_up;
+  int i, nfds;
+
+  logger(MSG_INFO, "%s: Initialize RMNET and GPS proxy.\n", __func__);
+  if (build_proxy_route_table() < 0) {
+    logger(MSG_ERROR, "%s: Couldn't build the routing table\n", __func__);
+  }
+
+  proxy_rt.epollfd = epoll_create1(EPOLL_CLOEXEC);
+  if (proxy_rt.epollfd < 0) {
+    logger(MSG_ERROR, "%s: Can't create epoll instance: %s\n", __func__,
+           strerror(errno));
+    return NULL;
+  }
 
-  logger(MSG_INFO, "%s: Initialize RMNET proxy thread.\n", __func__);
+  proxy_watch_fd(nodes->node2.fd); // ADSP
+  proxy_watch_fd(nodes->node1.fd); // USB
+  if (proxy_rt.wakeup_fd >= 0) {
+    proxy_watch_fd(proxy_rt.wakeup_fd);
+  }
+
+  memset(&gps_nodes, 0, sizeof(struct node_pair));
+  gps_nodes.node1.fd = -1;
+  gps_nodes.node2.fd = -1;
 
   while (1) {
-    source = -1;
-    sourcefd = -1;
-    targetfd = -1;
-    FD_ZERO(&readfds);
-    memset(buf, 0, sizeof(buf));
-    FD_SET(nodes->node2.fd, &readfds); // Always add ADSP
-    FD_SET(nodes->node1.fd, &readfds); // Testing: add usb always too
-
-    tv.tv_sec = 0;
-    tv.tv_usec = 500000;
-    select(MAX_FD, &readfds, NULL, NULL, &tv);
-    if (FD_ISSET(nodes->node2.fd, &readfds)) {
-      source = FROM_DSP;
-      sourcefd = nodes->node2.fd;
-      targetfd = nodes->node1.fd;
-    } else if (FD_ISSET(nodes->node1.fd, &readfds)) {
-      source = FROM_HOST;
-      sourcefd = nodes->node1.fd;
-      targetfd = nodes->node2.fd;
-    } else if (is_inject_needed()) {
-      source = FROM_OPENQTI;
-      logger(MSG_DEBUG,
-             "%s: OpenQTI needs to take over communication between the host "
-             "and the baseband \n",
-             __func__);
-      process_simulated_packet(source, nodes->node2.fd, nodes->node1.fd);
+    if (gps_nodes.node1.fd < 0 || gps_nodes.node2.fd < 0) {
+      open_gps_nodes(&gps_nodes);
     }
 
-    /* We've set it all up, now we do the work */
-    if (source == FROM_HOST || source == FROM_DSP) {
-      bytes_read = read(sourcefd, &buf, MAX_PACKET_SIZE);
-      switch (process_packet(source, buf, bytes_read, nodes->node2.fd,
-                             nodes->node1.fd)) {
-      case PACKET_EMPTY:
-        logger(MSG_WARN, "%s Empty packet on %s, (device closed?)\n", __func__,
-               (source == FROM_HOST ? "HOST" : "ADSP"));
-        proxy_rt.rmnet_packet_stats.empty++;
-        break;
-      case PACKET_PASS_TRHU:
-        logger(MSG_DEBUG, "%s Pass through\n", __func__); // MSG_DEBUG
-        if (!get_transceiver_suspend_state() || source == FROM_HOST) {
-          proxy_rt.rmnet_packet_stats.allowed++;
-          bytes_written = write(targetfd, buf, bytes_read);
-          if (bytes_written < 1) {
-            logger(MSG_WARN, "%s Error writing to %s\n", __func__,
-                   (source == FROM_HOST ? "ADSP" : "HOST"));
-            proxy_rt.rmnet_packet_stats.failed++;
-          }
-        } else {
-          proxy_rt.rmnet_packet_stats.discarded++;
-          logger(MSG_DEBUG, "%s Data discarded from %s to %s\n", __func__,
-                 (source == FROM_HOST ? "HOST" : "ADSP"),
-                 (source == FROM_HOST ? "ADSP" : "HOST"));
-        }
-        break;
-      case PACKET_FORCED_PT:
-        logger(MSG_DEBUG, "%s Force pass through\n", __func__); // MSG_DEBUG
-        proxy_rt.rmnet_packet_stats.allowed++;
-        bytes_written = write(targetfd, buf, bytes_read);
-        if (bytes_written < 1) {
-          logger(MSG_WARN, "%s [FPT] Error writing to %s\n", __func__,
-                 (source == FROM_HOST ? "ADSP" : "HOST"));
-          proxy_rt.rmnet_packet_stats.failed++;
+    woken_up = false;
+    nfds = epoll_wait(proxy_rt.epollfd, events, PROXY_MAX_EVENTS,
+                      get_proxy_wait_timeout(&gps_nodes, last_inject));
+    if (nfds < 0) {
+      if (errno != EINTR) {
+        logger(MSG_ERROR, "%s: epoll_wait failed: %s\n", __func__,
+               strerror(errno));
+      }
+      continue;
+    }
+
+    for (i = 0; i < nfds; i++) {
+      if (events[i].data.fd == proxy_rt.wakeup_fd) {
+        if (read(proxy_rt.wakeup_fd, &val, sizeof(uint64_t)) < 0) {
+          logger(MSG_DEBUG, "%s: Wakeup event already consumed\n", __func__);
         }
-        break;
-      case PACKET_BYPASS:
-        proxy_rt.rmnet_packet_stats.bypassed++;
-        logger(MSG_DEBUG, "%s Packet bypassed\n", __func__);
-        break;
-
-      default:
-        logger(MSG_WARN, "%s Default case\n", __func__);
-        break;
+        woken_up = true;
+      } else if (events[i].data.fd == nodes->node2.fd) {
+        handle_rmnet_event(nodes, FROM_DSP, buf);
+      } else if (events[i].data.fd == nodes->node1.fd) {
+        handle_rmnet_event(nodes, FROM_HOST, buf);
+      } else {
+        handle_gps_event(&gps_nodes, events[i].data.fd, buf);
       }
     }
+
+    if ((woken_up || get_monotonic_time_ms() - last_inject >=
+                         PROXY_INJECT_INTERVAL_MS) &&
+        is_inject_needed()) {
+      logger(MSG_DEBUG,
+             "%s: OpenQTI needs to take over communication between the host "
+             "and the baseband \n",
+             __func__);
+      process_simulated_packet(FROM_OPENQTI, nodes->node2.fd, nodes->node1.fd);
+      last_inject = get_monotonic_time_ms();
+    }
   } // end of infinite loop
 
   return NULL;
@@ -6,15 +6,19 @@
 #include "ipc.h"
 #include "logger.h"
 #include "openqti.h"
+#include "proxy.h"
 #include "sms.h"
 #include "wds.h"
 #include "voice.h"
 #include "nas.h"
 #include <endian.h>
 #include <errno.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/file.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <time.h>
@@ -22,10 +26,19 @@
 
 struct {
   uint8_t is_initialized;
-  uint8_t has_pending_message;
   int fd;
+  int wakeup_fd;
   struct qmi_service_bindings services[QMI_SERVICES_LAST];
-} internal_qmi_client;
+  /* Services that have a queue, so we don't scan all of them */
+  pthread_mutex_t queue_lock;
+  _Atomic uint8_t queue_count;
+  uint8_t queued_services[QMI_MAX_QUEUES];
+} internal_qmi_client = {
+    .is_initialized = 0,
+    .fd = -1,
+    .wakeup_fd = -1,
+    .queue_lock = PTHREAD_MUTEX_INITIALIZER,
+};
 
 /*
  *
@@ -49,19 +62,6 @@ uint8_t get_qmux_instance_id(void *bytes, size_t len) {
   return pkt->instance_id;
 }
 
-/* Set current instance in QMUX header and transaction id in qmi header*/
-void prepare_internal_pkt(void *bytes, size_t len) {
-  struct qmux_packet *pkt = (struct qmux_packet *)bytes;
-  pkt->instance_id = internal_qmi_client.services[pkt->service].instance;
-  struct qmi_packet *qmi =
-      (struct qmi_packet *)(bytes + sizeof(struct qmux_packet));
-  qmi->transaction_id =
-      internal_qmi_client.services[pkt->service].transaction_id;
-
-  pkt = NULL;
-  qmi = NULL;
-}
-
 /* Get Message ID from a QMI control message*/
 uint16_t get_control_message_id(void *bytes, size_t len) {
   struct ctl_qmi_packet *pkt =
@@ -99,6 +99,129 @@ uint16_t get_transaction_id(void *bytes, size_t len) {
   return pkt->qmi.transaction_id;
 }
 
+/*
+ * Index of the frame this thread is handling right now, set by
+ * the proxy and the internal client while handlers run, so every
+ * TLV lookup on that frame uses it. It's dropped as soon as the
+ * buffer holds something else: a new QMI header or a message
+ * being built in it
+ */
+__thread struct qmi_tlv_index *current_tlv_index;
+
+/*
+ * Walks the TLVs of a packet once and stores where each one is
+ * Returns the number of TLVs, or -EINVAL if one of them doesn't fit
+ * in the packet (the ones before it are still indexed)
+ */
+int build_qmi_tlv_index(struct qmi_tlv_index *index, uint8_t *buf,
+                        size_t len) {
+  size_t cur_byte = sizeof(struct encapsulated_qmi_packet);
+  struct empty_tlv *this_tlv;
+  uint16_t tlv_len;
+
+  index->buf = buf;
+  index->len = len;
+  if (len >= sizeof(struct encapsulated_qmi_packet)) {
+    memcpy(&index->header, buf + sizeof(struct qmux_packet),
+           sizeof(struct qmi_packet));
+  } else {
+    memset(&index->header, 0, sizeof(struct qmi_packet));
+  }
+  index->num_tlvs = 0;
+  index->is_valid = true;
+  index->is_truncated = false;
+  memset(index->present, 0, sizeof(index->present));
+
+  while (cur_byte < len) {
+    if (cur_byte + sizeof(struct empty_tlv) > len) {
+      index->is_valid = false;
+      break;
+    }
+    this_tlv = (struct empty_tlv *)(buf + cur_byte);
+    tlv_len = le16toh(this_tlv->len);
+    if (cur_byte + sizeof(struct empty_tlv) + tlv_len > len) {
+      logger(MSG_ERROR, "%s: TLV 0x%.2x exceeds packet size\n", __func__,
+             this_tlv->id);
+      index->is_valid = false;
+      break;
+    }
+    if (index->num_tlvs >= QMI_MAX_INDEXED_TLVS) {
+      index->is_truncated = true;
+      break;
+    }
+    index->tlvs[index->num_tlvs].id = this_tlv->id;
+    index->tlvs[index->num_tlvs].offset = cur_byte;
+    index->tlvs[index->num_tlvs].size = tlv_len;
+    index->present[this_tlv->id >> 5] |= 1U << (this_tlv->id & 0x1f);
+    index->num_tlvs++;
+    cur_byte += sizeof(struct empty_tlv) + tlv_len;
+  }
+
+  return index->is_valid ? index->num_tlvs : -EINVAL;
+}
+
+/* Same as get_tlv_offset_by_id, but on an index: 0 if not found */
+uint16_t get_tlv_offset_from_index(struct qmi_tlv_index *index,
+                                   uint8_t tlvid) {
+  if (index->present[tlvid >> 5] & (1U << (tlvid & 0x1f))) {
+    for (uint8_t i = 0; i < index->num_tlvs; i++) {
+      if (index->tlvs[i].id == tlvid) {
+        return index->tlvs[i].offset;
+      }
+    }
+  }
+  /* It might be in the part we couldn't index */
+  if (index->is_truncated) {
+    return get_tlv_offset_by_id(index->buf, index->len, tlvid);
+  }
+  return 0;
+}
+
+/* Set (or clear, with NULL) the index of the frame being handled */
+void set_current_tlv_index(struct qmi_tlv_index *index) {
+  current_tlv_index = index;
+}
+
+/* Drops the current index if it points into this buffer */
+void invalidate_tlv_index(void *buf) {
+  if (current_tlv_index != NULL && current_tlv_index->buf == buf) {
+    current_tlv_index = NULL;
+  }
+}
+
+/*
+ * Returns the current frame's index if it's for this packet. Same
+ * buffer and size isn't enough, the buffer might have been reused
+ * for another message: its QMI header has to match too
+ */
+struct qmi_tlv_index *find_current_tlv_index(void *buf, size_t len) {
+  if (current_tlv_index == NULL || current_tlv_index->buf != buf ||
+      current_tlv_index->len != len || current_tlv_index->is_truncated) {
+    return NULL;
+  }
+  if (len < sizeof(struct encapsulated_qmi_packet) ||
+      memcmp(&current_tlv_index->header,
+             (uint8_t *)buf + sizeof(struct qmux_packet),
+             sizeof(struct qmi_packet)) != 0) {
+    current_tlv_index = NULL;
+    return NULL;
+  }
+  return current_tlv_index;
+}
+
+/*
+ * Gets the index for a packet: the one of the current frame if
+ * it's the same packet, or builds a new one in fallback
+ */
+struct qmi_tlv_index *get_tlv_index(uint8_t *buf, size_t len,
+                                    struct qmi_tlv_index *fallback) {
+  if (find_current_tlv_index(buf, len) != NULL) {
+    return current_tlv_index;
+  }
+  build_qmi_tlv_index(fallback, buf, len);
+  return fallback;
+}
+
 /* Looks for the request TLV, and if found, it returns the offset
  * so it can be casted later
  * Not all the modem handling daemons send TLVs in the same order,
@@ -114,6 +237,11 @@ uint16_t get_tlv_offset_by_id(uint8_t *bytes, size_t len, uint8_t tlvid) {
     return 0;
   }
 
+  /* The frame we're handling is already indexed */
+  if (find_current_tlv_index(bytes, len) != NULL) {
+    return get_tlv_offset_from_index(current_tlv_index, tlvid);
+  }
+
   cur_byte = sizeof(struct encapsulated_qmi_packet);
   while ((cur_byte) < len) {
     this_tlv = (struct empty_tlv *)(arr + cur_byte);
@@ -168,7 +296,16 @@ uint16_t did_qmi_op_fail(uint8_t *bytes, size_t len) {
     return result;
   }
 
-  cur_byte = sizeof(struct encapsulated_qmi_packet);
+  /* The frame we're handling is already indexed, jump to the result */
+  if (find_current_tlv_index(bytes, len) != NULL) {
+    cur_byte = get_tlv_offset_from_index(current_tlv_index, 0x02);
+    if (cur_byte == 0) {
+      logger(MSG_WARN, "%s: Couldn't find an indication TLV\n", __func__);
+      return QMI_RESULT_UNKNOWN;
+    }
+  } else {
+    cur_byte = sizeof(struct encapsulated_qmi_packet);
+  }
   while ((cur_byte) < len) {
     this_tlv = (struct qmi_generic_result_ind *)(arr + cur_byte);
     if (this_tlv->result_code_type == 0x02 &&
@@ -212,6 +349,8 @@ int build_qmux_header(void *output, size_t output_len, uint8_t control,
            __func__);
     return -ENOMEM;
   }
+  /* Whatever was indexed in this buffer is gone */
+  invalidate_tlv_index(output);
   struct qmux_packet *pkt = (struct qmux_packet *)output;
   pkt->version = 0x01;
   pkt->packet_length =
@@ -234,6 +373,7 @@ int build_qmi_header(void *output, size_t output_len, uint8_t ctlid,
            __func__);
     return -ENOMEM;
   }
+  invalidate_tlv_index(output);
   struct qmi_packet *pkt =
       (struct qmi_packet *)(output + sizeof(struct qmux_packet));
   pkt->ctlid = ctlid;
@@ -286,6 +426,10 @@ uint16_t count_tlvs_in_message(uint8_t *bytes, size_t len) {
     return 0;
   }
 
+  if (find_current_tlv_index(bytes, len) != NULL) {
+    return current_tlv_index->num_tlvs;
+  }
+
   cur_byte = sizeof(struct encapsulated_qmi_packet);
   while ((cur_byte) < len) {
     this_tlv = (struct empty_tlv *)(arr + cur_byte);
@@ -306,13 +450,17 @@ uint16_t count_tlvs_in_message(uint8_t *bytes, size_t len) {
 /* INTERNAL QMI CLIENT */
 
 /*
- * Signals to the proxy thread that some internal service has a pending message
+ * Wakes up the client thread so it sends what was just queued
  */
-void set_pending_message(uint8_t service) {
-  logger(MSG_DEBUG, "%s: Pending QMI message for service %.2x\n", __func__,
-         service);
-  internal_qmi_client.services[service].has_pending_message = 1;
-  internal_qmi_client.has_pending_message = 1;
+void wake_up_qmi_client() {
+  uint64_t val = 1;
+  if (internal_qmi_client.wakeup_fd < 0) {
+    return; // The client thread will pick it up when it starts
+  }
+  if (write(internal_qmi_client.wakeup_fd, &val, sizeof(val)) < 0) {
+    logger(MSG_DEBUG, "%s: Client thread already has a pending wakeup\n",
+           __func__);
+  }
 }
 
 /*
@@ -379,45 +527,107 @@ int allocate_qmi_client(uint8_t service) {
 }
 
 /*
- * Returns either 1 or 0 if there's a pending message to deliver
- * to the baseband
+ * Gets the outgoing queue for a service, creating it the first
+ * time somebody wants to talk to that service
  */
-uint8_t is_internal_qmi_message_pending() {
-  if (internal_qmi_client.has_pending_message) {
-    logger(MSG_DEBUG, "%s: Pending messages found\n", __func__);
-    return 1;
+struct qmi_message_queue *get_queue_for_service(uint8_t service) {
+  struct qmi_message_queue *queue;
+  queue = atomic_load_explicit(&internal_qmi_client.services[service].queue,
+                               memory_order_acquire);
+  if (queue != NULL) {
+    return queue;
   }
-  return 0;
+
+  pthread_mutex_lock(&internal_qmi_client.queue_lock);
+  queue = atomic_load_explicit(&internal_qmi_client.services[service].queue,
+                               memory_order_acquire);
+  if (queue == NULL) {
+    uint8_t count = atomic_load(&internal_qmi_client.queue_count);
+    if (count >= QMI_MAX_QUEUES) {
+      logger(MSG_ERROR, "%s: Too many services, can't add %.2x\n", __func__,
+             service);
+      pthread_mutex_unlock(&internal_qmi_client.queue_lock);
+      return NULL;
+    }
+    queue = calloc(1, sizeof(struct qmi_message_queue));
+    for (uint32_t i = 0; i < QMI_QUEUE_SIZE; i++) {
+      atomic_init(&queue->slots[i].seq, i);
+    }
+    internal_qmi_client.services[service].service = service;
+    atomic_store_explicit(&internal_qmi_client.services[service].queue, queue,
+                          memory_order_release);
+    internal_qmi_client.queued_services[count] = service;
+    atomic_store(&internal_qmi_client.queue_count, count + 1);
+  }
+  pthread_mutex_unlock(&internal_qmi_client.queue_lock);
+  return queue;
 }
 
 /*
- * Clears the buffer and the pending flag after sending a message
- * to the baseband
+ * Claims a slot and stores the message in it. Never blocks, if
+ * the queue is full we just tell the caller
  */
-void clear_message_for_service(uint8_t service) {
-  if (service > QMI_SERVICES_LAST) {
-    logger(MSG_ERROR, "%s: Invalid service %.2x!!\n", __func__, service);
-    return;
+int qmi_queue_push(struct qmi_message_queue *queue,
+                   struct qmi_pending_request *request) {
+  struct qmi_queue_slot *slot;
+  uint32_t pos, seq;
+  int32_t diff;
+
+  pos = atomic_load_explicit(&queue->head, memory_order_relaxed);
+  for (;;) {
+    slot = &queue->slots[pos & QMI_QUEUE_MASK];
+    seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    diff = (int32_t)(seq - pos);
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(&queue->head, &pos, pos + 1,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      return -ENOSPC;
+    } else {
+      pos = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    }
   }
 
-  if (internal_qmi_client.services[service].message == NULL) {
-    logger(MSG_ERROR, "%s: Message for %.2x is already NULL!\n", __func__,
-           service);
-    return;
+  slot->request = *request;
+  atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+  return 0;
+}
+
+/* Looks at the oldest message without removing it (client thread only) */
+bool qmi_queue_peek(struct qmi_message_queue *queue,
+                    struct qmi_pending_request **request) {
+  struct qmi_queue_slot *slot = &queue->slots[queue->tail & QMI_QUEUE_MASK];
+  if (atomic_load_explicit(&slot->seq, memory_order_acquire) !=
+      queue->tail + 1) {
+    return false;
   }
+  *request = &slot->request;
+  return true;
+}
+
+/* Releases the oldest slot back to the producers (client thread only) */
+void qmi_queue_pop(struct qmi_message_queue *queue) {
+  struct qmi_queue_slot *slot = &queue->slots[queue->tail & QMI_QUEUE_MASK];
+  memset(&slot->request, 0, sizeof(struct qmi_pending_request));
+  atomic_store_explicit(&slot->seq, queue->tail + QMI_QUEUE_SIZE,
+                        memory_order_release);
+  queue->tail++;
+}
 
-  free(internal_qmi_client.services[service].message);
-  internal_qmi_client.services[service].message = NULL;
-  internal_qmi_client.services[service].message_len = 0;
-  internal_qmi_client.services[service].has_pending_message = 0;
-  logger(MSG_DEBUG, "%s: Message for %.2x cleared.\n", __func__, service);
+bool is_qmi_queue_empty(struct qmi_message_queue *queue) {
+  struct qmi_queue_slot *slot = &queue->slots[queue->tail & QMI_QUEUE_MASK];
+  return atomic_load_explicit(&slot->seq, memory_order_acquire) !=
+         queue->tail + 1;
 }
 
 /*
  * Set the transaction_id to 0 for a service
  */
 void clear_current_transaction_id(uint8_t service) {
-  if (service > QMI_SERVICES_LAST) {
+  if (service >= QMI_SERVICES_LAST) {
     logger(MSG_ERROR, "%s: Invalid service %.2x!!\n", __func__, service);
     return;
   }
@@ -428,147 +638,291 @@ void clear_current_transaction_id(uint8_t service) {
  * Get last transaction_id for a service
  */
 uint16_t get_transaction_id_for_service(uint8_t service) {
-  if (service > QMI_SERVICES_LAST) {
+  if (service >= QMI_SERVICES_LAST) {
     logger(MSG_ERROR, "%s: Invalid service %.2x!!\n", __func__, service);
     return 0;
   }
   return internal_qmi_client.services[service].transaction_id;
 }
 
+/* Transaction ID 0 is never used for requests */
+uint16_t get_next_transaction_id(struct qmi_service_bindings *svc) {
+  svc->transaction_id++;
+  if (svc->transaction_id == 0) {
+    svc->transaction_id = 1;
+  }
+  return svc->transaction_id;
+}
+
+void remove_inflight_request(struct qmi_service_bindings *svc, uint8_t i) {
+  svc->inflight_count--;
+  svc->inflight[i] = svc->inflight[svc->inflight_count];
+}
+
+/* Puts a response time in its histogram bucket */
+void account_qmi_latency(struct qmi_service_bindings *svc, uint64_t elapsed) {
+  uint8_t bucket = 0;
+  while (bucket < QMI_LATENCY_BUCKETS - 1 && elapsed >= (1ULL << bucket)) {
+    bucket++;
+  }
+  svc->latency.buckets[bucket]++;
+  svc->latency.responses++;
+  svc->latency.total_ms += elapsed;
+  if (elapsed > svc->latency.max_ms) {
+    svc->latency.max_ms = elapsed;
+  }
+}
+
 /*
- * Set a transaction ID for a service
+ * Gets the upper bound (in ms) of the bucket where the given
+ * percentile of the responses falls
  */
-void set_transaction_id_for_service(uint8_t service, uint16_t transaction_id) {
-  if (service > QMI_SERVICES_LAST) {
-    logger(MSG_ERROR, "%s: Invalid service %.2x!!\n", __func__, service);
-    return;
+uint32_t get_qmi_latency_percentile(struct qmi_latency_stats *stats,
+                                    uint8_t percent) {
+  uint64_t target, seen = 0;
+  if (stats->responses == 0) {
+    return 0;
+  }
+  target = ((uint64_t)stats->responses * percent + 99) / 100;
+  for (uint8_t i = 0; i < QMI_LATENCY_BUCKETS; i++) {
+    seen += stats->buckets[i];
+    if (seen >= target) {
+      return 1U << i;
+    }
   }
-  internal_qmi_client.services[service].transaction_id = transaction_id;
+  return stats->max_ms;
+}
+
+struct qmi_latency_stats get_qmi_latency_stats(uint8_t service) {
+  struct qmi_latency_stats stats = {0};
+  if (service < QMI_SERVICES_LAST) {
+    stats = internal_qmi_client.services[service].latency;
+  }
+  return stats;
 }
 
 /*
- * Looks for pending internal messages and dispatches them from the service
+ * Forgets about requests the baseband didn't answer before their
+ * deadline, so they don't hold the service forever, and tells
+ * whoever was waiting for them
  */
-int send_pending_internal_qmi_messages() {
-  uint8_t clear_pending_flag = 1;
-  if (!internal_qmi_client.has_pending_message) {
-    logger(MSG_WARN, "%s was called with no pending messages!\n", __func__);
-    return -EINVAL;
+void expire_inflight_requests(struct qmi_service_bindings *svc, uint64_t now) {
+  struct qmi_inflight_request request;
+  for (int i = svc->inflight_count - 1; i >= 0; i--) {
+    if (now >= svc->inflight[i].deadline) {
+      request = svc->inflight[i];
+      logger(MSG_WARN,
+             "%s: No response for message %.4x to service %.2x (TID %.4x)\n",
+             __func__, request.msgid, svc->service, request.transaction_id);
+      remove_inflight_request(svc, i);
+      svc->latency.timeouts++;
+      if (request.callback != NULL) {
+        request.callback(NULL, 0, -ETIMEDOUT, request.data);
+      }
+    }
+  }
+}
+
+/*
+ * Same thing, but for requests that didn't even leave the queue
+ * (i.e. the service never got a client)
+ */
+void expire_queued_requests(struct qmi_service_bindings *svc,
+                            struct qmi_message_queue *queue, uint64_t now) {
+  struct qmi_pending_request *request;
+  while (qmi_queue_peek(queue, &request) && now >= request->deadline) {
+    logger(MSG_WARN, "%s: Message for service %.2x expired in the queue\n",
+           __func__, svc->service);
+    svc->latency.timeouts++;
+    if (request->callback != NULL) {
+      request->callback(NULL, 0, -ETIMEDOUT, request->data);
+    }
+    free(request->message);
+    qmi_queue_pop(queue);
+  }
+}
+
+/*
+ * Matches a response with the request we sent
+ * Returns 1 if its callback took care of it, 0 if we were waiting
+ * for it but nobody asked to be called back, and -ENOENT otherwise
+ */
+int complete_inflight_request(uint8_t *buf, size_t buf_len) {
+  struct qmi_service_bindings *svc;
+  struct qmi_inflight_request request;
+  uint8_t instance = get_qmux_instance_id(buf, buf_len);
+  uint16_t transaction_id = get_transaction_id(buf, buf_len);
+  uint64_t elapsed;
+
+  svc = &internal_qmi_client.services[get_qmux_service_id(buf, buf_len)];
+  for (uint8_t i = 0; i < svc->inflight_count; i++) {
+    if (svc->inflight[i].instance == instance &&
+        svc->inflight[i].transaction_id == transaction_id) {
+      request = svc->inflight[i];
+      elapsed = get_monotonic_time_ms() - request.sent_at;
+      logger(MSG_DEBUG, "%s: Service %.2x answered TID %.4x after %u ms\n",
+             __func__, svc->service, transaction_id, (uint32_t)elapsed);
+      remove_inflight_request(svc, i);
+      account_qmi_latency(svc, elapsed);
+      if (request.callback != NULL) {
+        request.callback(buf, buf_len, 0, request.data);
+        return 1;
+      }
+      return 0;
+    }
+  }
+  return -ENOENT;
+}
+
+/*
+ * Sends as much as we can from a service's queue
+ * If the service doesn't have a client yet, we request it and
+ * leave the queue alone until the baseband gives us one.
+ * Returns 1 if we still have to come back to this service
+ */
+int send_pending_messages_for_service(struct qmi_service_bindings *svc,
+                                      uint64_t now) {
+  struct qmi_message_queue *queue;
+  struct qmi_pending_request *request;
+  struct qmi_inflight_request *inflight;
+  struct qmux_packet *qmux;
+  struct qmi_packet *qmi;
+
+  queue = atomic_load_explicit(&svc->queue, memory_order_acquire);
+  if (queue == NULL) {
+    return 0;
+  }
+
+  if (svc->inflight_count > 0) {
+    expire_inflight_requests(svc, now);
+  }
+
+  if (!svc->is_initialized) {
+    expire_queued_requests(svc, queue, now);
   }
-  for (uint8_t i = 0; i < QMI_SERVICES_LAST; i++) {
-    if (internal_qmi_client.services[i].has_pending_message) {
-      if (!internal_qmi_client.services[i].is_initialized) {
-        /*
-         * Try to allocate a new client, but don't send the pending message
-         * just yet, but wait for next pass. This avoids hogging the port
-         * if the client fails to be allocated and allows for the rest of the
-         * stack to keep working
-         */
-        if (allocate_qmi_client(i) < 0) {
-          logger(MSG_ERROR, "%s: Failed to allocate client: SVC %.2x\n",
-                 __func__, i);
-        } else {
-          logger(MSG_INFO,
-                 "%s: Requested allocation to svc %.2x. On next pass we'll "
-                 "send the pending message\n",
-                 __func__, i);
-        }
 
+  if (!is_qmi_queue_empty(queue) && !svc->is_initialized) {
+    /*
+     * Try to allocate a new client, but don't send anything until
+     * the baseband answers. This avoids hogging the port if the
+     * client fails to be allocated and allows for the rest of the
+     * stack to keep working
+     */
+    if (svc->allocation_requested_at == 0 ||
+        now - svc->allocation_requested_at >= QMI_ALLOCATION_RETRY_MS) {
+      if (allocate_qmi_client(svc->service) < 0) {
+        logger(MSG_ERROR, "%s: Failed to allocate client: SVC %.2x\n",
+               __func__, svc->service);
       } else {
-        switch (i) {          /* Just to add some debugging here */
-        case QMI_SERVICE_WDS: // Wireless Data Service
-          logger(MSG_INFO, "%s: Pending message for WDS\n", __func__);
-          prepare_internal_pkt(internal_qmi_client.services[i].message,
-                               internal_qmi_client.services[i].message_len);
-          write_to_qmi_port(internal_qmi_client.services[i].message,
-                            internal_qmi_client.services[i].message_len);
-          clear_message_for_service(i);
-          break;
-
-        case QMI_SERVICE_DMS: // Device Management Service
-          logger(MSG_DEBUG, "%s: Pending message for DMS\n", __func__);
-          prepare_internal_pkt(internal_qmi_client.services[i].message,
-                               internal_qmi_client.services[i].message_len);
-          write_to_qmi_port(internal_qmi_client.services[i].message,
-                            internal_qmi_client.services[i].message_len);
-          clear_message_for_service(i);
-          break;
-
-        case QMI_SERVICE_VOICE: // Voice Service (9)
-          logger(MSG_INFO, "%s: Pending message for Voice\n", __func__);
-          prepare_internal_pkt(internal_qmi_client.services[i].message,
-                               internal_qmi_client.services[i].message_len);
-          write_to_qmi_port(internal_qmi_client.services[i].message,
-                            internal_qmi_client.services[i].message_len);
-          clear_message_for_service(i);
-          break;
-
-        case QMI_SERVICE_NAS: // Network Access Service
-          logger(MSG_DEBUG, "%s: Pending message for NAS\n", __func__);
-          prepare_internal_pkt(internal_qmi_client.services[i].message,
-                               internal_qmi_client.services[i].message_len);
-          write_to_qmi_port(internal_qmi_client.services[i].message,
-                            internal_qmi_client.services[i].message_len);
-          clear_message_for_service(i);
-          break;
-
-        default:
-          logger(MSG_ERROR, "%s: Unknown service %.2x, discarding the flag\n",
-                 __func__, i);
-          internal_qmi_client.services[i].has_pending_message = 0;
-          break;
-        }
+        logger(MSG_INFO, "%s: Requested allocation to svc %.2x\n", __func__,
+               svc->service);
       }
+      svc->allocation_requested_at = now;
     }
+    return 1;
   }
 
-  for (uint8_t i = 0; i < QMI_SERVICES_LAST; i++) {
-    if (internal_qmi_client.services[i].has_pending_message == 1) {
-      clear_pending_flag = 0;
+  while (svc->inflight_count < QMI_MAX_INFLIGHT &&
+         qmi_queue_peek(queue, &request)) {
+    qmux = (struct qmux_packet *)request->message;
+    qmi = (struct qmi_packet *)(request->message + sizeof(struct qmux_packet));
+    qmux->instance_id = svc->instance;
+    qmi->transaction_id = get_next_transaction_id(svc);
+    logger(MSG_DEBUG, "%s: Sending message %.4x to service %.2x (TID %.4x)\n",
+           __func__, qmi->msgid, svc->service, qmi->transaction_id);
+    if (write_to_qmi_port(request->message, request->len) < request->len) {
+      logger(MSG_ERROR, "%s: Failed to send message %.4x to service %.2x\n",
+             __func__, qmi->msgid, svc->service);
+      if (request->callback != NULL) {
+        request->callback(NULL, 0, -EIO, request->data);
+      }
+    } else {
+      inflight = &svc->inflight[svc->inflight_count];
+      inflight->instance = svc->instance;
+      inflight->transaction_id = qmi->transaction_id;
+      inflight->msgid = qmi->msgid;
+      inflight->sent_at = now;
+      inflight->deadline = request->deadline;
+      inflight->callback = request->callback;
+      inflight->data = request->data;
+      svc->inflight_count++;
     }
+    free(request->message);
+    qmi_queue_pop(queue);
   }
-  if (clear_pending_flag) {
-    internal_qmi_client.has_pending_message = 0;
-    logger(MSG_DEBUG, "%s: Pending flag cleared\n", __func__);
+
+  return (!is_qmi_queue_empty(queue) || svc->inflight_count > 0);
+}
+
+/*
+ * Sends pending internal messages from every service that has a queue
+ * Returns 1 if something is still waiting on the baseband
+ */
+int send_pending_internal_qmi_messages() {
+  uint64_t now = get_monotonic_time_ms();
+  uint8_t count = atomic_load(&internal_qmi_client.queue_count);
+  int needs_tick = 0;
+
+  for (uint8_t i = 0; i < count; i++) {
+    if (send_pending_messages_for_service(
+            &internal_qmi_client
+                 .services[internal_qmi_client.queued_services[i]],
+            now)) {
+      needs_tick = 1;
+    }
   }
-  return 0;
+  return needs_tick;
 }
+
 /*
  * This is called from each client to add a message to the pool
+ * It doesn't wait: the message is copied to the service's queue
+ * and the client thread picks it up straight away. If a callback
+ * is set, it gets the response instead of the service handler,
+ * or -ETIMEDOUT if it doesn't arrive within timeout_ms
  */
-int add_pending_message(uint8_t service, uint8_t *buf, size_t buf_len) {
-  uint8_t retries = 25;
-  uint8_t *temporary_buffer = malloc(buf_len);
-  if (service > QMI_SERVICES_LAST) {
-    logger(MSG_ERROR, "%s: Invalid Service ID: %.2x\n", __func__);
-    free(temporary_buffer);
+int add_pending_message_with_callback(uint8_t service, uint8_t *buf,
+                                      size_t buf_len, qmi_response_cb callback,
+                                      void *data, uint32_t timeout_ms) {
+  struct qmi_message_queue *queue;
+  struct qmi_pending_request request;
+  if (service >= QMI_SERVICES_LAST) {
+    logger(MSG_ERROR, "%s: Invalid Service ID: %.2x\n", __func__, service);
     return -EINVAL;
   }
-  memcpy(temporary_buffer, buf, buf_len);
-  while (internal_qmi_client.services[service].has_pending_message &&
-         retries > 0) {
-    logger(MSG_DEBUG,
-           "%s: The QMI Service %.2x already has something pending. waiting...\n",
-           __func__, service);
-    sleep(1);
-    retries--;
+  if (buf_len < sizeof(struct qmux_packet) + sizeof(struct qmi_packet)) {
+    logger(MSG_ERROR, "%s: Message for service %.2x is too small\n", __func__,
+           service);
+    return -EINVAL;
   }
 
-  if (!internal_qmi_client.services[service].has_pending_message) {
-    internal_qmi_client.services[service].message = malloc(buf_len);
-    internal_qmi_client.services[service].message_len = buf_len;
-    memcpy(internal_qmi_client.services[service].message, temporary_buffer,
-           buf_len);
-    free(temporary_buffer);
-    internal_qmi_client.services[service].has_pending_message = 1;
-    internal_qmi_client.has_pending_message = 1;
-    return 0;
+  queue = get_queue_for_service(service);
+  if (queue == NULL) {
+    return -ENOMEM;
+  }
+
+  request.message = malloc(buf_len);
+  memcpy(request.message, buf, buf_len);
+  request.len = buf_len;
+  request.callback = callback;
+  request.data = data;
+  request.deadline = get_monotonic_time_ms() + timeout_ms;
+  if (qmi_queue_push(queue, &request) < 0) {
+    logger(MSG_ERROR,
+           "%s: Queue for service %.2x is full, dropping message of %u "
+           "bytes!\n",
+           __func__, service, buf_len);
+    free(request.message);
+    return -ENOSPC;
   }
 
-  logger(MSG_ERROR, "%s: Failed to add pending message for service %.2x of %u bytes!\n",
-         __func__, service, buf_len);
-  free(temporary_buffer);
-  return -EINVAL;
+  wake_up_qmi_client();
+  return 0;
+}
+
+int add_pending_message(uint8_t service, uint8_t *buf, size_t buf_len) {
+  return add_pending_message_with_callback(service, buf, buf_len, NULL, NULL,
+                                           QMI_REQUEST_TIMEOUT_MS);
 }
 
 int handle_incoming_qmi_control_message(uint8_t *buf, size_t buf_len) {
@@ -589,7 +943,7 @@ int handle_incoming_qmi_control_message(uint8_t *buf, size_t buf_len) {
         internal_qmi_client.services[response->instance.service_id].instance =
             response->instance.instance_id;
         internal_qmi_client.services[response->instance.service_id]
-            .transaction_id = response->qmi.transaction_id;
+            .allocation_requested_at = 0;
         internal_qmi_client.services[response->instance.service_id]
             .is_initialized = 1;
       }
@@ -613,8 +967,19 @@ void dispatch_incoming_qmi_message(uint8_t *buf, size_t buf_len) {
   logger(MSG_DEBUG, "%s: Pending message delivery service\n", __func__);
   uint8_t service = get_qmux_service_id(buf, buf_len);
   uint16_t transaction_id = get_transaction_id(buf, buf_len);
+  int ret;
 
-  set_transaction_id_for_service(service, transaction_id + 1);
+  /* 0x02: Response. Indications don't belong to any request */
+  if (service < QMI_SERVICES_LAST &&
+      get_qmi_message_type(buf, buf_len) == 0x02) {
+    ret = complete_inflight_request(buf, buf_len);
+    if (ret == 1) {
+      return; // Whoever sent it already took care of it
+    } else if (ret < 0) {
+      logger(MSG_DEBUG, "%s: Service %.2x answered TID %.4x we didn't send\n",
+             __func__, service, transaction_id);
+    }
+  }
   switch (service) {
   case QMI_SERVICE_CONTROL:
     break;
@@ -644,42 +1009,64 @@ void dispatch_incoming_qmi_message(uint8_t *buf, size_t buf_len) {
  * avoid depending on communication going to the host, so this one should
  * be able to dispatch data from services, and also route incoming data
  * from QMI to the required service
+ * We only wake up when the baseband sends something or when some
+ * service queues a message
  */
 void *init_internal_qmi_client() {
-  size_t buf_len;
-  fd_set readfds;
+  ssize_t buf_len;
+  uint64_t val;
+  int timeout;
+  struct pollfd fds[2];
+  struct qmi_tlv_index tlv_index;
   uint8_t buf[MAX_PACKET_SIZE];
-  struct timeval tv;
   if (!internal_qmi_client.is_initialized) {
+    internal_qmi_client.wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (internal_qmi_client.wakeup_fd < 0) {
+      logger(MSG_ERROR, "%s: Can't create the wakeup eventfd\n", __func__);
+      return NULL;
+    }
     internal_qmi_client.fd = open(INT_SMD_CNTL, O_RDWR);
     if (internal_qmi_client.fd < 0) {
       logger(MSG_ERROR, "Error opening %s!\n", INT_SMD_CNTL);
       return NULL;
-      ;
     } else {
       logger(MSG_INFO, "%s: Opened internal SMD port\n", __func__);
       internal_qmi_client.is_initialized = 1;
     }
   }
+
+  fds[0].fd = internal_qmi_client.fd;
+  fds[0].events = POLLIN;
+  fds[1].fd = internal_qmi_client.wakeup_fd;
+  fds[1].events = POLLIN;
   while (1) {
-    FD_SET(internal_qmi_client.fd, &readfds);
-    tv.tv_sec = 0;
-    tv.tv_usec = 500000;
-    if (is_internal_qmi_message_pending()) {
-      send_pending_internal_qmi_messages();
-      /* If we're sending stuff, we want a faster reply! */
-      tv.tv_usec = 50000;
+    /*
+     * Only tick while waiting on the baseband (client allocation or
+     * responses), otherwise sleep until something happens
+     */
+    timeout = send_pending_internal_qmi_messages() ? QMI_CLIENT_TICK_MS : -1;
+    if (poll(fds, 2, timeout) < 0) {
+      if (errno != EINTR) {
+        logger(MSG_ERROR, "%s: poll failed: %i\n", __func__, errno);
+      }
+      continue;
     }
-    select(MAX_FD, &readfds, NULL, NULL, &tv);
-    if (FD_ISSET(internal_qmi_client.fd, &readfds)) {
+
+    if (fds[1].revents & POLLIN) {
+      if (read(internal_qmi_client.wakeup_fd, &val, sizeof(val)) < 0) {
+        logger(MSG_DEBUG, "%s: Nothing in the wakeup fd\n", __func__);
+      }
+    }
+
+    if (fds[0].revents & POLLIN) {
       buf_len = read(internal_qmi_client.fd, &buf, MAX_PACKET_SIZE);
-      if (buf_len > sizeof(struct qmux_packet)) {
+      if (buf_len > (ssize_t)sizeof(struct qmux_packet)) {
         if (get_qmux_service_id(buf, buf_len) == 0) {
           logger(MSG_DEBUG, "%s: New QMI Control Message of %i bytes\n",
                  __func__, buf_len);
           if (buf_len >
               (sizeof(struct qmux_packet) + sizeof(struct ctl_qmi_packet))) {
-              handle_incoming_qmi_control_message(buf, buf_len);
+            handle_incoming_qmi_control_message(buf, buf_len);
           } else {
             logger(MSG_WARN, "%s: Size is too small!\n", __func__);
           }
@@ -690,24 +1077,24 @@ void *init_internal_qmi_client() {
               (sizeof(struct qmux_packet) + sizeof(struct qmi_packet))) {
 //            Too much noise with this printing everything
 //            pretty_print_qmi_pkt("Baseband --> Host", buf, buf_len);
+            build_qmi_tlv_index(&tlv_index, buf, buf_len);
+            set_current_tlv_index(&tlv_index);
             dispatch_incoming_qmi_message(buf, buf_len);
+            set_current_tlv_index(NULL);
           } else {
             logger(MSG_WARN, "%s: Size is too small!\n", __func__);
           }
         }
       }
     }
-
-
-      /* Demo: put code below */
-    }
-
-    return NULL;
   }
 
-  uint8_t is_internal_qmi_client_ready() {
-    return internal_qmi_client.is_initialized;
-  }
+  return NULL;
+}
+
+uint8_t is_internal_qmi_client_ready() {
+  return internal_qmi_client.is_initialized;
+}
 
 /*
  * We kickstart connections to all services from here
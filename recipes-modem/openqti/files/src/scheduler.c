@@ -8,57 +8,287 @@
 #include "openqti.h"
 #include "qmi.h"
 #include "sms.h"
-#include "space_mon.h"
 
 #include <endian.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include <time.h>
 #include <unistd.h>
 
+/*
+ * Simple scheduler to keep track of things
+ *  Pending tasks are kept in a binary min-heap keyed on their
+ *  execution time, and free slots in a stack, so adding, removing and
+ *  picking the next task to run are O(log n) at most. The thread
+ *  sleeps on a timerfd armed for the earliest deadline (either a task
+ *  or a recurring job) and is woken up through an eventfd whenever the
+ *  task list changes, so it doesn't wake up at all while idle.
+ *  Deadlines are wall clock times, the timerfd is cancelled if the
+ *  clock is set (i.e. by timesync) so they are recalculated.
+ *
+ *  tasks[], the heap and the free stack are protected by lock, since
+ *  tasks are added and removed from the chat thread
+ */
 struct {
   bool in_use;
+  bool index_ready;
   time_t cur_time;
+  pthread_mutex_t lock;
+  int timer_fd;
+  int wakeup_fd;
   struct task_p tasks[MAX_NUM_TASKS];
-} sch_runtime;
+  /* Task IDs, heap[0] is the next one to run */
+  uint8_t heap[MAX_NUM_TASKS];
+  uint16_t heap_size;
+  /* Position of each task in heap[] + 1, 0 if it's not there */
+  uint16_t heap_pos[MAX_NUM_TASKS];
+  uint8_t free_slots[MAX_NUM_TASKS];
+  uint16_t num_free_slots;
+  /* Records in the task log */
+  uint32_t log_entries;
+} sch_runtime = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .timer_fd = -1,
+    .wakeup_fd = -1,
+};
 
-/*
- *
- * Simple scheduler to keep track of things
- *
- *
- */
+void refresh_network_data();
+
+struct scheduler_job scheduler_jobs[] = {
+    {"network refresh", SCHEDULER_NETWORK_REFRESH_S, 0, &refresh_network_data},
+};
+
+bool task_runs_before(uint8_t a, uint8_t b) {
+  return sch_runtime.tasks[a].time.exec_time <
+         sch_runtime.tasks[b].time.exec_time;
+}
+
+void task_heap_set(uint16_t pos, uint8_t taskID) {
+  sch_runtime.heap[pos] = taskID;
+  sch_runtime.heap_pos[taskID] = pos + 1;
+}
+
+void task_heap_sift_up(uint16_t pos) {
+  uint8_t taskID = sch_runtime.heap[pos];
+  uint16_t parent;
+  while (pos > 0) {
+    parent = (pos - 1) / 2;
+    if (!task_runs_before(taskID, sch_runtime.heap[parent])) {
+      break;
+    }
+    task_heap_set(pos, sch_runtime.heap[parent]);
+    pos = parent;
+  }
+  task_heap_set(pos, taskID);
+}
+
+void task_heap_sift_down(uint16_t pos) {
+  uint8_t taskID = sch_runtime.heap[pos];
+  uint16_t child;
+  while ((child = pos * 2 + 1) < sch_runtime.heap_size) {
+    if (child + 1 < sch_runtime.heap_size &&
+        task_runs_before(sch_runtime.heap[child + 1],
+                         sch_runtime.heap[child])) {
+      child++;
+    }
+    if (!task_runs_before(sch_runtime.heap[child], taskID)) {
+      break;
+    }
+    task_heap_set(pos, sch_runtime.heap[child]);
+    pos = child;
+  }
+  task_heap_set(pos, taskID);
+}
+
+void task_heap_insert(uint8_t taskID) {
+  if (sch_runtime.heap_pos[taskID] != 0) {
+    return;
+  }
+  task_heap_set(sch_runtime.heap_size, taskID);
+  sch_runtime.heap_size++;
+  task_heap_sift_up(sch_runtime.heap_size - 1);
+}
+
+void task_heap_remove(uint8_t taskID) {
+  uint16_t pos;
+  uint8_t moved;
+  if (sch_runtime.heap_pos[taskID] == 0) {
+    return;
+  }
+  pos = sch_runtime.heap_pos[taskID] - 1;
+  sch_runtime.heap_pos[taskID] = 0;
+  sch_runtime.heap_size--;
+  if (pos == sch_runtime.heap_size) {
+    return;
+  }
+  /* Move the last one in its place and let it find its level */
+  moved = sch_runtime.heap[sch_runtime.heap_size];
+  task_heap_set(pos, moved);
+  task_heap_sift_up(pos);
+  task_heap_sift_down(sch_runtime.heap_pos[moved] - 1);
+}
+
+/* Rebuild the heap and the free stack from tasks[] */
+void rebuild_task_index() {
+  sch_runtime.heap_size = 0;
+  sch_runtime.num_free_slots = 0;
+  memset(sch_runtime.heap_pos, 0, sizeof(sch_runtime.heap_pos));
+  /* Backwards, so the lowest IDs get handed out first */
+  for (int i = MAX_NUM_TASKS - 1; i >= 0; i--) {
+    if (sch_runtime.tasks[i].status == STATUS_FREE) {
+      sch_runtime.free_slots[sch_runtime.num_free_slots++] = i;
+    } else if (sch_runtime.tasks[i].status == STATUS_PENDING) {
+      task_heap_insert(i);
+    }
+  }
+  sch_runtime.index_ready = true;
+}
+
+/* Let the scheduler thread know the next deadline might have changed */
+void wake_up_scheduler() {
+  uint64_t val = 1;
+  if (sch_runtime.wakeup_fd < 0) {
+    return;
+  }
+  if (write(sch_runtime.wakeup_fd, &val, sizeof(uint64_t)) < 0 &&
+      errno != EAGAIN) {
+    logger(MSG_WARN, "%s: Failed to signal the scheduler thread\n", __func__);
+  }
+}
 
 int find_free_task_slot() {
-  for (int i = 0; i < MAX_NUM_TASKS; i++) {
-    if (sch_runtime.tasks[i].status == 0) {
-      return i;
+  if (!sch_runtime.index_ready) {
+    rebuild_task_index();
+  }
+  if (sch_runtime.num_free_slots == 0) {
+    return -ENOSPC;
+  }
+  return sch_runtime.free_slots[--sch_runtime.num_free_slots];
+}
+
+uint32_t get_task_log_checksum(struct task_log_entry *entry,
+                               const char *arguments) {
+  uint32_t checksum = 2166136261U;
+  uint32_t saved = entry->checksum;
+  uint8_t *data = (uint8_t *)entry;
+  entry->checksum = 0;
+  for (size_t i = 0; i < sizeof(struct task_log_entry); i++) {
+    checksum = (checksum ^ data[i]) * 16777619U;
+  }
+  for (uint8_t i = 0; i < entry->arg_len; i++) {
+    checksum = (checksum ^ (uint8_t)arguments[i]) * 16777619U;
+  }
+  entry->checksum = saved;
+  return checksum;
+}
+
+/* Serialize a task, returns the number of argument bytes to write after it */
+uint8_t fill_task_log_entry(struct task_log_entry *entry, uint8_t op,
+                            uint8_t taskID) {
+  struct task_p *task = &sch_runtime.tasks[taskID];
+  memset(entry, 0, sizeof(struct task_log_entry));
+  entry->magic = TASK_LOG_MAGIC;
+  entry->op = op;
+  entry->task_id = taskID;
+  if (op == TASK_LOG_ADD) {
+    entry->exec_time = task->time.exec_time;
+    entry->type = task->type;
+    entry->param = task->param;
+    entry->mode = task->time.mode;
+    entry->hh = task->time.hh;
+    entry->mm = task->time.mm;
+    entry->weekdays = task->time.weekdays;
+    entry->arg_len = strnlen(task->arguments, ARG_SIZE - 1);
+  }
+  entry->checksum = get_task_log_checksum(entry, task->arguments);
+  return entry->arg_len;
+}
+
+int write_task_log_entry(int fd, uint8_t op, uint8_t taskID) {
+  struct task_log_entry entry;
+  uint8_t arg_len = fill_task_log_entry(&entry, op, taskID);
+  if (write(fd, &entry, sizeof(struct task_log_entry)) !=
+          sizeof(struct task_log_entry) ||
+      write(fd, sch_runtime.tasks[taskID].arguments, arg_len) != arg_len) {
+    return -EIO;
+  }
+  sch_runtime.log_entries++;
+  return 0;
+}
+
+/* Rewrites the log with only the live tasks */
+int write_task_log_snapshot() {
+  int fd, ret = 0;
+  fd = open(SCHEDULER_LOG_TMP_FILE_PATH,
+            O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    logger(MSG_ERROR, "%s: Can't open the task log for writing\n", __func__);
+    return -EIO;
+  }
+  sch_runtime.log_entries = 0;
+  for (int i = 0; i < MAX_NUM_TASKS && ret == 0; i++) {
+    if (sch_runtime.tasks[i].status == STATUS_PENDING ||
+        sch_runtime.tasks[i].status == STATUS_IN_PROGRESS) {
+      ret = write_task_log_entry(fd, TASK_LOG_ADD, i);
     }
   }
-  return -ENOSPC;
+  if (ret < 0 || fsync(fd) < 0) {
+    logger(MSG_ERROR, "%s: Error writing the task log\n", __func__);
+    close(fd);
+    unlink(SCHEDULER_LOG_TMP_FILE_PATH);
+    return -EIO;
+  }
+  close(fd);
+  if (rename(SCHEDULER_LOG_TMP_FILE_PATH, SCHEDULER_LOG_FILE_PATH) < 0) {
+    logger(MSG_ERROR, "%s: Can't replace the task log\n", __func__);
+    return -EIO;
+  }
+  logger(MSG_DEBUG, "%s: Task log compacted to %u entries\n", __func__,
+         sch_runtime.log_entries);
+  return 0;
 }
 
-int save_tasks_to_storage() {
-  FILE *fp;
+int append_task_log(uint8_t op, uint8_t taskID) {
+  int fd, ret;
+  fd = open(SCHEDULER_LOG_FILE_PATH, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+            0644);
+  if (fd < 0) {
+    logger(MSG_ERROR, "%s: Can't open the task log\n", __func__);
+    return -EIO;
+  }
+  ret = write_task_log_entry(fd, op, taskID);
+  if (ret < 0 || fsync(fd) < 0) {
+    logger(MSG_ERROR, "%s: Error writing to the task log\n", __func__);
+    ret = -EIO;
+  }
+  close(fd);
+  return ret;
+}
+
+/*
+ * Store a change to a task
+ *  Appends it to the log, or rewrites the log if it grew too much.
+ *  Caller must hold the lock
+ */
+int save_task_change(uint8_t op, uint8_t taskID) {
   int ret;
-  logger(MSG_DEBUG, "%s: Start\n", __func__);
+  uint16_t live_tasks = MAX_NUM_TASKS - sch_runtime.num_free_slots;
   if (set_persistent_partition_rw() < 0) {
     logger(MSG_ERROR, "%s: Can't set persist partition in RW mode\n", __func__);
     return -1;
   }
-  logger(MSG_DEBUG, "%s: Open file\n", __func__);
-  fp = fopen(SCHEDULER_DATA_FILE_PATH, "w");
-  if (fp == NULL) {
-    logger(MSG_ERROR, "%s: Can't open config file for writing\n", __func__);
-    return -1;
+  if (sch_runtime.log_entries >= live_tasks * 2 + TASK_LOG_COMPACT_SLACK) {
+    ret = write_task_log_snapshot();
+  } else {
+    ret = append_task_log(op, taskID);
   }
-  logger(MSG_DEBUG, "%s: Store\n", __func__);
-  ret = fwrite(sch_runtime.tasks, sizeof(struct task_p), MAX_NUM_TASKS, fp);
-  logger(MSG_DEBUG, "%s: Close (%i bytes written)\n", __func__, ret);
-  fclose(fp);
-  do_sync_fs();
   if (!use_persistent_logging()) {
     if (set_persistent_partition_ro() < 0) {
       logger(MSG_ERROR, "%s: Can't set persist partition in RO mode\n",
@@ -66,146 +296,306 @@ int save_tasks_to_storage() {
       return -1;
     }
   }
-  return 0;
+  return ret;
 }
 
-int read_tasks_from_storage() {
+/* Rebuild the task table from the log, returns -ENOENT if there's none */
+int replay_task_log() {
+  struct task_log_entry entry;
+  char arguments[ARG_SIZE];
+  struct task_p *task;
   FILE *fp;
-  int ret;
-  struct task_p tasks[MAX_NUM_TASKS];
-  logger(MSG_DEBUG, "%s: Start, open file\n", __func__);
-  fp = fopen(SCHEDULER_DATA_FILE_PATH, "r");
+  int ret = 0;
+
+  fp = fopen(SCHEDULER_LOG_FILE_PATH, "r");
   if (fp == NULL) {
-    logger(MSG_DEBUG, "%s: Can't open config file for reading\n", __func__);
-    return -1;
+    return -ENOENT;
   }
-  ret = fread(tasks, sizeof(struct task_p), MAX_NUM_TASKS, fp);
-  logger(MSG_DEBUG, "%s: Close (%i bytes read)\n", __func__, ret);
-  if (ret >= sizeof(struct task_p)) {
-    logger(MSG_DEBUG, "%s: Recovering tasks\n ", __func__);
-    for (int i = 0; i < MAX_NUM_TASKS; i++) {
-      sch_runtime.tasks[i] = tasks[i];
+  memset(sch_runtime.tasks, 0, sizeof(sch_runtime.tasks));
+  sch_runtime.log_entries = 0;
+  while (fread(&entry, sizeof(struct task_log_entry), 1, fp) == 1) {
+    if (entry.magic != TASK_LOG_MAGIC || entry.arg_len >= ARG_SIZE ||
+        fread(arguments, 1, entry.arg_len, fp) != entry.arg_len ||
+        get_task_log_checksum(&entry, arguments) != entry.checksum ||
+        entry.task_id >= MAX_NUM_TASKS) {
+      /* Torn write, everything before it is fine */
+      logger(MSG_WARN, "%s: Task log is corrupt after %u entries\n", __func__,
+             sch_runtime.log_entries);
+      ret = -EIO;
+      break;
     }
+    sch_runtime.log_entries++;
+    task = &sch_runtime.tasks[entry.task_id];
+    memset(task, 0, sizeof(struct task_p));
+    if (entry.op == TASK_LOG_ADD) {
+      task->type = entry.type;
+      task->param = entry.param;
+      task->status = STATUS_PENDING;
+      task->time.exec_time = entry.exec_time;
+      task->time.mode = entry.mode;
+      task->time.hh = entry.hh;
+      task->time.mm = entry.mm;
+      task->time.weekdays = entry.weekdays;
+      memcpy(task->arguments, arguments, entry.arg_len);
+    }
+  }
+  fclose(fp);
+  return ret;
+}
+
+/* Tasks from before the log existed */
+int read_legacy_tasks() {
+  struct legacy_task_p *tasks;
+  FILE *fp;
+  size_t count;
+
+  fp = fopen(SCHEDULER_DATA_FILE_PATH, "r");
+  if (fp == NULL) {
+    return -ENOENT;
+  }
+  tasks = calloc(MAX_NUM_TASKS, sizeof(struct legacy_task_p));
+  if (tasks == NULL) {
+    fclose(fp);
+    return -ENOMEM;
   }
+  count = fread(tasks, sizeof(struct legacy_task_p), MAX_NUM_TASKS, fp);
   fclose(fp);
+  logger(MSG_INFO, "%s: Migrating %zu task slots\n", __func__, count);
+  memset(sch_runtime.tasks, 0, sizeof(sch_runtime.tasks));
+  for (size_t i = 0; i < count; i++) {
+    if (tasks[i].status != STATUS_PENDING &&
+        tasks[i].status != STATUS_IN_PROGRESS) {
+      continue;
+    }
+    sch_runtime.tasks[i].type = tasks[i].type;
+    sch_runtime.tasks[i].param = tasks[i].param;
+    sch_runtime.tasks[i].status = STATUS_PENDING;
+    sch_runtime.tasks[i].time.exec_time = tasks[i].time.exec_time;
+    sch_runtime.tasks[i].time.mode = tasks[i].time.mode;
+    sch_runtime.tasks[i].time.hh = tasks[i].time.hh;
+    sch_runtime.tasks[i].time.mm = tasks[i].time.mm;
+    memcpy(sch_runtime.tasks[i].arguments, tasks[i].arguments, ARG_SIZE - 1);
+  }
+  free(tasks);
   return 0;
 }
 
+int read_tasks_from_storage() {
+  bool needs_snapshot = false;
+  time_t now = time(NULL);
+  int ret;
+  logger(MSG_DEBUG, "%s: Start\n", __func__);
+  pthread_mutex_lock(&sch_runtime.lock);
+  ret = replay_task_log();
+  if (ret == -ENOENT) {
+    ret = read_legacy_tasks();
+    needs_snapshot = (ret == 0);
+  } else if (ret < 0) {
+    /* Get rid of the broken tail */
+    needs_snapshot = true;
+  }
+  for (int i = 0; i < MAX_NUM_TASKS; i++) {
+    /* Skip whatever we missed while we were down */
+    if (sch_runtime.tasks[i].status == STATUS_PENDING &&
+        is_recurring_task(&sch_runtime.tasks[i].time)) {
+      sch_runtime.tasks[i].time.exec_time =
+          get_next_execution_time(&sch_runtime.tasks[i].time, now);
+    }
+  }
+  rebuild_task_index();
+  if (needs_snapshot && set_persistent_partition_rw() == 0) {
+    if (write_task_log_snapshot() == 0) {
+      unlink(SCHEDULER_DATA_FILE_PATH);
+    }
+    if (!use_persistent_logging()) {
+      set_persistent_partition_ro();
+    }
+  }
+  logger(MSG_DEBUG, "%s: %u tasks pending\n", __func__, sch_runtime.heap_size);
+  pthread_mutex_unlock(&sch_runtime.lock);
+  return ret;
+}
+
+bool is_recurring_task(struct execution_time *time) {
+  return time->mode == SCHED_MODE_TIME_DAILY ||
+         time->mode == SCHED_MODE_TIME_WEEKLY ||
+         time->mode == SCHED_MODE_TIME_INTERVAL;
+}
+
+/* First time the task should run after now */
+time_t get_next_execution_time(struct execution_time *time, time_t now) {
+  struct tm tm;
+  time_t next;
+  switch (time->mode) {
+  case SCHED_MODE_TIME_COUNTDOWN:
+  case SCHED_MODE_TIME_INTERVAL:
+    return now + time->hh * 3600 + time->mm * 60;
+  case SCHED_MODE_TIME_AT:
+  case SCHED_MODE_TIME_DAILY:
+  case SCHED_MODE_TIME_WEEKLY:
+    /* Let mktime() deal with month ends and DST */
+    for (uint8_t day = 0; day <= 7; day++) {
+      localtime_r(&now, &tm);
+      tm.tm_mday += day;
+      tm.tm_hour = time->hh;
+      tm.tm_min = time->mm;
+      tm.tm_sec = 0;
+      tm.tm_isdst = -1;
+      next = mktime(&tm);
+      if (next <= now) {
+        continue;
+      }
+      if (time->mode != SCHED_MODE_TIME_WEEKLY ||
+          (time->weekdays & (1 << tm.tm_wday))) {
+        return next;
+      }
+    }
+    break;
+  }
+  logger(MSG_WARN, "%s: Can't find when to run mode %u\n", __func__,
+         time->mode);
+  /* Never in the past, or we'd keep running it */
+  return now + 24 * 3600;
+}
+
+int get_task_schedule_description(struct execution_time *time, char *buf,
+                                  size_t len) {
+  const char *day_names[] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+  int strsz = 0;
+  switch (time->mode) {
+  case SCHED_MODE_TIME_DAILY:
+    strsz = snprintf(buf, len, "every day at %.2u:%.2u", time->hh, time->mm);
+    break;
+  case SCHED_MODE_TIME_WEEKLY:
+    strsz = snprintf(buf, len, "every");
+    for (uint8_t i = 0; i < 7 && strsz < (int)len; i++) {
+      if (time->weekdays & (1 << i)) {
+        strsz += snprintf(buf + strsz, len - strsz, " %s", day_names[i]);
+      }
+    }
+    if (strsz < (int)len) {
+      strsz += snprintf(buf + strsz, len - strsz, " at %.2u:%.2u", time->hh,
+                        time->mm);
+    }
+    break;
+  case SCHED_MODE_TIME_INTERVAL:
+    strsz = snprintf(buf, len, "every %uh %.2um", time->hh, time->mm);
+    break;
+  default:
+    strsz = snprintf(buf, len, "once");
+    break;
+  }
+  return strsz < (int)len ? strsz : (int)len - 1;
+}
+
 void delay_task_execution(int taskID, uint8_t seconds) {
   sch_runtime.tasks[taskID].time.exec_time += seconds;
+  if (sch_runtime.heap_pos[taskID] != 0) {
+    task_heap_sift_down(sch_runtime.heap_pos[taskID] - 1);
+  }
 }
 
 int add_task(struct task_p task) {
   int taskID;
   time_t t = time(NULL);
-  struct tm tm = *localtime(&t);
-  struct tm new_time;
   logger(MSG_INFO, "%s: Adding task: Type: %i, param: %i, arg: %s", __func__,
          task.type, task.param, task.arguments);
+  if ((task.time.mode == SCHED_MODE_TIME_WEEKLY &&
+       (task.time.weekdays & 0x7f) == 0) ||
+      (task.time.mode == SCHED_MODE_TIME_INTERVAL && task.time.hh == 0 &&
+       task.time.mm == 0) ||
+      task.time.mode > SCHED_MODE_TIME_INTERVAL) {
+    logger(MSG_ERROR, "%s: Invalid schedule, task not added\n", __func__);
+    return -EINVAL;
+  }
+  pthread_mutex_lock(&sch_runtime.lock);
   taskID = find_free_task_slot();
   if (taskID < 0) {
+    pthread_mutex_unlock(&sch_runtime.lock);
     logger(MSG_ERROR, "%s: No available slots, task not added\n", __func__);
     return -ENOSPC;
-  } else {
-    logger(MSG_INFO, "%s: Adding task %i to the queue\n", __func__, taskID);
-    sch_runtime.tasks[taskID] = task;
-    sch_runtime.tasks[taskID].status = STATUS_PENDING;
-    /* Calculate tick time from now */
-    switch (task.time.mode) {
-    case SCHED_MODE_TIME_AT:
-      new_time = tm;
-      new_time.tm_sec = 0;
-      if (tm.tm_hour > sch_runtime.tasks[taskID].time.hh) {
-        // Change to next day, then let mktime fix the rest
-        new_time.tm_mday = tm.tm_mday + 1;
-      }
-      new_time.tm_hour = sch_runtime.tasks[taskID].time.hh;
-      new_time.tm_min = sch_runtime.tasks[taskID].time.mm;
-      sch_runtime.tasks[taskID].time.exec_time = mktime(&new_time);
-      logger(MSG_INFO, "Current time: %i-%i-%i %i:%i:%i\n", tm.tm_year,
-             tm.tm_mon, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
-      logger(MSG_INFO, "Target time: %i-%i-%i %i:%i:%i\n", new_time.tm_year,
-             new_time.tm_mon, new_time.tm_mday, new_time.tm_hour,
-             new_time.tm_min, new_time.tm_sec);
-      logger(MSG_INFO, "From echo: Now %ld -> Exec at %ld\n", t,
-             sch_runtime.tasks[taskID].time.exec_time);
-      break;
-    case SCHED_MODE_TIME_COUNTDOWN:
-      sch_runtime.tasks[taskID].time.exec_time =
-          t + sch_runtime.tasks[taskID].time.hh * 3600 +
-          sch_runtime.tasks[taskID].time.mm * 60;
+  }
+  logger(MSG_INFO, "%s: Adding task %i to the queue\n", __func__, taskID);
+  sch_runtime.tasks[taskID] = task;
+  sch_runtime.tasks[taskID].status = STATUS_PENDING;
+  sch_runtime.tasks[taskID].arguments[ARG_SIZE - 1] = 0;
+  sch_runtime.tasks[taskID].time.exec_time =
+      get_next_execution_time(&sch_runtime.tasks[taskID].time, t);
+  logger(MSG_INFO, "%s: Now %ld -> Exec at %ld\n", __func__, t,
+         sch_runtime.tasks[taskID].time.exec_time);
+  task_heap_insert(taskID);
+  save_task_change(TASK_LOG_ADD, taskID);
+  pthread_mutex_unlock(&sch_runtime.lock);
+  wake_up_scheduler();
+  return taskID;
+}
 
-      break;
+/* Caller must hold the lock and save the change afterwards */
+void clear_task_slot(int taskID) {
+  if (sch_runtime.tasks[taskID].status != STATUS_FREE) {
+    if (!sch_runtime.index_ready) {
+      rebuild_task_index();
     }
+    task_heap_remove(taskID);
+    sch_runtime.free_slots[sch_runtime.num_free_slots++] = taskID;
   }
-  save_tasks_to_storage();
-  return taskID;
+  sch_runtime.tasks[taskID].status = 0;
+  sch_runtime.tasks[taskID].param = 0;
+  sch_runtime.tasks[taskID].type = 0;
+  sch_runtime.tasks[taskID].time.hh = 0;
+  sch_runtime.tasks[taskID].time.mm = 0;
+  sch_runtime.tasks[taskID].time.mode = 0;
+  sch_runtime.tasks[taskID].time.weekdays = 0;
+  memset(sch_runtime.tasks[taskID].arguments, 0, ARG_SIZE);
 }
 
 int remove_task(int taskID) {
   int ret = -EINVAL;
-  if (taskID < MAX_NUM_TASKS) {
+  if (taskID >= 0 && taskID < MAX_NUM_TASKS) {
+    pthread_mutex_lock(&sch_runtime.lock);
     if (sch_runtime.tasks[taskID].status != STATUS_FREE) {
+      clear_task_slot(taskID);
+      save_task_change(TASK_LOG_REMOVE, taskID);
       ret = 0;
     }
-    sch_runtime.tasks[taskID].status = 0;
-    sch_runtime.tasks[taskID].param = 0;
-    sch_runtime.tasks[taskID].type = 0;
-    sch_runtime.tasks[taskID].time.hh = 0;
-    sch_runtime.tasks[taskID].time.mm = 0;
-    sch_runtime.tasks[taskID].time.mode = 0;
-    memset(sch_runtime.tasks[taskID].arguments, 0, ARG_SIZE);
-    save_tasks_to_storage();
+    pthread_mutex_unlock(&sch_runtime.lock);
+    wake_up_scheduler();
   }
   return ret;
 }
 
 int remove_all_tasks_by_type(uint8_t task_type) {
-  for (int i = 0; i < MAX_NUM_TASKS; i++) {
-    if (sch_runtime.tasks[i].type == task_type) {
-      remove_task(i);
-    }
-  }
-  return 0;
-}
-int update_task_status(int taskID, uint8_t status) {
-  if (taskID < MAX_NUM_TASKS) {
-    sch_runtime.tasks[taskID].status = status;
-    return 0;
-  }
-
-  return -EINVAL;
-}
-
-void cleanup_tasks() {
   bool needs_write = false;
+  pthread_mutex_lock(&sch_runtime.lock);
   for (int i = 0; i < MAX_NUM_TASKS; i++) {
-    if (sch_runtime.tasks[i].status == STATUS_DONE ||
-        sch_runtime.tasks[i].status == STATUS_FAILED) {
-      logger(MSG_INFO, "%s: Removing task %i with status %i\n", __func__, i,
-             sch_runtime.tasks[i].status);
-      remove_task(i);
+    if (sch_runtime.tasks[i].status != STATUS_FREE &&
+        sch_runtime.tasks[i].type == task_type) {
+      clear_task_slot(i);
+      save_task_change(TASK_LOG_REMOVE, i);
       needs_write = true;
     }
   }
-  if (needs_write)
-    save_tasks_to_storage();
+  pthread_mutex_unlock(&sch_runtime.lock);
+  if (needs_write) {
+    wake_up_scheduler();
+  }
+  return 0;
 }
 
+/* Caller must hold the lock */
 int run_task(int taskID) {
   logger(MSG_INFO, "%s: Running task %i\n", __func__, taskID);
-  if (taskID < 0 || taskID > MAX_NUM_TASKS) {
+  if (taskID < 0 || taskID >= MAX_NUM_TASKS) {
     logger(MSG_ERROR, "%s: Invalid task\n", __func__);
     return -EINVAL;
   }
 
-  if (sch_runtime.tasks[taskID].status == STATUS_FREE ||
-      sch_runtime.tasks[taskID].status == STATUS_DONE ||
-      sch_runtime.tasks[taskID].status == STATUS_FAILED) {
+  if (sch_runtime.tasks[taskID].status != STATUS_PENDING) {
     logger(MSG_WARN, "%s: Attempted to run a task with status %i", __func__,
            sch_runtime.tasks[taskID].status);
     return -EINVAL;
   }
+  task_heap_remove(taskID);
   sch_runtime.tasks[taskID].status = STATUS_IN_PROGRESS;
   switch (sch_runtime.tasks[taskID].type) {
   case TASK_TYPE_SMS:
@@ -215,7 +605,10 @@ int run_task(int taskID) {
   case TASK_TYPE_CALL:
     logger(MSG_INFO, "%s: Call admin\n", __func__);
     if (get_call_simulation_mode()) {
+      /* Try again later */
+      sch_runtime.tasks[taskID].status = STATUS_PENDING;
       delay_task_execution(taskID, 60);
+      task_heap_insert(taskID);
     } else {
       set_pending_call_flag(true);
       set_looped_message(true);
@@ -234,64 +627,155 @@ int run_task(int taskID) {
     set_do_not_disturb(false);
     sch_runtime.tasks[taskID].status = STATUS_DONE;
     break;
+  default:
+    logger(MSG_WARN, "%s: Unknown task type %u\n", __func__,
+           sch_runtime.tasks[taskID].type);
+    sch_runtime.tasks[taskID].status = STATUS_FAILED;
+    break;
   }
 
-  cleanup_tasks();
+  if (sch_runtime.tasks[taskID].status == STATUS_DONE &&
+      is_recurring_task(&sch_runtime.tasks[taskID].time)) {
+    /* Nothing to store, we'll work out the next run again on boot */
+    sch_runtime.tasks[taskID].status = STATUS_PENDING;
+    sch_runtime.tasks[taskID].time.exec_time =
+        get_next_execution_time(&sch_runtime.tasks[taskID].time, time(NULL));
+    task_heap_insert(taskID);
+  } else if (sch_runtime.tasks[taskID].status == STATUS_DONE ||
+             sch_runtime.tasks[taskID].status == STATUS_FAILED) {
+    logger(MSG_INFO, "%s: Removing task %i with status %i\n", __func__,
+           taskID, sch_runtime.tasks[taskID].status);
+    clear_task_slot(taskID);
+    save_task_change(TASK_LOG_REMOVE, taskID);
+  }
+  return 0;
+}
+
+/* Run everything that is due, returns the time of the next pending task */
+time_t run_pending_tasks(time_t now) {
+  time_t next;
+  uint8_t taskID;
+  pthread_mutex_lock(&sch_runtime.lock);
+  if (!sch_runtime.index_ready) {
+    rebuild_task_index();
+  }
+  while (sch_runtime.heap_size > 0) {
+    taskID = sch_runtime.heap[0];
+    if (sch_runtime.tasks[taskID].time.exec_time > now) {
+      break;
+    }
+    run_task(taskID);
+  }
+  next = sch_runtime.heap_size > 0
+             ? sch_runtime.tasks[sch_runtime.heap[0]].time.exec_time
+             : 0;
+  pthread_mutex_unlock(&sch_runtime.lock);
+  return next;
+}
+
+void refresh_network_data() {
+  nas_request_signal_info();
+  nas_request_cell_location_info();
+}
+
+/* Run the recurring jobs that are due, returns the earliest next run */
+time_t run_scheduler_jobs(time_t now) {
+  time_t next = 0;
+  for (uint8_t i = 0; i < sizeof(scheduler_jobs) / sizeof(scheduler_jobs[0]);
+       i++) {
+    if (scheduler_jobs[i].next_run <= now) {
+      logger(MSG_DEBUG, "%s: Running %s\n", __func__, scheduler_jobs[i].name);
+      scheduler_jobs[i].run();
+      scheduler_jobs[i].next_run = now + scheduler_jobs[i].interval_s;
+    }
+    if (next == 0 || scheduler_jobs[i].next_run < next) {
+      next = scheduler_jobs[i].next_run;
+    }
+  }
+  return next;
+}
+
+/* The clock was set, start counting the intervals again from now */
+void reset_scheduler_jobs(time_t now) {
+  for (uint8_t i = 0; i < sizeof(scheduler_jobs) / sizeof(scheduler_jobs[0]);
+       i++) {
+    scheduler_jobs[i].next_run = now + scheduler_jobs[i].interval_s;
+  }
+}
+
+int arm_scheduler_timer(time_t deadline) {
+  struct itimerspec timer = {0};
+  timer.it_value.tv_sec = deadline;
+  if (timerfd_settime(sch_runtime.timer_fd,
+                      TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &timer,
+                      NULL) < 0) {
+    logger(MSG_ERROR, "%s: Can't arm the scheduler timer: %s\n", __func__,
+           strerror(errno));
+    return -errno;
+  }
   return 0;
 }
 
 void *start_scheduler_thread() {
-  int tick = 0;
+  struct pollfd fds[2];
+  uint64_t val;
+  time_t now, next_task, next_job, deadline;
+
+  sch_runtime.timer_fd =
+      timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+  sch_runtime.wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (sch_runtime.timer_fd < 0 || sch_runtime.wakeup_fd < 0) {
+    logger(MSG_ERROR, "%s: Can't create the scheduler timer: %s\n", __func__,
+           strerror(errno));
+    return NULL;
+  }
+
   logger(MSG_INFO, "%s: Waiting for network...\n", __func__);
   do {
-    sleep(5);
+    sleep(SCHEDULER_NETWORK_WAIT_S);
   } while (!nas_is_network_in_service());
   /*
     We should check here if time is synced by now...
   */
   logger(MSG_INFO, "%s: Starting scheduler thread\n", __func__);
   read_tasks_from_storage();
+
+  fds[0].fd = sch_runtime.timer_fd;
+  fds[0].events = POLLIN;
+  fds[1].fd = sch_runtime.wakeup_fd;
+  fds[1].events = POLLIN;
   while (1) {
-    sch_runtime.cur_time = time(NULL);
-    for (int i = 0; i < MAX_NUM_TASKS; i++) {
-      if (sch_runtime.tasks[i].status == STATUS_PENDING) {
-        logger(MSG_DEBUG,
-               "%s: Checking time for task %i of type %i\n Exec time %ld, "
-               "current %ld\n",
-               __func__, i, sch_runtime.tasks[i].type,
-               sch_runtime.tasks[i].time.exec_time, sch_runtime.cur_time);
-        if (sch_runtime.cur_time >= sch_runtime.tasks[i].time.exec_time) {
-          run_task(i);
-        }
-      }
+    now = time(NULL);
+    sch_runtime.cur_time = now;
+    next_task = run_pending_tasks(now);
+    next_job = run_scheduler_jobs(now);
+    deadline = next_job;
+    if (next_task != 0 && next_task < deadline) {
+      deadline = next_task;
+    }
+    logger(MSG_DEBUG, "%s: Sleeping for %ld seconds\n", __func__,
+           deadline - now);
+    if (arm_scheduler_timer(deadline) < 0) {
+      sleep(1);
+      continue;
     }
-    logger(MSG_DEBUG, "%s Tick!\n", __func__);
-    sleep(1);
-    if (tick > 10) {
-      logger(MSG_DEBUG, "%s: Tock!\n", __func__);
-      tick = 0;
-      // Request network update
-      nas_request_signal_info();
-      nas_request_cell_location_info();
-      uint32_t avail_space_persist = get_available_space_persist_mb();
-      uint32_t avail_space_tmpfs = get_available_space_tmpfs_mb();
-      if (avail_space_persist != -EINVAL && avail_space_persist < 1) {
-        uint8_t reply[MAX_MESSAGE_SIZE] = {0};
-        size_t strsz =
-            snprintf((char *)reply, MAX_MESSAGE_SIZE,
-                     "I'm running out of storage, cleaning /persist\n");
-        add_message_to_queue(reply, strsz);
-        cleanup_storage(1, true, "openqti.lock");
+
+    if (poll(fds, 2, -1) < 0) {
+      if (errno != EINTR) {
+        logger(MSG_WARN, "%s: poll failed: %s\n", __func__, strerror(errno));
       }
-      if (avail_space_tmpfs != -EINVAL && avail_space_tmpfs < 1) {
-        uint8_t reply[MAX_MESSAGE_SIZE] = {0};
-        size_t strsz = snprintf((char *)reply, MAX_MESSAGE_SIZE,
-                                "I'm running out of memory, cleaning /tmp\n");
-        add_message_to_queue(reply, strsz);
-        cleanup_storage(0, true, "openqti.lock");
+      continue;
+    }
+    if (fds[0].revents & POLLIN) {
+      if (read(sch_runtime.timer_fd, &val, sizeof(uint64_t)) < 0 &&
+          errno == ECANCELED) {
+        logger(MSG_INFO, "%s: System time changed\n", __func__);
+        reset_scheduler_jobs(time(NULL));
       }
     }
-    tick++;
+    if (fds[1].revents & POLLIN) {
+      read(sch_runtime.wakeup_fd, &val, sizeof(uint64_t));
+    }
   }
   return NULL;
 }
@@ -300,6 +784,8 @@ void dump_pending_tasks() {
   int strsz = 0;
   int count = 0;
   char reply[MAX_MESSAGE_SIZE];
+  pthread_mutex_lock(&sch_runtime.lock);
+  sch_runtime.cur_time = time(NULL);
   for (int i = 0; i < MAX_NUM_TASKS; i++) {
     if (sch_runtime.tasks[i].status == STATUS_PENDING) {
       count++;
@@ -326,9 +812,22 @@ void dump_pending_tasks() {
             (sch_runtime.tasks[i].time.exec_time - sch_runtime.cur_time) / 60);
         break;
       }
+      if (is_recurring_task(&sch_runtime.tasks[i].time) && strsz > 0 &&
+          strsz < MAX_MESSAGE_SIZE - 1) {
+        strsz += snprintf(reply + strsz, MAX_MESSAGE_SIZE - strsz, "\n Repeats ");
+        if (strsz < MAX_MESSAGE_SIZE - 1) {
+          strsz += get_task_schedule_description(&sch_runtime.tasks[i].time,
+                                                 reply + strsz,
+                                                 MAX_MESSAGE_SIZE - strsz);
+        }
+      }
+      if (strsz > MAX_MESSAGE_SIZE - 1) {
+        strsz = MAX_MESSAGE_SIZE - 1;
+      }
       add_message_to_queue((uint8_t *)reply, strsz);
     }
   }
+  pthread_mutex_unlock(&sch_runtime.lock);
   if (count == 0) {
     strsz = snprintf(reply, MAX_MESSAGE_SIZE, "There are no pending tasks!");
     add_message_to_queue((uint8_t *)reply, strsz);
@@ -1,6 +1,7 @@
 // SPDX-License-Identifier: MIT
 
 #include <asm-generic/errno-base.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
@@ -41,9 +42,10 @@
  *  Array elem is #msg id
  *  pkt is whole packet
  *  send_state: 1 Notify | 2 Send | 3 DEL REQ | 4 Del SUCCESS
- *    On Del success wipe from array
+ *    On Del success the slot is released
  */
 struct message {
+  _Atomic uint32_t seq; // Queue position + 1 once it's ready to send
   char pkt[MAX_MESSAGE_SIZE]; // JUST TEXT
   int len;                    // TEXT SIZE
   uint32_t message_id;
@@ -52,26 +54,52 @@ struct message {
   uint8_t tp_dcs;
   uint8_t state; // message sending status
   uint8_t retries;
-  struct timespec timestamp; // to know when to give up
+  uint64_t deadline; // to know when to retry or give up
+  /* Segment of a concatenated message, concat_total is 0 if it isn't */
+  uint8_t concat_ref;
+  uint8_t concat_total;
+  uint8_t concat_seq;
 };
 
+/*
+ * Outgoing message queue
+ *  A ring of QUEUE_SIZE messages. Any thread can add messages: they
+ *  claim a position moving the head, fill the slot and publish it
+ *  with its seq. Only the proxy thread consumes them, always from
+ *  the tail, so every step of the delivery state machine only looks
+ *  at a single message. The slot index is the message ID the host
+ *  sees, so it must fit in the storage index (uint8_t).
+ */
 struct message_queue {
-  bool lock_queue;
+  _Atomic bool lock_queue;
   bool needs_intercept;
-  int queue_pos;
-  // max QUEUE_SIZE message to keep, we use the array as MSGID
+  _Atomic uint32_t head; // Next position to claim (producers)
+  _Atomic uint32_t tail; // Message being delivered (proxy)
   struct message msg[QUEUE_SIZE];
 };
 
+/* A long command from the host being put back together */
+struct sms_reassembly {
+  bool in_use;
+  uint16_t ref;
+  uint8_t total;
+  uint8_t received; // One bit per part
+  uint64_t first_seen;
+  uint8_t len[SMS_REASSEMBLY_MAX_PARTS];
+  char parts[SMS_REASSEMBLY_MAX_PARTS][MAX_MESSAGE_SIZE];
+};
+
 struct {
-  bool notif_pending;
-  uint8_t source;
+  _Atomic bool notif_pending;
+  _Atomic uint8_t source;
   uint32_t current_message_id;
   uint16_t curr_transaction_id;
   uint32_t pending_messages_from_adsp;
   struct message_queue queue;
   uint8_t *stuck_message_data;
   bool stuck_message_data_pending;
+  _Atomic uint8_t concat_ref; // Next outgoing concatenation reference
+  struct sms_reassembly reassembly[SMS_REASSEMBLY_SLOTS];
 } sms_runtime;
 
 void reset_sms_runtime() {
@@ -79,14 +107,22 @@ void reset_sms_runtime() {
   sms_runtime.curr_transaction_id = 0;
   sms_runtime.source = -1;
   sms_runtime.queue.lock_queue = false;
-  sms_runtime.queue.queue_pos = -1;
+  sms_runtime.queue.head = 0;
+  sms_runtime.queue.tail = 0;
+  memset(sms_runtime.queue.msg, 0, sizeof(sms_runtime.queue.msg));
   sms_runtime.current_message_id = 0;
   sms_runtime.pending_messages_from_adsp = 0;
   sms_runtime.stuck_message_data = NULL;
   sms_runtime.stuck_message_data_pending = false;
+  memset(sms_runtime.reassembly, 0, sizeof(sms_runtime.reassembly));
 }
 
-void set_notif_pending(bool pending) { sms_runtime.notif_pending = pending; }
+void set_notif_pending(bool pending) {
+  sms_runtime.notif_pending = pending;
+  if (pending) {
+    wake_up_proxy();
+  }
+}
 void set_queue_lock(bool lock) { sms_runtime.queue.lock_queue = lock; }
 
 void set_pending_notification_source(uint8_t source) {
@@ -691,21 +727,17 @@ static inline void Write7Bits(uint8_t *bufferPtr, uint8_t val, uint32_t pos) {
     bufferPtr[idx + 1] = (val >> (8 - (pos & 7)));
   }
 }
-/**
- * Convert an ascii array into a 7bits array
- * length is the number of bytes in the ascii buffer
- *
- * @return the size of the a7bit string (in 7bit chars!), or LE_OVERFLOW if
- * a7bitPtr is too small.
+/*
+ * Same as ascii_to_gsm7(), but packing the text after start_septet
+ * septets (where the user data header and its fill bits go).
+ * Returns the septet count including them
  */
-uint8_t ascii_to_gsm7(const uint8_t *a8bitPtr, ///< [IN] 8bits array to convert
-                      uint8_t *a7bitPtr        ///< [OUT] 7bits array result
-) {
+uint8_t ascii_to_gsm7_offset(const uint8_t *a8bitPtr, size_t length,
+                             uint8_t *a7bitPtr, uint8_t start_septet) {
   int read;
-  int write = 0;
+  int write = start_septet;
   int size = 0;
   int pos = 0;
-  int length = strlen((char *)a8bitPtr);
 
   for (read = pos; read < length + pos; ++read) {
     uint8_t byte = Ascii8to7[a8bitPtr[read]];
@@ -728,6 +760,67 @@ uint8_t ascii_to_gsm7(const uint8_t *a8bitPtr, ///< [IN] 8bits array to convert
   return write;
 }
 
+/**
+ * Convert an ascii array into a 7bits array
+ * length is the number of bytes in the ascii buffer
+ *
+ * @return the size of the a7bit string (in 7bit chars!), or LE_OVERFLOW if
+ * a7bitPtr is too small.
+ */
+uint8_t ascii_to_gsm7(const uint8_t *a8bitPtr, ///< [IN] 8bits array to convert
+                      uint8_t *a7bitPtr        ///< [OUT] 7bits array result
+) {
+  return ascii_to_gsm7_offset(a8bitPtr, strlen((char *)a8bitPtr), a7bitPtr, 0);
+}
+
+/*
+ * Split a text in GSM-7 segments
+ *  Fills the length in characters of each segment and returns how
+ *  many of them we need, up to max_segments (the rest of the text
+ *  is left for the caller). Escaped characters take two septets and
+ *  are never split
+ */
+int split_gsm7_text(const uint8_t *text, size_t len, uint16_t *segment_len,
+                    int max_segments) {
+  uint16_t septets = 0, char_septets;
+  int num_segments = 0;
+  size_t i, start = 0;
+
+  for (i = 0; i < len; i++) {
+    septets += Ascii8to7[text[i]] >= 128 ? 2 : 1;
+  }
+  if (septets <= SMS_GSM7_MAX_SEPTETS) {
+    segment_len[0] = len;
+    return 1;
+  }
+
+  septets = 0;
+  for (i = 0; i < len && num_segments < max_segments; i++) {
+    char_septets = Ascii8to7[text[i]] >= 128 ? 2 : 1;
+    if (septets + char_septets > SMS_GSM7_SEGMENT_SEPTETS) {
+      segment_len[num_segments++] = i - start;
+      start = i;
+      septets = 0;
+      if (num_segments == max_segments) {
+        return num_segments;
+      }
+    }
+    septets += char_septets;
+  }
+  segment_len[num_segments++] = i - start;
+  return num_segments;
+}
+
+/* Concatenation header for a segment, SMS_UDH_CONCAT_SIZE bytes */
+void fill_concat_udh(uint8_t *buf, uint8_t ref, uint8_t total, uint8_t seq) {
+  buf[0] = SMS_UDH_CONCAT_SIZE - 1;
+  buf[1] = SMS_IEI_CONCAT_8BIT_REF;
+  buf[2] = 3;
+  buf[3] = ref;
+  buf[4] = total;
+  buf[5] = seq;
+}
+
 uint8_t swap_byte(uint8_t source) {
   uint8_t parsed = 0;
   parsed = (parsed << 4) + (source % 10);
@@ -874,17 +967,28 @@ int build_and_send_message(int fd, uint32_t message_id) {
   int ret, fullpktsz;
   uint8_t tmpyear;
 
+  struct message *msg = &sms_runtime.queue.msg[message_id];
+  uint8_t septets, udh_septets = 0;
+
   time_t t = time(NULL);
   struct tm tm = *localtime(&t);
-  uint8_t msgoutput[160] = {0};
-  ret = ascii_to_gsm7((uint8_t *)sms_runtime.queue.msg[message_id].pkt,
-                      msgoutput);
-
-  logger(MSG_DEBUG, "%s: Message ID: %u | Str: %s | %i bytes\n", __func__, message_id, sms_runtime.queue.msg[message_id].pkt, ret);
-  if (ret > MAX_MESSAGE_SIZE) {
-    logger(MSG_ERROR, "%s: Warning: resulting message size exceeds limit. Truncating\n");
-    ret = 160;
+  uint8_t msgoutput[MAX_MESSAGE_SIZE + 1] = {0};
+  if (msg->concat_total > 1) {
+    fill_concat_udh(msgoutput, msg->concat_ref, msg->concat_total,
+                    msg->concat_seq);
+    udh_septets = SMS_UDH_CONCAT_SEPTETS;
   }
+  septets = ascii_to_gsm7_offset((uint8_t *)msg->pkt,
+                                 strnlen(msg->pkt, MAX_MESSAGE_SIZE),
+                                 msgoutput, udh_septets);
+  if (septets > SMS_GSM7_MAX_SEPTETS) {
+    logger(MSG_ERROR, "%s: Warning: resulting message size exceeds limit. Truncating\n", __func__);
+    septets = SMS_GSM7_MAX_SEPTETS;
+  }
+  /* Packed size */
+  ret = (septets * 7 + 7) / 8;
+  logger(MSG_DEBUG, "%s: Message ID: %u | Str: %s | %u septets, %i bytes\n",
+         __func__, message_id, msg->pkt, septets, ret);
   /* QMUX */
   this_sms->qmuxpkt.version = 0x01;
   this_sms->qmuxpkt.packet_length = 0x00; // SIZE
@@ -922,7 +1026,10 @@ int build_and_send_message(int fd, uint32_t message_id) {
   else
     fill_sender_phone_number(this_sms->data.smsc.number, false);
 
-  this_sms->data.unknown = 0x04; // This is still unknown
+  this_sms->data.unknown = SMS_TP_MMS; // SMS-DELIVER, first PDU octet
+  if (msg->concat_total > 1) {
+    this_sms->data.unknown |= SMS_TP_UDHI;
+  }
 
   // We leave all this hardcoded, we will only worry about ourselves
   /* We need a hardcoded number so when a reply comes we can catch it,
@@ -994,12 +1101,10 @@ int build_and_send_message(int fd, uint32_t message_id) {
       this_sms->qmipkt.length - sizeof(struct qmi_generic_result_ind) -
       sizeof(struct wms_raw_message_header) - (3 * sizeof(uint8_t));
 
-  /* Content size is the number of bytes _after_ conversion
-   * from GSM7 to ASCII bytes (not the actual size of string)
+  /* Content size is the number of septets, header included, not the
+   * size of the packed data
    */
-
-  this_sms->data.contents.content_sz =
-      strlen((char *)sms_runtime.queue.msg[message_id].pkt);
+  this_sms->data.contents.content_sz = septets;
 
   ret = write(fd, (uint8_t *)this_sms, fullpktsz);
   dump_pkt_raw((uint8_t *)this_sms, fullpktsz);
@@ -1018,7 +1123,8 @@ int build_and_send_message(int fd, uint32_t message_id) {
 int build_and_send_raw_message(int fd, uint32_t message_id) {
   struct wms_build_message *this_sms;
   this_sms = calloc(1, sizeof(struct wms_build_message));
-  int ret, fullpktsz;
+  struct message *msg = &sms_runtime.queue.msg[message_id];
+  int ret, fullpktsz, udh_len = 0;
   uint8_t tmpyear;
 
   time_t t = time(NULL);
@@ -1059,7 +1165,11 @@ int build_and_send_raw_message(int fd, uint32_t message_id) {
   else
     fill_sender_phone_number(this_sms->data.smsc.number, false);
   // ENCODING TEST
-  this_sms->data.unknown = 0x04; // This is still unknown
+  this_sms->data.unknown = SMS_TP_MMS; // SMS-DELIVER, first PDU octet
+  if (msg->concat_total > 1) {
+    this_sms->data.unknown |= SMS_TP_UDHI;
+    udh_len = SMS_UDH_CONCAT_SIZE;
+  }
 
   // We leave all this hardcoded, we will only worry about ourselves
   /* We need a hardcoded number so when a reply comes we can catch it,
@@ -1087,9 +1197,11 @@ int build_and_send_raw_message(int fd, uint32_t message_id) {
     }
   }
   /* CONTENTS */
-  memcpy(this_sms->data.contents.contents,
-         sms_runtime.queue.msg[message_id].pkt,
-         sms_runtime.queue.msg[message_id].len);
+  if (udh_len > 0) {
+    fill_concat_udh(this_sms->data.contents.contents, msg->concat_ref,
+                    msg->concat_total, msg->concat_seq);
+  }
+  memcpy(this_sms->data.contents.contents + udh_len, msg->pkt, msg->len);
 
   /*
    * tm_year should return number of years from 1900
@@ -1122,7 +1234,7 @@ int build_and_send_raw_message(int fd, uint32_t message_id) {
   fullpktsz = sizeof(struct qmux_packet) + sizeof(struct qmi_packet) +
               sizeof(struct qmi_generic_result_ind) +
               sizeof(struct wms_raw_message_header) +
-              sizeof(struct wms_user_data) - MAX_MESSAGE_SIZE +
+              sizeof(struct wms_user_data) - MAX_MESSAGE_SIZE + udh_len +
               sms_runtime.queue.msg[message_id].len; // ret == msgsize
   // QMUX packet size
   this_sms->qmuxpkt.packet_length =
@@ -1131,7 +1243,7 @@ int build_and_send_raw_message(int fd, uint32_t message_id) {
   this_sms->qmipkt.length = sizeof(struct qmi_generic_result_ind) +
                             sizeof(struct wms_raw_message_header) +
                             sizeof(struct wms_user_data) - MAX_MESSAGE_SIZE +
-                            sms_runtime.queue.msg[message_id].len;
+                            udh_len + sms_runtime.queue.msg[message_id].len;
   // Header size: QMI - indication size - uint16_t size element itself - header
   // tlv
   this_sms->header.size = this_sms->qmipkt.length -
@@ -1143,7 +1255,8 @@ int build_and_send_raw_message(int fd, uint32_t message_id) {
       sizeof(struct wms_raw_message_header) - (3 * sizeof(uint8_t));
 
   /* In this case we leave the size alone, this ain't gsm-7 */
-  this_sms->data.contents.content_sz = sms_runtime.queue.msg[message_id].len;
+  this_sms->data.contents.content_sz =
+      udh_len + sms_runtime.queue.msg[message_id].len;
 
   if (sms_runtime.queue.msg[message_id].tp_dcs == 0x00) {
     logger(MSG_WARN, "*** RAWSMS: Content sz: %i -> to8 -> %i",
@@ -1174,7 +1287,7 @@ int build_and_send_raw_message(int fd, uint32_t message_id) {
  *  This func does the entire transaction
  */
 int handle_message_state(int fd, uint32_t message_id) {
-  if (message_id > QUEUE_SIZE) {
+  if (message_id >= QUEUE_SIZE) {
     logger(MSG_ERROR, "%s: Attempting to read invalid message ID: %i\n",
            __func__, message_id);
     return 0;
@@ -1188,8 +1301,8 @@ int handle_message_state(int fd, uint32_t message_id) {
     logger(MSG_DEBUG, "%s: Notify Message ID: %i\n", __func__, message_id);
     pulse_ring_in();
     generate_message_notification(fd, message_id);
-    clock_gettime(CLOCK_MONOTONIC,
-                  &sms_runtime.queue.msg[message_id].timestamp);
+    sms_runtime.queue.msg[message_id].deadline =
+        get_monotonic_time_ms() + SMS_QUEUE_RETRY_MS;
     sms_runtime.queue.msg[message_id].state = 1;
     sms_runtime.current_message_id =
         sms_runtime.queue.msg[message_id].message_id;
@@ -1216,8 +1329,8 @@ int handle_message_state(int fd, uint32_t message_id) {
                message_id);
       }
     }
-    clock_gettime(CLOCK_MONOTONIC,
-                  &sms_runtime.queue.msg[message_id].timestamp);
+    sms_runtime.queue.msg[message_id].deadline =
+        get_monotonic_time_ms() + SMS_QUEUE_RETRY_MS;
     break;
   case 3: // GET TID AND DELETE MESSAGE
     logger(MSG_DEBUG, "%s: Waiting for ACK %i: state %i\n", __func__,
@@ -1231,12 +1344,7 @@ int handle_message_state(int fd, uint32_t message_id) {
     } else {
       process_message_deletion(fd, 0, 1);
     }
-    clock_gettime(CLOCK_MONOTONIC,
-                  &sms_runtime.queue.msg[message_id].timestamp);
-    sms_runtime.queue.msg[message_id].state = 9;
-    memset(sms_runtime.queue.msg[message_id].pkt, 0, MAX_MESSAGE_SIZE);
-    sms_runtime.queue.msg[message_id].len = 0;
-    sms_runtime.current_message_id++;
+    release_message_slot(message_id);
     break;
   default:
     logger(MSG_WARN, "%s: Unknown task for message ID: %i (%i) \n", __func__,
@@ -1245,16 +1353,39 @@ int handle_message_state(int fd, uint32_t message_id) {
   }
   return 0;
 }
-void wipe_queue() {
-  logger(MSG_DEBUG, "%s: Wipe status. \n", __func__);
-  for (int i = 0; i <= sms_runtime.queue.queue_pos; i++) {
-    sms_runtime.queue.msg[i].state = 0;
-    sms_runtime.queue.msg[i].retries = 0;
+bool is_message_queue_empty() {
+  return atomic_load(&sms_runtime.queue.tail) ==
+         atomic_load(&sms_runtime.queue.head);
+}
+
+/*
+ * Done with the message at the tail (delivered or given up), free
+ * its slot and move on. Proxy thread only
+ */
+void release_message_slot(uint32_t message_id) {
+  uint32_t tail = atomic_load(&sms_runtime.queue.tail);
+  if (message_id != tail % QUEUE_SIZE) {
+    logger(MSG_WARN, "%s: Message %u is not the one being delivered (%u)\n",
+           __func__, message_id, tail % QUEUE_SIZE);
+    return;
+  }
+  memset(&sms_runtime.queue.msg[message_id], 0, sizeof(struct message));
+  atomic_store_explicit(&sms_runtime.queue.tail, tail + 1,
+                        memory_order_release);
+
+  if (is_message_queue_empty()) {
+    logger(MSG_INFO, "%s: Nothing left in the queue \n", __func__);
+    set_notif_pending(false);
+    set_pending_notification_source(MSG_NONE);
+    /* Someone may have queued a message while we were clearing the flag */
+    if (!is_message_queue_empty()) {
+      set_pending_notification_source(MSG_INTERNAL);
+      set_notif_pending(true);
+    }
+  } else {
+    /* Don't wait for the next tick to start with the next one */
+    wake_up_proxy();
   }
-  set_notif_pending(false);
-  set_pending_notification_source(MSG_NONE);
-  sms_runtime.queue.queue_pos = -1;
-  sms_runtime.current_message_id = 0;
 }
 
 /*
@@ -1267,9 +1398,10 @@ void notify_wms_event(uint8_t *bytes, size_t len, int fd) {
   struct encapsulated_qmi_packet *pkt;
   pkt = (struct encapsulated_qmi_packet *)bytes;
   sms_runtime.curr_transaction_id = pkt->qmi.transaction_id;
-  logger(MSG_DEBUG, "%s: Messages in queue: %i\n", __func__,
-         sms_runtime.queue.queue_pos + 1);
-  if (sms_runtime.queue.queue_pos < 0) {
+  logger(MSG_DEBUG, "%s: Messages in queue: %u\n", __func__,
+         atomic_load(&sms_runtime.queue.head) -
+             atomic_load(&sms_runtime.queue.tail));
+  if (is_message_queue_empty()) {
     logger(MSG_DEBUG, "%s: Nothing to do \n", __func__);
     return;
   }
@@ -1302,9 +1434,6 @@ void notify_wms_event(uint8_t *bytes, size_t len, int fd) {
       sms_runtime.current_message_id = storage->message_id;
       sms_runtime.queue.msg[sms_runtime.current_message_id].state = 2;
       handle_message_state(fd, sms_runtime.current_message_id);
-      clock_gettime(
-          CLOCK_MONOTONIC,
-          &sms_runtime.queue.msg[sms_runtime.current_message_id].timestamp);
     } else {
       logger(MSG_ERROR, "%s: Can't find offset for raw_message!\n", __func__);
       dump_pkt_raw(bytes, len);
@@ -1314,16 +1443,13 @@ void notify_wms_event(uint8_t *bytes, size_t len, int fd) {
     logger(MSG_DEBUG, "%s: WMS_DELETE for message %i. ID %.4x\n", __func__,
            sms_runtime.current_message_id, pkt->qmi.msgid);
     if (sms_runtime.queue.msg[sms_runtime.current_message_id].state != 3) {
+      /* Its slot is gone already, just acknowledge it again */
       logger(MSG_DEBUG, "%s: Requested to delete previous message \n", __func__);
-      if (sms_runtime.current_message_id > 0) {
-        sms_runtime.current_message_id--;
-      }
+      process_message_deletion(fd, 0, 1);
+      break;
     }
     sms_runtime.queue.msg[sms_runtime.current_message_id].state = 4;
     handle_message_state(fd, sms_runtime.current_message_id);
-    clock_gettime(
-        CLOCK_MONOTONIC,
-        &sms_runtime.queue.msg[sms_runtime.current_message_id].timestamp);
     break;
   case WMS_LIST_ALL_MESSAGES:
     logger(MSG_DEBUG, "Host requests to list ALL messages");
@@ -1341,128 +1467,203 @@ void notify_wms_event(uint8_t *bytes, size_t len, int fd) {
  * Process message queue
  *  We'll end up here from the proxy, when a MSG_INTERNAL is
  *  pending, but not necessarily as a response to a host WMS query
- *
+ *  Only the message at the tail is in flight, so this is a single
+ *  step of its state machine
  */
 int process_message_queue(int fd) {
-  int i;
-  struct timespec cur_time;
-  double elapsed_time;
+  struct message *msg;
+  uint32_t tail;
 
-  clock_gettime(CLOCK_MONOTONIC, &cur_time);
-  if (sms_runtime.queue.lock_queue) {
+  if (atomic_load(&sms_runtime.queue.lock_queue)) {
     logger(MSG_INFO, "%s: Queue is locked \n", __func__);
     return 0;
   }
-  if (sms_runtime.queue.queue_pos < 0) {
-    logger(MSG_INFO, "%s: Nothing yet \n", __func__);
+  tail = atomic_load(&sms_runtime.queue.tail);
+  if (tail == atomic_load(&sms_runtime.queue.head)) {
+    logger(MSG_INFO, "%s: Nothing left in the queue \n", __func__);
+    set_notif_pending(false);
+    set_pending_notification_source(MSG_NONE);
+    if (!is_message_queue_empty()) {
+      set_pending_notification_source(MSG_INTERNAL);
+      set_notif_pending(true);
+    }
     return 0;
   }
 
-  if (sms_runtime.current_message_id > sms_runtime.queue.queue_pos + 1) {
-    logger(MSG_INFO, "%s: We finished the queue \n", __func__);
+  msg = &sms_runtime.queue.msg[tail % QUEUE_SIZE];
+  /* Claimed but still being written, its producer will wake us up */
+  if (atomic_load_explicit(&msg->seq, memory_order_acquire) != tail + 1) {
+    logger(MSG_DEBUG, "%s: Nothing yet \n", __func__);
+    return 0;
   }
 
-  if (sms_runtime.queue.queue_pos >= 0) {
-    for (i = 0; i <= sms_runtime.queue.queue_pos; i++) {
+  switch (msg->state) {
+  case 0: // We're beginning, we need to send the notification
+  case 2: // For whatever reason we're here with a message send pending
+  case 4:
+    handle_message_state(fd, tail % QUEUE_SIZE);
+    break;
+  case 1: // We're here but we're waiting for an ACK
+  case 3:
+    if (get_monotonic_time_ms() < msg->deadline) {
+      logger(MSG_DEBUG, "-->%s: Waiting on message for %u \n", __func__,
+             tail % QUEUE_SIZE);
+    } else if (msg->retries < SMS_QUEUE_MAX_RETRIES) {
+      logger(MSG_WARN, "-->%s: Retrying message id %u \n", __func__,
+             tail % QUEUE_SIZE);
+      msg->retries++;
+      msg->state--;
+      handle_message_state(fd, tail % QUEUE_SIZE);
+    } else {
+      logger(MSG_ERROR, "-->%s: Message %u timed out, killing it \n",
+             __func__, tail % QUEUE_SIZE);
+      release_message_slot(tail % QUEUE_SIZE);
+    }
+    break;
+  default:
+    release_message_slot(tail % QUEUE_SIZE);
+    break;
+  }
+  return 0;
+}
 
-      elapsed_time =
-          (((cur_time.tv_sec - sms_runtime.queue.msg[i].timestamp.tv_sec) *
-            1e9) +
-           (cur_time.tv_nsec - sms_runtime.queue.msg[i].timestamp.tv_nsec)) /
-          1e9;
-      if (elapsed_time < 0) {
-        clock_gettime(CLOCK_MONOTONIC, &sms_runtime.queue.msg[i].timestamp);
-      }
-      switch (sms_runtime.queue.msg[i].state) {
-      case 0: // We're beginning, we need to send the notification
-        sms_runtime.current_message_id = sms_runtime.queue.msg[i].message_id;
-        handle_message_state(fd, sms_runtime.current_message_id);
-        return 0;
-      case 2: // For whatever reason we're here with a message send pending
-        handle_message_state(fd, sms_runtime.current_message_id);
-        return 0;
-      case 4:
-        handle_message_state(fd, sms_runtime.current_message_id);
-        return 0;
-      case 1: // We're here but we're waiting for an ACK
-      case 3:
-        if (elapsed_time > 5 && sms_runtime.queue.msg[i].retries < 3) {
-          logger(MSG_WARN, "-->%s: Retrying message id %i \n", __func__, i);
-          sms_runtime.queue.msg[i].retries++;
-          sms_runtime.queue.msg[i].state--;
-        } else if (elapsed_time > 5 && sms_runtime.queue.msg[i].retries >= 3) {
-          logger(MSG_ERROR, "-->%s: Message %i timed out, killing it \n",
-                 __func__, i);
-          memset(sms_runtime.queue.msg[i].pkt, 0, MAX_MESSAGE_SIZE);
-          sms_runtime.queue.msg[i].state = 9;
-          sms_runtime.queue.msg[i].retries = 0;
-          sms_runtime.queue.msg[i].len = 0;
-          sms_runtime.current_message_id++;
-        } else {
-          logger(MSG_WARN, "-->%s: Waiting on message for %i \n", __func__, i);
-        }
-        return 0;
-      }
+/*
+ * Reserve the next count slots in the queue, safe from any thread.
+ * Segments of the same message are claimed together so they reach
+ * the host back to back. Returns the position of the first one or
+ * -ENOSPC if they don't fit
+ */
+int64_t claim_message_slots(uint8_t count) {
+  uint32_t head = atomic_load(&sms_runtime.queue.head);
+  do {
+    if (head + count - atomic_load_explicit(&sms_runtime.queue.tail,
+                                            memory_order_acquire) >
+        QUEUE_SIZE) {
+      return -ENOSPC;
     }
+  } while (!atomic_compare_exchange_weak(&sms_runtime.queue.head, &head,
+                                         head + count));
+  for (uint8_t i = 0; i < count; i++) {
+    sms_runtime.queue.msg[(head + i) % QUEUE_SIZE].message_id =
+        (head + i) % QUEUE_SIZE;
   }
+  return head;
+}
 
-  logger(MSG_INFO, "%s: Nothing left in the queue \n", __func__);
-  wipe_queue();
-  return 0;
+/* Hand the filled slot to the proxy */
+void commit_message_slot(struct message *msg, uint32_t pos) {
+  atomic_store_explicit(&msg->seq, pos + 1, memory_order_release);
+  set_pending_notification_source(MSG_INTERNAL);
+  set_notif_pending(true);
 }
 
 /*
  * Update message queue and add new message text
  * to the array
+ *  Texts over a single SMS are queued as a concatenated message
  */
 void add_sms_to_queue(uint8_t *message, size_t len) {
-  if (sms_runtime.queue.queue_pos > QUEUE_SIZE - 2) {
-    logger(MSG_ERROR, "%s: Queue is full!\n", __func__);
-    return;
-  }
-  if (len > 0) {
-    set_notif_pending(true);
-    set_pending_notification_source(MSG_INTERNAL);
-    logger(MSG_DEBUG, "%s: Adding SMS: Text: %s\n Position %u\n", __func__, message,
-           sms_runtime.queue.queue_pos + 1);
-    sms_runtime.queue.queue_pos++;
-    memcpy(sms_runtime.queue.msg[sms_runtime.queue.queue_pos].pkt, message,
-           len);
-    sms_runtime.queue.msg[sms_runtime.queue.queue_pos].message_id =
-        sms_runtime.queue.queue_pos;
-    sms_runtime.queue.msg[sms_runtime.queue.queue_pos].tp_dcs = 0x00;
-    sms_runtime.queue.msg[sms_runtime.queue.queue_pos].is_raw = 0;
-    sms_runtime.queue.msg[sms_runtime.queue.queue_pos].is_cb = 0;
+  uint16_t segment_len[SMS_MAX_SEGMENTS];
+  struct message *msg;
+  int64_t pos;
+  uint8_t ref = 0;
+  int num_segments;
 
-  } else {
+  if (len == 0) {
     logger(MSG_ERROR, "%s: Size of message is 0\n", __func__);
+    return;
+  }
+  while (len > 0) {
+    num_segments = split_gsm7_text(message, len, segment_len, SMS_MAX_SEGMENTS);
+    pos = claim_message_slots(num_segments);
+    if (pos < 0) {
+      logger(MSG_ERROR, "%s: Queue is full!\n", __func__);
+      return;
+    }
+    if (num_segments > 1) {
+      ref = atomic_fetch_add(&sms_runtime.concat_ref, 1);
+    }
+    for (int i = 0; i < num_segments; i++) {
+      msg = &sms_runtime.queue.msg[(pos + i) % QUEUE_SIZE];
+      logger(MSG_DEBUG, "%s: Adding SMS: Text: %.*s\n Position %u\n",
+             __func__, segment_len[i], message, msg->message_id);
+      memcpy(msg->pkt, message, segment_len[i]);
+      msg->tp_dcs = 0x00;
+      msg->is_raw = 0;
+      msg->is_cb = 0;
+      if (num_segments > 1) {
+        msg->concat_ref = ref;
+        msg->concat_total = num_segments;
+        msg->concat_seq = i + 1;
+      }
+      commit_message_slot(msg, pos + i);
+      message += segment_len[i];
+      len -= segment_len[i];
+    }
   }
 }
 
+/*
+ * Raw (already encoded) contents. UCS-2 and 8 bit data can be split
+ * in segments, packed GSM-7 can't and is cut to a single message
+ */
 void add_raw_sms_to_queue(uint8_t *message, size_t len, uint8_t tp_dcs,
                           bool is_cb) {
-  if (sms_runtime.queue.queue_pos > QUEUE_SIZE - 2) {
+  uint16_t segment_len[SMS_MAX_SEGMENTS];
+  struct message *msg;
+  int num_segments = 0;
+  size_t offset = 0;
+  uint16_t chunk;
+  int64_t pos;
+  uint8_t ref;
+
+  if (len == 0) {
+    logger(MSG_ERROR, "%s: Size of message is 0\n", __func__);
+    return;
+  }
+  if (tp_dcs == 0x00 || len <= SMS_MAX_USER_DATA_OCTETS) {
+    segment_len[num_segments++] = len > MAX_MESSAGE_SIZE ? MAX_MESSAGE_SIZE : len;
+  } else {
+    while (offset < len && num_segments < SMS_MAX_SEGMENTS) {
+      chunk = len - offset > SMS_SEGMENT_OCTETS ? SMS_SEGMENT_OCTETS
+                                                : len - offset;
+      /* Don't leave half of a UTF-16 surrogate pair in each segment */
+      if (sms_encoding_type(tp_dcs) == MM_SMS_ENCODING_UCS2 &&
+          offset + chunk < len && chunk >= 2 &&
+          (message[offset + chunk - 2] & 0xfc) == 0xd8) {
+        chunk -= 2;
+      }
+      segment_len[num_segments++] = chunk;
+      offset += chunk;
+    }
+    if (offset < len) {
+      logger(MSG_WARN, "%s: Message too long, dropping %u bytes\n", __func__,
+             len - offset);
+    }
+  }
+
+  pos = claim_message_slots(num_segments);
+  if (pos < 0) {
     logger(MSG_ERROR, "%s: Queue is full!\n", __func__);
     return;
   }
-  if (len > 0) {
-    set_notif_pending(true);
-    set_pending_notification_source(MSG_INTERNAL);
-    logger(MSG_INFO, "%s: Adding message to queue (%i)\n", __func__,
-           sms_runtime.queue.queue_pos + 1);
-    sms_runtime.queue.queue_pos++;
-    memcpy(sms_runtime.queue.msg[sms_runtime.queue.queue_pos].pkt, message,
-           len);
-    sms_runtime.queue.msg[sms_runtime.queue.queue_pos].message_id =
-        sms_runtime.queue.queue_pos;
-    sms_runtime.queue.msg[sms_runtime.queue.queue_pos].len = len;
-    sms_runtime.queue.msg[sms_runtime.queue.queue_pos].tp_dcs = tp_dcs;
-    sms_runtime.queue.msg[sms_runtime.queue.queue_pos].is_raw = 1;
-    if (is_cb) {
-      sms_runtime.queue.msg[sms_runtime.queue.queue_pos].is_cb = 1;
+  ref = num_segments > 1 ? atomic_fetch_add(&sms_runtime.concat_ref, 1) : 0;
+  for (int i = 0; i < num_segments; i++) {
+    msg = &sms_runtime.queue.msg[(pos + i) % QUEUE_SIZE];
+    logger(MSG_INFO, "%s: Adding message to queue (%u)\n", __func__,
+           msg->message_id);
+    memcpy(msg->pkt, message, segment_len[i]);
+    msg->len = segment_len[i];
+    msg->tp_dcs = tp_dcs;
+    msg->is_raw = 1;
+    msg->is_cb = is_cb ? 1 : 0;
+    if (num_segments > 1) {
+      msg->concat_ref = ref;
+      msg->concat_total = num_segments;
+      msg->concat_seq = i + 1;
     }
-  } else {
-    logger(MSG_ERROR, "%s: Size of message is 0\n", __func__);
+    commit_message_slot(msg, pos + i);
+    message += segment_len[i];
   }
 }
 
@@ -1514,14 +1715,130 @@ uint8_t send_outgoing_msg_ack(uint16_t transaction_id, int usbfd,
   return ret;
 }
 
+/*
+ * Inbound concatenated messages
+ *  Stores a part of a long command. Returns the size of the full
+ *  command, copied to output, once we have all of its parts, or 0
+ *  while we're still waiting for some of them
+ */
+int reassemble_message_part(uint16_t ref, uint8_t total, uint8_t seq,
+                            const char *text, uint8_t len, char *output,
+                            size_t output_len) {
+  struct sms_reassembly *entry = NULL, *free_entry = NULL, *oldest = NULL;
+  uint64_t now = get_monotonic_time_ms();
+  size_t strsz = 0;
+
+  for (uint8_t i = 0; i < SMS_REASSEMBLY_SLOTS; i++) {
+    struct sms_reassembly *cur = &sms_runtime.reassembly[i];
+    if (cur->in_use && now - cur->first_seen > SMS_REASSEMBLY_TIMEOUT_MS) {
+      logger(MSG_WARN, "%s: Dropping incomplete message %u (%u of %u parts)\n",
+             __func__, cur->ref, __builtin_popcount(cur->received),
+             cur->total);
+      cur->in_use = false;
+    }
+    if (!cur->in_use) {
+      if (free_entry == NULL) {
+        free_entry = cur;
+      }
+      continue;
+    }
+    if (cur->ref == ref && cur->total == total) {
+      entry = cur;
+    }
+    if (oldest == NULL || cur->first_seen < oldest->first_seen) {
+      oldest = cur;
+    }
+  }
+
+  if (total > SMS_REASSEMBLY_MAX_PARTS) {
+    logger(MSG_WARN, "%s: Message %u has %u parts, keeping the first %u\n",
+           __func__, ref, total, SMS_REASSEMBLY_MAX_PARTS);
+    if (seq > SMS_REASSEMBLY_MAX_PARTS) {
+      return 0;
+    }
+  }
+
+  if (entry == NULL) {
+    entry = free_entry != NULL ? free_entry : oldest;
+    if (entry->in_use) {
+      logger(MSG_WARN, "%s: Too many messages in flight, dropping %u\n",
+             __func__, entry->ref);
+    }
+    memset(entry, 0, sizeof(struct sms_reassembly));
+    entry->in_use = true;
+    entry->ref = ref;
+    entry->total = total;
+    entry->first_seen = now;
+  }
+
+  memcpy(entry->parts[seq - 1], text, len);
+  entry->len[seq - 1] = len;
+  entry->received |= 1 << (seq - 1);
+  logger(MSG_DEBUG, "%s: Message %u: part %u of %u\n", __func__, ref, seq,
+         total);
+
+  if (entry->received !=
+      (1 << (total < SMS_REASSEMBLY_MAX_PARTS ? total
+                                              : SMS_REASSEMBLY_MAX_PARTS)) -
+          1) {
+    return 0;
+  }
+  for (uint8_t i = 0; i < SMS_REASSEMBLY_MAX_PARTS && i < total; i++) {
+    if (strsz + entry->len[i] >= output_len) {
+      break;
+    }
+    memcpy(output + strsz, entry->parts[i], entry->len[i]);
+    strsz += entry->len[i];
+  }
+  output[strsz] = 0;
+  entry->in_use = false;
+  return strsz;
+}
+
+/*
+ * Reads the concatenation IE from a user data header, if there's one
+ *  Returns true and fills ref, total and seq for a valid one
+ */
+bool get_concat_info_from_udh(uint8_t *udh, uint8_t udhl, uint16_t *ref,
+                              uint8_t *total, uint8_t *seq) {
+  uint8_t offset = 1, ie_id, ie_len;
+  while (offset + 1 < udhl) {
+    ie_id = udh[offset++];
+    ie_len = udh[offset++];
+    if (offset + ie_len > udhl) {
+      break;
+    }
+    if (ie_id == SMS_IEI_CONCAT_8BIT_REF && ie_len == 3) {
+      *ref = udh[offset];
+      *total = udh[offset + 1];
+      *seq = udh[offset + 2];
+    } else if (ie_id == SMS_IEI_CONCAT_16BIT_REF && ie_len == 4) {
+      *ref = (udh[offset] << 8) | udh[offset + 1];
+      *total = udh[offset + 2];
+      *seq = udh[offset + 3];
+    } else {
+      offset += ie_len;
+      continue;
+    }
+    /* Part 0 of M or part N > M are bogus */
+    return *seq > 0 && *seq <= *total;
+  }
+  return false;
+}
+
 /* Intercept and ACK a message */
 uint8_t intercept_and_parse(void *bytes, size_t len, int adspfd, int usbfd) {
   uint8_t *output;
-  uint8_t ret;
+  char text[MAX_MESSAGE_SIZE + 1] = {0};
   struct outgoing_sms_packet *pkt;
   struct outgoing_no_validity_period_sms_packet *nodate_pkt;
+  struct sms_content *contents = NULL;
+  uint8_t udhl = 0, fill_bits = 0, septets, total = 0, seq = 0;
+  uint16_t ref = 0;
+  bool is_concatenated = false;
+  int ret;
 
-  output = calloc(MAX_MESSAGE_SIZE, sizeof(uint8_t));
+  output = calloc(SMS_MAX_COMMAND_SIZE, sizeof(uint8_t));
   if (len >= sizeof(struct outgoing_sms_packet) - (MAX_MESSAGE_SIZE + 2)) {
     pkt = (struct outgoing_sms_packet *)bytes;
     nodate_pkt = (struct outgoing_no_validity_period_sms_packet *)bytes;
@@ -1529,28 +1846,12 @@ uint8_t intercept_and_parse(void *bytes, size_t len, int adspfd, int usbfd) {
      *  0x31 -> Most of ModemManager stuff
      *  0x11 -> From jeremy, still keeps 0x21
      *  0x01 -> Skips the 0x21 and jumps to content
+     *  0x40 on top of any of them if it's part of a long message
      */
-    if (pkt->pdu_type >= 0x11) {
-      uint8_t tp_user_data_size_elements = pkt->contents.content_sz;
-      uint8_t tp_user_data_size_bytes =
-          (7 * (tp_user_data_size_elements + 1)) / 8;
-      ret = gsm7_to_ascii(pkt->contents.contents, tp_user_data_size_elements,
-                          (char *)output, tp_user_data_size_bytes, 0);
-      if (ret < 0) {
-        logger(MSG_ERROR, "%s: %i: Failed to convert to ASCII\n", __func__,
-               __LINE__);
-      }
-    } else if (pkt->pdu_type == 0x01) {
-      uint8_t tp_user_data_size_elements = nodate_pkt->contents.content_sz;
-      uint8_t tp_user_data_size_bytes =
-          (7 * (tp_user_data_size_elements + 1)) / 8;
-      ret = gsm7_to_ascii(nodate_pkt->contents.contents,
-                          tp_user_data_size_elements, (char *)output,
-                          tp_user_data_size_bytes, 0);
-      if (ret < 0) {
-        logger(MSG_ERROR, "%s: %i: Failed to convert to ASCII\n", __func__,
-               __LINE__);
-      }
+    if ((pkt->pdu_type & SMS_TP_VPF_MASK) == SMS_TP_VPF_RELATIVE) {
+      contents = &pkt->contents;
+    } else if ((pkt->pdu_type & SMS_TP_VPF_MASK) == SMS_TP_VPF_NONE) {
+      contents = &nodate_pkt->contents;
     } else {
       set_log_level(MSG_DEBUG);
 
@@ -1564,9 +1865,43 @@ uint8_t intercept_and_parse(void *bytes, size_t len, int adspfd, int usbfd) {
              "get him the following dump:\n",
              __func__);
     }
+
+    if (contents != NULL) {
+      septets = contents->content_sz;
+      if (pkt->pdu_type & SMS_TP_UDHI) {
+        udhl = contents->contents[0] + 1;
+        if (udhl < MAX_MESSAGE_SIZE) {
+          is_concatenated = get_concat_info_from_udh(contents->contents, udhl,
+                                                     &ref, &total, &seq);
+          /* Text starts on the next septet boundary after the header */
+          fill_bits = (7 - (udhl * 8) % 7) % 7;
+          septets = septets > (udhl * 8 + fill_bits) / 7
+                        ? septets - (udhl * 8 + fill_bits) / 7
+                        : 0;
+        } else {
+          udhl = 0;
+        }
+      }
+      ret = gsm7_to_ascii(contents->contents + udhl,
+                          septets < MAX_MESSAGE_SIZE ? septets
+                                                     : MAX_MESSAGE_SIZE,
+                          text, MAX_MESSAGE_SIZE, fill_bits);
+      if (ret < 0) {
+        logger(MSG_ERROR, "%s: %i: Failed to convert to ASCII\n", __func__,
+               __LINE__);
+      }
+    }
     set_log_level(MSG_INFO);
     send_outgoing_msg_ack(pkt->qmipkt.transaction_id, usbfd, 0x0000);
-    parse_command(output);
+    if (is_concatenated && total > 1) {
+      if (reassemble_message_part(ref, total, seq, text, strlen(text),
+                                  (char *)output, SMS_MAX_COMMAND_SIZE) > 0) {
+        parse_command(output);
+      }
+    } else {
+      memcpy(output, text, strlen(text));
+      parse_command(output);
+    }
   }
   pkt = NULL;
   nodate_pkt = NULL;
@@ -2042,6 +2377,7 @@ int check_wms_list_all_messages(uint8_t source, void *bytes, size_t len,
               MSG_WARN,
               "The DSP wants to give us some messages, we're going to lie\n");
           sms_runtime.stuck_message_data_pending = true;
+          wake_up_proxy();
           needs_bypass = 1;
           empty_answer->qmuxpkt = pkt->qmuxpkt;
           empty_answer->qmipkt = pkt->qmipkt;
@@ -2129,9 +2465,8 @@ uint8_t intercept_cb_message(void *bytes, size_t len) {
       }
       int sz = pkt->message.len - 6;
       if (sz > MAX_MESSAGE_SIZE)
-        memcpy(output, pkt->message.pdu.contents, MAX_MESSAGE_SIZE);
-      else
-        memcpy(output, pkt->message.pdu.contents, sz);
+        sz = MAX_MESSAGE_SIZE;
+      memcpy(output, pkt->message.pdu.contents, sz);
 
       int sms_dcs = pkt->message.pdu.encoding;
       /* We need to make sure certain bits of the data coding scheme are set to
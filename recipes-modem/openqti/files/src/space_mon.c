@@ -1,33 +1,346 @@
 #include "space_mon.h"
 #include "config.h"
+#include "helpers.h"
 #include "logger.h"
+#include "nas.h"
+#include "proxy.h"
+#include "sms.h"
 #include <dirent.h>
 #include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/statvfs.h>
 #include <sys/types.h>
-#include <sys/vfs.h>
+#include <unistd.h>
+
+/*
+ * Storage monitor
+ *  A single thread samples /tmp and /persist and caches their free
+ *  space and level, so nobody else has to call into the filesystem to
+ *  know if there's room left. Consumers account what they write with
+ *  storage_account_write() (just an atomic add), which gives us a write
+ *  rate and a projected time to full for each of them, and that in turn
+ *  sets how often we sample. Consumers get a callback when the level of
+ *  the filesystem they write to changes.
+ */
+struct {
+  _Atomic int32_t free_mb[STORAGE_LAST];
+  _Atomic uint8_t level[STORAGE_LAST];
+  /* Monitor thread only */
+  uint64_t free_bytes[STORAGE_LAST];
+  uint32_t drop_rate[STORAGE_LAST]; // bytes/s, whoever wrote them
+  uint64_t last_sample_ms;
+  struct {
+    storage_level_cb callback;
+    _Atomic uint64_t bytes_written;
+    uint64_t last_bytes_written; // Monitor thread only
+    _Atomic uint32_t write_rate; // bytes/s
+  } consumers[STORAGE_CONSUMER_LAST];
+  /* File that must survive a cleanup (i.e. the recording in progress) */
+  pthread_mutex_t lock;
+  char protected_file[256];
+} storage_rt = {
+    .free_mb = {-EINVAL, -EINVAL},
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+const int32_t storage_level_thresholds_mb[] = {
+    0, STORAGE_LOW_MB, STORAGE_CLEANUP_MB, STORAGE_CRITICAL_MB,
+    STORAGE_FULL_MB,
+};
+
+const char *get_storage_path(uint8_t storage_id) {
+  return storage_id == STORAGE_PERSIST ? PERSISTENT_STORAGE_PATH_BASE
+                                       : RAM_STORAGE_PATH_BASE;
+}
+
+int get_available_space(uint8_t storage_id, uint64_t *free_bytes) {
+  struct statvfs stats;
+  if (statvfs(get_storage_path(storage_id), &stats) < 0) {
+    logger(MSG_INFO, "%s: statvfs(%s) failed\n", __func__,
+           get_storage_path(storage_id));
+    return -EINVAL;
+  }
+  *free_bytes = (uint64_t)stats.f_frsize * stats.f_bavail;
+  return 0;
+}
 
 int get_available_space_tmpfs_mb() {
-  struct statfs sStats;
-  if (statfs("/tmp", &sStats) == -1) {
-    logger(MSG_INFO, "statfs() failed\n");
+  uint64_t free_bytes;
+  if (get_available_space(STORAGE_TMPFS, &free_bytes) < 0) {
     return -EINVAL;
-  } else {
-    return (sStats.f_bsize * sStats.f_bavail) / 1024 / 1024;
   }
+  return free_bytes / 1024 / 1024;
 }
 
 int get_available_space_persist_mb() {
-  struct statfs sStats;
-  uint32_t size;
-  if (statfs("/persist", &sStats) == -1) {
-    logger(MSG_INFO, "statfs() failed\n");
+  uint64_t free_bytes;
+  if (get_available_space(STORAGE_PERSIST, &free_bytes) < 0) {
     return -EINVAL;
-  } else {
-    size = (sStats.f_bsize * sStats.f_bavail) / 1024 / 1024;
-    return size;
+  }
+  return free_bytes / 1024 / 1024;
+}
+
+/* Recordings and logs go wherever persistent logging says */
+uint8_t get_consumer_storage(uint8_t consumer) {
+  switch (consumer) {
+  case STORAGE_CONSUMER_CELL_HISTORY:
+    return STORAGE_PERSIST;
+  case STORAGE_CONSUMER_TTS_CACHE:
+    return STORAGE_TMPFS;
+  default:
+    return use_persistent_logging() ? STORAGE_PERSIST : STORAGE_TMPFS;
+  }
+}
+
+void register_storage_consumer(uint8_t consumer, storage_level_cb callback) {
+  if (consumer >= STORAGE_CONSUMER_LAST) {
+    return;
+  }
+  pthread_mutex_lock(&storage_rt.lock);
+  storage_rt.consumers[consumer].callback = callback;
+  pthread_mutex_unlock(&storage_rt.lock);
+}
+
+/* Safe to call from anywhere, including the audio path */
+void storage_account_write(uint8_t consumer, uint32_t bytes) {
+  if (consumer >= STORAGE_CONSUMER_LAST) {
+    return;
+  }
+  atomic_fetch_add_explicit(&storage_rt.consumers[consumer].bytes_written,
+                            bytes, memory_order_relaxed);
+}
+
+void set_storage_protected_file(const char *filename) {
+  const char *name = NULL;
+  if (filename != NULL) {
+    /* cleanup_storage() matches it against the file name alone */
+    name = strrchr(filename, '/');
+    name = name != NULL ? name + 1 : filename;
+  }
+  pthread_mutex_lock(&storage_rt.lock);
+  snprintf(storage_rt.protected_file, sizeof(storage_rt.protected_file), "%s",
+           name != NULL ? name : "");
+  pthread_mutex_unlock(&storage_rt.lock);
+}
+
+uint8_t get_storage_level(uint8_t storage_id) {
+  if (storage_id >= STORAGE_LAST) {
+    return STORAGE_LEVEL_OK;
+  }
+  return atomic_load(&storage_rt.level[storage_id]);
+}
+
+/* -EINVAL until the first sample */
+int32_t get_cached_free_space_mb(uint8_t storage_id) {
+  if (storage_id >= STORAGE_LAST) {
+    return -EINVAL;
+  }
+  return atomic_load(&storage_rt.free_mb[storage_id]);
+}
+
+/* Seconds until the consumer fills its storage at its current rate, -1 if
+ * it isn't writing anything */
+int64_t get_storage_time_to_full_s(uint8_t consumer) {
+  uint32_t rate;
+  int64_t headroom_mb;
+  if (consumer >= STORAGE_CONSUMER_LAST) {
+    return -1;
+  }
+  rate = atomic_load(&storage_rt.consumers[consumer].write_rate);
+  headroom_mb =
+      get_cached_free_space_mb(get_consumer_storage(consumer)) - STORAGE_FULL_MB;
+  if (rate == 0) {
+    return -1;
+  }
+  if (headroom_mb <= 0) {
+    return 0;
+  }
+  return headroom_mb * 1024 * 1024 / rate;
+}
+
+/* Dropping a level is immediate, getting it back needs some margin */
+uint8_t get_new_storage_level(int32_t free_mb, uint8_t current) {
+  uint8_t level = STORAGE_LEVEL_OK;
+  for (uint8_t i = STORAGE_LEVEL_FULL; i > STORAGE_LEVEL_OK; i--) {
+    if (free_mb < storage_level_thresholds_mb[i]) {
+      level = i;
+      break;
+    }
+  }
+  while (current > level &&
+         free_mb >= storage_level_thresholds_mb[current] + STORAGE_HYSTERESIS_MB) {
+    current--;
+  }
+  return level > current ? level : current;
+}
+
+void update_write_rate(uint32_t *rate, uint64_t bytes, uint64_t elapsed_ms) {
+  uint32_t sample = elapsed_ms > 0 ? bytes * 1000 / elapsed_ms : 0;
+  *rate = *rate + ((int64_t)sample - *rate) / STORAGE_RATE_SMOOTHING;
+  /* Don't keep a tiny leftover rate forever */
+  if (sample == 0 && *rate < STORAGE_RATE_SMOOTHING) {
+    *rate = 0;
+  }
+}
+
+void handle_storage_level_change(uint8_t storage_id, uint8_t old_level,
+                                 uint8_t level, int32_t free_mb) {
+  storage_level_cb callbacks[STORAGE_CONSUMER_LAST];
+  char exclude_file[256];
+  uint8_t reply[MAX_MESSAGE_SIZE] = {0};
+  size_t strsz;
+
+  logger(level > old_level ? MSG_WARN : MSG_INFO,
+         "%s: %s is now at level %u (%i MB free)\n", __func__,
+         get_storage_path(storage_id), level, free_mb);
+
+  pthread_mutex_lock(&storage_rt.lock);
+  snprintf(exclude_file, sizeof(exclude_file), "%s",
+           storage_rt.protected_file[0] != 0 ? storage_rt.protected_file
+                                             : "openqti.lock");
+  for (uint8_t i = 0; i < STORAGE_CONSUMER_LAST; i++) {
+    callbacks[i] = storage_rt.consumers[i].callback;
+  }
+  pthread_mutex_unlock(&storage_rt.lock);
+
+  if (level > old_level && level >= STORAGE_LEVEL_CLEANUP) {
+    if (level >= STORAGE_LEVEL_CRITICAL) {
+      strsz = snprintf((char *)reply, MAX_MESSAGE_SIZE,
+                       "I'm running out of %s, cleaning %s\n",
+                       storage_id == STORAGE_PERSIST ? "storage" : "memory",
+                       get_storage_path(storage_id));
+      add_message_to_queue(reply, strsz);
+    }
+    cleanup_storage(storage_id, level >= STORAGE_LEVEL_CRITICAL, exclude_file);
+  }
+
+  for (uint8_t i = 0; i < STORAGE_CONSUMER_LAST; i++) {
+    if (callbacks[i] != NULL && get_consumer_storage(i) == storage_id) {
+      callbacks[i](storage_id, level, free_mb);
+    }
+  }
+}
+
+/* Samples everything and returns how long to wait for the next sample */
+uint32_t sample_storage() {
+  uint64_t now = get_monotonic_time_ms();
+  uint64_t elapsed = now - storage_rt.last_sample_ms;
+  uint64_t free_bytes, written, headroom;
+  uint32_t rate, storage_rate[STORAGE_LAST] = {0};
+  uint32_t interval = STORAGE_POLL_MAX_MS;
+  uint8_t level, old_level, storage_id;
+  int32_t free_mb;
+
+  for (uint8_t i = 0; i < STORAGE_CONSUMER_LAST; i++) {
+    written = atomic_load(&storage_rt.consumers[i].bytes_written);
+    rate = atomic_load(&storage_rt.consumers[i].write_rate);
+    if (storage_rt.last_sample_ms != 0) {
+      update_write_rate(&rate, written - storage_rt.consumers[i].last_bytes_written,
+                        elapsed);
+    }
+    storage_rt.consumers[i].last_bytes_written = written;
+    atomic_store(&storage_rt.consumers[i].write_rate, rate);
+    storage_rate[get_consumer_storage(i)] += rate;
+  }
+
+  for (storage_id = 0; storage_id < STORAGE_LAST; storage_id++) {
+    if (get_available_space(storage_id, &free_bytes) < 0) {
+      continue;
+    }
+    if (storage_rt.last_sample_ms != 0) {
+      update_write_rate(&storage_rt.drop_rate[storage_id],
+                        free_bytes < storage_rt.free_bytes[storage_id]
+                            ? storage_rt.free_bytes[storage_id] - free_bytes
+                            : 0,
+                        elapsed);
+    }
+    storage_rt.free_bytes[storage_id] = free_bytes;
+    free_mb = free_bytes / 1024 / 1024;
+    atomic_store(&storage_rt.free_mb[storage_id], free_mb);
+
+    old_level = atomic_load(&storage_rt.level[storage_id]);
+    level = get_new_storage_level(free_mb, old_level);
+    if (level != old_level) {
+      atomic_store(&storage_rt.level[storage_id], level);
+      handle_storage_level_change(storage_id, old_level, level, free_mb);
+    }
+
+    /*
+     * Plan the next sample around whoever fills it faster. This holds
+     * at critical levels too: a full filesystem that isn't changing
+     * doesn't need to be watched any closer than an empty one
+     */
+    rate = storage_rate[storage_id] > storage_rt.drop_rate[storage_id]
+               ? storage_rate[storage_id]
+               : storage_rt.drop_rate[storage_id];
+    if (rate > 0) {
+      headroom = free_bytes > STORAGE_FULL_MB * 1024 * 1024
+                     ? free_bytes - STORAGE_FULL_MB * 1024 * 1024
+                     : 0;
+      if (headroom * 1000 / rate / STORAGE_POLL_SAMPLES_TO_FULL < interval) {
+        interval = headroom * 1000 / rate / STORAGE_POLL_SAMPLES_TO_FULL;
+      }
+    }
+  }
+  storage_rt.last_sample_ms = now;
+
+  if (interval < STORAGE_POLL_MIN_MS) {
+    interval = STORAGE_POLL_MIN_MS;
+  }
+  logger(MSG_DEBUG, "%s: tmpfs %i MB, persist %i MB, next check in %u ms\n",
+         __func__, get_cached_free_space_mb(STORAGE_TMPFS),
+         get_cached_free_space_mb(STORAGE_PERSIST), interval);
+  return interval;
+}
+
+/*
+ * What a cleanup pass removes
+ *  Configuration, databases and anything we can't rebuild (.raw) is
+ *  always kept. A normal pass only removes logs and csv dumps, an
+ *  aggressive one everything else except exclude_file
+ */
+bool is_storage_file_removable(const char *name, bool aggressive,
+                               const char *exclude_file) {
+  /* Not .raw, but losing it loses every report since the last dump */
+  const char *kept_files[] = {INTERNAL_CELLID_JOURNAL_PATH};
+  for (uint8_t i = 0; i < (sizeof(kept_files) / sizeof(kept_files[0])); i++) {
+    if (strcmp(name, strrchr(kept_files[i], '/') + 1) == 0) {
+      return false;
+    }
+  }
+  if (strcmp(name, "..") == 0 || strcmp(name, ".") == 0 ||
+      strcmp(name, "openqti.conf") == 0 || strcmp(name, "openqti.lock") == 0 ||
+      strstr(name, ".bin") != NULL || strstr(name, ".autostart") != NULL ||
+      strstr(name, ".apps") != NULL || strstr(name, ".raw") != NULL) {
+    return false;
+  }
+  if (aggressive) {
+    // The file name comes from the incall thread with the entire path
+    return strstr(name, exclude_file) == NULL;
+  }
+  return strstr(name, "log") != NULL || strstr(name, "csv") != NULL;
+}
+
+/*
+ * Files we depend on to survive a restart, make sure no cleanup
+ * pass would ever take them
+ */
+void check_storage_kept_files() {
+  const char *kept_files[] = {SCHEDULER_LOG_FILE_PATH,
+                              INTERNAL_CELLID_INFO_PATH,
+                              INTERNAL_CELLID_JOURNAL_PATH};
+  const char *name;
+  for (uint8_t i = 0; i < (sizeof(kept_files) / sizeof(kept_files[0])); i++) {
+    name = strrchr(kept_files[i], '/') + 1;
+    if (is_storage_file_removable(name, false, "openqti.lock") ||
+        is_storage_file_removable(name, true, "openqti.lock")) {
+      logger(MSG_ERROR, "%s: Cleanup would remove %s!\n", __func__,
+             kept_files[i]);
+    }
   }
 }
 
@@ -61,26 +374,9 @@ int cleanup_storage(int storage_id, bool aggressive, char *exclude_file) {
     while ((ep = readdir(dp))) {
       memset(tmpfile, 0, 512);
       snprintf(tmpfile, 512, "%s/%s", path, ep->d_name);
-      if (strcmp(ep->d_name, "..") != 0 && 
-          strcmp(ep->d_name, ".") != 0 && 
-          strcmp(ep->d_name, "openqti.conf") != 0 &&
-          strcmp(ep->d_name, "openqti.lock") != 0 &&
-          strstr(ep->d_name, ".bin") == NULL &&
-          strstr(ep->d_name, ".autostart") == NULL &&
-          strstr(ep->d_name, ".apps") == NULL &&
-          strstr(ep->d_name, ".raw") == NULL ) {
-        logger(MSG_DEBUG, "Found file: %s\n", tmpfile);
-        if (aggressive) {
-          if (strstr(ep->d_name, exclude_file) == NULL) { 
-                    // The file name comes from the incall thread with the
-                          // entire path
-            logger(MSG_ERROR, "Deleting %s\n", ep->d_name);
-            remove(tmpfile);
-          }
-        } else if (strstr(ep->d_name, "log") != NULL || strstr(ep->d_name, "csv") != NULL) {
-          logger(MSG_ERROR, " DEL %s\n", ep->d_name);
-          remove(tmpfile);
-        }
+      if (is_storage_file_removable(ep->d_name, aggressive, exclude_file)) {
+        logger(MSG_ERROR, "Deleting %s\n", ep->d_name);
+        remove(tmpfile);
       }
     }
   } else {
@@ -90,4 +386,15 @@ int cleanup_storage(int storage_id, bool aggressive, char *exclude_file) {
   free(path);
 
   return 0;
-}
\ No newline at end of file
+}
+
+void *storage_monitor_thread() {
+  uint32_t interval;
+  logger(MSG_INFO, "%s: Starting storage monitor\n", __func__);
+  check_storage_kept_files();
+  while (1) {
+    interval = sample_storage();
+    usleep(interval * 1000);
+  }
+  return NULL;
+}
@@ -0,0 +1,376 @@
+// SPDX-License-Identifier: MIT
+
+#include "tts_cache.h"
+#include "logger.h"
+#include "space_mon.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Only the TTS thread speaks, but the storage monitor may purge the
+ * spilled phrases at any time. Cached phrases are played with the
+ * mutex held, so they can't be evicted halfway through; new ones are
+ * synthesized without it and inserted afterwards.
+ */
+struct {
+  pthread_mutex_t mutex;
+  struct tts_cache_entry entries[TTS_CACHE_MAX_ENTRIES];
+  uint32_t memory_used;
+  uint32_t spill_used;
+  uint64_t clock;
+  uint32_t hits;
+  uint32_t misses;
+  _Atomic bool spill_allowed;
+} tts_cache_rt = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .spill_allowed = true,
+};
+
+/* Phrase being synthesized, on its way to the sink and the cache */
+struct tts_capture {
+  tts_sample_sink sink;
+  void *data;
+  uint8_t *pcm;
+  size_t size;
+};
+
+/* Trim and collapse whitespace, so "Hello  there\n" == "Hello there" */
+size_t normalize_tts_text(const char *phrase, size_t len, char *out,
+                          size_t out_len) {
+  size_t strsz = 0;
+  bool space = false;
+  for (size_t i = 0; i < len && phrase[i] != 0 && strsz < out_len - 1; i++) {
+    if (isspace((unsigned char)phrase[i])) {
+      space = strsz > 0;
+      continue;
+    }
+    if (space && strsz < out_len - 2) {
+      out[strsz++] = ' ';
+    }
+    space = false;
+    out[strsz++] = phrase[i];
+  }
+  out[strsz] = 0;
+  return strsz;
+}
+
+/* FNV-1a, 64 bit, of the voice and the text */
+uint64_t get_tts_cache_key(const char *text) {
+  const char *voice = get_tts_voice_name();
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; voice[i] != 0; i++) {
+    hash = (hash ^ (uint8_t)voice[i]) * 1099511628211ULL;
+  }
+  /* Separator, so the voice name can't run into the text */
+  hash = (hash ^ 0) * 1099511628211ULL;
+  for (size_t i = 0; text[i] != 0; i++) {
+    hash = (hash ^ (uint8_t)text[i]) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+void get_tts_spill_file(struct tts_cache_entry *entry, char *path,
+                        size_t len) {
+  snprintf(path, len, TTS_CACHE_SPILL_FILE, (unsigned long long)entry->key);
+}
+
+/* Must be called with the mutex held */
+void drop_tts_cache_entry(struct tts_cache_entry *entry) {
+  char path[256];
+  if (entry->spilled) {
+    get_tts_spill_file(entry, path, sizeof(path));
+    unlink(path);
+    tts_cache_rt.spill_used -= entry->size;
+  } else {
+    free(entry->pcm);
+    tts_cache_rt.memory_used -= entry->size;
+  }
+  memset(entry, 0, sizeof(struct tts_cache_entry));
+}
+
+/* Must be called with the mutex held */
+int spill_tts_cache_entry(struct tts_cache_entry *entry) {
+  char path[256];
+  FILE *fp;
+  size_t written;
+
+  if (!atomic_load(&tts_cache_rt.spill_allowed) ||
+      tts_cache_rt.spill_used + entry->size > TTS_CACHE_SPILL_BUDGET) {
+    return -ENOSPC;
+  }
+  get_tts_spill_file(entry, path, sizeof(path));
+  fp = fopen(path, "w");
+  if (fp == NULL) {
+    return -errno;
+  }
+  written = fwrite(entry->pcm, 1, entry->size, fp);
+  fclose(fp);
+  storage_account_write(STORAGE_CONSUMER_TTS_CACHE, written);
+  if (written != entry->size) {
+    unlink(path);
+    return -EIO;
+  }
+  free(entry->pcm);
+  entry->pcm = NULL;
+  entry->spilled = true;
+  tts_cache_rt.memory_used -= entry->size;
+  tts_cache_rt.spill_used += entry->size;
+  return 0;
+}
+
+/* Least recently used entry, in memory or spilled. NULL if none */
+struct tts_cache_entry *get_lru_tts_cache_entry(bool spilled) {
+  struct tts_cache_entry *lru = NULL;
+  for (uint8_t i = 0; i < TTS_CACHE_MAX_ENTRIES; i++) {
+    struct tts_cache_entry *entry = &tts_cache_rt.entries[i];
+    if (entry->in_use && entry->spilled == spilled &&
+        (lru == NULL || entry->last_used < lru->last_used)) {
+      lru = entry;
+    }
+  }
+  return lru;
+}
+
+/*
+ * Make room for a new phrase of size bytes
+ *  Returns a free slot, or NULL if the phrase doesn't fit at all.
+ *  Must be called with the mutex held
+ */
+struct tts_cache_entry *make_room_in_tts_cache(uint32_t size) {
+  struct tts_cache_entry *entry, *free_entry = NULL;
+
+  while (tts_cache_rt.memory_used + size > TTS_CACHE_MEMORY_BUDGET) {
+    entry = get_lru_tts_cache_entry(false);
+    if (entry == NULL) {
+      return NULL;
+    }
+    /* Make room on tmpfs for it first */
+    while (atomic_load(&tts_cache_rt.spill_allowed) &&
+           tts_cache_rt.spill_used + entry->size > TTS_CACHE_SPILL_BUDGET &&
+           get_lru_tts_cache_entry(true) != NULL) {
+      drop_tts_cache_entry(get_lru_tts_cache_entry(true));
+    }
+    if (spill_tts_cache_entry(entry) < 0) {
+      drop_tts_cache_entry(entry);
+    }
+  }
+
+  for (uint8_t i = 0; i < TTS_CACHE_MAX_ENTRIES; i++) {
+    if (!tts_cache_rt.entries[i].in_use) {
+      free_entry = &tts_cache_rt.entries[i];
+      break;
+    }
+  }
+  if (free_entry == NULL) {
+    /* Spilled phrases go first, they're the oldest anyway */
+    free_entry = get_lru_tts_cache_entry(true);
+    if (free_entry == NULL) {
+      free_entry = get_lru_tts_cache_entry(false);
+    }
+    drop_tts_cache_entry(free_entry);
+  }
+  return free_entry;
+}
+
+/* Must be called with the mutex held */
+struct tts_cache_entry *find_tts_cache_entry(uint64_t key, const char *text) {
+  for (uint8_t i = 0; i < TTS_CACHE_MAX_ENTRIES; i++) {
+    struct tts_cache_entry *entry = &tts_cache_rt.entries[i];
+    if (entry->in_use && entry->key == key && strcmp(entry->text, text) == 0) {
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Must be called with the mutex held
+ *  Returns 0 once the whole phrase was played, the sink's error if it
+ *  stopped us, or -ENOENT if the spill file is gone (cleaned up)
+ */
+int play_tts_cache_entry(struct tts_cache_entry *entry, tts_sample_sink sink,
+                         void *data) {
+  uint8_t chunk[TTS_STREAM_CHUNK_SIZE];
+  char path[256];
+  size_t bytes, played = 0;
+  FILE *fp;
+  int ret = 0;
+
+  if (!entry->spilled) {
+    while (played < entry->size) {
+      bytes = entry->size - played;
+      if (bytes > TTS_STREAM_CHUNK_SIZE) {
+        bytes = TTS_STREAM_CHUNK_SIZE;
+      }
+      if ((ret = sink(data, entry->pcm + played, bytes)) < 0) {
+        return ret;
+      }
+      played += bytes;
+    }
+    return 0;
+  }
+
+  get_tts_spill_file(entry, path, sizeof(path));
+  fp = fopen(path, "r");
+  if (fp == NULL) {
+    return -ENOENT;
+  }
+  while (played < entry->size &&
+         (bytes = fread(chunk, 1, sizeof(chunk), fp)) > 0) {
+    if ((ret = sink(data, chunk, bytes)) < 0) {
+      break;
+    }
+    played += bytes;
+  }
+  fclose(fp);
+  if (ret == 0 && played < entry->size) {
+    /* Truncated, don't trust it again */
+    return played == 0 ? -ENOENT : -ENODATA;
+  }
+  return ret;
+}
+
+/* Forwards the samples to the real sink and keeps a copy for the cache */
+int tts_capture_sink(void *data, uint8_t *samples, size_t bytes) {
+  struct tts_capture *capture = (struct tts_capture *)data;
+  if (capture->pcm != NULL) {
+    if (capture->size + bytes > TTS_CACHE_MAX_ENTRY_SIZE) {
+      /* Too long to be worth caching */
+      free(capture->pcm);
+      capture->pcm = NULL;
+    } else {
+      memcpy(capture->pcm + capture->size, samples, bytes);
+      capture->size += bytes;
+    }
+  }
+  return capture->sink(capture->data, samples, bytes);
+}
+
+void add_to_tts_cache(uint64_t key, const char *text,
+                      struct tts_capture *capture) {
+  struct tts_cache_entry *entry;
+  uint8_t *pcm;
+
+  pthread_mutex_lock(&tts_cache_rt.mutex);
+  /* Somebody else may have said it in the meantime */
+  if (find_tts_cache_entry(key, text) != NULL ||
+      (entry = make_room_in_tts_cache(capture->size)) == NULL) {
+    pthread_mutex_unlock(&tts_cache_rt.mutex);
+    free(capture->pcm);
+    return;
+  }
+  pcm = realloc(capture->pcm, capture->size);
+  entry->in_use = true;
+  entry->key = key;
+  strncpy(entry->text, text, TTS_CACHE_MAX_TEXT - 1);
+  entry->pcm = pcm != NULL ? pcm : capture->pcm;
+  entry->size = capture->size;
+  entry->last_used = ++tts_cache_rt.clock;
+  tts_cache_rt.memory_used += entry->size;
+  logger(MSG_DEBUG, "%s: Cached %u bytes, %u in memory, %u spilled\n",
+         __func__, entry->size, tts_cache_rt.memory_used,
+         tts_cache_rt.spill_used);
+  pthread_mutex_unlock(&tts_cache_rt.mutex);
+  capture->pcm = NULL;
+}
+
+/* Must be called with the mutex held */
+void purge_spilled_tts_cache_entries() {
+  for (uint8_t i = 0; i < TTS_CACHE_MAX_ENTRIES; i++) {
+    if (tts_cache_rt.entries[i].in_use && tts_cache_rt.entries[i].spilled) {
+      drop_tts_cache_entry(&tts_cache_rt.entries[i]);
+    }
+  }
+}
+
+/*
+ * Speak a phrase, from the cache if we said it before
+ *  Same as pico2aud(), but phrases up to TTS_CACHE_MAX_TEXT characters
+ *  are kept once synthesized, so next time they're played right away
+ */
+int speak_cached_phrase(char *phrase, size_t len, tts_sample_sink sink,
+                        void *data) {
+  struct tts_capture capture = {0};
+  struct tts_cache_entry *entry;
+  char text[TTS_CACHE_MAX_TEXT];
+  uint64_t key;
+  int ret;
+
+  if (len >= TTS_CACHE_MAX_TEXT ||
+      normalize_tts_text(phrase, len, text, sizeof(text)) == 0) {
+    return pico2aud(phrase, len, sink, data);
+  }
+  key = get_tts_cache_key(text);
+
+  pthread_mutex_lock(&tts_cache_rt.mutex);
+  if (!atomic_load(&tts_cache_rt.spill_allowed)) {
+    purge_spilled_tts_cache_entries();
+  }
+  entry = find_tts_cache_entry(key, text);
+  if (entry != NULL) {
+    entry->last_used = ++tts_cache_rt.clock;
+    entry->hits++;
+    tts_cache_rt.hits++;
+    ret = play_tts_cache_entry(entry, sink, data);
+    if (ret == -ENOENT || ret == -ENODATA) {
+      logger(MSG_WARN, "%s: Lost the cached audio for \"%s\"\n", __func__,
+             text);
+      drop_tts_cache_entry(entry);
+      /* If we played some of it, just leave it there */
+      ret = ret == -ENODATA ? 0 : ret;
+    }
+    if (ret != -ENOENT) {
+      logger(MSG_DEBUG, "%s: Cache hit (%u hits, %u misses)\n", __func__,
+             tts_cache_rt.hits, tts_cache_rt.misses);
+      pthread_mutex_unlock(&tts_cache_rt.mutex);
+      return ret;
+    }
+  }
+  tts_cache_rt.misses++;
+  pthread_mutex_unlock(&tts_cache_rt.mutex);
+
+  capture.sink = sink;
+  capture.data = data;
+  capture.pcm = malloc(TTS_CACHE_MAX_ENTRY_SIZE);
+  ret = pico2aud(phrase, len, tts_capture_sink, &capture);
+  if (ret == 0 && capture.pcm != NULL && capture.size > 0) {
+    add_to_tts_cache(key, text, &capture);
+  } else {
+    /* Interrupted phrases are incomplete, don't keep them */
+    free(capture.pcm);
+  }
+  return ret;
+}
+
+void flush_tts_cache() {
+  pthread_mutex_lock(&tts_cache_rt.mutex);
+  for (uint8_t i = 0; i < TTS_CACHE_MAX_ENTRIES; i++) {
+    if (tts_cache_rt.entries[i].in_use) {
+      drop_tts_cache_entry(&tts_cache_rt.entries[i]);
+    }
+  }
+  pthread_mutex_unlock(&tts_cache_rt.mutex);
+}
+
+/*
+ * Storage monitor callback
+ *  Stop spilling to tmpfs as soon as it starts running low, and give
+ *  back what we took. If a phrase is playing right now, the next one
+ *  will do the cleanup
+ */
+void tts_cache_storage_level_changed(uint8_t storage_id, uint8_t level,
+                                     int32_t free_mb) {
+  atomic_store(&tts_cache_rt.spill_allowed, level == STORAGE_LEVEL_OK);
+  if (level != STORAGE_LEVEL_OK &&
+      pthread_mutex_trylock(&tts_cache_rt.mutex) == 0) {
+    purge_spilled_tts_cache_entries();
+    pthread_mutex_unlock(&tts_cache_rt.mutex);
+  }
+}
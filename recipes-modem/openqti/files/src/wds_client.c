@@ -211,7 +211,7 @@ int wds_set_rawip_mode() {
   int fd;
   struct ifreq *ifr = calloc(1, sizeof(struct ifreq));
   char netdev[] = "rmnet0";
-  system("ifconfig rmnet0 down"); // <-- This has to go
+  run_command("ifconfig rmnet0 down"); // <-- This has to go
   if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
     logger(MSG_ERROR, "%s: Can't open socket!\n", __func__);
     free(ifr);
@@ -227,7 +227,7 @@ int wds_set_rawip_mode() {
     return -EIO;
   }
   // This has to go
-  system(
+  run_command(
       "ifconfig rmnet0 169.252.10.1 netmask 255.0.0.0 allmulti multicast up");
   close(fd);
   free(ifr);
@@ -271,9 +271,27 @@ int wds_bind_mux_data_port() {
   return 0;
 }
 
+/*
+ * Gets the response to our start network request, or tells us
+ * if the baseband never answered so we don't stay "in progress"
+ * forever
+ */
+void wds_start_network_callback(uint8_t *buf, size_t buf_len, int status,
+                                void *data) {
+  if (status < 0) {
+    logger(MSG_ERROR, "%s: Start network request failed: %i\n", __func__,
+           status);
+    notify_network_down("No response from the baseband");
+    wds_runtime.in_progress = 0;
+    return;
+  }
+  wds_handle_start_network_response(buf, buf_len);
+}
+
 int wds_attempt_to_connect() {
   uint8_t *pkt = NULL;
   size_t curr_offset = 0;
+  int ret;
   size_t pkt_len = sizeof(struct qmux_packet) + sizeof(struct qmi_packet);
 
   pkt_len += sizeof(struct apn_config);
@@ -364,10 +382,16 @@ int wds_attempt_to_connect() {
   roaming_lock->value = 0x00; // OFF
   curr_offset += sizeof(struct block_in_roaming);
 
-  add_pending_message(QMI_SERVICE_WDS, (uint8_t *)pkt, pkt_len);
+  ret = add_pending_message_with_callback(QMI_SERVICE_WDS, (uint8_t *)pkt,
+                                          pkt_len, wds_start_network_callback,
+                                          NULL, WDS_START_NETWORK_TIMEOUT_MS);
+  if (ret < 0) {
+    logger(MSG_ERROR, "%s: Can't queue the start network request: %i\n",
+           __func__, ret);
+  }
 
   free(pkt);
-  return 0;
+  return ret;
 }
 
 void *init_internal_networking() {
@@ -392,7 +416,12 @@ void *init_internal_networking() {
   wds_set_autoconnect(0);
   wds_set_rawip_mode();
 
-  wds_attempt_to_connect();
+  /* The callback won't run if the request never made it to the queue */
+  if (wds_attempt_to_connect() < 0) {
+    logger(MSG_ERROR, "%s: Couldn't start the network\n", __func__);
+    notify_network_down("Couldn't send the request to the baseband");
+    wds_runtime.in_progress = 0;
+  }
 
   return NULL;
 }
@@ -426,7 +455,7 @@ void wds_handle_start_network_response(uint8_t *buf, size_t buf_len) {
     logger(MSG_INFO,
            "%s: Network started! enable indications and request dhcp\n",
            __func__);
-    system("udhcpc -q -f -i rmnet0");
+    run_command("udhcpc -q -f -i rmnet0");
     wds_enable_indications_ipv4();
     int offset =
         get_tlv_offset_by_id(buf, buf_len, 0x01); // get our packet data handle